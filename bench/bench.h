@@ -0,0 +1,113 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+//
+// Benchmark Helpers
+//
+// Small header-only helpers shared by the benchmark programs. Latencies are
+// collected as raw samples and summarized with percentiles at the end, since
+// means hide exactly the tail behavior we care about.
+//
+
+/** A growable set of latency samples in nanoseconds. */
+struct bench_samples {
+  /** The samples. */
+  double* values;
+
+  /** The number of samples. */
+  size_t len;
+
+  /** The allocated capacity. */
+  size_t cap;
+};
+
+/**
+ * Read the monotonic clock.
+ *
+ * @return The time in nanoseconds
+ */
+static inline unsigned long long bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Add a sample.
+ *
+ * @param s The sample set
+ * @param value The sample
+ */
+static inline void bench_samples_add(struct bench_samples* s, double value) {
+  if (s->len == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    s->values = realloc(s->values, s->cap * sizeof *s->values);
+    if (!s->values) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+
+  s->values[s->len++] = value;
+}
+
+/** @private */
+static inline int bench__compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Get a percentile of a sample set. Sorts the samples in place.
+ *
+ * @param s The sample set
+ * @param p The percentile from 0 to 100
+ * @return The sample at that percentile or zero if empty
+ */
+static inline double bench_samples_percentile(struct bench_samples* s, double p) {
+  if (!s->len) {
+    return 0;
+  }
+
+  qsort(s->values, s->len, sizeof *s->values, &bench__compare_doubles);
+
+  size_t i = (size_t) (p / 100 * (s->len - 1) + 0.5);
+  return s->values[i];
+}
+
+/**
+ * Print a one-line percentile summary of a sample set in microseconds.
+ *
+ * @param name The row label
+ * @param s The sample set
+ */
+static inline void bench_samples_report(const char* name, struct bench_samples* s) {
+  printf("%-24s n=%-8zu p50=%10.2fus p90=%10.2fus p99=%10.2fus max=%10.2fus\n", name, s->len,
+      bench_samples_percentile(s, 50) / 1e3, bench_samples_percentile(s, 90) / 1e3,
+      bench_samples_percentile(s, 99) / 1e3, bench_samples_percentile(s, 100) / 1e3);
+}
+
+/**
+ * Free a sample set.
+ *
+ * @param s The sample set
+ */
+static inline void bench_samples_free(struct bench_samples* s) {
+  free(s->values);
+  s->values = NULL;
+  s->len = 0;
+  s->cap = 0;
+}
+
+#endif // #ifndef BENCH_H
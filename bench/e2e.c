@@ -0,0 +1,360 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#include "../src/metric.h"
+#include "../src/record.h"
+#include "../src/service.h"
+#include "../src/service/face.h"
+#include "../src/service/speech.h"
+
+//
+// End-to-End Benchmark
+//
+// Replays recorded inputs through the face and speech services together, so
+// the numbers include their contention for the CPU and each other. Without a
+// recording, one is first captured from synthetic inputs arriving at the pace
+// a camera and microphone would deliver them: a face-sized patch drifting
+// over noise at 15 frames per second, and bursts of tone in noise as speech.
+// Detection and recognition are stood in for, as in the face and speech
+// benchmarks, and console commands in the recording are skipped.
+//
+// Face latency runs from a frame's submission to its result. Speech latency
+// runs from the last voiced hop of an utterance to the recognizer finishing
+// it, so it includes the hangover. Both come from the services' own latency
+// histograms. As fast as possible, throughput is what the services sustain;
+// at the recorded pace, lag is how far replay fell behind the recording.
+//
+
+/** The synthetic frame width. */
+#define SYNTH_WIDTH 320
+
+/** The synthetic frame height. */
+#define SYNTH_HEIGHT 240
+
+/** The synthetic face side length. */
+#define SYNTH_FACE 64
+
+/** The synthetic frame period in nanoseconds. */
+#define SYNTH_FRAME_NS 66666667ull
+
+/** The synthetic speech burst period in hops. */
+#define SYNTH_BURST_HOPS 200
+
+/** The synthetic speech burst length in hops. */
+#define SYNTH_VOICED_HOPS 80
+
+static int detect_stand_in(void* ctx, const struct face_frame* frame, struct face_box* boxes, size_t boxes_cap,
+    size_t* boxes_len) {
+  // No ground truth, so pretend there is a face in the middle
+  int side = (frame->width < frame->height ? frame->width : frame->height) / 3;
+  boxes[0] = (struct face_box) { (frame->width - side) / 2, (frame->height - side) / 2, side, side };
+  *boxes_len = boxes_cap ? 1 : 0;
+  return 0;
+}
+
+static int begin_stand_in(void* ctx) {
+  return 0;
+}
+
+static int feed_stand_in(void* ctx, const float* samples, size_t len) {
+  return 0;
+}
+
+static int end_stand_in(void* ctx) {
+  return 0;
+}
+
+/**
+ * Capture a synthetic session into a recording, in real time.
+ *
+ * @param path The recording path
+ * @param seconds The session length
+ * @return Zero on success, otherwise nonzero
+ */
+static int synthesize(const char* path, double seconds) {
+  if (record_start(path)) {
+    return 1;
+  }
+
+  unsigned char* pixels = malloc((size_t) SYNTH_WIDTH * SYNTH_HEIGHT);
+  size_t hop = SPEECH_SAMPLE_RATE * SPEECH_HOP_MS / 1000;
+  short* samples = malloc(hop * sizeof *samples);
+
+  unsigned int seed = 12345;
+  unsigned long long t0 = bench_now();
+  unsigned long long end = t0 + (unsigned long long) (seconds * 1e9);
+  unsigned long long next_frame = t0;
+  unsigned long frame_id = 0;
+
+  for (unsigned long h = 0;; ++h) {
+    unsigned long long due = t0 + h * SPEECH_HOP_MS * 1000000ull;
+    if (due >= end) {
+      break;
+    }
+
+    struct timespec ts = { (time_t) (due / 1000000000ull), (long) (due % 1000000000ull) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+
+    // One hop of noise, with a tone through the voiced part of each burst
+    int voiced = h % SYNTH_BURST_HOPS < SYNTH_VOICED_HOPS;
+    for (size_t i = 0; i < hop; ++i) {
+      seed = seed * 1103515245 + 12345;
+      double v = ((int) (seed >> 20) - 2048) / 8.0;
+      if (voiced) {
+        v += 6000 * sin(2 * M_PI * 440 * (double) (h * hop + i) / SPEECH_SAMPLE_RATE);
+      }
+      samples[i] = (short) v;
+    }
+
+    record_audio(&(struct speech_audio) { .samples = samples, .frames = hop }, SPEECH_SAMPLE_RATE, 1);
+
+    if (due >= next_frame) {
+      next_frame += SYNTH_FRAME_NS;
+
+      for (size_t i = 0; i < (size_t) SYNTH_WIDTH * SYNTH_HEIGHT; ++i) {
+        seed = seed * 1103515245 + 12345;
+        pixels[i] = (unsigned char) (96 + (seed >> 27));
+      }
+
+      int cx = (int) (SYNTH_WIDTH / 2 + 40 * cos(0.05 * frame_id));
+      int cy = (int) (SYNTH_HEIGHT / 2 + 30 * sin(0.05 * frame_id));
+      for (int y = 0; y < SYNTH_FACE; ++y) {
+        for (int x = 0; x < SYNTH_FACE; ++x) {
+          double v = 128 + 100 * sin(x / 7.0) * cos(y / 9.0);
+          pixels[(size_t) (cy - SYNTH_FACE / 2 + y) * SYNTH_WIDTH + cx - SYNTH_FACE / 2 + x] = (unsigned char) v;
+        }
+      }
+
+      record_frame(&(struct face_frame) {
+        .id = frame_id++,
+        .width = SYNTH_WIDTH,
+        .height = SYNTH_HEIGHT,
+        .stride = SYNTH_WIDTH,
+        .format = face_pixel_format_gray8,
+        .data = pixels,
+      });
+    }
+  }
+
+  free(pixels);
+  free(samples);
+
+  return record_stop();
+}
+
+/**
+ * Find the audio format of a recording.
+ *
+ * @param path The recording path
+ * @param sample_rate The sample rate, left alone if there is no audio
+ * @param channels The number of channels, left alone if there is no audio
+ * @return Zero on success, otherwise nonzero
+ */
+static int probe_audio(const char* path, int* sample_rate, int* channels) {
+  struct record_reader reader;
+  if (record_reader_open(&reader, path)) {
+    return 1;
+  }
+
+  struct record_entry entry;
+  while (record_reader_next(&reader, &entry)) {
+    if (entry.kind == record_kind_audio && entry.len >= sizeof(struct record_audio)) {
+      const struct record_audio* audio = entry.data;
+      *sample_rate = audio->sample_rate;
+      *channels = audio->channels;
+      break;
+    }
+  }
+
+  record_reader_close(&reader);
+  return 0;
+}
+
+/**
+ * Print a latency histogram in the style of bench_samples_report.
+ *
+ * @param name The row label
+ * @param metric_name The histogram name
+ */
+static void report_metric(const char* name, const char* metric_name) {
+  struct metric* m = metric_get(metric_name, metric_kind_histogram);
+  struct metric_value v = {0};
+  if (m) {
+    metric_read(m, &v);
+  }
+
+  printf("%-24s n=%-8.0f p50=%10.2fus p99=%10.2fus mean=%9.2fus\n", name, v.value, v.p50 / 1e3, v.p99 / 1e3,
+      v.mean / 1e3);
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s [-p recording | -o synth_path [-s seconds]] [-r] [-n passes]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  const char* path = NULL;
+  const char* synth_path = "e2e.czrec";
+  double seconds = 10;
+  int realtime = 0;
+  int passes = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "p:o:s:rn:h")) != -1) {
+    switch (opt) {
+      case 'p':
+        path = optarg;
+        break;
+      case 'o':
+        synth_path = optarg;
+        break;
+      case 's':
+        seconds = atof(optarg);
+        break;
+      case 'r':
+        realtime = 1;
+        break;
+      case 'n':
+        passes = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (!path) {
+    fprintf(stderr, "capturing %.0fs of synthetic input to %s\n", seconds, synth_path);
+    if (synthesize(synth_path, seconds)) {
+      fprintf(stderr, "failed to capture synthetic input\n");
+      return 1;
+    }
+    path = synth_path;
+  }
+
+  int sample_rate = SPEECH_SAMPLE_RATE;
+  int channels = 1;
+  if (probe_audio(path, &sample_rate, &channels)) {
+    fprintf(stderr, "failed to open %s\n", path);
+    return 1;
+  }
+
+  service_load(SERVICE_FACE);
+  service_load(SERVICE_SPEECH);
+
+  struct face_backend face_backend = { .detect = &detect_stand_in };
+  service_call(SERVICE_FACE, service_face_proc_set_backend, &face_backend, NULL);
+
+  struct face_config face_config = {
+    .detect_interval = 10,
+    .track_min_confidence = 0.5f,
+    .identity_refresh_interval = 15,
+    .match_threshold = 0.5f,
+    .preprocess = face_preprocess_normalize,
+  };
+  service_call(SERVICE_FACE, service_face_proc_configure, &face_config, NULL);
+
+  struct speech_config speech_config = {
+    .sample_rate = sample_rate,
+    .channels = channels,
+    .buffer_ms = 500,
+    .vad = 1,
+    .vad_onset_db = 9,
+    .vad_offset_db = 6,
+    .vad_hangover_ms = 300,
+    .vad_preroll_ms = 200,
+  };
+
+  if (service_call(SERVICE_SPEECH, service_speech_proc_configure, &speech_config, NULL)) {
+    fprintf(stderr, "failed to configure speech pipeline\n");
+    return 1;
+  }
+
+  struct speech_backend speech_backend = {
+    .begin = &begin_stand_in,
+    .feed = &feed_stand_in,
+    .end = &end_stand_in,
+  };
+  service_call(SERVICE_SPEECH, service_speech_proc_set_backend, &speech_backend, NULL);
+
+  struct record_replay_options options = {
+    .path = path,
+    .realtime = realtime,
+    .kinds = 1u << record_kind_frame | 1u << record_kind_audio,
+  };
+
+  struct record_replay_stats total = {0};
+  struct face_stats face;
+  struct speech_stats speech;
+
+  for (int pass = 0; pass < passes; ++pass) {
+    service_start(SERVICE_FACE);
+    service_start(SERVICE_SPEECH);
+
+    struct record_replay_stats stats;
+    if (record_replay(&options, &stats)) {
+      return 1;
+    }
+
+    // Let the last frame finish before stopping closes the last utterance
+    unsigned long long t0 = bench_now();
+    do {
+      service_call(SERVICE_FACE, service_face_proc_get_stats, NULL, &face);
+    } while (face.frames_processed + face.frames_dropped < face.frames_submitted && bench_now() - t0 < 1000000000ull);
+
+    stats.elapsed_ns += bench_now() - t0;
+
+    service_stop(SERVICE_SPEECH);
+    service_stop(SERVICE_FACE);
+
+    total.frames += stats.frames;
+    total.audio_frames += stats.audio_frames;
+    total.audio_dropped += stats.audio_dropped;
+    total.recorded_ns += stats.recorded_ns;
+    total.elapsed_ns += stats.elapsed_ns;
+    total.lag_max = stats.lag_max > total.lag_max ? stats.lag_max : total.lag_max;
+  }
+
+  service_call(SERVICE_FACE, service_face_proc_get_stats, NULL, &face);
+  service_call(SERVICE_SPEECH, service_speech_proc_get_stats, NULL, &speech);
+
+  struct service_sched_stats face_sched;
+  struct service_sched_stats speech_sched;
+  service_get_sched_stats(SERVICE_FACE, &face_sched);
+  service_get_sched_stats(SERVICE_SPEECH, &speech_sched);
+
+  double elapsed = total.elapsed_ns / 1e9;
+  double audio = (double) total.audio_frames / sample_rate;
+
+  printf("recording=%s passes=%d recorded=%.1fs mode=%s\n", path, passes, total.recorded_ns / 1e9,
+      realtime ? "realtime" : "fast");
+  printf("%-24s %.1f frames/s, %lu processed, %lu dropped\n", "face throughput", face.frames_processed / elapsed,
+      face.frames_processed, face.frames_dropped);
+  printf("%-24s %.2fx real time, %llu frames dropped\n", "speech throughput", elapsed ? audio / elapsed : 0,
+      total.audio_dropped);
+  printf("%-24s %lu utterances, %lu hops\n", "speech", speech.utterances_closed, speech.hops);
+  printf("%-24s face %lu of %lu, speech %lu of %lu\n", "deadline misses", face_sched.missed, face_sched.completed,
+      speech_sched.missed, speech_sched.completed);
+  if (realtime) {
+    printf("%-24s %.2fms\n", "worst replay lag", total.lag_max / 1e6);
+  }
+
+  printf("\nend-to-end latency\n");
+  report_metric("  face frame", "face.latency_ns");
+  report_metric("  speech utterance", "speech.eou_ns");
+
+  service_unload(SERVICE_SPEECH);
+  service_unload(SERVICE_FACE);
+  return 0;
+}
@@ -0,0 +1,391 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#include "../src/service.h"
+#include "../src/service/face.h"
+
+//
+// Face Pipeline Benchmark
+//
+// Drives the face service end to end without a camera. Frames are either
+// synthesized (textured faces drifting over a noisy background) or loaded
+// from a directory of binary PGM files. Detection is stood in for by a
+// backend that reports the synthetic ground truth, or a centered box for
+// recorded frames, so the numbers cover everything except the detector.
+//
+// Each gallery size runs in a child process of its own, so its peak RSS is
+// its own. The growth over the frames it inherited is what the gallery and
+// the pipeline cost.
+//
+
+/** The synthetic frame width. */
+#define SYNTH_WIDTH 640
+
+/** The synthetic frame height. */
+#define SYNTH_HEIGHT 480
+
+/** The synthetic face side length. */
+#define SYNTH_FACE 96
+
+/** A set of frames to play. */
+struct frames {
+  /** The frames. */
+  struct face_frame* frames;
+
+  /** The ground truth boxes per frame. */
+  struct face_box (* boxes)[FACE_MAX_FACES];
+
+  /** The number of frames. */
+  size_t len;
+
+  /** The number of faces per frame. */
+  size_t faces;
+};
+
+/** The frames being played. */
+static struct frames frames;
+
+/** The index of the frame being processed. */
+static size_t current;
+
+static int detect_stand_in(void* ctx, const struct face_frame* frame, struct face_box* boxes, size_t boxes_cap,
+    size_t* boxes_len) {
+  size_t n = frames.faces < boxes_cap ? frames.faces : boxes_cap;
+  memcpy(boxes, frames.boxes[current], n * sizeof *boxes);
+  *boxes_len = n;
+  return 0;
+}
+
+/**
+ * Synthesize frames of drifting faces.
+ *
+ * @param len The number of frames
+ * @param faces The number of faces per frame
+ */
+static void synthesize(size_t len, size_t faces) {
+  frames.frames = calloc(len, sizeof *frames.frames);
+  frames.boxes = calloc(len, sizeof *frames.boxes);
+  frames.len = len;
+  frames.faces = faces;
+
+  unsigned int seed = 12345;
+
+  for (size_t f = 0; f < len; ++f) {
+    unsigned char* rgb = malloc((size_t) SYNTH_WIDTH * SYNTH_HEIGHT * 3);
+
+    // Low-contrast noise background
+    for (size_t i = 0; i < (size_t) SYNTH_WIDTH * SYNTH_HEIGHT * 3; ++i) {
+      seed = seed * 1103515245 + 12345;
+      rgb[i] = (unsigned char) (96 + (seed >> 27));
+    }
+
+    for (size_t k = 0; k < faces; ++k) {
+      // Lay faces out on a grid and let each drift on its own circle
+      int cx = (int) (80 + (k % 4) * 150 + 20 * cos(0.05 * f + k));
+      int cy = (int) (80 + (k / 4) * 200 + 20 * sin(0.05 * f + k));
+
+      struct face_box box = { cx - SYNTH_FACE / 2, cy - SYNTH_FACE / 2, SYNTH_FACE, SYNTH_FACE };
+      frames.boxes[f][k] = box;
+
+      for (int y = 0; y < SYNTH_FACE; ++y) {
+        for (int x = 0; x < SYNTH_FACE; ++x) {
+          double v = 128 + 100 * sin((x + 13.0 * k) / 7.0) * cos((y + 7.0 * k) / 9.0);
+          unsigned char* p = rgb + ((size_t) (box.y + y) * SYNTH_WIDTH + box.x + x) * 3;
+          p[0] = p[1] = p[2] = (unsigned char) v;
+        }
+      }
+    }
+
+    frames.frames[f] = (struct face_frame) {
+      .id = f,
+      .width = SYNTH_WIDTH,
+      .height = SYNTH_HEIGHT,
+      .stride = SYNTH_WIDTH * 3,
+      .format = face_pixel_format_rgb24,
+      .data = rgb,
+    };
+  }
+}
+
+/**
+ * Load one binary PGM file.
+ *
+ * @param path The file path
+ * @param frame The output frame
+ * @return Zero on success, otherwise nonzero
+ */
+static int load_pgm(const char* path, struct face_frame* frame) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return 1;
+  }
+
+  int width;
+  int height;
+  int max;
+  if (fscanf(file, "P5 %d %d %d", &width, &height, &max) != 3 || max != 255 || fgetc(file) == EOF) {
+    fclose(file);
+    return 1;
+  }
+
+  unsigned char* data = malloc((size_t) width * height);
+  if (fread(data, 1, (size_t) width * height, file) != (size_t) width * height) {
+    free(data);
+    fclose(file);
+    return 1;
+  }
+
+  fclose(file);
+
+  *frame = (struct face_frame) {
+    .width = width,
+    .height = height,
+    .stride = width,
+    .format = face_pixel_format_gray8,
+    .data = data,
+  };
+  return 0;
+}
+
+static int compare_names(const void* a, const void* b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/**
+ * Load recorded frames from a directory of PGM files, in name order.
+ *
+ * @param dir The directory path
+ * @return Zero on success, otherwise nonzero
+ */
+static int load_recording(const char* dir) {
+  DIR* d = opendir(dir);
+  if (!d) {
+    return 1;
+  }
+
+  char** names = NULL;
+  size_t names_len = 0;
+
+  struct dirent* entry;
+  while ((entry = readdir(d))) {
+    size_t n = strlen(entry->d_name);
+    if (n > 4 && !strcmp(entry->d_name + n - 4, ".pgm")) {
+      names = realloc(names, (names_len + 1) * sizeof *names);
+      names[names_len++] = strdup(entry->d_name);
+    }
+  }
+  closedir(d);
+
+  qsort(names, names_len, sizeof *names, &compare_names);
+
+  frames.frames = calloc(names_len, sizeof *frames.frames);
+  frames.boxes = calloc(names_len, sizeof *frames.boxes);
+  frames.faces = 1;
+
+  for (size_t i = 0; i < names_len; ++i) {
+    char path[4096];
+    snprintf(path, sizeof path, "%s/%s", dir, names[i]);
+    free(names[i]);
+
+    struct face_frame* frame = &frames.frames[frames.len];
+    if (load_pgm(path, frame)) {
+      fprintf(stderr, "skipping %s\n", path);
+      continue;
+    }
+
+    frame->id = frames.len;
+
+    // No ground truth, so pretend there is a face in the middle
+    int side = (frame->width < frame->height ? frame->width : frame->height) / 3;
+    frames.boxes[frames.len][0] = (struct face_box) {
+      (frame->width - side) / 2, (frame->height - side) / 2, side, side,
+    };
+
+    ++frames.len;
+  }
+
+  free(names);
+  return frames.len ? 0 : 1;
+}
+
+/**
+ * Get the resident set size.
+ *
+ * @return The resident set size in KiB, or zero if unknown
+ */
+static long resident_kib(void) {
+  long pages = 0;
+
+  FILE* file = fopen("/proc/self/statm", "r");
+  if (file) {
+    if (fscanf(file, "%*s %ld", &pages) != 1) {
+      pages = 0;
+    }
+    fclose(file);
+  }
+
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * Run every frame through the pipeline against a gallery of one size.
+ *
+ * @param gallery_size The number of gallery entries
+ * @param passes The number of times to play the frames
+ */
+static void run(size_t gallery_size, int passes) {
+  long base_rss = resident_kib();
+
+  service_load(SERVICE_FACE);
+
+  struct face_backend backend = { .detect = &detect_stand_in };
+  service_call(SERVICE_FACE, service_face_proc_set_backend, &backend, NULL);
+
+  // Refresh identities often so matching shows up in the numbers
+  struct face_config config = {
+    .detect_interval = 10,
+    .track_min_confidence = 0.5f,
+    .identity_refresh_interval = 15,
+    .match_threshold = 0.5f,
+    .preprocess = face_preprocess_normalize,
+  };
+  service_call(SERVICE_FACE, service_face_proc_configure, &config, NULL);
+
+  struct face_identity identity;
+  unsigned int seed = 777;
+  for (size_t i = 0; i < gallery_size; ++i) {
+    identity.id = (int) i;
+    for (int k = 0; k < FACE_EMBEDDING_DIM; ++k) {
+      seed = seed * 1103515245 + 12345;
+      identity.embedding[k] = (float) (seed >> 8) / (1 << 24) - 0.5f;
+    }
+    service_call(SERVICE_FACE, service_face_proc_enroll, &identity, NULL);
+  }
+
+  struct bench_samples total = {0};
+  struct bench_samples stages[face_stage_count] = {{0}};
+
+  static const char* stage_names[face_stage_count] = {
+    "  convert", "  detect", "  track", "  preprocess", "  embed", "  match",
+  };
+
+  unsigned long long t_start = bench_now();
+
+  for (int pass = 0; pass < passes; ++pass) {
+    for (current = 0; current < frames.len; ++current) {
+      struct face_result result;
+
+      unsigned long long t0 = bench_now();
+      service_call(SERVICE_FACE, service_face_proc_process, &frames.frames[current], &result);
+      bench_samples_add(&total, (double) (bench_now() - t0));
+
+      for (int s = 0; s < face_stage_count; ++s) {
+        if (result.stage_time[s]) {
+          bench_samples_add(&stages[s], (double) result.stage_time[s]);
+        }
+      }
+    }
+  }
+
+  double elapsed = (bench_now() - t_start) / 1e9;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("\ngallery=%zu faces=%zu frames=%zu\n", gallery_size, frames.faces, total.len);
+  printf("%-24s %.1f frames/s\n", "throughput", total.len / elapsed);
+  printf("%-24s %ld KiB\n", "peak rss", usage.ru_maxrss);
+  printf("%-24s %ld KiB\n", "peak rss growth", usage.ru_maxrss - base_rss);
+  bench_samples_report("frame", &total);
+
+  for (int s = 0; s < face_stage_count; ++s) {
+    bench_samples_report(stage_names[s], &stages[s]);
+    bench_samples_free(&stages[s]);
+  }
+  bench_samples_free(&total);
+
+  service_unload(SERVICE_FACE);
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s [-n frames] [-f faces] [-p passes] [-d pgm_dir]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  size_t frame_count = 300;
+  size_t faces = 1;
+  int passes = 1;
+  const char* dir = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:f:p:d:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        frame_count = strtoul(optarg, NULL, 10);
+        break;
+      case 'f':
+        faces = strtoul(optarg, NULL, 10);
+        break;
+      case 'p':
+        passes = atoi(optarg);
+        break;
+      case 'd':
+        dir = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (faces < 1 || faces > 8) {
+    fprintf(stderr, "faces must be between 1 and 8\n");
+    return 1;
+  }
+
+  if (dir) {
+    if (load_recording(dir)) {
+      fprintf(stderr, "no usable PGM frames in %s\n", dir);
+      return 1;
+    }
+  } else {
+    synthesize(frame_count, faces);
+  }
+
+  for (size_t gallery_size = 10; gallery_size <= 100000; gallery_size *= 10) {
+    // A child's peak RSS starts from what it inherited, not from earlier sizes
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "failed to fork\n");
+      return 1;
+    }
+
+    if (!pid) {
+      run(gallery_size, passes);
+      fflush(stdout);
+      _exit(0);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "gallery size %zu failed\n", gallery_size);
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#include "../src/service/face/kernel.h"
+
+/** The number of timed iterations per case. */
+#define ITERATIONS 2000
+
+/** Sink to keep results observable. */
+static volatile float sink;
+
+/**
+ * Fill a buffer with deterministic pseudo-random bytes.
+ *
+ * @param data The buffer
+ * @param len The buffer length
+ */
+static void fill(unsigned char* data, size_t len) {
+  unsigned int x = 2463534242u;
+  for (size_t i = 0; i < len; ++i) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    data[i] = (unsigned char) x;
+  }
+}
+
+/**
+ * Benchmark grayscale conversion at one resolution.
+ *
+ * @param width The frame width
+ * @param height The frame height
+ */
+static void bench_rgb_to_gray(int width, int height) {
+  unsigned char* rgb = malloc((size_t) width * height * 3);
+  unsigned char* gray = malloc((size_t) width * height);
+  fill(rgb, (size_t) width * height * 3);
+
+  struct bench_samples s = {0};
+  for (int i = 0; i < ITERATIONS; ++i) {
+    unsigned long long t0 = bench_now();
+    face_kernel_rgb_to_gray(rgb, width * 3, gray, width, width, height);
+    bench_samples_add(&s, (double) (bench_now() - t0));
+  }
+  sink = gray[0];
+
+  char name[64];
+  snprintf(name, sizeof name, "rgb_to_gray %dx%d", width, height);
+
+  double p50 = bench_samples_percentile(&s, 50);
+  bench_samples_report(name, &s);
+  printf("%-24s %.1f Mpx/s\n", "", width * height / p50 * 1e3);
+
+  bench_samples_free(&s);
+  free(rgb);
+  free(gray);
+}
+
+/**
+ * Benchmark the fused crop kernels for one face size.
+ *
+ * @param size The face box side length in frame pixels
+ * @param equalize Nonzero for equalization, otherwise normalization
+ */
+static void bench_crop(int size, int equalize) {
+  const int width = 640;
+  const int height = 480;
+
+  unsigned char* data = malloc((size_t) width * height);
+  fill(data, (size_t) width * height);
+
+  struct face_frame frame = {
+    .width = width,
+    .height = height,
+    .stride = width,
+    .format = face_pixel_format_gray8,
+    .data = data,
+  };
+
+  float input[FACE_INPUT_SIZE * FACE_INPUT_SIZE];
+
+  struct bench_samples s = {0};
+  for (int i = 0; i < ITERATIONS; ++i) {
+    // Walk the box around so the source is not always hot in cache
+    struct face_box box = {
+      .x = (i * 37) % (width - size),
+      .y = (i * 23) % (height - size),
+      .width = size,
+      .height = size,
+    };
+
+    unsigned long long t0 = bench_now();
+    if (equalize) {
+      face_kernel_crop_resize_equalize(&frame, &box, input, FACE_INPUT_SIZE, FACE_INPUT_SIZE);
+    } else {
+      face_kernel_crop_resize_normalize(&frame, &box, input, FACE_INPUT_SIZE, FACE_INPUT_SIZE);
+    }
+    bench_samples_add(&s, (double) (bench_now() - t0));
+  }
+  sink = input[0];
+
+  char name[64];
+  snprintf(name, sizeof name, "crop_%s %d", equalize ? "equalize" : "normalize", size);
+  bench_samples_report(name, &s);
+
+  bench_samples_free(&s);
+  free(data);
+}
+
+int main() {
+#if defined(__SSSE3__)
+  printf("vector path: SSSE3\n");
+#elif defined(__SSE2__)
+  printf("vector path: SSE2\n");
+#else
+  printf("vector path: none\n");
+#endif
+
+  bench_rgb_to_gray(320, 240);
+  bench_rgb_to_gray(640, 480);
+  bench_rgb_to_gray(1280, 720);
+
+  for (int size = 32; size <= 256; size *= 2) {
+    bench_crop(size, 0);
+    bench_crop(size, 1);
+  }
+
+  return 0;
+}
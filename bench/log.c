@@ -0,0 +1,164 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#include "../src/log.h"
+
+//
+// Log Ring Benchmark
+//
+// Submits a steady stream of records from a few subsystems, mostly routine
+// with the odd warning, so the ring wraps many times over. Submission latency
+// covers formatting and indexing, with output sent to a sink that discards
+// it, and is compared against trace records dropped by level. Queries are
+// then timed against the full ring. Narrow queries should cost in proportion
+// to what they match, while a query for everything walks the whole ring and
+// gives the scale for comparison.
+//
+
+/** Records from the face service. */
+static void emit_face(unsigned long i) {
+  const char* LOG_TAG = "face";
+  if (i % 500 == 0) {
+    LOGW("Lost track {}", _ul(i));
+  } else {
+    LOGI("Frame {} has {} faces", _ul(i), _i(i % 3));
+  }
+}
+
+/** Records from the speech service. */
+static void emit_speech(unsigned long i) {
+  const char* LOG_TAG = "speech";
+  LOGD("Chunk {} energy {}", _ul(i), _d(i * 0.25));
+}
+
+/** Records from the monitor service. */
+static void emit_monitor(unsigned long i) {
+  const char* LOG_TAG = "monitor";
+  LOGI("Drew frame {}", _ul(i));
+}
+
+/** Records from the Python service. */
+static void emit_python(unsigned long i) {
+  const char* LOG_TAG = "python";
+  if (i % 250 == 0) {
+    LOGE("Script {} raised", _ul(i));
+  } else {
+    LOGD("Script {} ran", _ul(i));
+  }
+}
+
+/** Discards formatted records. */
+static void discard(const char* rec, size_t len) {
+  (void) rec;
+  (void) len;
+}
+
+/**
+ * Time a query.
+ *
+ * @param name The row label
+ * @param query The query
+ * @param out The record buffer, LOG_RING_LEN long
+ * @param cap The most records to return
+ * @param rounds The number of times to run it
+ */
+static void run_query(const char* name, const struct log_query* query, struct log_record* out, size_t cap,
+    int rounds) {
+  struct bench_samples samples = {0};
+  size_t len = 0;
+  for (int r = 0; r < rounds; ++r) {
+    unsigned long long t0 = bench_now();
+    len = log_tail(query, out, cap);
+    bench_samples_add(&samples, (double) (bench_now() - t0));
+  }
+
+  char label[64];
+  snprintf(label, sizeof label, "%s (%zu)", name, len);
+  bench_samples_report(label, &samples);
+  bench_samples_free(&samples);
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s [-n records]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  unsigned long records = 1000000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        records = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  log_set_sink(&discard);
+
+  struct bench_samples submit = {0};
+  for (unsigned long i = 0; i < records; ++i) {
+    unsigned long long t0 = bench_now();
+    switch (i % 4) {
+      case 0:
+        emit_face(i / 4);
+        break;
+      case 1:
+        emit_speech(i / 4);
+        break;
+      case 2:
+        emit_monitor(i / 4);
+        break;
+      default:
+        emit_python(i / 4);
+        break;
+    }
+    bench_samples_add(&submit, (double) (bench_now() - t0));
+  }
+  bench_samples_report("submit", &submit);
+  bench_samples_free(&submit);
+
+  // Trace records below the level are dropped before they are formatted or kept
+  log_set_level(log_level_debug);
+  struct bench_samples dropped = {0};
+  for (unsigned long i = 0; i < records / 4; ++i) {
+    const char* LOG_TAG = "speech";
+    unsigned long long t0 = bench_now();
+    LOGT("Hop {} skipped", _ul(i));
+    bench_samples_add(&dropped, (double) (bench_now() - t0));
+  }
+  bench_samples_report("submit dropped", &dropped);
+  bench_samples_free(&dropped);
+  log_set_level(log_level_trace);
+
+  log_set_sink(NULL);
+
+  struct log_record* out = malloc(LOG_RING_LEN * sizeof *out);
+  int rounds = 1000;
+
+  run_query("all", &(struct log_query) { .level = log_level_trace }, out, LOG_RING_LEN, rounds);
+  run_query("tail 20", &(struct log_query) { .level = log_level_trace }, out, 20, rounds);
+  run_query("face warn", &(struct log_query) { .tag = "face", .level = log_level_warn }, out, LOG_RING_LEN, rounds);
+  run_query("error", &(struct log_query) { .level = log_level_error }, out, LOG_RING_LEN, rounds);
+  run_query("monitor", &(struct log_query) { .tag = "monitor" }, out, LOG_RING_LEN, rounds);
+  run_query("log.c", &(struct log_query) { .file = "log.c" }, out, LOG_RING_LEN, rounds);
+  run_query("absent tag", &(struct log_query) { .tag = "absent" }, out, LOG_RING_LEN, rounds);
+
+  // Measure back from the newest record
+  log_tail(&(struct log_query) { .level = log_level_trace }, out, 1);
+  run_query("last 50us", &(struct log_query) { .since = out[0].time - 50000 }, out, LOG_RING_LEN, rounds);
+
+  free(out);
+  return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#include "../src/service.h"
+#include "../src/service/face.h"
+#include "../src/service/python.h"
+
+//
+// Zero-Copy View Benchmark
+//
+// Counts the copies a camera frame goes through on its way to Python. Each
+// synthetic frame is submitted to the face service, which makes the one copy
+// it needs as it converts the frame to grayscale into its mailbox, and is
+// then viewed from a script through cozmonaut.frame() and memoryview. The
+// buffer the script sees must be the very pixels the face service pinned,
+// so any further copy shows up as a buffer elsewhere. Exits nonzero if one
+// was made or a pin was not given back.
+//
+// Last, a frame is left viewed while the face service unloads, and must
+// still read back the same pixels afterward.
+//
+
+/** The synthetic frame width. */
+#define SYNTH_WIDTH 640
+
+/** The synthetic frame height. */
+#define SYNTH_HEIGHT 480
+
+/** The longest to wait for the face pipeline to take a frame in nanoseconds. */
+#define WAIT_NS 1000000000ull
+
+/**
+ * Wait for the face pipeline to finish a number of frames.
+ *
+ * @param processed The number of frames
+ * @return Zero on success, otherwise nonzero
+ */
+static int wait_processed(unsigned long processed) {
+  unsigned long long deadline = bench_now() + WAIT_NS;
+
+  struct face_stats stats;
+  while (!service_call(SERVICE_FACE, service_face_proc_get_stats, NULL, &stats)
+      && stats.frames_processed < processed) {
+    if (bench_now() > deadline) {
+      return 1;
+    }
+    usleep(100);
+  }
+
+  return 0;
+}
+
+/**
+ * Get the buffer the script last viewed, as __main__.m.
+ *
+ * @return The first byte, or NULL if there is none
+ */
+static const void* viewed(void) {
+  PyGILState_STATE gil = PyGILState_Ensure();
+
+  const void* data = NULL;
+
+  PyObject* m = PyObject_GetAttrString(PyImport_AddModule("__main__"), "m");
+  Py_buffer buf;
+  if (m && !PyObject_GetBuffer(m, &buf, PyBUF_RECORDS_RO)) {
+    data = buf.buf;
+    PyBuffer_Release(&buf);
+  }
+
+  PyErr_Clear();
+  Py_XDECREF(m);
+
+  PyGILState_Release(gil);
+  return data;
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s [-n frames]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  size_t len = 1000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n':
+        len = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  unsigned char* rgb = malloc((size_t) SYNTH_WIDTH * SYNTH_HEIGHT * 3);
+  if (!rgb) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  service_load(SERVICE_FACE);
+  service_load(SERVICE_PYTHON);
+
+  // With no detector the pipeline converts and tracks, which is all a view needs
+  struct face_config config = {
+    .detect_interval = 10,
+    .track_min_confidence = 0.5f,
+    .identity_refresh_interval = 15,
+    .match_threshold = 0.5f,
+    .preprocess = face_preprocess_normalize,
+  };
+  service_call(SERVICE_FACE, service_face_proc_configure, &config, NULL);
+
+  if (service_start(SERVICE_FACE)) {
+    fprintf(stderr, "failed to start face service\n");
+    return 1;
+  }
+
+  // Scripts run on this thread while the Python service is stopped
+  service_call(SERVICE_PYTHON, service_python_proc_exec, "import cozmonaut", NULL);
+
+  struct bench_samples view = {0};
+  unsigned long copies = 0;
+  unsigned long missing = 0;
+  unsigned int seed = 4242;
+
+  for (size_t f = 0; f < len; ++f) {
+    for (size_t i = 0; i < (size_t) SYNTH_WIDTH * SYNTH_HEIGHT * 3; ++i) {
+      seed = seed * 1103515245 + 12345;
+      rgb[i] = (unsigned char) (seed >> 24);
+    }
+
+    struct face_frame frame = {
+      .id = f + 1,
+      .width = SYNTH_WIDTH,
+      .height = SYNTH_HEIGHT,
+      .stride = SYNTH_WIDTH * 3,
+      .format = face_pixel_format_rgb24,
+      .data = rgb,
+    };
+
+    service_call(SERVICE_FACE, service_face_proc_submit, &frame, NULL);
+    if (wait_processed(f + 1)) {
+      fprintf(stderr, "face pipeline stalled at frame %zu\n", f);
+      return 1;
+    }
+
+    // Pin the frame ourselves to learn where its pixels live
+    struct face_pin pin;
+    if (service_call(SERVICE_FACE, service_face_proc_pin_frame, NULL, &pin)) {
+      ++missing;
+      continue;
+    }
+
+    unsigned long long t0 = bench_now();
+    service_call(SERVICE_PYTHON, service_python_proc_exec, "v = cozmonaut.frame(); m = memoryview(v)", NULL);
+    bench_samples_add(&view, (double) (bench_now() - t0));
+
+    const void* data = viewed();
+    if (!data) {
+      ++missing;
+    } else if (data != pin.frame.data) {
+      ++copies;
+    }
+
+    service_call(SERVICE_PYTHON, service_python_proc_exec, "m.release(); v.release(); del m, v", NULL);
+    service_call(SERVICE_FACE, service_face_proc_unpin_frame, &pin, NULL);
+  }
+
+  struct python_stats python;
+  service_call(SERVICE_PYTHON, service_python_proc_get_stats, NULL, &python);
+
+  printf("\nframes=%zu size=%dx%d\n", len, SYNTH_WIDTH, SYNTH_HEIGHT);
+  printf("%-24s %lu\n", "frames viewed", python.frames_viewed);
+  printf("%-24s %.1f MiB\n", "bytes viewed", python.bytes_viewed / 1048576.0);
+  printf("%-24s %.2f\n", "copies per frame", len ? (double) copies / (double) len : 0);
+  printf("%-24s %lu\n", "frames not viewed", missing);
+  printf("%-24s %lu\n", "pins held", python.pins_held);
+  bench_samples_report("view", &view);
+  bench_samples_free(&view);
+
+  // A view held across an unload must keep reading the same pixels
+  service_call(SERVICE_PYTHON, service_python_proc_exec, "v = cozmonaut.frame(); before = bytes(v)", NULL);
+  service_stop(SERVICE_FACE);
+  service_unload(SERVICE_FACE);
+  int survived = !service_call(SERVICE_PYTHON, service_python_proc_exec,
+      "assert bytes(v) == before; v.release(); del v, before", NULL);
+  printf("%-24s %s\n", "view across unload", survived ? "ok" : "failed");
+
+  service_call(SERVICE_PYTHON, service_python_proc_get_stats, NULL, &python);
+
+  service_unload(SERVICE_PYTHON);
+  free(rgb);
+
+  if (copies || missing || python.pins_held || !survived) {
+    fprintf(stderr, "frames were copied, not viewed or not given back\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#include "../src/service.h"
+#include "../src/service/speech.h"
+
+//
+// Speech Pipeline Benchmark
+//
+// Replays a corpus directory of WAV or raw PCM recordings through the speech
+// service without a microphone. Each file is replayed on a freshly built
+// pipeline, so runs are repeatable. The recognizer is stood in for by a
+// backend that only counts what it is given, so the numbers cover everything
+// up to the recognizer. Per-stage latency is the mean cost per hop of each
+// file. End-of-utterance latency runs from the last voiced hop to the
+// recognizer finishing the segment; as fast as possible it is the processing
+// cost of the hangover, and in real time it adds the hangover itself.
+//
+
+/** What the stand-in recognizer was given. */
+struct heard {
+  /** The number of segments begun. */
+  unsigned long segments;
+
+  /** The number of samples fed. */
+  unsigned long samples;
+
+  /** The number of feature frames received. */
+  unsigned long frames;
+};
+
+static int begin_stand_in(void* ctx) {
+  ++((struct heard*) ctx)->segments;
+  return 0;
+}
+
+static int feed_stand_in(void* ctx, const float* samples, size_t len) {
+  ((struct heard*) ctx)->samples += len;
+  return 0;
+}
+
+static int features_stand_in(void* ctx, const float* mfcc) {
+  ++((struct heard*) ctx)->frames;
+  return 0;
+}
+
+static int end_stand_in(void* ctx) {
+  return 0;
+}
+
+static int compare_names(const void* a, const void* b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/**
+ * Check whether a file name looks like a recording.
+ */
+static int is_recording(const char* name) {
+  size_t n = strlen(name);
+  return n > 4 && (!strcmp(name + n - 4, ".wav") || !strcmp(name + n - 4, ".pcm") || !strcmp(name + n - 4, ".raw"));
+}
+
+/**
+ * List the recordings in a directory, in name order.
+ *
+ * @param dir The directory path
+ * @param names The file names, to be freed by the caller
+ * @return The number of recordings
+ */
+static size_t list_corpus(const char* dir, char*** names) {
+  *names = NULL;
+  size_t len = 0;
+
+  DIR* d = opendir(dir);
+  if (!d) {
+    return 0;
+  }
+
+  struct dirent* entry;
+  while ((entry = readdir(d))) {
+    if (is_recording(entry->d_name)) {
+      *names = realloc(*names, (len + 1) * sizeof **names);
+      (*names)[len++] = strdup(entry->d_name);
+    }
+  }
+  closedir(d);
+
+  qsort(*names, len, sizeof **names, &compare_names);
+  return len;
+}
+
+/**
+ * Add a per-hop mean to a sample set, if there were any hops.
+ */
+static void add_mean(struct bench_samples* s, unsigned long long total, unsigned long count) {
+  if (count) {
+    bench_samples_add(s, (double) total / count);
+  }
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s -d corpus_dir [-r] [-p passes] [-s pcm_rate] [-c pcm_channels] [-k kws_model]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  const char* dir = NULL;
+  const char* model = NULL;
+  int realtime = 0;
+  int passes = 1;
+  int pcm_rate = SPEECH_SAMPLE_RATE;
+  int pcm_channels = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:rp:s:c:k:h")) != -1) {
+    switch (opt) {
+      case 'd':
+        dir = optarg;
+        break;
+      case 'r':
+        realtime = 1;
+        break;
+      case 'p':
+        passes = atoi(optarg);
+        break;
+      case 's':
+        pcm_rate = atoi(optarg);
+        break;
+      case 'c':
+        pcm_channels = atoi(optarg);
+        break;
+      case 'k':
+        model = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (!dir) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  char** names;
+  size_t names_len = list_corpus(dir, &names);
+  if (!names_len) {
+    fprintf(stderr, "no recordings in %s\n", dir);
+    return 1;
+  }
+
+  service_load(SERVICE_SPEECH);
+
+  struct speech_config config = {
+    .sample_rate = SPEECH_SAMPLE_RATE,
+    .channels = 1,
+    .buffer_ms = 500,
+    .vad = 1,
+    .vad_onset_db = 9,
+    .vad_offset_db = 6,
+    .vad_hangover_ms = 300,
+    .vad_preroll_ms = 200,
+    .kws_model = model,
+    .kws_threshold = 0.8f,
+  };
+
+  if (service_call(SERVICE_SPEECH, service_speech_proc_configure, &config, NULL)) {
+    fprintf(stderr, "failed to configure speech pipeline\n");
+    return 1;
+  }
+
+  struct heard heard = {0};
+  struct speech_backend backend = {
+    .ctx = &heard,
+    .begin = &begin_stand_in,
+    .feed = &feed_stand_in,
+    .features = &features_stand_in,
+    .end = &end_stand_in,
+  };
+  service_call(SERVICE_SPEECH, service_speech_proc_set_backend, &backend, NULL);
+
+  struct bench_samples vad = {0};
+  struct bench_samples feature = {0};
+  struct bench_samples kws = {0};
+  struct bench_samples recognizer = {0};
+  struct bench_samples eou = {0};
+
+  unsigned long long audio_ns = 0;
+  unsigned long long wall_ns = 0;
+  size_t replayed = 0;
+
+  struct speech_stats before;
+  struct speech_stats after;
+
+  for (int pass = 0; pass < passes; ++pass) {
+    for (size_t i = 0; i < names_len; ++i) {
+      char path[4096];
+      snprintf(path, sizeof path, "%s/%s", dir, names[i]);
+
+      struct speech_replay_options options = {
+        .path = path,
+        .sample_rate = pcm_rate,
+        .channels = pcm_channels,
+        .realtime = realtime,
+      };
+
+      service_call(SERVICE_SPEECH, service_speech_proc_get_stats, NULL, &before);
+
+      unsigned long long t0 = bench_now();
+      if (service_call(SERVICE_SPEECH, service_speech_proc_replay, &options, NULL)) {
+        fprintf(stderr, "skipping %s\n", path);
+        continue;
+      }
+      wall_ns += bench_now() - t0;
+
+      service_call(SERVICE_SPEECH, service_speech_proc_get_stats, NULL, &after);
+
+      unsigned long hops = after.hops - before.hops;
+      audio_ns += (unsigned long long) hops * SPEECH_HOP_MS * 1000000ull;
+      ++replayed;
+
+      add_mean(&vad, after.vad_time - before.vad_time, hops);
+      add_mean(&feature, after.feature_time - before.feature_time, after.hops_forwarded - before.hops_forwarded);
+      add_mean(&kws, after.kws_time - before.kws_time, after.hops_forwarded - before.hops_forwarded);
+      add_mean(&recognizer, after.recognizer_time - before.recognizer_time,
+          after.hops_recognized - before.hops_recognized);
+      add_mean(&eou, after.eou_time - before.eou_time, after.utterances_closed - before.utterances_closed);
+    }
+  }
+
+  service_call(SERVICE_SPEECH, service_speech_proc_get_stats, NULL, &after);
+
+  printf("files=%zu audio=%.1fs mode=%s\n", replayed, audio_ns / 1e9, realtime ? "realtime" : "fast");
+  printf("%-24s %.5f\n", "real-time factor", audio_ns ? (double) wall_ns / audio_ns : 0);
+  printf("%-24s %lu forwarded, %lu recognized of %lu\n", "hops", after.hops_forwarded, after.hops_recognized,
+      after.hops);
+  printf("%-24s %lu utterances, %lu keywords, %lu recognizer segments\n", "segments", after.utterances_closed,
+      after.kws_detections, heard.segments);
+
+  printf("\nper-hop cost, mean per file\n");
+  bench_samples_report("  vad", &vad);
+  bench_samples_report("  feature", &feature);
+  bench_samples_report("  kws", &kws);
+  bench_samples_report("  recognizer", &recognizer);
+
+  printf("\nper-utterance latency, mean per file\n");
+  bench_samples_report("  end of utterance", &eou);
+
+  bench_samples_free(&vad);
+  bench_samples_free(&feature);
+  bench_samples_free(&kws);
+  bench_samples_free(&recognizer);
+  bench_samples_free(&eou);
+
+  for (size_t i = 0; i < names_len; ++i) {
+    free(names[i]);
+  }
+  free(names);
+
+  service_unload(SERVICE_SPEECH);
+  return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#include "../src/service/speech/resample.h"
+
+//
+// Resampler Benchmark
+//
+// Converts capture formats the robot is likely to see down to the 16 kHz mono
+// the speech pipeline runs at. Throughput is measured on noise pushed in
+// capture-sized chunks on one core. Quality is measured with pure tones:
+// passband ripple is the spread of gain across tones up to the passband edge,
+// and aliasing is the worst output level for tones above the output Nyquist
+// frequency, which should have been removed entirely.
+//
+
+/** The output sample rate. */
+#define OUT_RATE 16000
+
+/** The number of input frames per push, as a capture callback might deliver. */
+#define CHUNK 480
+
+/** A capture format to test. */
+struct format {
+  /** The input sample rate. */
+  int rate;
+
+  /** The number of channels. */
+  int channels;
+};
+
+/**
+ * Resample a whole buffer in capture-sized chunks.
+ *
+ * @param rs The resampler
+ * @param in The interleaved input
+ * @param len The number of input frames
+ * @param channels The number of channels
+ * @param out The output
+ * @return The number of output samples
+ */
+static size_t resample_all(struct speech_resample* rs, const short* in, size_t len, int channels, float* out) {
+  size_t n = 0;
+  for (size_t i = 0; i < len; i += CHUNK) {
+    size_t chunk = len - i < CHUNK ? len - i : CHUNK;
+    n += speech_resample_push(rs, in + i * channels, chunk, channels, out + n);
+  }
+  return n;
+}
+
+/**
+ * Measure the gain of a tone through the resampler.
+ *
+ * @param fmt The capture format
+ * @param freq The tone frequency in hertz
+ * @return The gain in decibels
+ */
+static double tone_gain(const struct format* fmt, double freq) {
+  size_t len = (size_t) fmt->rate;
+  short* in = malloc(len * fmt->channels * sizeof *in);
+  float* out = malloc((len * OUT_RATE / fmt->rate + 16) * sizeof *out);
+
+  double amplitude = 0.5;
+  for (size_t i = 0; i < len; ++i) {
+    short v = (short) lrint(32767 * amplitude * sin(2 * M_PI * freq * i / fmt->rate));
+    for (int c = 0; c < fmt->channels; ++c) {
+      in[i * fmt->channels + c] = v;
+    }
+  }
+
+  struct speech_resample rs;
+  speech_resample_init(&rs, fmt->rate, OUT_RATE, CHUNK);
+  size_t n = resample_all(&rs, in, len, fmt->channels, out);
+
+  // Skip the filter's warm-up and measure the steady-state level
+  size_t skip = n / 4;
+  double power = 0;
+  for (size_t i = skip; i < n; ++i) {
+    power += (double) out[i] * out[i];
+  }
+  power /= (double) (n - skip);
+
+  speech_resample_free(&rs);
+  free(in);
+  free(out);
+
+  return 10 * log10(power / (amplitude * amplitude / 2) + 1e-20);
+}
+
+/**
+ * Benchmark one capture format.
+ *
+ * @param fmt The capture format
+ * @param seconds The amount of audio to time
+ */
+static void run(const struct format* fmt, int seconds) {
+  struct speech_resample rs;
+  if (speech_resample_init(&rs, fmt->rate, OUT_RATE, CHUNK)) {
+    printf("%6d Hz x%d   unsupported\n", fmt->rate, fmt->channels);
+    return;
+  }
+
+  size_t len = (size_t) fmt->rate * seconds;
+  short* in = malloc(len * fmt->channels * sizeof *in);
+  float* out = malloc(speech_resample_max_out(&rs, len) * sizeof *out);
+
+  unsigned int seed = 99;
+  for (size_t i = 0; i < len * fmt->channels; ++i) {
+    seed = seed * 1103515245 + 12345;
+    in[i] = (short) (seed >> 16);
+  }
+
+  unsigned long long t0 = bench_now();
+  resample_all(&rs, in, len, fmt->channels, out);
+  double elapsed = (bench_now() - t0) / 1e9;
+
+  double nyquist = 0.5 * (fmt->rate < OUT_RATE ? fmt->rate : OUT_RATE);
+
+  double gain_min = 1e9;
+  double gain_max = -1e9;
+  for (double f = 100; f <= SPEECH_RESAMPLE_PASSBAND * nyquist; f += 100) {
+    double g = tone_gain(fmt, f);
+    gain_min = g < gain_min ? g : gain_min;
+    gain_max = g > gain_max ? g : gain_max;
+  }
+
+  // Only downsampling can alias, and only from tones the input can carry
+  double alias = -INFINITY;
+  for (double f = OUT_RATE / 2.0 + 250; f < 0.98 * fmt->rate / 2; f += 250) {
+    double g = tone_gain(fmt, f);
+    alias = g > alias ? g : alias;
+  }
+
+  printf("%6d Hz x%d   taps %4zu phases %4u   %8.2f Mframes/s (%5.0fx real time)   ripple %.3f dB   ", fmt->rate,
+      fmt->channels, rs.taps, rs.up, len / elapsed / 1e6, len / elapsed / fmt->rate, gain_max - gain_min);
+
+  if (isinf(alias)) {
+    printf("aliasing n/a\n");
+  } else {
+    printf("aliasing %.1f dB\n", alias);
+  }
+
+  speech_resample_free(&rs);
+  free(in);
+  free(out);
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s [-s seconds]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  int seconds = 60;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:h")) != -1) {
+    switch (opt) {
+      case 's':
+        seconds = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  static const struct format formats[] = {
+    { 48000, 2 },
+    { 48000, 1 },
+    { 44100, 2 },
+    { 44100, 1 },
+    { 32000, 1 },
+    { 22050, 1 },
+    { 16000, 2 },
+    { 16000, 1 },
+    { 8000, 1 },
+  };
+
+  for (size_t i = 0; i < sizeof formats / sizeof *formats; ++i) {
+    run(&formats[i], seconds);
+  }
+
+  return 0;
+}
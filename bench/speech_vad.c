@@ -0,0 +1,342 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#include "../src/service/speech/vad.h"
+
+//
+// Voice Activity Detector Benchmark
+//
+// Runs the detector over a synthetic, labeled corpus and reports how much
+// speech it fails to forward (false rejects) and how much background it
+// forwards (false accepts), along with its cost per hop. Utterances are
+// strings of voiced syllables with formant-shaped harmonics, some followed by
+// fricative noise, between stretches of background noise at several SNRs.
+//
+
+/** The corpus sample rate. */
+#define RATE 16000
+
+/** The number of samples per hop. */
+#define HOP 160
+
+/** The detector hangover in hops, matching the service default. */
+#define HANGOVER_HOPS 30
+
+/** The pre-roll in hops, matching the service default. */
+#define PREROLL_HOPS 20
+
+/** A background noise kind. */
+enum noise {
+  /** Flat broadband hiss. */
+  noise_white,
+
+  /** Low-frequency motor rumble. */
+  noise_rumble,
+
+  noise_count,
+};
+
+/** A labeled utterance. */
+struct utterance {
+  /** The samples. */
+  float* samples;
+
+  /** The number of samples. */
+  size_t len;
+
+  /** Per hop, nonzero if the hop carries speech. */
+  unsigned char* speech;
+
+  /** The first hop of the utterance. */
+  size_t first_hop;
+
+  /** One past the last hop of the utterance. */
+  size_t last_hop;
+};
+
+/** The generator state. */
+static unsigned int seed = 4242;
+
+/**
+ * Draw a uniform number from zero to one.
+ */
+static float uniform(void) {
+  seed = seed * 1103515245 + 12345;
+  return (float) (seed >> 8) / (1 << 24);
+}
+
+/**
+ * Draw an approximately Gaussian number with unit variance.
+ */
+static float gaussian(void) {
+  return (uniform() + uniform() + uniform() + uniform() - 2) * 1.7320508f;
+}
+
+/**
+ * Synthesize one voiced syllable into a buffer.
+ *
+ * @param out The output samples, added to
+ * @param len The number of samples
+ * @param amplitude The peak amplitude
+ */
+static void voiced(float* out, size_t len, float amplitude) {
+  float f0 = 90 + 130 * uniform();
+  float drift = (uniform() - 0.5f) * 40;
+  float f1 = 300 + 600 * uniform();
+  float f2 = 900 + 1600 * uniform();
+
+  double phase = 0;
+  size_t ramp = RATE / 50;
+
+  for (size_t i = 0; i < len; ++i) {
+    float t = (float) i / (float) len;
+    phase += 2 * M_PI * (f0 + drift * t) / RATE;
+
+    // Harmonics weighted by two formant bumps and a falling tilt
+    float v = 0;
+    for (int h = 1; h * f0 < 4000; ++h) {
+      float f = h * f0;
+      float w = expf(-(f - f1) * (f - f1) / (2 * 150.0f * 150.0f)) + 0.5f * expf(-(f - f2) * (f - f2)
+          / (2 * 250.0f * 250.0f)) + 0.05f / h;
+      v += w * (float) sin(h * phase);
+    }
+
+    float env = 1;
+    if (i < ramp) {
+      env = (float) i / ramp;
+    } else if (len - i < ramp) {
+      env = (float) (len - i) / ramp;
+    }
+
+    out[i] += amplitude * env * v * 0.3f;
+  }
+}
+
+/**
+ * Synthesize one fricative into a buffer.
+ *
+ * @param out The output samples, added to
+ * @param len The number of samples
+ * @param amplitude The peak amplitude
+ */
+static void fricative(float* out, size_t len, float amplitude) {
+  float prev = 0;
+  for (size_t i = 0; i < len; ++i) {
+    // A first difference pushes the noise toward high frequencies
+    float n = gaussian();
+    float env = sinf((float) M_PI * (float) i / (float) len);
+    out[i] += amplitude * env * (n - prev) * 0.5f;
+    prev = n;
+  }
+}
+
+/**
+ * Synthesize a labeled utterance in background noise.
+ *
+ * @param u The output utterance
+ * @param kind The background noise
+ * @param snr The speech to noise ratio in decibels
+ */
+static void synthesize(struct utterance* u, enum noise kind, float snr) {
+  size_t lead = (size_t) (RATE * (0.6f + 0.4f * uniform()));
+  size_t speech_len = (size_t) (RATE * (1.0f + uniform()));
+  size_t tail = (size_t) (RATE * (0.8f + 0.4f * uniform()));
+
+  u->len = (lead + speech_len + tail) / HOP * HOP;
+  u->samples = calloc(u->len, sizeof *u->samples);
+  u->speech = calloc(u->len / HOP, 1);
+
+  unsigned char* content = calloc(u->len, 1);
+
+  // Lay down syllables with short gaps until the speech stretch is used up
+  size_t at = lead;
+  while (at < lead + speech_len) {
+    float amplitude = powf(10, (uniform() - 0.5f) * 12 / 20);
+
+    size_t len = (size_t) (RATE * (0.12f + 0.13f * uniform()));
+    if (at + len > u->len) {
+      break;
+    }
+    voiced(u->samples + at, len, amplitude);
+    memset(content + at, 1, len);
+    at += len;
+
+    if (uniform() < 0.4f) {
+      len = (size_t) (RATE * (0.06f + 0.06f * uniform()));
+      if (at + len > u->len) {
+        break;
+      }
+      fricative(u->samples + at, len, amplitude * 0.3f);
+      memset(content + at, 1, len);
+      at += len;
+    }
+
+    at += (size_t) (RATE * (0.03f + 0.07f * uniform()));
+  }
+
+  double signal = 0;
+  size_t signal_len = 0;
+  for (size_t i = 0; i < u->len; ++i) {
+    if (content[i]) {
+      signal += u->samples[i] * u->samples[i];
+      ++signal_len;
+    }
+  }
+  signal /= signal_len ? signal_len : 1;
+
+  float noise_rms = (float) sqrt(signal / pow(10, snr / 10));
+
+  float state = 0;
+  for (size_t i = 0; i < u->len; ++i) {
+    float n = gaussian();
+    if (kind == noise_rumble) {
+      // A one-pole low-pass, rescaled back to unit variance
+      state = 0.98f * state + n;
+      n = state * 0.2f;
+    }
+    u->samples[i] += noise_rms * n;
+  }
+
+  // A hop is speech when most of it is content
+  for (size_t h = 0; h < u->len / HOP; ++h) {
+    int count = 0;
+    for (size_t i = 0; i < HOP; ++i) {
+      count += content[h * HOP + i];
+    }
+    u->speech[h] = count > HOP / 2;
+  }
+
+  u->first_hop = lead / HOP;
+  u->last_hop = (at + HOP - 1) / HOP;
+
+  free(content);
+}
+
+/**
+ * Run the detector over one noise condition.
+ *
+ * @param kind The background noise
+ * @param snr The speech to noise ratio in decibels
+ * @param utterances The number of utterances
+ * @param cost The per-hop detector times
+ */
+static void run(enum noise kind, float snr, int utterances, struct bench_samples* cost) {
+  struct speech_vad_config config = {
+    .onset_db = 9,
+    .offset_db = 6,
+    .flatness_max = 0.35f,
+    .zcr_min = 0.25f,
+    .onset_hops = 2,
+    .hangover_hops = HANGOVER_HOPS,
+  };
+
+  unsigned long speech_hops = 0;
+  unsigned long rejected = 0;
+  unsigned long background_hops = 0;
+  unsigned long accepted = 0;
+
+  for (int n = 0; n < utterances; ++n) {
+    struct utterance u;
+    synthesize(&u, kind, snr);
+
+    struct speech_vad vad;
+    speech_vad_init(&vad, HOP, RATE, &config);
+
+    size_t hops = u.len / HOP;
+    unsigned char* forwarded = calloc(hops, 1);
+    size_t held = 0;
+
+    for (size_t h = 0; h < hops; ++h) {
+      unsigned long long t0 = bench_now();
+      enum speech_vad_state state = speech_vad_update(&vad, u.samples + h * HOP);
+      bench_samples_add(cost, (double) (bench_now() - t0));
+
+      switch (state) {
+        case speech_vad_onset:
+          // Forward the held pre-roll along with the onset hop
+          for (size_t k = h - held; k < h; ++k) {
+            forwarded[k] = 1;
+          }
+          held = 0;
+          forwarded[h] = 1;
+          break;
+        case speech_vad_speech:
+          forwarded[h] = 1;
+          break;
+        case speech_vad_silence:
+        case speech_vad_offset:
+          held = held < PREROLL_HOPS ? held + 1 : PREROLL_HOPS;
+          break;
+      }
+    }
+
+    // Count background only well clear of the utterance, where forwarding is a mistake
+    for (size_t h = 0; h < hops; ++h) {
+      if (u.speech[h]) {
+        ++speech_hops;
+        rejected += !forwarded[h];
+      } else if (h + PREROLL_HOPS < u.first_hop || h > u.last_hop + HANGOVER_HOPS) {
+        ++background_hops;
+        accepted += forwarded[h];
+      }
+    }
+
+    free(forwarded);
+    speech_vad_free(&vad);
+    free(u.samples);
+    free(u.speech);
+  }
+
+  static const char* names[noise_count] = { "white", "rumble" };
+
+  printf("%-8s %5.0f dB   false reject %6.2f%%   false accept %6.2f%%\n", names[kind], snr,
+      100.0 * rejected / (speech_hops ? speech_hops : 1), 100.0 * accepted / (background_hops ? background_hops : 1));
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s [-u utterances]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  int utterances = 50;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "u:h")) != -1) {
+    switch (opt) {
+      case 'u':
+        utterances = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  static const float snrs[] = { 20, 10, 5, 0 };
+
+  struct bench_samples cost = {0};
+
+  for (int kind = 0; kind < noise_count; ++kind) {
+    for (size_t s = 0; s < sizeof snrs / sizeof *snrs; ++s) {
+      run((enum noise) kind, snrs[s], utterances, &cost);
+    }
+  }
+
+  printf("\n");
+  bench_samples_report("vad hop", &cost);
+  printf("%-24s %.2f%% of one core\n", "real-time load", 100 * bench_samples_percentile(&cost, 50)
+      / (1e9 * HOP / RATE));
+  bench_samples_free(&cost);
+
+  return 0;
+}
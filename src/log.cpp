@@ -4,12 +4,146 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <utility>
 #include <vector>
 
+#include <pthread.h>
+
 #include <fmt/format.h>
 
 #include "log.h"
 
+/** Where formatted records go, or nullptr for standard output. */
+static std::atomic<log_sink> log__sink{nullptr};
+
+/** The least severity level submitted. */
+static std::atomic<int> log__level{log_level_trace};
+
+/** The number of severity levels. */
+constexpr size_t log__num_levels = log_level_fatal + 1;
+
+/** The most distinct tags indexed. */
+constexpr size_t log__max_tags = 64;
+
+/** The most distinct source files indexed. */
+constexpr size_t log__max_files = 256;
+
+/** The most distinct call sites indexed. */
+constexpr size_t log__max_sites = 2048;
+
+/** The most index chains one query walks at once. */
+constexpr size_t log__max_cursors = 32;
+
+/** An absent index entry. */
+constexpr unsigned int log__none = ~0u;
+
+/** A kind of chain linking records that share a key. */
+enum log__chain {
+  /** Records with the same level. */
+  log__chain_level,
+
+  /** Records with the same tag and level. */
+  log__chain_tag,
+
+  /** Records from the same source file. */
+  log__chain_file,
+
+  /** Records from the same call site. */
+  log__chain_site,
+
+  /** The number of chains. */
+  log__num_chains,
+};
+
+/** A record kept in the ring. */
+struct log__slot {
+  /** The record. */
+  log_record rec;
+
+  /** The sequence numbers of the previous records in each chain, or zero. */
+  unsigned long long prev[log__num_chains];
+};
+
+/** An indexed tag. */
+struct log__tag {
+  /** The tag, or empty if unused. */
+  char name[32];
+
+  /** The latest record with this tag at each level. */
+  unsigned long long head[log__num_levels];
+};
+
+/** An indexed source file. */
+struct log__file {
+  /** The file name, or empty if unused. */
+  char name[256];
+
+  /** The latest record from this file. */
+  unsigned long long head;
+};
+
+/** An indexed call site. */
+struct log__site {
+  /** The file name as submitted, or nullptr if unused. */
+  const char* file;
+
+  /** The line number. */
+  unsigned int line;
+
+  /** The tag as last submitted. */
+  const char* tag;
+
+  /** The index of the file. */
+  unsigned int file_id;
+
+  /** The index of the tag. */
+  unsigned int tag_id;
+
+  /** The latest record from this call site. */
+  unsigned long long head;
+};
+
+/** Guards the ring and its indexes. */
+static std::mutex log__ring_lock;
+
+/** Holds the ring lock across fork, so a child never starts out with it held by a thread it lacks. */
+static struct log__fork_guard {
+  log__fork_guard() {
+    pthread_atfork([] { log__ring_lock.lock(); }, [] { log__ring_lock.unlock(); }, [] { log__ring_lock.unlock(); });
+  }
+} log__fork_guard;
+
+/** The ring of recent records. */
+static log__slot log__ring[LOG_RING_LEN];
+
+/** The sequence number of the latest record. */
+static unsigned long long log__ring_last;
+
+/** The latest record at each level. */
+static unsigned long long log__level_head[log__num_levels];
+
+/** The tag index, open addressed by name. */
+static log__tag log__tags[log__max_tags];
+
+/** The number of tags indexed. */
+static size_t log__tags_len;
+
+/** The file index, open addressed by name. */
+static log__file log__files[log__max_files];
+
+/** The number of files indexed. */
+static size_t log__files_len;
+
+/** The call site index, open addressed by file name address and line. */
+static log__site log__sites[log__max_sites];
+
+/** The number of call sites indexed. */
+static size_t log__sites_len;
+
 constexpr auto log__level_name(log_level level) {
   switch (level) {
     case log_level_debug:
@@ -73,7 +207,287 @@ constexpr auto log__format_arg_to_fmt_arg(const log_format_arg& arg) {
   }
 }
 
+/**
+ * Hash a string.
+ *
+ * @param str The string
+ * @return The hash
+ */
+static size_t log__hash(const char* str) {
+  size_t h = 2166136261u;
+  for (; *str; ++str) {
+    h = (h ^ (unsigned char) *str) * 16777619u;
+  }
+  return h;
+}
+
+/**
+ * Find a name in an open addressed index.
+ *
+ * @param table The index
+ * @param cap The capacity of the index
+ * @param len The number of entries, which grows if one is added
+ * @param name The name
+ * @param add Whether to add the name if missing
+ * @return The entry index, or log__none if missing or full
+ */
+template<typename T>
+static unsigned int log__find(T* table, size_t cap, size_t& len, const char* name, bool add) {
+  for (size_t i = log__hash(name) % cap, n = 0; n < cap; i = (i + 1) % cap, ++n) {
+    auto& entry = table[i];
+    if (!entry.name[0]) {
+      if (!add || len == cap - 1) {
+        return log__none;
+      }
+
+      // Names that do not fit are truncated, and share an entry with others alike
+      std::strncpy(entry.name, name, sizeof entry.name - 1);
+      ++len;
+      return (unsigned int) i;
+    }
+    if (std::strncmp(entry.name, name, sizeof entry.name - 1) == 0) {
+      return (unsigned int) i;
+    }
+  }
+  return log__none;
+}
+
+/**
+ * Find the call site of a request, adding it if missing. Call with the ring
+ * lock held.
+ *
+ * @param req The request
+ * @return The site index, or log__none if the index is full
+ */
+static unsigned int log__find_site(const log_request* req) {
+  // Call sites are keyed by the address of the file name, which is fixed
+  auto key = (size_t) req->file * 31 + req->line;
+  for (size_t i = key % log__max_sites, n = 0; n < log__max_sites; i = (i + 1) % log__max_sites, ++n) {
+    auto& site = log__sites[i];
+    if (!site.file) {
+      if (log__sites_len == log__max_sites - 1) {
+        return log__none;
+      }
+
+      site.file = req->file;
+      site.line = req->line;
+      site.tag = req->tag;
+      site.file_id = log__find(log__files, log__max_files, log__files_len, req->file, true);
+      site.tag_id = log__find(log__tags, log__max_tags, log__tags_len, req->tag, true);
+      ++log__sites_len;
+      return (unsigned int) i;
+    }
+    if (site.file == req->file && site.line == req->line) {
+      // A file may set a different tag partway through
+      if (site.tag != req->tag) {
+        site.tag = req->tag;
+        site.tag_id = log__find(log__tags, log__max_tags, log__tags_len, req->tag, true);
+      }
+      return (unsigned int) i;
+    }
+  }
+  return log__none;
+}
+
+/**
+ * Check whether a record is still in the ring. Call with the ring lock held.
+ *
+ * @param seq The sequence number
+ * @return Whether it is
+ */
+static bool log__live(unsigned long long seq) {
+  return seq && seq + LOG_RING_LEN > log__ring_last;
+}
+
+/**
+ * Keep a record in the ring and link it into the indexes.
+ *
+ * @param req The request
+ * @param msg The formatted message
+ * @param len The length of the message
+ */
+static void log__keep(const log_request* req, const char* msg, size_t len) {
+  len = std::min(len, (size_t) LOG_RECORD_MSG_MAX - 1);
+
+  std::lock_guard<std::mutex> guard(log__ring_lock);
+
+  // Read the clock under the lock so times rise with sequence numbers
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  auto site_id = log__find_site(req);
+  auto file_id = log__none;
+  auto tag_id = log__none;
+  if (site_id != log__none) {
+    file_id = log__sites[site_id].file_id;
+    tag_id = log__sites[site_id].tag_id;
+  } else {
+    file_id = log__find(log__files, log__max_files, log__files_len, req->file, true);
+    tag_id = log__find(log__tags, log__max_tags, log__tags_len, req->tag, true);
+  }
+
+  auto seq = ++log__ring_last;
+  auto& slot = log__ring[seq % LOG_RING_LEN];
+
+  slot.rec.seq = seq;
+  slot.rec.time = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  slot.rec.level = req->level;
+  slot.rec.tag = tag_id != log__none ? log__tags[tag_id].name : req->tag;
+  slot.rec.file = file_id != log__none ? log__files[file_id].name : req->file;
+  slot.rec.line = req->line;
+  std::memcpy(slot.rec.msg, msg, len);
+  slot.rec.msg[len] = '\0';
+
+  // Push onto the front of each chain
+  slot.prev[log__chain_level] = std::exchange(log__level_head[req->level], seq);
+  slot.prev[log__chain_tag] = tag_id != log__none ? std::exchange(log__tags[tag_id].head[req->level], seq) : 0;
+  slot.prev[log__chain_file] = file_id != log__none ? std::exchange(log__files[file_id].head, seq) : 0;
+  slot.prev[log__chain_site] = site_id != log__none ? std::exchange(log__sites[site_id].head, seq) : 0;
+}
+
+/**
+ * Check whether a file name ends with a path.
+ *
+ * @param file The file name
+ * @param path The path
+ * @return Whether it does, on a path separator
+ */
+static bool log__file_matches(const char* file, const char* path) {
+  auto file_len = std::strlen(file);
+  auto path_len = std::strlen(path);
+  if (path_len > file_len || std::strcmp(file + file_len - path_len, path) != 0) {
+    return false;
+  }
+  return path_len == file_len || file[file_len - path_len - 1] == '/';
+}
+
+/**
+ * Check whether a record matches a query.
+ *
+ * @param rec The record
+ * @param query The query
+ * @return Whether it does
+ */
+static bool log__matches(const log_record& rec, const log_query* query) {
+  if (rec.level < query->level) {
+    return false;
+  }
+  if (query->tag && std::strncmp(rec.tag, query->tag, sizeof log__tag::name - 1) != 0) {
+    return false;
+  }
+  if (query->file && !log__file_matches(rec.file, query->file)) {
+    return false;
+  }
+  return !query->line || rec.line == query->line;
+}
+
+size_t log_tail(const log_query* query, log_record* out, size_t cap) {
+  // Chains to walk, newest record first
+  unsigned long long cursors[log__max_cursors];
+  size_t cursors_len = 0;
+  log__chain chain = log__chain_level;
+
+  auto add_cursor = [&](unsigned long long head) {
+    if (head && cursors_len < log__max_cursors) {
+      cursors[cursors_len++] = head;
+    }
+  };
+
+  std::lock_guard<std::mutex> guard(log__ring_lock);
+
+  //
+  // Query Planning
+  //
+  // Walk the chains of the narrowest index the query names: call sites, then
+  // files, then tags. Every query can fall back to the level chains, which
+  // together hold every record, when a narrower index would need too many
+  // chains or never saw the key.
+  //
+
+  bool planned = false;
+
+  if (query->file) {
+    size_t matched = 0;
+    if (query->line) {
+      for (auto& site : log__sites) {
+        if (site.file && site.line == query->line && log__file_matches(site.file, query->file) && matched++ < log__max_cursors) {
+          add_cursor(site.head);
+        }
+      }
+      chain = log__chain_site;
+    } else {
+      for (auto& file : log__files) {
+        if (file.name[0] && log__file_matches(file.name, query->file) && matched++ < log__max_cursors) {
+          add_cursor(file.head);
+        }
+      }
+      chain = log__chain_file;
+    }
+
+    // An unindexed file could be anywhere, as could one of too many matches
+    planned = matched <= log__max_cursors && log__sites_len < log__max_sites - 1 && log__files_len < log__max_files - 1;
+    if (!planned) {
+      cursors_len = 0;
+    }
+  }
+
+  if (!planned && query->tag) {
+    auto tag_id = log__find(log__tags, log__max_tags, log__tags_len, query->tag, false);
+    if (tag_id != log__none) {
+      for (size_t level = query->level; level < log__num_levels; ++level) {
+        add_cursor(log__tags[tag_id].head[level]);
+      }
+      chain = log__chain_tag;
+      planned = true;
+    } else if (log__tags_len < log__max_tags - 1) {
+      // The tag was never seen
+      return 0;
+    }
+  }
+
+  if (!planned) {
+    for (size_t level = query->level; level < log__num_levels; ++level) {
+      add_cursor(log__level_head[level]);
+    }
+    chain = log__chain_level;
+  }
+
+  // Merge the chains, newest first, until the query is satisfied
+  size_t len = 0;
+  while (len < cap) {
+    size_t newest = cursors_len;
+    for (size_t i = 0; i < cursors_len; ++i) {
+      if (log__live(cursors[i]) && (newest == cursors_len || cursors[i] > cursors[newest])) {
+        newest = i;
+      }
+    }
+    if (newest == cursors_len) {
+      break;
+    }
+
+    auto& slot = log__ring[cursors[newest] % LOG_RING_LEN];
+    if (slot.rec.time < query->since) {
+      // Everything further down this chain is older still
+      cursors[newest] = 0;
+      continue;
+    }
+
+    cursors[newest] = slot.prev[chain];
+    if (log__matches(slot.rec, query)) {
+      out[len++] = slot.rec;
+    }
+  }
+
+  std::reverse(out, out + len);
+  return len;
+}
+
 void log__submit_request(log_request* req) {
+  // Dropped records never reach the ring lock
+  if (req->level < log__level.load(std::memory_order_relaxed)) {
+    return;
+  }
+
   // A place to hold {fmt} arguments
   std::vector<fmt::basic_format_arg<fmt::format_context>> args_vec;
   args_vec.reserve(req->format_args_len);
@@ -93,9 +507,24 @@ void log__submit_request(log_request* req) {
   // Format the log message
   auto msg = fmt::vformat(req->format, args);
 
+  // Keep it for queries
+  log__keep(req, msg.data(), msg.size());
+
   // Format the log record string
-  auto rec = fmt::format("{} [{}:{}] ({}) {}", log__level_name(req->level), req->file, req->line, req->tag, msg);
+  auto rec = fmt::format("{} [{}:{}] ({}) {}\n", log__level_name(req->level), req->file, req->line, req->tag, msg);
+
+  // Send to the sink if there is one, otherwise to standard output
+  if (auto sink = log__sink.load(std::memory_order_acquire)) {
+    sink(rec.data(), rec.size());
+  } else {
+    fmt::print("{}", rec);
+  }
+}
+
+void log_set_sink(log_sink sink) {
+  log__sink.store(sink, std::memory_order_release);
+}
 
-  // FIXME: Send to standard output for now
-  fmt::print("{}\n", rec);
+void log_set_level(log_level level) {
+  log__level.store(level, std::memory_order_relaxed);
 }
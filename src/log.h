@@ -162,6 +162,99 @@ struct log_format_arg {
   union log_format_arg_value value;
 };
 
+/**
+ * A log record sink.
+ *
+ * @param rec The formatted record, ending in a newline
+ * @param len The length of the record
+ */
+typedef void (* log_sink)(const char* rec, size_t len);
+
+/**
+ * Send formatted log records to a sink instead of standard output.
+ *
+ * @param sink The sink, or NULL for standard output
+ */
+void log_set_sink(log_sink sink);
+
+/**
+ * Drop records below a severity level as they are submitted, before they are
+ * formatted, kept or printed, at the cost of one load each. Defaults to
+ * log_level_trace, so everything is logged until the level is raised.
+ *
+ * @param level The least severity level
+ */
+void log_set_level(enum log_level level);
+
+//
+// Record Ring
+//
+// The most recent records are kept in memory as well as printed, so they can
+// be queried after the fact. Each record is linked to the one before it with
+// the same level, the same tag and level, the same source file, and the same
+// call site. A query walks only the chains for the most selective index it
+// names, so its cost grows with the number of records that index matches and
+// not with the size of the ring.
+//
+
+/** The number of log records kept in memory. */
+#define LOG_RING_LEN 4096
+
+/** The longest message kept with a log record, including the terminator. */
+#define LOG_RECORD_MSG_MAX 160
+
+/** A log record kept in memory. */
+struct log_record {
+  /** The sequence number, counting from one. */
+  unsigned long long seq;
+
+  /** The CLOCK_MONOTONIC time in nanoseconds. */
+  unsigned long long time;
+
+  /** The severity level. */
+  enum log_level level;
+
+  /** The subject tag. */
+  const char* tag;
+
+  /** The source file name. */
+  const char* file;
+
+  /** The source line number. */
+  unsigned int line;
+
+  /** The formatted message, truncated to fit. */
+  char msg[LOG_RECORD_MSG_MAX];
+};
+
+/** A query over the log records kept in memory. */
+struct log_query {
+  /** The subject tag, or NULL for any. */
+  const char* tag;
+
+  /** The least severity level. */
+  enum log_level level;
+
+  /** The source file name or a trailing part of it, or NULL for any. */
+  const char* file;
+
+  /** The source line number, or zero for any. */
+  unsigned int line;
+
+  /** The earliest CLOCK_MONOTONIC time in nanoseconds, or zero for any. */
+  unsigned long long since;
+};
+
+/**
+ * Find the most recent log records matching a query.
+ *
+ * @param query The query
+ * @param out The matching records, oldest first
+ * @param cap The most records to return
+ * @return The number of records returned
+ */
+size_t log_tail(const struct log_query* query, struct log_record* out, size_t cap);
+
 /** @private */
 void log__submit_request(struct log_request* req);
 
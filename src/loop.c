@@ -0,0 +1,452 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "loop.h"
+#include "metric.h"
+#include "service.h"
+#include "trace.h"
+
+#define LOG_TAG "loop"
+
+/** The most events handled per wait. */
+#define BATCH 16
+
+/** The epoll key of the wake eventfd. */
+#define WAKE_KEY UINT64_MAX
+
+/** A watched file descriptor or timer. */
+struct watch {
+  /** Nonzero if in use. */
+  int used;
+
+  /** The service it is for, or NULL. */
+  struct service* svc;
+
+  /** Nonzero while its handler runs. */
+  int busy;
+
+  /** Incremented on every removal, so stale events can be told apart. */
+  unsigned int generation;
+
+  /** The file descriptor, a timerfd for timers. */
+  int fd;
+
+  /** Nonzero if a timer, which the loop owns. */
+  int timer;
+
+  /** The handler for a file descriptor. */
+  loop_fd_fn fd_fn;
+
+  /** The handler for a timer. */
+  loop_timer_fn timer_fn;
+
+  /** The handler context. */
+  void* ctx;
+};
+
+/** The watches. */
+static struct watch watches[LOOP_MAX_WATCHES];
+
+/** Guards the watches. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signaled when a handler returns. */
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+
+/** The epoll instance. */
+static int epoll_fd = -1;
+
+/** Written to wake the loop. */
+static int wake_fd = -1;
+
+/** Set to ask the loop to stop. */
+static atomic_int stopping;
+
+/** Nonzero while a thread runs the loop. */
+static atomic_int running;
+
+/** The thread running the loop. */
+static pthread_t loop_thread;
+
+/** The time handlers take. */
+static struct metric* metric_handler_ns;
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Check whether the calling thread is running the loop.
+ *
+ * @return Nonzero if it is
+ */
+static int on_loop_thread(void) {
+  return atomic_load(&running) && pthread_equal(pthread_self(), loop_thread);
+}
+
+/**
+ * Watch a file descriptor for a handler.
+ *
+ * @param svc The service it is for, or NULL
+ * @param fd The file descriptor
+ * @param timer Nonzero if a timer
+ * @param events The events to watch for
+ * @param fd_fn The handler for a file descriptor
+ * @param timer_fn The handler for a timer
+ * @param ctx The handler context
+ * @return Zero on success, otherwise nonzero
+ */
+static int add_watch(struct service* svc, int fd, int timer, unsigned int events, loop_fd_fn fd_fn,
+    loop_timer_fn timer_fn, void* ctx) {
+  pthread_mutex_lock(&lock);
+
+  // A slot whose handler is still returning cannot be reused yet
+  struct watch* w = NULL;
+  for (int i = 0; i < LOOP_MAX_WATCHES; ++i) {
+    if (!watches[i].used && !watches[i].busy) {
+      w = &watches[i];
+      break;
+    }
+  }
+
+  if (!w) {
+    pthread_mutex_unlock(&lock);
+    LOGE("Too many watches on the loop");
+    return 1;
+  }
+
+  w->used = 1;
+  w->svc = svc;
+  w->fd = fd;
+  w->timer = timer;
+  w->fd_fn = fd_fn;
+  w->timer_fn = timer_fn;
+  w->ctx = ctx;
+
+  struct epoll_event ev = {
+    .events = events,
+    .data.u64 = (uint64_t) w->generation << 32 | (uint64_t) (w - watches),
+  };
+
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+    w->used = 0;
+    pthread_mutex_unlock(&lock);
+    LOGE("Failed to watch fd {}: {}", _i(fd), _str(strerror(errno)));
+    return 1;
+  }
+
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+/**
+ * Stop watching a file descriptor, waiting out its handler unless called
+ * from the loop thread.
+ *
+ * @param fd The file descriptor
+ * @param timer Nonzero if a timer
+ * @return Zero on success, otherwise nonzero
+ */
+static int remove_watch(int fd, int timer) {
+  pthread_mutex_lock(&lock);
+
+  struct watch* w = NULL;
+  for (int i = 0; i < LOOP_MAX_WATCHES; ++i) {
+    if (watches[i].used && watches[i].fd == fd && watches[i].timer == timer) {
+      w = &watches[i];
+      break;
+    }
+  }
+
+  if (!w) {
+    pthread_mutex_unlock(&lock);
+    LOGE("No watch on fd {}", _i(fd));
+    return 1;
+  }
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  w->used = 0;
+  ++w->generation;
+
+  // On the loop thread this may be the handler itself, which is already done with it
+  if (!on_loop_thread()) {
+    while (w->busy) {
+      pthread_cond_wait(&idle, &lock);
+    }
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  if (timer) {
+    close(fd);
+  }
+
+  return 0;
+}
+
+/**
+ * Rank a priority class, lowest first to run.
+ *
+ * @param svc The service, or NULL
+ * @return The rank
+ */
+static int class_rank(const struct service* svc) {
+  switch (svc ? svc->sched_class : service_class_interactive) {
+    case service_class_realtime:
+      return 0;
+    case service_class_background:
+      return 2;
+    default:
+      return 1;
+  }
+}
+
+/**
+ * Put a batch of ready events in the order their handlers should run: by
+ * class, then by earliest deadline. Loop thread only.
+ *
+ * @param events The events
+ * @param len The number of events
+ */
+static void order(struct epoll_event* events, int len) {
+  int ranks[BATCH];
+  unsigned long long deadlines[BATCH];
+
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < len; ++i) {
+    // Waking is cheap and must not wait behind anything
+    if (events[i].data.u64 == WAKE_KEY) {
+      ranks[i] = -1;
+      deadlines[i] = 0;
+      continue;
+    }
+
+    const struct watch* w = &watches[(uint32_t) events[i].data.u64];
+    const struct service* svc = w->used ? w->svc : NULL;
+    ranks[i] = class_rank(svc);
+    deadlines[i] = svc && svc->deadline ? svc->deadline : ~0ull;
+  }
+  pthread_mutex_unlock(&lock);
+
+  // Batches are small, and the kernel mostly hands them over in order
+  for (int i = 1; i < len; ++i) {
+    struct epoll_event ev = events[i];
+    int rank = ranks[i];
+    unsigned long long deadline = deadlines[i];
+
+    int j = i;
+    for (; j > 0 && (ranks[j - 1] > rank || (ranks[j - 1] == rank && deadlines[j - 1] > deadline)); --j) {
+      events[j] = events[j - 1];
+      ranks[j] = ranks[j - 1];
+      deadlines[j] = deadlines[j - 1];
+    }
+
+    events[j] = ev;
+    ranks[j] = rank;
+    deadlines[j] = deadline;
+  }
+}
+
+/**
+ * Run the handler for an event. Loop thread only.
+ *
+ * @param ev The event
+ * @param ready When the event was seen to be ready
+ */
+static void dispatch(const struct epoll_event* ev, unsigned long long ready) {
+  struct watch* w = &watches[(uint32_t) ev->data.u64];
+  unsigned int generation = (unsigned int) (ev->data.u64 >> 32);
+
+  pthread_mutex_lock(&lock);
+
+  // Removed, and maybe replaced, since the wait returned
+  if (!w->used || w->generation != generation) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  struct watch copy = *w;
+  w->busy = 1;
+
+  pthread_mutex_unlock(&lock);
+
+  unsigned long long t0 = now_ns();
+  int traced = trace_begin("handler", LOG_TAG, copy.svc ? copy.svc->name : NULL, copy.fd);
+
+  if (copy.timer) {
+    // Nothing to read if it was rearmed since the wait returned
+    uint64_t expirations;
+    if (read(copy.fd, &expirations, sizeof expirations) == sizeof expirations && expirations) {
+      copy.timer_fn(copy.fd, expirations, copy.ctx);
+    }
+  } else {
+    copy.fd_fn(copy.fd, ev->events, copy.ctx);
+  }
+
+  trace_end(traced);
+
+  unsigned long long done = now_ns();
+  metric_record(metric_handler_ns, done - t0);
+
+  if (copy.svc) {
+    service_sched_done(copy.svc, ready, done);
+  }
+
+  pthread_mutex_lock(&lock);
+  w->busy = 0;
+  pthread_cond_broadcast(&idle);
+  pthread_mutex_unlock(&lock);
+}
+
+int loop_init(void) {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  struct epoll_event ev = {
+    .events = EPOLLIN,
+    .data.u64 = WAKE_KEY,
+  };
+
+  if (epoll_fd < 0 || wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev)) {
+    LOGE("Failed to create the event loop");
+    loop_free();
+    return 1;
+  }
+
+  metric_handler_ns = metric_get("loop.handler_ns", metric_kind_histogram);
+  atomic_store(&stopping, 0);
+  return 0;
+}
+
+void loop_free(void) {
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < LOOP_MAX_WATCHES; ++i) {
+    if (watches[i].used && watches[i].timer) {
+      close(watches[i].fd);
+    }
+    watches[i].used = 0;
+    ++watches[i].generation;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (epoll_fd >= 0) {
+    close(epoll_fd);
+    epoll_fd = -1;
+  }
+
+  if (wake_fd >= 0) {
+    close(wake_fd);
+    wake_fd = -1;
+  }
+}
+
+int loop_run(void) {
+  loop_thread = pthread_self();
+  atomic_store(&running, 1);
+
+  int result = 0;
+  struct epoll_event events[BATCH];
+
+  while (!atomic_load(&stopping)) {
+    int n = epoll_wait(epoll_fd, events, BATCH, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      LOGE("Event loop wait failed: {}", _str(strerror(errno)));
+      result = 1;
+      break;
+    }
+
+    unsigned long long ready = now_ns();
+    order(events, n);
+
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.u64 == WAKE_KEY) {
+        uint64_t count;
+        if (read(wake_fd, &count, sizeof count) < 0) {
+          // Already drained
+        }
+        continue;
+      }
+
+      dispatch(&events[i], ready);
+    }
+  }
+
+  atomic_store(&running, 0);
+  return result;
+}
+
+void loop_stop(void) {
+  atomic_store(&stopping, 1);
+
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof one) < 0) {
+    // Only fails if the counter is saturated, and then it is awake anyway
+  }
+}
+
+int loop_add_fd(struct service* svc, int fd, unsigned int events, loop_fd_fn fn, void* ctx) {
+  return add_watch(svc, fd, 0, events, fn, NULL, ctx);
+}
+
+int loop_remove_fd(int fd) {
+  return remove_watch(fd, 0);
+}
+
+int loop_add_timer(struct service* svc, unsigned long long period_ns, loop_timer_fn fn, void* ctx, int* timer) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+    LOGE("Failed to create a timer: {}", _str(strerror(errno)));
+    return 1;
+  }
+
+  if (add_watch(svc, fd, 1, EPOLLIN, NULL, fn, ctx)) {
+    close(fd);
+    return 1;
+  }
+
+  if (period_ns && loop_set_timer(fd, period_ns, period_ns)) {
+    remove_watch(fd, 1);
+    return 1;
+  }
+
+  *timer = fd;
+  return 0;
+}
+
+int loop_set_timer(int timer, unsigned long long delay_ns, unsigned long long period_ns) {
+  struct itimerspec spec = {
+    .it_value = { (time_t) (delay_ns / 1000000000ull), (long) (delay_ns % 1000000000ull) },
+    .it_interval = { (time_t) (period_ns / 1000000000ull), (long) (period_ns % 1000000000ull) },
+  };
+
+  if (timerfd_settime(timer, 0, &spec, NULL)) {
+    LOGE("Failed to set timer {}: {}", _i(timer), _str(strerror(errno)));
+    return 1;
+  }
+
+  return 0;
+}
+
+int loop_remove_timer(int timer) {
+  return remove_watch(timer, 1);
+}
@@ -0,0 +1,126 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef LOOP_H
+#define LOOP_H
+
+struct service;
+
+//
+// Event Loop
+//
+// One loop, run by the main thread, watches file descriptors and timers for
+// every service so they need not keep threads of their own just to wait.
+// Handlers run one at a time on the loop thread and should return quickly,
+// since a slow handler delays everything else waiting on the loop. Work that
+// takes a while belongs on a worker the handler hands it to.
+//
+// Watches may be added and removed from any thread, including from inside a
+// handler. Once a remove returns on another thread, the handler is not
+// running and will not run again.
+//
+// Each watch belongs to a service, whose priority class and deadline decide
+// the order in which handlers ready at the same time run: by class, then by
+// earliest deadline. Handlers finishing past the deadline of their service
+// count against it.
+//
+
+/** The most file descriptors and timers watched at once. */
+#define LOOP_MAX_WATCHES 64
+
+/**
+ * A handler for a ready file descriptor.
+ *
+ * @param fd The file descriptor
+ * @param events The ready events, as for epoll
+ * @param ctx The context given when it was added
+ */
+typedef void (* loop_fd_fn)(int fd, unsigned int events, void* ctx);
+
+/**
+ * A handler for an expired timer.
+ *
+ * @param timer The timer
+ * @param expirations The number of times it expired since it last ran, at least one
+ * @param ctx The context given when it was added
+ */
+typedef void (* loop_timer_fn)(int timer, unsigned long long expirations, void* ctx);
+
+/**
+ * Create the loop.
+ *
+ * @return Zero on success, otherwise nonzero
+ */
+int loop_init(void);
+
+/**
+ * Destroy the loop. Anything still watched is dropped.
+ */
+void loop_free(void);
+
+/**
+ * Run the loop on the calling thread until asked to stop.
+ *
+ * @return Zero on success, otherwise nonzero
+ */
+int loop_run(void);
+
+/**
+ * Ask the loop to stop once the handler running, if any, returns. Safe from
+ * any thread.
+ */
+void loop_stop(void);
+
+/**
+ * Watch a file descriptor.
+ *
+ * @param svc The service it is for, or NULL
+ * @param fd The file descriptor, which stays the caller's to close
+ * @param events The events to watch for, as for epoll
+ * @param fn The handler
+ * @param ctx The handler context
+ * @return Zero on success, otherwise nonzero
+ */
+int loop_add_fd(struct service* svc, int fd, unsigned int events, loop_fd_fn fn, void* ctx);
+
+/**
+ * Stop watching a file descriptor.
+ *
+ * @param fd The file descriptor
+ * @return Zero on success, otherwise nonzero
+ */
+int loop_remove_fd(int fd);
+
+/**
+ * Add a timer.
+ *
+ * @param svc The service it is for, or NULL
+ * @param period_ns The period in nanoseconds, or zero to add it disarmed
+ * @param fn The handler
+ * @param ctx The handler context
+ * @param timer The timer
+ * @return Zero on success, otherwise nonzero
+ */
+int loop_add_timer(struct service* svc, unsigned long long period_ns, loop_timer_fn fn, void* ctx, int* timer);
+
+/**
+ * Arm or disarm a timer.
+ *
+ * @param timer The timer
+ * @param delay_ns The time to the first expiration in nanoseconds, or zero to disarm
+ * @param period_ns The period after that in nanoseconds, or zero for once
+ * @return Zero on success, otherwise nonzero
+ */
+int loop_set_timer(int timer, unsigned long long delay_ns, unsigned long long period_ns);
+
+/**
+ * Remove a timer.
+ *
+ * @param timer The timer
+ * @return Zero on success, otherwise nonzero
+ */
+int loop_remove_timer(int timer);
+
+#endif // #ifndef LOOP_H
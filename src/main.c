@@ -3,5 +3,312 @@
  * Copyright 2019 The Cozmonaut Contributors
  */
 
-int main() {
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "loop.h"
+#include "record.h"
+#include "service.h"
+#include "service/console.h"
+#include "service/face.h"
+#include "service/monitor.h"
+#include "service/python.h"
+#include "service/speech.h"
+
+#define LOG_TAG "main"
+
+/** The longest shutdown may take to stop services in nanoseconds. */
+#define DRAIN_NS 5000000000ull
+
+//
+// Runtime
+//
+// Main loads and starts every service, then runs the event loop until a
+// shutdown signal arrives on a signalfd. Services are stopped in reverse
+// order on a thread of their own while the loop keeps serving those still
+// up, so the console keeps printing while the rest drain. If they overrun
+// the deadline, or a second signal arrives, the process exits without
+// waiting for them.
+//
+// Service threads can be pinned to CPUs of their own with -a, as in
+// -a speech=2 -a face=3.
+//
+// Inputs can be recorded to a file with -r and replayed through the services
+// with -p, at the recorded pace or, with -f, as fast as they are taken. The
+// process shuts down once a replay is done.
+//
+
+/** The services, in the order they start. */
+static struct service* const* const services[] = {
+  &SERVICE_CONSOLE,
+  &SERVICE_MONITOR,
+  &SERVICE_FACE,
+  &SERVICE_SPEECH,
+  &SERVICE_PYTHON,
+};
+
+/** The number of services. */
+#define SERVICES_LEN (sizeof services / sizeof *services)
+
+/** The CPUs each service is pinned to, or NULL. */
+static const char* affinity[SERVICES_LEN];
+
+/** Nonzero for each service loaded. */
+static int loaded[SERVICES_LEN];
+
+/** Nonzero for each service started. Drain thread only once draining. */
+static int started[SERVICES_LEN];
+
+/** Nonzero once shutdown has begun. Loop thread only. */
+static int draining;
+
+/** Set once every service has stopped. */
+static atomic_int drained;
+
+/** The thread stopping services. */
+static pthread_t drain_thread;
+
+/** The timer for the shutdown deadline. */
+static int deadline_timer = -1;
+
+/** The replay options. */
+static struct record_replay_options replay = {
+  .realtime = 1,
+};
+
+/** Set to end the replay early. */
+static atomic_int replay_cancel;
+
+/** Nonzero while the replay thread runs. */
+static int replaying;
+
+/** The thread replaying inputs. */
+static pthread_t replay_thread;
+
+static void* replay_main(void* arg) {
+  struct record_replay_stats stats;
+
+  if (!record_replay(&replay, &stats)) {
+    LOGI("Replayed {} frames, {} audio frames and {} commands in {} ms", _ul(stats.frames),
+        _ull(stats.audio_frames), _ul(stats.commands), _ull(stats.elapsed_ns / 1000000));
+  }
+
+  // Shut down as if asked to, unless already shutting down
+  if (!atomic_load(&replay_cancel)) {
+    kill(getpid(), SIGTERM);
+  }
+
+  return NULL;
+}
+
+/**
+ * End the replay, if any, and wait for it.
+ */
+static void stop_replay(void) {
+  if (replaying) {
+    atomic_store(&replay_cancel, 1);
+    pthread_join(replay_thread, NULL);
+    replaying = 0;
+  }
+}
+
+/**
+ * Stop every started service, last started first.
+ */
+static void stop_services(void) {
+  for (size_t i = SERVICES_LEN; i-- > 0;) {
+    if (started[i]) {
+      service_stop(*services[i]);
+      started[i] = 0;
+    }
+  }
+}
+
+static void* drain_main(void* arg) {
+  stop_replay();
+  stop_services();
+
+  atomic_store(&drained, 1);
+  loop_stop();
+  return NULL;
+}
+
+static void on_deadline(int timer, unsigned long long expirations, void* ctx) {
+  loop_stop();
+}
+
+/**
+ * Begin stopping services without blocking the loop. Loop thread only.
+ */
+static void drain(void) {
+  draining = 1;
+
+  if (loop_add_timer(NULL, DRAIN_NS, &on_deadline, NULL, &deadline_timer)) {
+    LOGW("Shutting down without a deadline");
+  }
+
+  if (pthread_create(&drain_thread, NULL, &drain_main, NULL)) {
+    // Stopping them here still works, only the loop is stuck until it is done
+    LOGE("Failed to start drain thread");
+    stop_replay();
+    stop_services();
+    atomic_store(&drained, 1);
+    loop_stop();
+  }
+}
+
+static void on_signal(int fd, unsigned int events, void* ctx) {
+  struct signalfd_siginfo info;
+
+  while (read(fd, &info, sizeof info) == sizeof info) {
+    if (!draining) {
+      LOGI("Caught {}, shutting down", _str(strsignal((int) info.ssi_signo)));
+      drain();
+    } else {
+      LOGW("Caught {} again, exiting now", _str(strsignal((int) info.ssi_signo)));
+      loop_stop();
+    }
+  }
+}
+
+/**
+ * Parse an affinity option like speech=2 or face=3-4.
+ *
+ * @param arg The option argument
+ * @return Zero on success, otherwise nonzero
+ */
+static int parse_affinity(char* arg) {
+  char* cpus = strchr(arg, '=');
+  if (!cpus) {
+    return 1;
+  }
+  *cpus++ = '\0';
+
+  for (size_t i = 0; i < SERVICES_LEN; ++i) {
+    if (!strcmp((*services[i])->name, arg)) {
+      affinity[i] = cpus;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr, "usage: %s [-a service=cpus]... [-r record_path] [-p replay_path [-f]]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  const char* record_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "a:r:p:fh")) != -1) {
+    switch (opt) {
+      case 'a':
+        if (parse_affinity(optarg)) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'r':
+        record_path = optarg;
+        break;
+      case 'p':
+        replay.path = optarg;
+        break;
+      case 'f':
+        replay.realtime = 0;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  // Block shutdown signals before any thread starts, so all of them inherit it
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  if (loop_init()) {
+    return 1;
+  }
+
+  int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd < 0 || loop_add_fd(NULL, signal_fd, EPOLLIN, &on_signal, NULL)) {
+    LOGE("Failed to watch for shutdown signals");
+    if (signal_fd >= 0) {
+      close(signal_fd);
+    }
+    loop_free();
+    return 1;
+  }
+
+  // Record from before the first input can arrive
+  if (record_path && record_start(record_path)) {
+    LOGW("Running without recording");
+  }
+
+  // A service that fails to come up is left out rather than taking the rest down
+  for (size_t i = 0; i < SERVICES_LEN; ++i) {
+    loaded[i] = !service_load(*services[i]);
+    if (loaded[i] && affinity[i]) {
+      service_set_affinity(*services[i], affinity[i]);
+    }
+    started[i] = loaded[i] && !service_start(*services[i]);
+  }
+
+  if (replay.path) {
+    replay.cancel = &replay_cancel;
+    replaying = !pthread_create(&replay_thread, NULL, &replay_main, NULL);
+    if (!replaying) {
+      LOGE("Failed to start replay thread");
+    }
+  }
+
+  int result = loop_run();
+
+  if (!draining) {
+    // The loop failed, so there is no one left to race
+    stop_replay();
+    stop_services();
+  } else if (!atomic_load(&drained)) {
+    // Whatever is still stopping may never return, nor may the console
+    log_set_sink(NULL);
+    LOGE("Exiting before every service stopped");
+    fflush(stdout);
+    _exit(EXIT_FAILURE);
+  } else {
+    pthread_join(drain_thread, NULL);
+  }
+
+  if (record_enabled()) {
+    record_stop();
+  }
+
+  for (size_t i = SERVICES_LEN; i-- > 0;) {
+    if (loaded[i]) {
+      service_unload(*services[i]);
+    }
+  }
+
+  if (deadline_timer >= 0) {
+    loop_remove_timer(deadline_timer);
+  }
+
+  loop_remove_fd(signal_fd);
+  close(signal_fd);
+  loop_free();
+
+  return result;
 }
@@ -0,0 +1,532 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metric.h"
+
+/** The cell shared by threads once every other one is taken. */
+#define SHARED_SLOT (METRIC_MAX_THREADS - 1)
+
+/** The nanoseconds in one history point at the finest resolution. */
+#define SECOND_NS 1000000000ull
+
+/** The longest gap filled in with idle points, enough to cycle all history. */
+#define MAX_IDLE_POINTS 3600
+
+/** A counter cell owned by one thread. */
+struct metric_cell {
+  /** The counter total. */
+  _Alignas(64) atomic_ullong value;
+};
+
+/** A histogram cell owned by one thread. */
+struct metric_hist_cell {
+  /** The number of values. */
+  _Alignas(64) atomic_ullong count;
+
+  /** The sum of values. */
+  atomic_ullong sum;
+
+  /** The number of values in each power-of-two bucket. */
+  atomic_ullong buckets[METRIC_BUCKETS];
+};
+
+/** The history at one resolution. */
+struct history {
+  /** The points, a ring. */
+  struct metric_point points[METRIC_HISTORY];
+
+  /** The index of the next point. */
+  size_t next;
+
+  /** The number of points. */
+  size_t len;
+
+  /** The finer points gathered toward the next coarser one. */
+  struct metric_point acc;
+
+  /** The number of points in acc. */
+  size_t acc_len;
+};
+
+struct metric {
+  /** The name. */
+  char name[METRIC_NAME_LEN];
+
+  /** The kind. */
+  enum metric_kind kind;
+
+  /** The gauge level. */
+  _Alignas(64) atomic_llong level;
+
+  /** The per-thread counter cells. */
+  struct metric_cell* cells;
+
+  /** The per-thread histogram cells. */
+  struct metric_hist_cell* hist;
+
+  /** What exited threads added to a counter, or recorded to a histogram. Guarded by the lock. */
+  unsigned long long retired;
+
+  /** The sum of values exited threads recorded to a histogram. Guarded by the lock. */
+  unsigned long long retired_sum;
+
+  /** The histogram buckets of exited threads. Guarded by the lock. */
+  unsigned long long retired_buckets[METRIC_BUCKETS];
+
+  /** The counter total or histogram count at the last point. */
+  unsigned long long prev_total;
+
+  /** The histogram buckets at the last point. */
+  unsigned long long prev_buckets[METRIC_BUCKETS];
+
+  /** The history at each resolution. */
+  struct history history[metric_resolution_count];
+};
+
+/** The number of finer points per point at each resolution. */
+static const size_t rollup[metric_resolution_count] = { 1, 10, 6 };
+
+/** The metrics. */
+static struct metric metrics[METRIC_MAX];
+
+/** The number of metrics, published after each is set up. */
+static atomic_size_t metrics_len;
+
+/** Serializes registration, history, reads and exiting threads. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The time history was last brought up to date, or zero. */
+static unsigned long long sampled_at;
+
+/** Bumped whenever history gains a point. */
+static atomic_ulong version;
+
+/** The thread slots in use, one bit each, the shared one aside. */
+static atomic_uint slots_used;
+
+/** Hands a slot back when its thread exits. */
+static pthread_key_t slot_key;
+
+/** Creates the key once. */
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+
+/** The calling thread's slot, or -1 before its first write. */
+static _Thread_local int thread_slot = -1;
+
+/**
+ * Fold what an exited thread left in its cells into the retired totals and
+ * clear them for the next thread. Readers hold the lock, so they never see
+ * the same values twice or not at all.
+ *
+ * @param arg The slot plus one
+ */
+static void release_slot(void* arg) {
+  int s = (int) (intptr_t) arg - 1;
+
+  pthread_mutex_lock(&lock);
+
+  size_t len = atomic_load_explicit(&metrics_len, memory_order_relaxed);
+  for (size_t i = 0; i < len; ++i) {
+    struct metric* m = &metrics[i];
+
+    if (m->cells) {
+      m->retired += atomic_exchange_explicit(&m->cells[s].value, 0, memory_order_relaxed);
+    }
+
+    if (m->hist) {
+      struct metric_hist_cell* cell = &m->hist[s];
+      m->retired += atomic_exchange_explicit(&cell->count, 0, memory_order_relaxed);
+      m->retired_sum += atomic_exchange_explicit(&cell->sum, 0, memory_order_relaxed);
+      for (int b = 0; b < METRIC_BUCKETS; ++b) {
+        m->retired_buckets[b] += atomic_exchange_explicit(&cell->buckets[b], 0, memory_order_relaxed);
+      }
+    }
+  }
+
+  atomic_fetch_and_explicit(&slots_used, ~(1u << s), memory_order_release);
+
+  pthread_mutex_unlock(&lock);
+
+  thread_slot = -1;
+}
+
+static void create_slot_key(void) {
+  pthread_key_create(&slot_key, &release_slot);
+}
+
+/**
+ * Get the calling thread's cell index, taking a free one on first use.
+ */
+static int slot(void) {
+  if (thread_slot >= 0) {
+    return thread_slot;
+  }
+
+  pthread_once(&slot_key_once, &create_slot_key);
+
+  unsigned int used = atomic_load_explicit(&slots_used, memory_order_acquire);
+  for (;;) {
+    int s = __builtin_ctz(~used);
+    if (s >= SHARED_SLOT) {
+      // Every cell is taken, so share the last one and never give it back
+      thread_slot = SHARED_SLOT;
+      return thread_slot;
+    }
+
+    if (atomic_compare_exchange_weak_explicit(&slots_used, &used, used | 1u << s, memory_order_acquire,
+        memory_order_acquire)) {
+      pthread_setspecific(slot_key, (void*) (intptr_t) (s + 1));
+      thread_slot = s;
+      return thread_slot;
+    }
+  }
+}
+
+/**
+ * Add to a cell. Cells other than the shared one have a single writer, so a
+ * plain load and store does and avoids a locked instruction.
+ */
+static void cell_add(atomic_ullong* cell, unsigned long long n, int s) {
+  if (s == SHARED_SLOT) {
+    atomic_fetch_add_explicit(cell, n, memory_order_relaxed);
+  } else {
+    atomic_store_explicit(cell, atomic_load_explicit(cell, memory_order_relaxed) + n, memory_order_relaxed);
+  }
+}
+
+struct metric* metric_get(const char* name, enum metric_kind kind) {
+  pthread_mutex_lock(&lock);
+
+  size_t len = atomic_load_explicit(&metrics_len, memory_order_relaxed);
+  for (size_t i = 0; i < len; ++i) {
+    if (!strcmp(metrics[i].name, name)) {
+      pthread_mutex_unlock(&lock);
+      return metrics[i].kind == kind ? &metrics[i] : NULL;
+    }
+  }
+
+  if (len == METRIC_MAX || strlen(name) >= METRIC_NAME_LEN) {
+    pthread_mutex_unlock(&lock);
+    return NULL;
+  }
+
+  struct metric* m = &metrics[len];
+  memset(m, 0, sizeof *m);
+  strcpy(m->name, name);
+  m->kind = kind;
+
+  // A gauge is one level, so only counters and histograms need cells
+  if (kind == metric_kind_histogram) {
+    m->hist = aligned_alloc(64, METRIC_MAX_THREADS * sizeof *m->hist);
+    if (m->hist) {
+      memset(m->hist, 0, METRIC_MAX_THREADS * sizeof *m->hist);
+    }
+  } else if (kind == metric_kind_counter) {
+    m->cells = aligned_alloc(64, METRIC_MAX_THREADS * sizeof *m->cells);
+    if (m->cells) {
+      memset(m->cells, 0, METRIC_MAX_THREADS * sizeof *m->cells);
+    }
+  }
+
+  if (kind != metric_kind_gauge && !m->hist && !m->cells) {
+    pthread_mutex_unlock(&lock);
+    return NULL;
+  }
+
+  atomic_store_explicit(&metrics_len, len + 1, memory_order_release);
+
+  pthread_mutex_unlock(&lock);
+  return m;
+}
+
+void metric_add(struct metric* m, unsigned long long n) {
+  if (m) {
+    int s = slot();
+    cell_add(&m->cells[s].value, n, s);
+  }
+}
+
+void metric_set(struct metric* m, long long v) {
+  if (m) {
+    atomic_store_explicit(&m->level, v, memory_order_relaxed);
+  }
+}
+
+void metric_record(struct metric* m, unsigned long long v) {
+  if (m) {
+    int s = slot();
+    struct metric_hist_cell* cell = &m->hist[s];
+
+    // Bucket b holds values in [2^(b - 1), 2^b)
+    int b = v ? 64 - __builtin_clzll(v) : 0;
+    if (b >= METRIC_BUCKETS) {
+      b = METRIC_BUCKETS - 1;
+    }
+
+    cell_add(&cell->buckets[b], 1, s);
+    cell_add(&cell->sum, v, s);
+    cell_add(&cell->count, 1, s);
+  }
+}
+
+const char* metric_name(const struct metric* m) {
+  return m->name;
+}
+
+enum metric_kind metric_kind(const struct metric* m) {
+  return m->kind;
+}
+
+size_t metric_list(struct metric** out, size_t cap) {
+  size_t len = atomic_load_explicit(&metrics_len, memory_order_acquire);
+  if (len > cap) {
+    len = cap;
+  }
+
+  for (size_t i = 0; i < len; ++i) {
+    out[i] = &metrics[i];
+  }
+  return len;
+}
+
+/**
+ * Sum the cells of a counter. Call with the lock held.
+ */
+static unsigned long long sum_cells(const struct metric* m) {
+  unsigned long long total = m->retired;
+  for (int s = 0; s < METRIC_MAX_THREADS; ++s) {
+    total += atomic_load_explicit(&m->cells[s].value, memory_order_relaxed);
+  }
+  return total;
+}
+
+/**
+ * Sum the cells of a histogram. Call with the lock held.
+ */
+static void sum_hist(const struct metric* m, unsigned long long* count, unsigned long long* sum,
+    unsigned long long buckets[METRIC_BUCKETS]) {
+  *count = m->retired;
+  *sum = m->retired_sum;
+  memcpy(buckets, m->retired_buckets, METRIC_BUCKETS * sizeof *buckets);
+
+  for (int s = 0; s < METRIC_MAX_THREADS; ++s) {
+    const struct metric_hist_cell* cell = &m->hist[s];
+    *count += atomic_load_explicit(&cell->count, memory_order_relaxed);
+    *sum += atomic_load_explicit(&cell->sum, memory_order_relaxed);
+    for (int b = 0; b < METRIC_BUCKETS; ++b) {
+      buckets[b] += atomic_load_explicit(&cell->buckets[b], memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * Estimate a percentile from bucket counts, interpolating linearly within
+ * its bucket.
+ *
+ * @param buckets The bucket counts
+ * @param p The fraction from 0 to 1
+ * @return The estimate, or zero with no values
+ */
+static double percentile(const unsigned long long buckets[METRIC_BUCKETS], double p) {
+  unsigned long long count = 0;
+  for (int b = 0; b < METRIC_BUCKETS; ++b) {
+    count += buckets[b];
+  }
+
+  if (!count) {
+    return 0;
+  }
+
+  unsigned long long rank = (unsigned long long) ceil(p * (double) count);
+  rank = rank ? rank : 1;
+
+  unsigned long long seen = 0;
+  for (int b = 0; b < METRIC_BUCKETS; ++b) {
+    if (seen + buckets[b] >= rank) {
+      if (!b) {
+        return 0;
+      }
+
+      // Bucket b holds values from 2^(b-1) up to 2^b
+      double lo = ldexp(1, b - 1);
+      return lo + lo * (double) (rank - seen) / (double) buckets[b];
+    }
+    seen += buckets[b];
+  }
+
+  return 0;
+}
+
+void metric_read(const struct metric* m, struct metric_value* out) {
+  memset(out, 0, sizeof *out);
+
+  pthread_mutex_lock(&lock);
+
+  switch (m->kind) {
+    case metric_kind_counter:
+      out->value = (double) sum_cells(m);
+      break;
+    case metric_kind_gauge:
+      out->value = (double) atomic_load_explicit(&m->level, memory_order_relaxed);
+      break;
+    case metric_kind_histogram: {
+      unsigned long long count;
+      unsigned long long sum;
+      unsigned long long buckets[METRIC_BUCKETS];
+      sum_hist(m, &count, &sum, buckets);
+
+      out->value = (double) count;
+      out->mean = count ? (double) sum / count : 0;
+      out->p50 = percentile(buckets, 0.5);
+      out->p99 = percentile(buckets, 0.99);
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Add a point at a resolution and roll it up into the next. Call with the
+ * lock held.
+ */
+static void push(struct metric* m, int res, struct metric_point p) {
+  struct history* h = &m->history[res];
+
+  h->points[h->next] = p;
+  h->next = (h->next + 1) % METRIC_HISTORY;
+  if (h->len < METRIC_HISTORY) {
+    ++h->len;
+  }
+
+  if (res + 1 == metric_resolution_count) {
+    return;
+  }
+
+  h->acc.value += p.value;
+  h->acc.p50 += p.p50;
+  h->acc.p99 = p.p99 > h->acc.p99 ? p.p99 : h->acc.p99;
+
+  if (++h->acc_len < rollup[res + 1]) {
+    return;
+  }
+
+  // Counts add up, but levels and medians average
+  struct metric_point coarse = h->acc;
+  if (m->kind == metric_kind_gauge) {
+    coarse.value /= (double) h->acc_len;
+  }
+  coarse.p50 /= (double) h->acc_len;
+
+  memset(&h->acc, 0, sizeof h->acc);
+  h->acc_len = 0;
+
+  push(m, res + 1, coarse);
+}
+
+/**
+ * Take the point for the second just ended. Call with the lock held.
+ */
+static struct metric_point take_point(struct metric* m) {
+  struct metric_point p = {0};
+
+  switch (m->kind) {
+    case metric_kind_counter: {
+      unsigned long long total = sum_cells(m);
+      p.value = (double) (total - m->prev_total);
+      m->prev_total = total;
+      break;
+    }
+    case metric_kind_gauge:
+      p.value = (double) atomic_load_explicit(&m->level, memory_order_relaxed);
+      break;
+    case metric_kind_histogram: {
+      unsigned long long count;
+      unsigned long long sum;
+      unsigned long long buckets[METRIC_BUCKETS];
+      sum_hist(m, &count, &sum, buckets);
+
+      unsigned long long delta[METRIC_BUCKETS];
+      for (int b = 0; b < METRIC_BUCKETS; ++b) {
+        delta[b] = buckets[b] - m->prev_buckets[b];
+        m->prev_buckets[b] = buckets[b];
+      }
+
+      p.value = (double) (count - m->prev_total);
+      p.p50 = percentile(delta, 0.5);
+      p.p99 = percentile(delta, 0.99);
+      m->prev_total = count;
+      break;
+    }
+  }
+
+  return p;
+}
+
+void metric_sample(unsigned long long now) {
+  pthread_mutex_lock(&lock);
+
+  size_t len = atomic_load_explicit(&metrics_len, memory_order_relaxed);
+
+  if (!sampled_at) {
+    sampled_at = now;
+  }
+
+  if (now - sampled_at < SECOND_NS) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  unsigned long long seconds = (now - sampled_at) / SECOND_NS;
+  sampled_at += seconds * SECOND_NS;
+
+  for (size_t i = 0; i < len; ++i) {
+    struct metric* m = &metrics[i];
+    struct metric_point p = take_point(m);
+
+    // Whatever happened during a gap lands in its last second
+    struct metric_point idle = {0};
+    if (m->kind == metric_kind_gauge) {
+      idle.value = p.value;
+    }
+
+    unsigned long long gap = seconds - 1 < MAX_IDLE_POINTS ? seconds - 1 : MAX_IDLE_POINTS;
+    for (unsigned long long k = 0; k < gap; ++k) {
+      push(m, metric_resolution_1s, idle);
+    }
+    push(m, metric_resolution_1s, p);
+  }
+
+  atomic_fetch_add_explicit(&version, 1, memory_order_relaxed);
+
+  pthread_mutex_unlock(&lock);
+}
+
+unsigned long metric_version(void) {
+  return atomic_load_explicit(&version, memory_order_relaxed);
+}
+
+size_t metric_history(const struct metric* m, enum metric_resolution res, struct metric_point* out, size_t cap) {
+  pthread_mutex_lock(&lock);
+
+  const struct history* h = &m->history[res];
+  size_t len = h->len < cap ? h->len : cap;
+  size_t first = (h->next + METRIC_HISTORY - len) % METRIC_HISTORY;
+
+  for (size_t i = 0; i < len; ++i) {
+    out[i] = h->points[(first + i) % METRIC_HISTORY];
+  }
+
+  pthread_mutex_unlock(&lock);
+  return len;
+}
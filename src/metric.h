@@ -0,0 +1,185 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef METRIC_H
+#define METRIC_H
+
+#include <stddef.h>
+
+/** The most metrics that can be registered. */
+#define METRIC_MAX 64
+
+/** The longest metric name, including the terminator. */
+#define METRIC_NAME_LEN 48
+
+/**
+ * The number of threads that get a cell of their own in every metric. Any
+ * threads past these share one last cell. A thread's cell is handed on to
+ * the next thread once it exits.
+ */
+#define METRIC_MAX_THREADS 16
+
+/** The number of power-of-two histogram buckets. */
+#define METRIC_BUCKETS 64
+
+/** The number of points kept at each history resolution. */
+#define METRIC_HISTORY 60
+
+/** A metric kind. */
+enum metric_kind {
+  /** A monotonically increasing count. */
+  metric_kind_counter,
+
+  /** A level, whatever was last set. */
+  metric_kind_gauge,
+
+  /** A distribution of recorded values. */
+  metric_kind_histogram,
+};
+
+/** A history resolution. */
+enum metric_resolution {
+  /** One point per second. */
+  metric_resolution_1s,
+
+  /** One point per ten seconds. */
+  metric_resolution_10s,
+
+  /** One point per minute. */
+  metric_resolution_1min,
+
+  metric_resolution_count,
+};
+
+/** A registered metric. Opaque. */
+struct metric;
+
+/** A metric aggregated across threads. */
+struct metric_value {
+  /** The counter total, gauge level or histogram count. */
+  double value;
+
+  /** The histogram mean, or zero. */
+  double mean;
+
+  /** The histogram median, or zero. */
+  double p50;
+
+  /** The histogram 99th percentile, or zero. */
+  double p99;
+};
+
+/**
+ * A point of history.
+ *
+ * Counters hold the increase over the point, gauges their mean level and
+ * histograms the number of values recorded along with their percentiles.
+ * Coarser points sum counts and average levels and medians, and keep the
+ * worst 99th percentile.
+ */
+struct metric_point {
+  /** The value. */
+  double value;
+
+  /** The histogram median, or zero. */
+  double p50;
+
+  /** The histogram 99th percentile, or zero. */
+  double p99;
+};
+
+/**
+ * Get a metric by name, registering it on first use. Not for hot paths.
+ *
+ * @param name The name, such as "speech.hop_ns"
+ * @param kind The kind, which must match any earlier registration
+ * @return The metric, or NULL if there is no room or the kind differs
+ */
+struct metric* metric_get(const char* name, enum metric_kind kind);
+
+/**
+ * Add to a counter. Wait-free. A NULL metric is ignored.
+ *
+ * @param m The counter
+ * @param n The amount
+ */
+void metric_add(struct metric* m, unsigned long long n);
+
+/**
+ * Set a gauge. Wait-free. A NULL metric is ignored.
+ *
+ * @param m The gauge
+ * @param v The level
+ */
+void metric_set(struct metric* m, long long v);
+
+/**
+ * Record a value in a histogram. Wait-free. A NULL metric is ignored.
+ *
+ * @param m The histogram
+ * @param v The value
+ */
+void metric_record(struct metric* m, unsigned long long v);
+
+/**
+ * Get the name of a metric.
+ *
+ * @param m The metric
+ * @return The name
+ */
+const char* metric_name(const struct metric* m);
+
+/**
+ * Get the kind of a metric.
+ *
+ * @param m The metric
+ * @return The kind
+ */
+enum metric_kind metric_kind(const struct metric* m);
+
+/**
+ * List the registered metrics in registration order.
+ *
+ * @param out The metrics
+ * @param cap The capacity of out
+ * @return The number of metrics
+ */
+size_t metric_list(struct metric** out, size_t cap);
+
+/**
+ * Aggregate a metric across threads as of now.
+ *
+ * @param m The metric
+ * @param out The value
+ */
+void metric_read(const struct metric* m, struct metric_value* out);
+
+/**
+ * Bring history up to date. Cheap to call often; a point is only added once
+ * each whole second has passed.
+ *
+ * @param now The monotonic time in nanoseconds
+ */
+void metric_sample(unsigned long long now);
+
+/**
+ * Get a number that changes whenever history gains a point.
+ *
+ * @return The version
+ */
+unsigned long metric_version(void);
+
+/**
+ * Copy out the history of a metric, oldest first.
+ *
+ * @param m The metric
+ * @param res The resolution
+ * @param out The points
+ * @param cap The capacity of out
+ * @return The number of points
+ */
+size_t metric_history(const struct metric* m, enum metric_resolution res, struct metric_point* out, size_t cap);
+
+#endif // #ifndef METRIC_H
@@ -0,0 +1,212 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "pool.h"
+
+#define LOG_TAG "pool"
+
+/** A pool of worker threads. */
+struct pool {
+  /** The worker threads. */
+  pthread_t* threads;
+
+  /** The number of worker threads. */
+  int threads_len;
+
+  /** Guards everything below except next. */
+  pthread_mutex_t lock;
+
+  /** Signaled when a new job is posted or the pool stops. */
+  pthread_cond_t wake;
+
+  /** Signaled when the last running worker leaves a job. */
+  pthread_cond_t done;
+
+  /** Incremented for every job. */
+  unsigned long generation;
+
+  /** The number of workers still allowed to join the current job. */
+  int open;
+
+  /** The number of workers inside the current job. */
+  int running;
+
+  /** Nonzero once the pool is stopping. */
+  int stop;
+
+  /** The current job function. */
+  pool_fn fn;
+
+  /** The current job context. */
+  void* ctx;
+
+  /** The current job item count. */
+  size_t count;
+
+  /** The next unclaimed item of the current job. */
+  atomic_size_t next;
+};
+
+/**
+ * Claim and run items until none are left.
+ *
+ * @param pool The pool
+ * @param fn The job function
+ * @param ctx The job context
+ * @param count The job item count
+ */
+static void run_items(struct pool* pool, pool_fn fn, void* ctx, size_t count) {
+  size_t i;
+  while ((i = atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed)) < count) {
+    fn(ctx, i);
+  }
+}
+
+static void* worker_main(void* arg) {
+  struct pool* pool = arg;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+
+  for (;;) {
+    // Sleep until there is a job with room for us
+    while (!pool->stop && (pool->generation == seen || !pool->open)) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+
+    if (pool->stop) {
+      break;
+    }
+
+    seen = pool->generation;
+
+    // Join the job
+    --pool->open;
+    ++pool->running;
+
+    pool_fn fn = pool->fn;
+    void* ctx = pool->ctx;
+    size_t count = pool->count;
+
+    pthread_mutex_unlock(&pool->lock);
+    run_items(pool, fn, ctx, count);
+    pthread_mutex_lock(&pool->lock);
+
+    // Leave the job
+    if (!--pool->running) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+struct pool* pool_create(int threads) {
+  if (threads <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 1 ? (int) cpus - 1 : 0;
+  }
+
+  struct pool* pool = calloc(1, sizeof *pool);
+  if (!pool) {
+    LOGE("Pool alloc failed");
+    return NULL;
+  }
+
+  pool->threads = calloc(threads ? threads : 1, sizeof *pool->threads);
+  if (!pool->threads) {
+    LOGE("Pool thread array alloc failed");
+    free(pool);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  atomic_init(&pool->next, 0);
+
+  for (int i = 0; i < threads; ++i) {
+    if (pthread_create(&pool->threads[i], NULL, &worker_main, pool)) {
+      LOGW("Pool thread creation failed, continuing with {} threads", _i(i));
+      break;
+    }
+    ++pool->threads_len;
+  }
+
+  LOGD("Created pool of {} threads", _i(pool->threads_len));
+  return pool;
+}
+
+void pool_destroy(struct pool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->threads_len; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+int pool_size(const struct pool* pool) {
+  return pool->threads_len;
+}
+
+void pool_for(struct pool* pool, size_t count, int max_threads, pool_fn fn, void* ctx) {
+  if (!count) {
+    return;
+  }
+
+  // Wake no more helpers than there are items beyond our own
+  int helpers = pool->threads_len;
+  if (max_threads > 0 && helpers > max_threads - 1) {
+    helpers = max_threads - 1;
+  }
+  if ((size_t) helpers > count - 1) {
+    helpers = (int) (count - 1);
+  }
+
+  // Skip the handoff entirely for serial work
+  if (!helpers) {
+    for (size_t i = 0; i < count; ++i) {
+      fn(ctx, i);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->ctx = ctx;
+  pool->count = count;
+  atomic_store_explicit(&pool->next, 0, memory_order_relaxed);
+  pool->open = helpers;
+  ++pool->generation;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  run_items(pool, fn, ctx, count);
+
+  // Close the job to latecomers, then wait out anyone still working
+  pthread_mutex_lock(&pool->lock);
+  pool->open = 0;
+  while (pool->running) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
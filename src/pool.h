@@ -0,0 +1,63 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/** A pool of worker threads. Opaque. */
+struct pool;
+
+/**
+ * A unit of parallel work.
+ *
+ * @param ctx The caller context
+ * @param i The item index
+ */
+typedef void (* pool_fn)(void* ctx, size_t i);
+
+/**
+ * Create a worker pool.
+ *
+ * The calling thread of pool_for(...) always participates, so a pool of n
+ * threads can run n + 1 items at once.
+ *
+ * @param threads The number of threads, or zero for one per other online CPU
+ * @return The pool or NULL on failure
+ */
+struct pool* pool_create(int threads);
+
+/**
+ * Stop all threads and free a pool.
+ *
+ * @param pool The pool
+ */
+void pool_destroy(struct pool* pool);
+
+/**
+ * Get the number of threads in a pool, not counting callers.
+ *
+ * @param pool The pool
+ * @return The number of threads
+ */
+int pool_size(const struct pool* pool);
+
+/**
+ * Run fn for every index in [0, count) and wait for all of them to finish.
+ *
+ * Items are claimed dynamically, so uneven items balance across threads. Only
+ * as many threads as there are items are woken. Not reentrant: only one call
+ * may be in progress per pool.
+ *
+ * @param pool The pool
+ * @param count The number of items
+ * @param max_threads The maximum threads to use including the caller, or zero
+ * @param fn The work function
+ * @param ctx The work function context
+ */
+void pool_for(struct pool* pool, size_t count, int max_threads, pool_fn fn, void* ctx);
+
+#endif // #ifndef POOL_H
@@ -0,0 +1,756 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "record.h"
+#include "service.h"
+#include "service/console.h"
+#include "service/face.h"
+#include "service/speech.h"
+
+#define LOG_TAG "record"
+
+/** The file magic. */
+#define FILE_MAGIC "CZMREC\0"
+
+/** The file format version. */
+#define FILE_VERSION 1
+
+/** The chunk magic, "CHNK" read little-endian. */
+#define CHUNK_MAGIC 0x4b4e4843u
+
+/** The longest a chunk is filled before it is written in nanoseconds. */
+#define SEAL_NS 1000000000ull
+
+/** The longest replay waits on a service that makes no progress in nanoseconds. */
+#define STALL_NS 1000000000ull
+
+/** The time between checks on a service replay is waiting for in nanoseconds. */
+#define POLL_NS 100000ull
+
+/** The longest replay sleeps between checks for cancellation in nanoseconds. */
+#define CANCEL_POLL_NS 100000000ull
+
+/** The time between checks on copies into a chunk waiting to be written in nanoseconds. */
+#define COPY_POLL_NS 20000ull
+
+/** The file header. */
+struct file_header {
+  /** The magic. */
+  char magic[8];
+
+  /** The format version. */
+  uint32_t version;
+
+  /** The chunk length it was written with. */
+  uint32_t chunk_len;
+
+  /** Reserved. */
+  uint64_t reserved[2];
+};
+
+/** A chunk header. */
+struct chunk_header {
+  /** The magic. */
+  uint32_t magic;
+
+  /** The length of the chunk in bytes, header included. */
+  uint32_t len;
+
+  /** The number of records. */
+  uint32_t records;
+
+  /** Reserved. */
+  uint32_t reserved;
+
+  /** The time of the first record. */
+  uint64_t first;
+
+  /** The time of the last record. */
+  uint64_t last;
+};
+
+/** A record header. */
+struct record_header {
+  /** The time in nanoseconds since recording began. */
+  uint64_t time;
+
+  /** The kind. */
+  uint32_t kind;
+
+  /** The length of the payload in bytes, before padding. */
+  uint32_t len;
+};
+
+/** A chunk state. */
+enum chunk_state {
+  /** Free to fill. */
+  chunk_state_free,
+
+  /** Being filled. */
+  chunk_state_filling,
+
+  /** Waiting to be written. */
+  chunk_state_full,
+};
+
+/** A chunk in memory. */
+struct chunk {
+  /** The bytes, RECORD_CHUNK_LEN long. */
+  unsigned char* data;
+
+  /** The bytes used, header included. */
+  size_t used;
+
+  /** The state. */
+  enum chunk_state state;
+
+  /** The number of records reserved whose payloads are still being copied in. */
+  atomic_int copying;
+};
+
+atomic_int record__enabled;
+
+/** Guards everything below. Held to reserve room for a record, never across its copy. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signaled when a chunk fills or recording stops. */
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/** Nonzero while recording. */
+static int recording;
+
+/** Nonzero once the writer should finish up. */
+static int stopping;
+
+/** Nonzero once a write failed. */
+static int failed;
+
+/** The chunks. */
+static struct chunk chunks[RECORD_CHUNKS];
+
+/** The index of the chunk being filled, or -1. */
+static int filling = -1;
+
+/** The full chunks, oldest first, a ring. */
+static int queue[RECORD_CHUNKS];
+
+/** The index of the oldest full chunk. */
+static int queue_first;
+
+/** The number of full chunks. */
+static int queue_len;
+
+/** The file. */
+static int fd = -1;
+
+/** The writer thread. */
+static pthread_t writer;
+
+/** The time recording began. */
+static unsigned long long start_ns;
+
+/** The statistics. */
+static struct record_stats stats;
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + (unsigned long long) ts.tv_nsec;
+}
+
+static void sleep_until(unsigned long long ns) {
+  struct timespec ts = {
+    .tv_sec = (time_t) (ns / 1000000000ull),
+    .tv_nsec = (long) (ns % 1000000000ull),
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+}
+
+/**
+ * Round a length up to a multiple of eight.
+ */
+static size_t pad(size_t len) {
+  return (len + 7) & ~(size_t) 7;
+}
+
+static int write_all(const void* data, size_t len) {
+  const unsigned char* p = data;
+  while (len) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    p += n;
+    len -= (size_t) n;
+  }
+  return 0;
+}
+
+/**
+ * Hand the chunk being filled to the writer. Call with the lock held.
+ */
+static void seal(void) {
+  struct chunk* c = &chunks[filling];
+  struct chunk_header* header = (struct chunk_header*) c->data;
+  header->magic = CHUNK_MAGIC;
+  header->len = (uint32_t) c->used;
+
+  c->state = chunk_state_full;
+  queue[(queue_first + queue_len++) % RECORD_CHUNKS] = filling;
+  filling = -1;
+
+  pthread_cond_signal(&cond);
+}
+
+/**
+ * Make room for a record and write its header. The payload is copied in
+ * after the lock is let go, then committed so the writer knows it is whole.
+ *
+ * @param kind The kind
+ * @param len The length of the payload
+ * @param chunk The chunk to commit to
+ * @return Where the payload goes, or NULL if it was dropped
+ */
+static unsigned char* reserve(enum record_kind kind, size_t len, struct chunk** chunk) {
+  size_t need = sizeof(struct record_header) + pad(len);
+
+  pthread_mutex_lock(&lock);
+
+  if (!recording) {
+    pthread_mutex_unlock(&lock);
+    return NULL;
+  }
+
+  if (need > RECORD_CHUNK_LEN - sizeof(struct chunk_header)) {
+    ++stats.dropped;
+    pthread_mutex_unlock(&lock);
+    return NULL;
+  }
+
+  // Stamped under the lock so records are in time order
+  unsigned long long time = now_ns() - start_ns;
+
+  // Bound what a crash loses when inputs trickle in
+  if (filling >= 0 && (chunks[filling].used + need > RECORD_CHUNK_LEN
+      || time - ((struct chunk_header*) chunks[filling].data)->first >= SEAL_NS)) {
+    seal();
+  }
+
+  if (filling < 0) {
+    for (int i = 0; i < RECORD_CHUNKS && filling < 0; ++i) {
+      if (chunks[i].state == chunk_state_free) {
+        filling = i;
+      }
+    }
+
+    // Every chunk is waiting on the disk
+    if (filling < 0) {
+      ++stats.dropped;
+      pthread_mutex_unlock(&lock);
+      return NULL;
+    }
+
+    struct chunk* c = &chunks[filling];
+    memset(c->data, 0, sizeof(struct chunk_header));
+    c->used = sizeof(struct chunk_header);
+    c->state = chunk_state_filling;
+  }
+
+  struct chunk* c = &chunks[filling];
+  struct chunk_header* chunk_header = (struct chunk_header*) c->data;
+
+  if (!chunk_header->records++) {
+    chunk_header->first = time;
+  }
+  chunk_header->last = time;
+
+  struct record_header* header = (struct record_header*) (c->data + c->used);
+  header->time = time;
+  header->kind = (uint32_t) kind;
+  header->len = (uint32_t) len;
+
+  unsigned char* payload = (unsigned char*) (header + 1);
+  memset(payload + len, 0, pad(len) - len);
+
+  c->used += need;
+  ++stats.records;
+
+  atomic_fetch_add_explicit(&c->copying, 1, memory_order_relaxed);
+  *chunk = c;
+
+  pthread_mutex_unlock(&lock);
+  return payload;
+}
+
+/**
+ * Mark a reserved record's payload as copied in.
+ *
+ * @param chunk The chunk it was reserved in
+ */
+static void commit(struct chunk* chunk) {
+  atomic_fetch_sub_explicit(&chunk->copying, 1, memory_order_release);
+}
+
+static void* writer_main(void* arg) {
+  pthread_mutex_lock(&lock);
+
+  for (;;) {
+    while (!queue_len && !stopping) {
+      pthread_cond_wait(&cond, &lock);
+    }
+
+    if (!queue_len) {
+      break;
+    }
+
+    struct chunk* c = &chunks[queue[queue_first]];
+    pthread_mutex_unlock(&lock);
+
+    // Copies finish in well under a frame, so waiting them out beats waking the writer
+    while (atomic_load_explicit(&c->copying, memory_order_acquire)) {
+      sleep_until(now_ns() + COPY_POLL_NS);
+    }
+
+    int fail = write_all(c->data, c->used);
+
+    pthread_mutex_lock(&lock);
+    if (fail && !failed) {
+      LOGE("Failed to write recording: {}", _str(strerror(errno)));
+    }
+    failed |= fail;
+    stats.bytes += fail ? 0 : c->used;
+
+    c->state = chunk_state_free;
+    queue_first = (queue_first + 1) % RECORD_CHUNKS;
+    --queue_len;
+  }
+
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+int record_start(const char* path) {
+  pthread_mutex_lock(&lock);
+
+  if (recording) {
+    pthread_mutex_unlock(&lock);
+    LOGE("Already recording");
+    return 1;
+  }
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    pthread_mutex_unlock(&lock);
+    LOGE("Failed to open {}", _str(path));
+    return 1;
+  }
+
+  struct file_header header = {
+    .magic = FILE_MAGIC,
+    .version = FILE_VERSION,
+    .chunk_len = RECORD_CHUNK_LEN,
+  };
+
+  int fail = write_all(&header, sizeof header);
+
+  for (int i = 0; i < RECORD_CHUNKS && !fail; ++i) {
+    chunks[i].data = malloc(RECORD_CHUNK_LEN);
+    chunks[i].state = chunk_state_free;
+    fail = !chunks[i].data;
+  }
+
+  filling = -1;
+  queue_first = 0;
+  queue_len = 0;
+  stopping = 0;
+  failed = 0;
+  stats = (struct record_stats) { .bytes = sizeof header };
+  start_ns = now_ns();
+
+  if (fail || pthread_create(&writer, NULL, &writer_main, NULL)) {
+    for (int i = 0; i < RECORD_CHUNKS; ++i) {
+      free(chunks[i].data);
+      chunks[i].data = NULL;
+    }
+    close(fd);
+    fd = -1;
+    pthread_mutex_unlock(&lock);
+    LOGE("Failed to start recording to {}", _str(path));
+    return 1;
+  }
+
+  recording = 1;
+  atomic_store(&record__enabled, 1);
+
+  pthread_mutex_unlock(&lock);
+
+  LOGI("Recording inputs to {}", _str(path));
+  return 0;
+}
+
+int record_stop(void) {
+  pthread_mutex_lock(&lock);
+
+  if (!recording) {
+    pthread_mutex_unlock(&lock);
+    LOGE("Not recording");
+    return 1;
+  }
+
+  atomic_store(&record__enabled, 0);
+  recording = 0;
+
+  if (filling >= 0) {
+    seal();
+  }
+
+  stopping = 1;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+
+  pthread_join(writer, NULL);
+
+  for (int i = 0; i < RECORD_CHUNKS; ++i) {
+    free(chunks[i].data);
+    chunks[i].data = NULL;
+  }
+
+  int fail = failed | close(fd);
+  fd = -1;
+
+  LOGI("Recorded {} inputs in {} bytes, dropped {}", _ul(stats.records), _ull(stats.bytes), _ul(stats.dropped));
+  return fail;
+}
+
+void record_get_stats(struct record_stats* out) {
+  pthread_mutex_lock(&lock);
+  *out = stats;
+  pthread_mutex_unlock(&lock);
+}
+
+void record_frame(const struct face_frame* frame) {
+  if (!record_enabled()) {
+    return;
+  }
+
+  size_t pixel = frame->format == face_pixel_format_rgb24 ? 3 : 1;
+  size_t row = (size_t) frame->width * pixel;
+
+  struct chunk* c;
+  unsigned char* p = reserve(record_kind_frame, sizeof(struct record_frame) + row * (size_t) frame->height, &c);
+  if (p) {
+    *(struct record_frame*) p = (struct record_frame) {
+      .id = frame->id,
+      .width = frame->width,
+      .height = frame->height,
+      .format = frame->format,
+    };
+    p += sizeof(struct record_frame);
+
+    // Rows are packed tight whatever the stride was
+    for (int y = 0; y < frame->height; ++y) {
+      memcpy(p + (size_t) y * row, frame->data + (size_t) y * frame->stride, row);
+    }
+
+    commit(c);
+  }
+}
+
+void record_audio(const struct speech_audio* audio, int sample_rate, int channels) {
+  if (!record_enabled()) {
+    return;
+  }
+
+  size_t len = audio->frames * (size_t) channels * sizeof *audio->samples;
+
+  struct chunk* c;
+  unsigned char* p = reserve(record_kind_audio, sizeof(struct record_audio) + len, &c);
+  if (p) {
+    *(struct record_audio*) p = (struct record_audio) {
+      .sample_rate = sample_rate,
+      .channels = channels,
+    };
+    memcpy(p + sizeof(struct record_audio), audio->samples, len);
+    commit(c);
+  }
+}
+
+void record_command(const char* line) {
+  if (!record_enabled()) {
+    return;
+  }
+
+  size_t len = strnlen(line, RECORD_COMMAND_MAX - 1);
+
+  struct chunk* c;
+  unsigned char* p = reserve(record_kind_command, len, &c);
+  if (p) {
+    memcpy(p, line, len);
+    commit(c);
+  }
+}
+
+int record_reader_open(struct record_reader* reader, const char* path) {
+  int file = open(path, O_RDONLY | O_CLOEXEC);
+  if (file < 0) {
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(file, &st) || (size_t) st.st_size < sizeof(struct file_header)) {
+    close(file);
+    return 1;
+  }
+
+  void* map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (map == MAP_FAILED) {
+    return 1;
+  }
+
+  const struct file_header* header = map;
+  if (memcmp(header->magic, FILE_MAGIC, sizeof header->magic) || header->version != FILE_VERSION) {
+    munmap(map, (size_t) st.st_size);
+    return 1;
+  }
+
+  // Replay reads front to back
+  madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+  *reader = (struct record_reader) {
+    .map = map,
+    .map_len = (size_t) st.st_size,
+    .chunk = sizeof(struct file_header),
+    .pos = sizeof(struct file_header),
+    .end = sizeof(struct file_header),
+  };
+  return 0;
+}
+
+void record_reader_close(struct record_reader* reader) {
+  if (reader->map) {
+    munmap(reader->map, reader->map_len);
+    reader->map = NULL;
+  }
+}
+
+int record_reader_next(struct record_reader* reader, struct record_entry* entry) {
+  const unsigned char* base = reader->map;
+
+  while (reader->pos == reader->end) {
+    if (reader->map_len - reader->chunk < sizeof(struct chunk_header)) {
+      return 0;
+    }
+
+    // A chunk cut short by a crash ends the recording there
+    const struct chunk_header* chunk = (const struct chunk_header*) (base + reader->chunk);
+    if (chunk->magic != CHUNK_MAGIC || chunk->len < sizeof *chunk || chunk->len > reader->map_len - reader->chunk) {
+      return 0;
+    }
+
+    reader->pos = reader->chunk + sizeof *chunk;
+    reader->end = reader->chunk + chunk->len;
+    reader->chunk = reader->end;
+  }
+
+  if (reader->end - reader->pos < sizeof(struct record_header)) {
+    return 0;
+  }
+
+  const struct record_header* header = (const struct record_header*) (base + reader->pos);
+  size_t len = pad(header->len);
+  if (len > reader->end - reader->pos - sizeof *header) {
+    return 0;
+  }
+
+  *entry = (struct record_entry) {
+    .time = header->time,
+    .kind = (enum record_kind) header->kind,
+    .data = header + 1,
+    .len = header->len,
+  };
+
+  reader->pos += sizeof *header + len;
+  return 1;
+}
+
+/**
+ * Wait until the face pipeline has finished every frame submitted, or stops
+ * making progress.
+ */
+static void wait_face_idle(void) {
+  unsigned long long deadline = now_ns() + STALL_NS;
+
+  struct face_stats face;
+  while (!service_call(SERVICE_FACE, service_face_proc_get_stats, NULL, &face)
+      && face.frames_processed + face.frames_dropped < face.frames_submitted && now_ns() < deadline) {
+    sleep_until(now_ns() + POLL_NS);
+  }
+}
+
+static void replay_frame(const struct record_entry* entry, int realtime, struct record_replay_stats* stats) {
+  const struct record_frame* header = entry->data;
+  if (entry->len < sizeof *header) {
+    return;
+  }
+
+  int pixel = header->format == face_pixel_format_rgb24 ? 3 : 1;
+  if (entry->len - sizeof *header < (size_t) header->width * header->height * pixel) {
+    return;
+  }
+
+  if (!realtime) {
+    wait_face_idle();
+  }
+
+  struct face_frame frame = {
+    .id = header->id,
+    .timestamp = now_ns(),
+    .width = header->width,
+    .height = header->height,
+    .stride = header->width * pixel,
+    .format = (enum face_pixel_format) header->format,
+    .data = (const unsigned char*) (header + 1),
+  };
+
+  service_call(SERVICE_FACE, service_face_proc_submit, &frame, NULL);
+  ++stats->frames;
+}
+
+static void replay_audio(const struct record_entry* entry, int realtime, struct record_replay_stats* stats) {
+  const struct record_audio* header = entry->data;
+  if (entry->len < sizeof *header || header->channels < 1) {
+    return;
+  }
+
+  struct speech_audio audio = {
+    .samples = (const short*) (header + 1),
+    .frames = (entry->len - sizeof *header) / (sizeof(short) * (size_t) header->channels),
+  };
+  stats->audio_frames += audio.frames;
+
+  unsigned long long deadline = now_ns() + STALL_NS;
+
+  while (audio.frames) {
+    size_t written = 0;
+    if (service_call(SERVICE_SPEECH, service_speech_proc_push_audio, &audio, &written)) {
+      break;
+    }
+
+    audio.samples += written * (size_t) header->channels;
+    audio.frames -= written;
+
+    // At the recorded pace, what does not fit is lost as it would be in capture
+    if (realtime || now_ns() > deadline) {
+      break;
+    }
+
+    if (audio.frames) {
+      sleep_until(now_ns() + POLL_NS);
+    }
+  }
+
+  stats->audio_dropped += audio.frames;
+}
+
+static void replay_command(const struct record_entry* entry, struct record_replay_stats* stats) {
+  char line[RECORD_COMMAND_MAX];
+  size_t len = entry->len < sizeof line - 1 ? entry->len : sizeof line - 1;
+  memcpy(line, entry->data, len);
+  line[len] = '\0';
+
+  service_call(SERVICE_CONSOLE, service_console_proc_command, line, NULL);
+  ++stats->commands;
+}
+
+static int canceled(const struct record_replay_options* options) {
+  return options->cancel && atomic_load(options->cancel);
+}
+
+int record_replay(const struct record_replay_options* options, struct record_replay_stats* stats) {
+  struct record_reader reader;
+  if (record_reader_open(&reader, options->path)) {
+    LOGE("Failed to open recording {}", _str(options->path));
+    return 1;
+  }
+
+  unsigned int kinds = options->kinds ? options->kinds : ~0u;
+  struct record_replay_stats s = {0};
+
+  unsigned long long t0 = now_ns();
+  unsigned long long first = 0;
+  int started = 0;
+
+  struct record_entry entry;
+  while (!canceled(options) && record_reader_next(&reader, &entry)) {
+    if ((unsigned int) entry.kind >= 32 || !(kinds & (1u << entry.kind))) {
+      continue;
+    }
+
+    if (!started) {
+      first = entry.time;
+      started = 1;
+    }
+    s.recorded_ns = entry.time - first;
+
+    if (options->realtime) {
+      // Sleep in slices so a long quiet stretch can still be cut short
+      unsigned long long due = t0 + (entry.time - first);
+      while (now_ns() < due && !canceled(options)) {
+        unsigned long long slice = now_ns() + CANCEL_POLL_NS;
+        sleep_until(slice < due ? slice : due);
+      }
+
+      if (canceled(options)) {
+        break;
+      }
+
+      unsigned long long now = now_ns();
+      if (now > due && now - due > s.lag_max) {
+        s.lag_max = now - due;
+      }
+    }
+
+    switch (entry.kind) {
+      case record_kind_frame:
+        replay_frame(&entry, options->realtime, &s);
+        break;
+      case record_kind_audio:
+        replay_audio(&entry, options->realtime, &s);
+        break;
+      case record_kind_command:
+        replay_command(&entry, &s);
+        break;
+      default:
+        break;
+    }
+  }
+
+  s.elapsed_ns = now_ns() - t0;
+  record_reader_close(&reader);
+
+  if (stats) {
+    *stats = s;
+  }
+
+  return 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct face_frame;
+struct speech_audio;
+
+//
+// Recording and Replay
+//
+// While recording, every input from outside the process is appended to a
+// file with the time it arrived: camera frames submitted to the face
+// service, audio pushed to the speech service and console command lines.
+// Room for each input is reserved in large chunks under a lock held for a
+// few dozen instructions, and the input is copied in after it is let go, so
+// a frame being copied never holds up audio. A thread of its own writes each
+// chunk once it fills and every copy into it is done, so the capture paths
+// never wait on the disk. If every chunk is waiting to be written, inputs
+// are dropped and counted rather than holding capture up.
+//
+// A recording is a header followed by chunks, each a header followed by
+// records, each a header followed by its payload padded to eight bytes. It is
+// mapped into memory to read, so payloads are read in place, and a file cut
+// short ends at its last whole chunk. A chunk is written once full, or once
+// an input arrives a second or more after its first. Like the speech
+// replays, the host must be little-endian like the files.
+//
+// Replay feeds a recording back through the services, either at the pace it
+// was recorded or as fast as they take it.
+//
+
+/** The bytes in a chunk, header included. */
+#define RECORD_CHUNK_LEN (4u << 20)
+
+/** The number of chunks filled or waiting to be written at once. */
+#define RECORD_CHUNKS 4
+
+/** The most bytes of a console command kept. */
+#define RECORD_COMMAND_MAX 512
+
+/** An input kind. */
+enum record_kind {
+  /** A camera frame. The payload is struct record_frame then the pixels. */
+  record_kind_frame = 1,
+
+  /** Captured audio. The payload is struct record_audio then the samples. */
+  record_kind_audio,
+
+  /** A console command line. The payload is the text without a terminator. */
+  record_kind_command,
+};
+
+/** The payload header of a frame. Rows follow without padding. */
+struct record_frame {
+  /** The frame number. */
+  uint64_t id;
+
+  /** The width in pixels. */
+  int32_t width;
+
+  /** The height in pixels. */
+  int32_t height;
+
+  /** The pixel format, an enum face_pixel_format. */
+  int32_t format;
+
+  /** Padding. */
+  int32_t reserved;
+};
+
+/** The payload header of audio. Interleaved 16-bit samples follow. */
+struct record_audio {
+  /** The capture sample rate in hertz. */
+  int32_t sample_rate;
+
+  /** The number of interleaved channels per frame. */
+  int32_t channels;
+};
+
+/** A recorded input. */
+struct record_entry {
+  /** The time it arrived in nanoseconds since recording began. */
+  unsigned long long time;
+
+  /** The kind. */
+  enum record_kind kind;
+
+  /** The payload, pointing into the mapping. */
+  const void* data;
+
+  /** The length of the payload in bytes. */
+  size_t len;
+};
+
+/** A recording mapped for reading. */
+struct record_reader {
+  /** The mapping. */
+  void* map;
+
+  /** The length of the mapping in bytes. */
+  size_t map_len;
+
+  /** The offset of the next chunk. */
+  size_t chunk;
+
+  /** The offset of the next record. */
+  size_t pos;
+
+  /** The offset of the end of the current chunk. */
+  size_t end;
+};
+
+/** Recording statistics. */
+struct record_stats {
+  /** The number of inputs recorded. */
+  unsigned long records;
+
+  /** The number of inputs dropped because every chunk was waiting to be written. */
+  unsigned long dropped;
+
+  /** The number of bytes written. */
+  unsigned long long bytes;
+};
+
+/** Replay options. */
+struct record_replay_options {
+  /** The recording path. */
+  const char* path;
+
+  /** Nonzero to pace inputs as they were recorded, otherwise as fast as they are taken. */
+  int realtime;
+
+  /** The kinds to replay, a mask of 1 << enum record_kind, or zero for all. */
+  unsigned int kinds;
+
+  /** Set nonzero from another thread to end the replay early, or NULL. */
+  const atomic_int* cancel;
+};
+
+/** Replay statistics. */
+struct record_replay_stats {
+  /** The number of frames submitted. */
+  unsigned long frames;
+
+  /** The number of audio frames pushed. */
+  unsigned long long audio_frames;
+
+  /** The number of audio frames the speech service had no room for. */
+  unsigned long long audio_dropped;
+
+  /** The number of commands run. */
+  unsigned long commands;
+
+  /** The recorded time from the first input to the last in nanoseconds. */
+  unsigned long long recorded_ns;
+
+  /** The time taken to replay in nanoseconds. */
+  unsigned long long elapsed_ns;
+
+  /** The furthest an input fell behind its recorded pace in nanoseconds. */
+  unsigned long long lag_max;
+};
+
+/** @private */
+extern atomic_int record__enabled;
+
+/**
+ * Check whether inputs are being recorded.
+ *
+ * @return Nonzero if they are
+ */
+static inline int record_enabled(void) {
+  return atomic_load_explicit(&record__enabled, memory_order_relaxed);
+}
+
+/**
+ * Start recording inputs.
+ *
+ * @param path The file to write, replaced if it exists
+ * @return Zero on success, otherwise nonzero
+ */
+int record_start(const char* path);
+
+/**
+ * Stop recording, writing out everything recorded so far.
+ *
+ * @return Zero on success, otherwise nonzero
+ */
+int record_stop(void);
+
+/**
+ * Get recording statistics for the current or last recording.
+ *
+ * @param out The statistics
+ */
+void record_get_stats(struct record_stats* out);
+
+/**
+ * Record a camera frame, if recording.
+ *
+ * @param frame The frame
+ */
+void record_frame(const struct face_frame* frame);
+
+/**
+ * Record captured audio, if recording. Never blocks on the disk.
+ *
+ * @param audio The audio
+ * @param sample_rate The capture sample rate in hertz
+ * @param channels The number of interleaved channels per frame
+ */
+void record_audio(const struct speech_audio* audio, int sample_rate, int channels);
+
+/**
+ * Record a console command line, if recording.
+ *
+ * @param line The line
+ */
+void record_command(const char* line);
+
+/**
+ * Map a recording for reading.
+ *
+ * @param reader The reader
+ * @param path The recording path
+ * @return Zero on success, otherwise nonzero
+ */
+int record_reader_open(struct record_reader* reader, const char* path);
+
+/**
+ * Unmap a recording.
+ *
+ * @param reader The reader
+ */
+void record_reader_close(struct record_reader* reader);
+
+/**
+ * Read the next input without copying it.
+ *
+ * @param reader The reader
+ * @param entry The input
+ * @return Nonzero if one was read, zero at the end or at a damaged chunk
+ */
+int record_reader_next(struct record_reader* reader, struct record_entry* entry);
+
+/**
+ * Replay a recording on the calling thread, returning once every input has
+ * been handed over. Frames go to the face service, audio to the speech
+ * service and commands to the console, so each must be loaded if its inputs
+ * are replayed. Frames are stamped with the time they are submitted.
+ *
+ * As fast as possible, each frame waits for the face pipeline to finish the
+ * one before, and audio waits for room in the speech buffer, so inputs are
+ * not dropped for arriving faster than they were recorded. Audio is pushed as
+ * it was captured, so speech should be configured in the recorded format.
+ *
+ * @param options The options
+ * @param stats The statistics, or NULL
+ * @return Zero on success, otherwise nonzero
+ */
+int record_replay(const struct record_replay_options* options, struct record_replay_stats* stats);
+
+#endif // #ifndef RECORD_H
@@ -3,24 +3,75 @@
  * Copyright 2019 The Cozmonaut Contributors
  */
 
+// For CPU affinity
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "log.h"
+#include "metric.h"
 #include "service.h"
+#include "trace.h"
 
 #define LOG_TAG "service"
 
+/** The real-time priority of realtime class threads. */
+#define REALTIME_PRIORITY 10
+
+/** The nice value of background class threads. */
+#define BACKGROUND_NICE 10
+
 /** Internal service state. */
 struct service_state {
   /** Nonzero if service is started. */
   int started;
+
+  /** Nonzero if its threads are pinned. */
+  int pinned;
+
+  /** The CPUs its threads are pinned to. */
+  cpu_set_t affinity;
+
+  /** The number of units of work finished. */
+  atomic_ulong completed;
+
+  /** The number of those finished past their deadline. */
+  atomic_ulong missed;
+
+  /** The furthest any finished past its deadline in nanoseconds. */
+  atomic_ullong worst_late;
+
+  /** Counts deadline misses. */
+  struct metric* metric_misses;
 };
 
+/**
+ * Call a lifecycle hook of a service, traced as a span.
+ *
+ * @param svc The service definition
+ * @param hook The hook
+ * @param name The hook name
+ * @return What the hook returned
+ */
+static int notify(struct service* svc, int (* hook)(struct service* svc), const char* name) {
+  int traced = trace_begin(name, LOG_TAG, svc->name, 0);
+  int result = hook(svc);
+  trace_end(traced);
+  return result;
+}
+
 service_proc service_get_proc(const struct service* svc, int proc) {
-  LOGT("Get procedure {}#{}", _str(svc->name), _i(proc));
+  // Not logged, as real-time paths like the capture callback come through here
 
   // Abort if service not loaded
   if (!svc->state) {
@@ -41,14 +92,18 @@ int service_load(struct service* svc) {
   }
 
   // Create state for service
-  svc->state = malloc(sizeof *svc->state);
+  svc->state = calloc(1, sizeof *svc->state);
   if (!svc->state) {
     LOGE("{} state alloc failed", _str(svc->name));
     return 1;
   }
 
+  char name[64];
+  snprintf(name, sizeof name, "%s.deadline_misses", svc->name);
+  svc->state->metric_misses = metric_get(name, metric_kind_counter);
+
   // Notify service
-  if (svc->iface->on_load(svc)) {
+  if (notify(svc, svc->iface->on_load, "on_load")) {
     LOGE("{} aborted during load", _str(svc->name));
 
     // Service aborted during load
@@ -79,7 +134,7 @@ int service_unload(struct service* svc) {
   }
 
   // Notify service
-  if (svc->iface->on_unload(svc)) {
+  if (notify(svc, svc->iface->on_unload, "on_unload")) {
     // Unload cannot be aborted
     LOGW("{} returned exceptional status during unload", _str(svc->name));
   }
@@ -92,6 +147,8 @@ int service_unload(struct service* svc) {
 }
 
 int service_start(struct service* svc) {
+  TRACE_SCOPE_WITH("service_start", svc->name, 0);
+
   LOGT("Starting {}", _str(svc->name));
 
   // Abort if service not loaded
@@ -110,7 +167,7 @@ int service_start(struct service* svc) {
   svc->state->started = 1;
 
   // Notify service
-  if (svc->iface->on_start(svc)) {
+  if (notify(svc, svc->iface->on_start, "on_start")) {
     LOGE("{} aborted during start", _str(svc->name));
 
     // Service aborted during start
@@ -124,6 +181,8 @@ int service_start(struct service* svc) {
 }
 
 int service_stop(struct service* svc) {
+  TRACE_SCOPE_WITH("service_stop", svc->name, 0);
+
   LOGT("Stopping {}", _str(svc->name));
 
   // Abort if service not loaded
@@ -142,7 +201,7 @@ int service_stop(struct service* svc) {
   svc->state->started = 0;
 
   // Notify service
-  if (svc->iface->on_stop(svc)) {
+  if (notify(svc, svc->iface->on_stop, "on_stop")) {
     // Stop cannot be aborted
     LOGW("{} returned exceptional status during stop", _str(svc->name));
   }
@@ -151,3 +210,150 @@ int service_stop(struct service* svc) {
 
   return 0;
 }
+
+/**
+ * Parse a CPU list like "0,2-3".
+ *
+ * @param cpus The CPU list
+ * @param out The CPU set
+ * @return Zero on success, otherwise nonzero
+ */
+static int parse_cpus(const char* cpus, cpu_set_t* out) {
+  CPU_ZERO(out);
+
+  const char* p = cpus;
+  while (*p) {
+    char* end;
+    unsigned long first = strtoul(p, &end, 10);
+    unsigned long last = first;
+    if (end == p) {
+      return 1;
+    }
+
+    if (*end == '-') {
+      p = end + 1;
+      last = strtoul(p, &end, 10);
+      if (end == p) {
+        return 1;
+      }
+    }
+
+    if (first > last || last >= CPU_SETSIZE) {
+      return 1;
+    }
+
+    for (unsigned long cpu = first; cpu <= last; ++cpu) {
+      CPU_SET(cpu, out);
+    }
+
+    if (*end == ',') {
+      ++end;
+    } else if (*end) {
+      return 1;
+    }
+    p = end;
+  }
+
+  return !CPU_COUNT(out);
+}
+
+int service_set_affinity(struct service* svc, const char* cpus) {
+  // Abort if service not loaded
+  if (!svc->state) {
+    LOGE("{} is not loaded", _str(svc->name));
+    return 1;
+  }
+
+  if (!cpus) {
+    svc->state->pinned = 0;
+    return 0;
+  }
+
+  cpu_set_t affinity;
+  if (parse_cpus(cpus, &affinity)) {
+    LOGE("Invalid CPU list {} for {}", _str(cpus), _str(svc->name));
+    return 1;
+  }
+
+  svc->state->affinity = affinity;
+  svc->state->pinned = 1;
+
+  LOGI("Pinned {} to CPUs {}", _str(svc->name), _str(cpus));
+  return 0;
+}
+
+int service_sched_thread(struct service* svc) {
+  // Abort if service not loaded
+  if (!svc->state) {
+    LOGE("{} is not loaded", _str(svc->name));
+    return 1;
+  }
+
+  int fail = 0;
+
+  if (svc->state->pinned) {
+    fail = pthread_setaffinity_np(pthread_self(), sizeof svc->state->affinity, &svc->state->affinity);
+    if (fail) {
+      LOGE("Failed to pin a {} thread: {}", _str(svc->name), _str(strerror(fail)));
+    }
+  }
+
+  switch (svc->sched_class) {
+    case service_class_realtime: {
+      // Real-time policies need privileges the robot may not grant, and then it runs as usual
+      struct sched_param param = { .sched_priority = REALTIME_PRIORITY };
+      int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+      if (err) {
+        LOGD("A {} thread runs without real-time priority: {}", _str(svc->name), _str(strerror(err)));
+      }
+      break;
+    }
+    case service_class_background: {
+      // Anyone may lower their own priority, and nice applies per thread on Linux
+      struct sched_param param = { .sched_priority = 0 };
+      pthread_setschedparam(pthread_self(), SCHED_BATCH, &param);
+      setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), BACKGROUND_NICE);
+      break;
+    }
+    default:
+      break;
+  }
+
+  return fail ? 1 : 0;
+}
+
+void service_sched_done(struct service* svc, unsigned long long ready, unsigned long long done) {
+  struct service_state* state = svc->state;
+  if (!state) {
+    return;
+  }
+
+  atomic_fetch_add_explicit(&state->completed, 1, memory_order_relaxed);
+
+  unsigned long long took = done > ready ? done - ready : 0;
+  if (!svc->deadline || took <= svc->deadline) {
+    return;
+  }
+
+  atomic_fetch_add_explicit(&state->missed, 1, memory_order_relaxed);
+  metric_add(state->metric_misses, 1);
+
+  unsigned long long late = took - svc->deadline;
+  unsigned long long worst = atomic_load_explicit(&state->worst_late, memory_order_relaxed);
+  while (late > worst && !atomic_compare_exchange_weak_explicit(&state->worst_late, &worst, late,
+      memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+int service_get_sched_stats(const struct service* svc, struct service_sched_stats* out) {
+  // Abort if service not loaded
+  if (!svc->state) {
+    LOGE("{} is not loaded", _str(svc->name));
+    return 1;
+  }
+
+  out->completed = atomic_load_explicit(&svc->state->completed, memory_order_relaxed);
+  out->missed = atomic_load_explicit(&svc->state->missed, memory_order_relaxed);
+  out->worst_late = atomic_load_explicit(&svc->state->worst_late, memory_order_relaxed);
+  return 0;
+}
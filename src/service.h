@@ -6,6 +6,8 @@
 #ifndef SERVICE_H
 #define SERVICE_H
 
+#include "trace.h"
+
 struct service;
 struct service_iface;
 struct service_state;
@@ -20,6 +22,43 @@ struct service_state;
  */
 typedef int (* service_proc)(struct service* svc, const void* arg1, void* arg2);
 
+//
+// Scheduling
+//
+// Each service declares a priority class for its work and, optionally, a
+// deadline by which each unit of work should finish once it is ready. Work
+// waiting on the event loop runs in class order, and by earliest deadline
+// within a class. Service threads take on their class when they start: the
+// realtime class asks the kernel for a real-time policy where permitted, and
+// the background class yields to everything else. Threads may also be pinned
+// to CPUs of their own. Work finishing past its deadline is counted against
+// the service.
+//
+
+/** A priority class. */
+enum service_class {
+  /** Work someone is waiting on, scheduled normally. The default. */
+  service_class_interactive,
+
+  /** Work with hard latency needs, run before anything else. */
+  service_class_realtime,
+
+  /** Work nobody is waiting on, run after everything else. */
+  service_class_background,
+};
+
+/** Deadline statistics for a service. */
+struct service_sched_stats {
+  /** The number of units of work finished. */
+  unsigned long completed;
+
+  /** The number of those finished past their deadline. */
+  unsigned long missed;
+
+  /** The furthest any finished past its deadline in nanoseconds. */
+  unsigned long long worst_late;
+};
+
 /** A service definition. */
 struct service {
   /** A unique name of the service. */
@@ -31,6 +70,12 @@ struct service {
   /** An interface to the service. */
   struct service_iface* iface;
 
+  /** The priority class of its work. */
+  enum service_class sched_class;
+
+  /** The time each unit of work has to finish once ready in nanoseconds, or zero for none. */
+  unsigned long long deadline;
+
   /** The internal state of the service. Opaque. */
   struct service_state* state;
 };
@@ -122,12 +167,51 @@ int service_start(struct service* svc);
  */
 int service_stop(struct service* svc);
 
+/**
+ * Pin the threads of a loaded service to some CPUs. Takes effect for threads
+ * that start after this, so set it before starting the service.
+ *
+ * @param svc The service definition
+ * @param cpus A CPU list like "2" or "0,2-3", or NULL for any CPU
+ * @return Zero on success, otherwise nonzero
+ */
+int service_set_affinity(struct service* svc, const char* cpus);
+
+/**
+ * Schedule the calling thread for a service, applying its priority class and
+ * CPU affinity. Service threads call this as they start.
+ *
+ * @param svc The service definition
+ * @return Zero on success, otherwise nonzero
+ */
+int service_sched_thread(struct service* svc);
+
+/**
+ * Record a unit of work a service finished, counting it against the
+ * deadline. Times are in nanoseconds on the monotonic clock.
+ *
+ * @param svc The service definition
+ * @param ready When the work became ready
+ * @param done When it finished
+ */
+void service_sched_done(struct service* svc, unsigned long long ready, unsigned long long done);
+
+/**
+ * Get the deadline statistics of a service.
+ *
+ * @param svc The service definition
+ * @param out The statistics
+ * @return Zero on success, otherwise nonzero
+ */
+int service_get_sched_stats(const struct service* svc, struct service_sched_stats* out);
+
 /**
  * Call a service.
  *
  * This is a convenience function meant for infrequent or prototype use. If you
  * need to call the same service procedure many times, consider looking up the
  * procedure yourself with service_get_proc(...) and caching it for later.
+ * While tracing is on, each call is traced as a span.
  *
  * @param svc The service definition
  * @param proc The function ordinal
@@ -141,7 +225,10 @@ inline static int service_call(struct service* svc, int proc, const void* arg1,
 
   if (sp) {
     // Procedure exists (forward return code)
-    return sp(svc, arg1, arg2);
+    int traced = trace_begin("service_call", "service", svc->name, proc);
+    int result = sp(svc, arg1, arg2);
+    trace_end(traced);
+    return result;
   } else {
     // Procedure nonexistent
     return 1;
@@ -9,6 +9,36 @@
 /** A console service procedure. */
 enum service_console_proc {
   service_console_proc_hello,
+
+  /**
+   * Print every metric with its current value. Takes const char* as arg1,
+   * optionally, for a name prefix to match, such as "speech.".
+   */
+  service_console_proc_metrics,
+
+  /**
+   * Run a console command line as if it were typed, such as "metrics face.".
+   * Takes const char* as arg1. Fails if the command is unknown or fails.
+   */
+  service_console_proc_command,
+
+  /** Get console statistics. Takes struct console_stats* as arg2. */
+  service_console_proc_get_stats,
+};
+
+/** Console statistics. */
+struct console_stats {
+  /** The number of commands run. */
+  unsigned long commands;
+
+  /** The number of screen refreshes, each one write. */
+  unsigned long refreshes;
+
+  /** The number of bytes written to the terminal. */
+  unsigned long long bytes_written;
+
+  /** The number of log records dropped because the terminal fell behind. */
+  unsigned long records_dropped;
 };
 
 /** The console service. */
@@ -3,24 +3,938 @@
  * Copyright 2019 The Cozmonaut Contributors
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "../console.h"
+#include "../face.h"
+#include "../monitor.h"
+#include "../python.h"
+#include "../speech.h"
 
 #include "../../log.h"
+#include "../../loop.h"
+#include "../../metric.h"
+#include "../../record.h"
 #include "../../service.h"
+#include "../../trace.h"
+
+#include "edit.h"
 
 #define LOG_TAG "console"
 
+/** The most output held for the next refresh. */
+#define OUT_LEN 65536
+
+/** The most log output held, leaving the rest for commands. */
+#define OUT_LOG_LEN (OUT_LEN / 4 * 3)
+
+/** The shortest time between refreshes in nanoseconds. */
+#define REFRESH_NS 16000000ull
+
+/** The most log records one command shows. */
+#define MAX_LOGS 200
+
+/** The most words in a command line. */
+#define MAX_ARGS 16
+
+/** The prompt. */
+#define PROMPT "cozmonaut> "
+
+//
+// Console Reactor
+//
+// The console runs on the event loop, which sleeps until there is input or
+// output, so it costs nothing while idle. Input is read edge-triggered until
+// it would block. Output from commands and log records is appended to a
+// buffer, and the loop is woken only when the buffer goes from empty to not.
+// Each refresh erases the prompt, writes everything buffered and redraws the
+// prompt in one write(), and refreshes are paced by a timer so a flood of log
+// records costs one write per frame rather than one per record. If the
+// terminal falls behind, log records are dropped and counted rather than
+// blocking whoever logged them, and some room is always kept for command
+// output.
+//
+
+/** A console command. */
+struct command {
+  /** The name. */
+  const char* name;
+
+  /** The usage. */
+  const char* usage;
+
+  /** The fewest arguments it takes. */
+  int min_args;
+
+  /**
+   * Run the command.
+   *
+   * @param argc The number of words, including the name
+   * @param argv The words
+   * @return Zero on success, otherwise nonzero
+   */
+  int (* fn)(int argc, char** argv);
+};
+
+/** How the call command passes its text to a procedure. */
+enum call_arg {
+  /** As nothing, so no text may be given. */
+  call_arg_none,
+
+  /** As const char* arg1, or NULL if none is given. */
+  call_arg_text_optional,
+};
+
+/** A procedure the call command can make. */
+struct callable {
+  /** The service. */
+  struct service* const* svc;
+
+  /** The procedure number. */
+  int proc;
+
+  /** How the text is passed. */
+  enum call_arg arg1;
+
+  /** Nonzero if it takes arg2 to fill in. */
+  int out;
+};
+
+/** The services commands can name. */
+static struct service* const* const services[] = {
+  &SERVICE_CONSOLE,
+  &SERVICE_FACE,
+  &SERVICE_MONITOR,
+  &SERVICE_PYTHON,
+  &SERVICE_SPEECH,
+};
+
+/**
+ * The procedures the call command can make. Most procedures read their
+ * arguments as structs a command line cannot spell, so only those that take
+ * no more than text, and at most fill in a result, are listed.
+ */
+static const struct callable callables[] = {
+  { &SERVICE_CONSOLE, service_console_proc_hello, call_arg_none, 0 },
+  { &SERVICE_CONSOLE, service_console_proc_metrics, call_arg_text_optional, 0 },
+  { &SERVICE_CONSOLE, service_console_proc_get_stats, call_arg_none, 1 },
+  { &SERVICE_FACE, service_face_proc_hello, call_arg_none, 0 },
+  { &SERVICE_FACE, service_face_proc_get_result, call_arg_none, 1 },
+  { &SERVICE_FACE, service_face_proc_get_stats, call_arg_none, 1 },
+  { &SERVICE_MONITOR, service_monitor_proc_hello, call_arg_none, 0 },
+  { &SERVICE_MONITOR, service_monitor_proc_render, call_arg_none, 1 },
+  { &SERVICE_MONITOR, service_monitor_proc_get_stats, call_arg_none, 1 },
+  { &SERVICE_PYTHON, service_python_proc_hello, call_arg_none, 0 },
+  { &SERVICE_PYTHON, service_python_proc_get_stats, call_arg_none, 1 },
+  { &SERVICE_SPEECH, service_speech_proc_hello, call_arg_none, 0 },
+  { &SERVICE_SPEECH, service_speech_proc_get_stats, call_arg_none, 1 },
+};
+
+/** The line editor. Loop thread only. */
+static struct console_edit edit;
+
+/** The input, or -1 if there is none. */
+static int input_fd = -1;
+
+/** Nonzero if the input is a terminal in raw mode. */
+static int input_tty;
+
+/** The terminal settings to restore. */
+static struct termios input_termios;
+
+/** Nonzero while the input is watched. */
+static int input_watched;
+
+/** Written to wake the console on the loop. */
+static int wake_fd = -1;
+
+/** The timer that paces refreshes. */
+static int refresh_timer = -1;
+
+/** Nonzero while the refresh timer is armed. Loop thread only. */
+static int refresh_armed;
+
+/** The time of the last refresh. Loop thread only. */
+static unsigned long long last_refresh;
+
+/** Output waiting for the next refresh. */
+static char out_buf[OUT_LEN];
+
+/** The length of the waiting output. */
+static size_t out_len;
+
+/** Nonzero while output goes through the loop. */
+static int out_open;
+
+/** Guards the waiting output and statistics. */
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The console statistics. Output lock only. */
+static struct console_stats stats;
+
+/** The number of records dropped since the last refresh. Output lock only. */
+static unsigned long out_dropped;
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Wake the console on the loop.
+ */
+static void wake(void) {
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof one) < 0) {
+    // Only fails if the counter is saturated, and then it is awake anyway
+  }
+}
+
+/**
+ * Queue output for the next refresh.
+ *
+ * @param data The output
+ * @param len The length of the output
+ * @param limit The most output to hold, beyond which it is dropped
+ */
+static void out_queue(const char* data, size_t len, size_t limit) {
+  pthread_mutex_lock(&out_lock);
+
+  if (!out_open) {
+    pthread_mutex_unlock(&out_lock);
+    fwrite(data, 1, len, stdout);
+    fflush(stdout);
+    return;
+  }
+
+  // Only the first output after a refresh needs to wake the loop
+  int was_empty = !out_len && !out_dropped;
+
+  if (out_len > limit || len > limit - out_len) {
+    ++out_dropped;
+    ++stats.records_dropped;
+  } else {
+    memcpy(out_buf + out_len, data, len);
+    out_len += len;
+  }
+
+  pthread_mutex_unlock(&out_lock);
+
+  if (was_empty) {
+    wake();
+  }
+}
+
+/**
+ * Queue a log record for the next refresh. The log sink while started.
+ */
+static void out_log(const char* rec, size_t len) {
+  out_queue(rec, len, OUT_LOG_LEN);
+}
+
+/**
+ * Queue formatted output for the next refresh.
+ */
+static void out_printf(const char* format, ...) {
+  char buf[1024];
+
+  va_list ap;
+  va_start(ap, format);
+  int n = vsnprintf(buf, sizeof buf, format, ap);
+  va_end(ap);
+
+  if (n > 0) {
+    out_queue(buf, (size_t) n < sizeof buf ? (size_t) n : sizeof buf - 1, OUT_LEN);
+  }
+}
+
+/**
+ * Write everything to the terminal, riding out interruptions.
+ */
+static void write_all(const char* data, size_t len) {
+  while (len) {
+    ssize_t n = write(STDOUT_FILENO, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    data += n;
+    len -= (size_t) n;
+  }
+}
+
+/**
+ * Write the waiting output and redraw the prompt in one write(). Loop thread
+ * only, or once the console is off the loop.
+ */
+static void refresh(void) {
+  static char frame[OUT_LEN + 2 * CONSOLE_LINE_MAX];
+  size_t len = 0;
+
+  // Output goes where the prompt was
+  if (input_tty) {
+    memcpy(frame, "\r\x1b[K", 4);
+    len = 4;
+  }
+
+  pthread_mutex_lock(&out_lock);
+
+  memcpy(frame + len, out_buf, out_len);
+  len += out_len;
+  out_len = 0;
+
+  unsigned long dropped = out_dropped;
+  out_dropped = 0;
+
+  pthread_mutex_unlock(&out_lock);
+
+  if (dropped) {
+    len += (size_t) snprintf(frame + len, sizeof frame - len, "[%lu records dropped]\n", dropped);
+  }
+
+  if (input_tty) {
+    len += console_edit_render(&edit, PROMPT, frame + len, sizeof frame - len);
+  }
+
+  write_all(frame, len);
+
+  pthread_mutex_lock(&out_lock);
+  ++stats.refreshes;
+  stats.bytes_written += len;
+  pthread_mutex_unlock(&out_lock);
+}
+
+/**
+ * Look up a service by name.
+ *
+ * @param name The name
+ * @return The service, or NULL
+ */
+static struct service* find_service(const char* name) {
+  for (size_t i = 0; i < sizeof services / sizeof *services; ++i) {
+    if (!strcmp((*services[i])->name, name)) {
+      return *services[i];
+    }
+  }
+
+  out_printf("No service named %s\n", name);
+  return NULL;
+}
+
+static int cmd_help(int argc, char** argv);
+
+static int cmd_call(int argc, char** argv) {
+  struct service* svc = find_service(argv[1]);
+  if (!svc) {
+    return 1;
+  }
+
+  char* end;
+  long proc = strtol(argv[2], &end, 10);
+  if (*end || !service_get_proc(svc, (int) proc)) {
+    out_printf("No procedure %s in service %s\n", argv[2], argv[1]);
+    return 1;
+  }
+
+  const struct callable* c = NULL;
+  for (size_t i = 0; i < sizeof callables / sizeof *callables; ++i) {
+    if (*callables[i].svc == svc && callables[i].proc == proc) {
+      c = &callables[i];
+      break;
+    }
+  }
+
+  if (!c) {
+    out_printf("Procedure %s of service %s cannot be called from the console\n", argv[2], argv[1]);
+    return 1;
+  }
+
+  if (argc > 3 && c->arg1 == call_arg_none) {
+    out_printf("Procedure %s of service %s takes no text\n", argv[2], argv[1]);
+    return 1;
+  }
+
+  // Results are filled in somewhere harmless and thrown away
+  static union {
+    struct console_stats console;
+    struct face_result face_result;
+    struct face_stats face;
+    struct monitor_render monitor_render;
+    struct monitor_stats monitor;
+    struct python_stats python;
+    struct speech_stats speech;
+  } scratch;
+  memset(&scratch, 0, sizeof scratch);
+
+  int result = service_call(svc, (int) proc, argc > 3 ? argv[3] : NULL, c->out ? &scratch : NULL);
+  out_printf("%s:%ld returned %d\n", argv[1], proc, result);
+  return result;
+}
+
+/**
+ * Parse a log level name.
+ *
+ * @param name The name
+ * @param level The level
+ * @return Zero on success, otherwise nonzero
+ */
+static int parse_level(const char* name, enum log_level* level) {
+  static const char* names[] = { "trace", "debug", "info", "warn", "error", "fatal" };
+  for (size_t i = 0; i < sizeof names / sizeof *names; ++i) {
+    if (!strcmp(names[i], name)) {
+      *level = (enum log_level) i;
+      return 0;
+    }
+  }
+
+  out_printf("No log level %s\n", name);
+  return 1;
+}
+
+/**
+ * Parse a duration like 500ms, 5s, 2m or 1h. Bare numbers are seconds.
+ *
+ * @param text The duration
+ * @param ns The duration in nanoseconds
+ * @return Zero on success, otherwise nonzero
+ */
+static int parse_duration(const char* text, unsigned long long* ns) {
+  char* end;
+  double value = strtod(text, &end);
+
+  double scale;
+  if (!strcmp(end, "ms")) {
+    scale = 1e6;
+  } else if (!*end || !strcmp(end, "s")) {
+    scale = 1e9;
+  } else if (!strcmp(end, "m")) {
+    scale = 60e9;
+  } else if (!strcmp(end, "h")) {
+    scale = 3600e9;
+  } else {
+    scale = -1;
+  }
+
+  if (end == text || scale < 0 || value < 0) {
+    out_printf("Bad duration %s\n", text);
+    return 1;
+  }
+
+  *ns = (unsigned long long) (value * scale);
+  return 0;
+}
+
+static int cmd_level(int argc, char** argv) {
+  enum log_level level;
+  if (parse_level(argv[1], &level)) {
+    return 1;
+  }
+
+  log_set_level(level);
+  return 0;
+}
+
+static int cmd_logs(int argc, char** argv) {
+  struct log_query query = {
+    .level = log_level_trace,
+  };
+  size_t count = 20;
+
+  for (int i = 1; i < argc; ++i) {
+    char* value = argv[i + 1];
+    if (!value) {
+      out_printf("Missing value for %s\n", argv[i]);
+      return 1;
+    }
+
+    if (!strcmp(argv[i], "--tag")) {
+      query.tag = value;
+    } else if (!strcmp(argv[i], "--level")) {
+      if (parse_level(value, &query.level)) {
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--site")) {
+      // A site is a file name, or the end of one, with an optional line
+      char* colon = strrchr(value, ':');
+      if (colon) {
+        *colon = '\0';
+        query.line = (unsigned int) strtoul(colon + 1, NULL, 10);
+      }
+      query.file = value;
+    } else if (!strcmp(argv[i], "--since")) {
+      unsigned long long ago;
+      if (parse_duration(value, &ago)) {
+        return 1;
+      }
+      unsigned long long now = now_ns();
+      query.since = ago < now ? now - ago : 0;
+    } else if (!strcmp(argv[i], "-n")) {
+      count = strtoul(value, NULL, 10);
+      count = count < MAX_LOGS ? count : MAX_LOGS;
+    } else {
+      out_printf("Unknown option %s\n", argv[i]);
+      return 1;
+    }
+    ++i;
+  }
+
+  // Commands also come from other threads, so each gets its own copy
+  struct log_record* records = malloc((count ? count : 1) * sizeof *records);
+  if (!records) {
+    out_printf("Out of memory\n");
+    return 1;
+  }
+
+  size_t len = log_tail(&query, records, count);
+
+  static const char* names[] = { "TRACE", "DEBUG", "INFO ", "WARN ", "ERROR", "FATAL" };
+  unsigned long long now = now_ns();
+  for (size_t i = 0; i < len; ++i) {
+    const struct log_record* rec = &records[i];
+    out_printf("%9.3fs %s [%s:%u] (%s) %s\n", (double) (now - rec->time) / -1e9, names[rec->level], rec->file,
+        rec->line, rec->tag, rec->msg);
+  }
+
+  free(records);
+  return 0;
+}
+
+static int cmd_metrics(int argc, char** argv) {
+  return service_call(SERVICE_CONSOLE, service_console_proc_metrics, argc > 1 ? argv[1] : NULL, NULL);
+}
+
+static int cmd_quit(int argc, char** argv) {
+  // Whoever owns the process decides what shutting down means, and raise() would
+  // leave it pending on a thread that blocks it when the command came from Python
+  return kill(getpid(), SIGTERM);
+}
+
+static int cmd_record(int argc, char** argv) {
+  if (!strcmp(argv[1], "start") && argc > 2) {
+    return record_start(argv[2]);
+  } else if (!strcmp(argv[1], "stop")) {
+    return record_stop();
+  }
+
+  out_printf("Unknown record action %s\n", argv[1]);
+  return 1;
+}
+
+static int cmd_services(int argc, char** argv) {
+  for (size_t i = 0; i < sizeof services / sizeof *services; ++i) {
+    out_printf("%-10s %s\n", (*services[i])->name, (*services[i])->description);
+  }
+  return 0;
+}
+
+static int cmd_start(int argc, char** argv) {
+  struct service* svc = find_service(argv[1]);
+  return !svc || service_start(svc);
+}
+
+static int cmd_stop(int argc, char** argv) {
+  struct service* svc = find_service(argv[1]);
+
+  // Stopping the console from itself would close the input it is reading
+  if (svc == SERVICE_CONSOLE) {
+    out_printf("The console cannot stop itself\n");
+    return 1;
+  }
+
+  return !svc || service_stop(svc);
+}
+
+static int cmd_trace(int argc, char** argv) {
+  if (!strcmp(argv[1], "on")) {
+    trace_start();
+    return 0;
+  } else if (!strcmp(argv[1], "off")) {
+    trace_stop();
+    return 0;
+  } else if (!strcmp(argv[1], "dump") && argc > 2) {
+    size_t events;
+    if (trace_dump(argv[2], &events)) {
+      return 1;
+    }
+    out_printf("Wrote %zu events to %s\n", events, argv[2]);
+    return 0;
+  }
+
+  out_printf("Unknown trace action %s\n", argv[1]);
+  return 1;
+}
+
+/** The commands, by name. */
+static const struct command commands[] = {
+  { "call", "call <service> <proc> [text]", 2, &cmd_call },
+  { "help", "help", 0, &cmd_help },
+  { "level", "level trace|debug|info|warn|error|fatal", 1, &cmd_level },
+  { "logs", "logs [--tag <tag>] [--level <level>] [--site <file>[:<line>]] [--since <duration>] [-n <count>]", 0,
+    &cmd_logs },
+  { "metrics", "metrics [prefix]", 0, &cmd_metrics },
+  { "quit", "quit", 0, &cmd_quit },
+  { "record", "record start <path>|stop", 1, &cmd_record },
+  { "services", "services", 0, &cmd_services },
+  { "start", "start <service>", 1, &cmd_start },
+  { "stop", "stop <service>", 1, &cmd_stop },
+  { "trace", "trace on|off|dump <path>", 1, &cmd_trace },
+};
+
+static int cmd_help(int argc, char** argv) {
+  for (size_t i = 0; i < sizeof commands / sizeof *commands; ++i) {
+    out_printf("  %s\n", commands[i].usage);
+  }
+  return 0;
+}
+
+/**
+ * Split a command line into words in place. Words are separated by spaces,
+ * and double quotes group words with backslash escapes inside.
+ *
+ * @param line The line
+ * @param argv The words
+ * @return The number of words
+ */
+static int split(char* line, char** argv) {
+  int argc = 0;
+  char* out = line;
+
+  while (*line) {
+    while (*line == ' ' || *line == '\t') {
+      ++line;
+    }
+
+    if (!*line || argc == MAX_ARGS) {
+      break;
+    }
+
+    argv[argc++] = out;
+
+    int quoted = 0;
+    for (; *line && (quoted || (*line != ' ' && *line != '\t')); ++line) {
+      if (*line == '"') {
+        quoted = !quoted;
+      } else if (quoted && *line == '\\' && line[1]) {
+        *out++ = *++line;
+      } else {
+        *out++ = *line;
+      }
+    }
+
+    // The word ends here even if it was copied back over the separator
+    char* next = *line ? line + 1 : line;
+    *out++ = '\0';
+    line = next;
+  }
+
+  return argc;
+}
+
+/**
+ * Run a command line.
+ *
+ * @param text The line
+ * @return Zero on success, otherwise nonzero
+ */
+static int dispatch(const char* text) {
+  char line[CONSOLE_LINE_MAX];
+  snprintf(line, sizeof line, "%s", text);
+
+  char* argv[MAX_ARGS + 1];
+  int argc = split(line, argv);
+  if (!argc) {
+    return 0;
+  }
+  argv[argc] = NULL;
+
+  pthread_mutex_lock(&out_lock);
+  ++stats.commands;
+  pthread_mutex_unlock(&out_lock);
+
+  for (size_t i = 0; i < sizeof commands / sizeof *commands; ++i) {
+    if (!strcmp(commands[i].name, argv[0])) {
+      if (argc - 1 < commands[i].min_args) {
+        out_printf("Usage: %s\n", commands[i].usage);
+        return 1;
+      }
+      return commands[i].fn(argc, argv);
+    }
+  }
+
+  out_printf("Unknown command %s, try help\n", argv[0]);
+  return 1;
+}
+
+/**
+ * Run a line from the input, recording it if inputs are being recorded.
+ *
+ * @param line The line
+ */
+static void run_input(const char* line) {
+  record_command(line);
+  dispatch(line);
+}
+
+/**
+ * Feed input to the line editor, running lines as they are submitted. Loop
+ * thread only.
+ *
+ * @param c The input byte
+ */
+static void feed(unsigned char c) {
+  // Lines piped in are run as they are, without editing or echo
+  if (!input_tty) {
+    if (c == '\n') {
+      edit.line[edit.len] = '\0';
+      edit.len = 0;
+      run_input(edit.line);
+    } else if (c != '\r' && edit.len < CONSOLE_LINE_MAX - 1) {
+      edit.line[edit.len++] = (char) c;
+    }
+    return;
+  }
+
+  switch (console_edit_feed(&edit, c)) {
+    case console_edit_event_submit: {
+      char line[CONSOLE_LINE_MAX];
+      console_edit_take(&edit, line);
+
+      // Leave the command on screen above its output
+      out_printf("%s%s\n", PROMPT, line);
+      run_input(line);
+      break;
+    }
+    case console_edit_event_clear:
+      write_all("\x1b[H\x1b[2J", 7);
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * Read all available input. Loop thread only.
+ */
+static void read_input(void) {
+  unsigned char buf[256];
+
+  for (;;) {
+    ssize_t n = read(input_fd, buf, sizeof buf);
+
+    if (n > 0) {
+      for (ssize_t i = 0; i < n; ++i) {
+        feed(buf[i]);
+      }
+      continue;
+    }
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    // Edge-triggered, so stop only once it would block
+    if (n < 0 && errno == EAGAIN) {
+      return;
+    }
+
+    // End of input, so stop watching it
+    loop_remove_fd(input_fd);
+    input_watched = 0;
+    return;
+  }
+}
+
+/**
+ * Refresh now, or arm the refresh timer if the last refresh was too recent.
+ * Loop thread only.
+ */
+static void schedule_refresh(void) {
+  if (refresh_armed) {
+    return;
+  }
+
+  unsigned long long now = now_ns();
+  if (now - last_refresh >= REFRESH_NS) {
+    refresh();
+    last_refresh = now;
+  } else if (!loop_set_timer(refresh_timer, REFRESH_NS - (now - last_refresh), 0)) {
+    refresh_armed = 1;
+  }
+}
+
+static void on_wake(int fd, unsigned int events, void* ctx) {
+  uint64_t count;
+  if (read(wake_fd, &count, sizeof count) < 0) {
+    // Already drained
+  }
+
+  schedule_refresh();
+}
+
+static void on_refresh(int timer, unsigned long long expirations, void* ctx) {
+  refresh_armed = 0;
+  refresh();
+  last_refresh = now_ns();
+}
+
+static void on_input(int fd, unsigned int events, void* ctx) {
+  read_input();
+
+  // Echo keys now rather than at the next frame
+  refresh();
+  last_refresh = now_ns();
+}
+
+/**
+ * Open the input, putting a terminal into raw mode.
+ *
+ * @return Zero on success, otherwise nonzero
+ */
+static int open_input(void) {
+  input_tty = 0;
+
+  if (isatty(STDIN_FILENO)) {
+    // A description of its own, so non-blocking reads leave stdout blocking
+    const char* name = ttyname(STDIN_FILENO);
+    input_fd = name ? open(name, O_RDONLY | O_NONBLOCK | O_CLOEXEC) : -1;
+
+    if (input_fd >= 0 && !tcgetattr(input_fd, &input_termios)) {
+      struct termios raw = input_termios;
+      raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+      raw.c_iflag &= ~(IXON | ICRNL);
+      raw.c_cc[VMIN] = 1;
+      raw.c_cc[VTIME] = 0;
+      input_tty = !tcsetattr(input_fd, TCSANOW, &raw);
+    }
+  } else {
+    input_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    if (input_fd >= 0) {
+      fcntl(input_fd, F_SETFL, fcntl(input_fd, F_GETFL) | O_NONBLOCK);
+    }
+  }
+
+  if (input_fd < 0) {
+    return 1;
+  }
+
+  // Files and null devices cannot be watched, so commands can only come by procedure
+  struct stat st;
+  int watchable = input_tty || (!fstat(input_fd, &st) && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)));
+
+  if (!watchable || loop_add_fd(SERVICE_CONSOLE, input_fd, EPOLLIN | EPOLLET, &on_input, NULL)) {
+    if (input_tty) {
+      tcsetattr(input_fd, TCSANOW, &input_termios);
+      input_tty = 0;
+    }
+    close(input_fd);
+    input_fd = -1;
+    return 1;
+  }
+
+  input_watched = 1;
+  return 0;
+}
+
+/**
+ * Close the input, restoring a terminal.
+ */
+static void close_input(void) {
+  if (input_fd < 0) {
+    return;
+  }
+
+  if (input_watched) {
+    loop_remove_fd(input_fd);
+    input_watched = 0;
+  }
+
+  if (input_tty) {
+    tcsetattr(input_fd, TCSANOW, &input_termios);
+    input_tty = 0;
+  }
+
+  close(input_fd);
+  input_fd = -1;
+}
+
 static int proc_hello(struct service* svc, const void* arg1, void* arg2) {
   LOGI("Hello, world!");
   return 0;
 }
 
+static int proc_metrics(struct service* svc, const void* arg1, void* arg2) {
+  static const char* const kinds[] = {
+    [metric_kind_counter] = "counter",
+    [metric_kind_gauge] = "gauge",
+    [metric_kind_histogram] = "histogram",
+  };
+
+  const char* prefix = arg1;
+
+  struct metric* list[METRIC_MAX];
+  size_t len = metric_list(list, METRIC_MAX);
+
+  for (size_t i = 0; i < len; ++i) {
+    const char* name = metric_name(list[i]);
+    if (prefix && strncmp(name, prefix, strlen(prefix)) != 0) {
+      continue;
+    }
+
+    struct metric_value v;
+    metric_read(list[i], &v);
+
+    enum metric_kind kind = metric_kind(list[i]);
+    if (kind == metric_kind_histogram) {
+      out_printf("%-32s %-9s %14.0f  mean %.0f  p50 %.0f  p99 %.0f\n", name, kinds[kind], v.value, v.mean, v.p50,
+          v.p99);
+    } else {
+      out_printf("%-32s %-9s %14.0f\n", name, kinds[kind], v.value);
+    }
+  }
+
+  return 0;
+}
+
+static int proc_command(struct service* svc, const void* arg1, void* arg2) {
+  return dispatch(arg1);
+}
+
+static int proc_get_stats(struct service* svc, const void* arg1, void* arg2) {
+  pthread_mutex_lock(&out_lock);
+  *(struct console_stats*) arg2 = stats;
+  pthread_mutex_unlock(&out_lock);
+  return 0;
+}
+
 static service_proc get_proc(const struct service* svc, int proc) {
   switch (proc) {
     case service_console_proc_hello:
       return &proc_hello;
+    case service_console_proc_metrics:
+      return &proc_metrics;
+    case service_console_proc_command:
+      return &proc_command;
+    case service_console_proc_get_stats:
+      return &proc_get_stats;
     default:
       return NULL;
   }
@@ -28,6 +942,10 @@ static service_proc get_proc(const struct service* svc, int proc) {
 
 static int on_load(struct service* svc) {
   LOGI("Console service load");
+
+  console_edit_init(&edit);
+  memset(&stats, 0, sizeof stats);
+
   return 0;
 }
 
@@ -38,10 +956,77 @@ static int on_unload(struct service* svc) {
 
 static int on_start(struct service* svc) {
   LOGI("Console service start");
+
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd < 0 || loop_add_fd(SERVICE_CONSOLE, wake_fd, EPOLLIN, &on_wake, NULL)) {
+    LOGE("Failed to put the console on the loop");
+    if (wake_fd >= 0) {
+      close(wake_fd);
+      wake_fd = -1;
+    }
+    return 1;
+  }
+
+  if (loop_add_timer(SERVICE_CONSOLE, 0, &on_refresh, NULL, &refresh_timer)) {
+    LOGE("Failed to create the console refresh timer");
+    loop_remove_fd(wake_fd);
+    close(wake_fd);
+    wake_fd = -1;
+    return 1;
+  }
+
+  refresh_armed = 0;
+  last_refresh = 0;
+
+  if (open_input()) {
+    LOGI("Console has no input to watch");
+  }
+
+  // Records printed so far must not come out after those the console writes
+  fflush(stdout);
+
+  pthread_mutex_lock(&out_lock);
+  out_open = 1;
+  pthread_mutex_unlock(&out_lock);
+
+  log_set_sink(&out_log);
+
+  // Draw the prompt
+  if (input_tty) {
+    wake();
+  }
+
   return 0;
 }
 
 static int on_stop(struct service* svc) {
+  // Once off the loop, nothing else touches the console
+  if (input_watched) {
+    loop_remove_fd(input_fd);
+    input_watched = 0;
+  }
+  loop_remove_timer(refresh_timer);
+  loop_remove_fd(wake_fd);
+  refresh_timer = -1;
+
+  refresh();
+  if (input_tty) {
+    write_all("\r\n", 2);
+  }
+
+  log_set_sink(NULL);
+
+  // Anything queued since the last refresh goes straight out
+  pthread_mutex_lock(&out_lock);
+  write_all(out_buf, out_len);
+  out_len = 0;
+  out_open = 0;
+  pthread_mutex_unlock(&out_lock);
+
+  close_input();
+  close(wake_fd);
+  wake_fd = -1;
+
   LOGI("Console service stop");
   return 0;
 }
@@ -56,4 +1041,5 @@ struct service* const SERVICE_CONSOLE = &(struct service) {
     .on_start = &on_start,
     .on_stop = &on_stop,
   },
+  .sched_class = service_class_interactive,
 };
@@ -0,0 +1,220 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "edit.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/** Control keys. */
+enum {
+  key_ctrl_a = 0x01,
+  key_ctrl_b = 0x02,
+  key_ctrl_e = 0x05,
+  key_ctrl_f = 0x06,
+  key_backspace = 0x08,
+  key_ctrl_k = 0x0b,
+  key_ctrl_l = 0x0c,
+  key_ctrl_n = 0x0e,
+  key_ctrl_p = 0x10,
+  key_ctrl_u = 0x15,
+  key_ctrl_w = 0x17,
+  key_escape = 0x1b,
+  key_delete = 0x7f,
+};
+
+/** Escape sequence states. */
+enum {
+  escape_none,
+  escape_start,
+  escape_csi,
+};
+
+void console_edit_init(struct console_edit* e) {
+  memset(e, 0, sizeof *e);
+}
+
+/**
+ * Replace the line, moving the cursor to its end.
+ */
+static void set_line(struct console_edit* e, const char* line) {
+  snprintf(e->line, sizeof e->line, "%s", line);
+  e->len = strlen(e->line);
+  e->cursor = e->len;
+}
+
+/**
+ * Step through history. Positive steps go back in time.
+ */
+static enum console_edit_event browse(struct console_edit* e, int step) {
+  size_t pos = e->history_pos + step;
+  if ((step < 0 && !e->history_pos) || pos > e->history_len) {
+    return console_edit_event_none;
+  }
+
+  if (!e->history_pos) {
+    snprintf(e->draft, sizeof e->draft, "%.*s", (int) e->len, e->line);
+  }
+
+  e->history_pos = pos;
+  if (pos) {
+    set_line(e, e->history[(e->history_next + CONSOLE_HISTORY_LEN - pos) % CONSOLE_HISTORY_LEN]);
+  } else {
+    set_line(e, e->draft);
+  }
+
+  return console_edit_event_changed;
+}
+
+/**
+ * Delete a span of the line.
+ */
+static enum console_edit_event erase(struct console_edit* e, size_t from, size_t to) {
+  if (from >= to) {
+    return console_edit_event_none;
+  }
+
+  memmove(e->line + from, e->line + to, e->len - to);
+  e->len -= to - from;
+  e->cursor = from;
+  return console_edit_event_changed;
+}
+
+/**
+ * Finish an escape sequence.
+ */
+static enum console_edit_event escape(struct console_edit* e, unsigned char c) {
+  switch (c) {
+    case 'A':
+      return browse(e, 1);
+    case 'B':
+      return browse(e, -1);
+    case 'C':
+      if (e->cursor == e->len) {
+        return console_edit_event_none;
+      }
+      ++e->cursor;
+      return console_edit_event_changed;
+    case 'D':
+      if (!e->cursor) {
+        return console_edit_event_none;
+      }
+      --e->cursor;
+      return console_edit_event_changed;
+    case 'H':
+      e->cursor = 0;
+      return console_edit_event_changed;
+    case 'F':
+      e->cursor = e->len;
+      return console_edit_event_changed;
+    case '~':
+      // Delete is ESC [ 3 ~
+      if (e->escape_param != 3 || e->cursor == e->len) {
+        return console_edit_event_none;
+      }
+      return erase(e, e->cursor, e->cursor + 1);
+    default:
+      return console_edit_event_none;
+  }
+}
+
+enum console_edit_event console_edit_feed(struct console_edit* e, unsigned char c) {
+  switch (e->escape) {
+    case escape_start:
+      e->escape = c == '[' || c == 'O' ? escape_csi : escape_none;
+      e->escape_param = 0;
+      return console_edit_event_none;
+    case escape_csi:
+      if (c >= '0' && c <= '9') {
+        e->escape_param = e->escape_param * 10 + (c - '0');
+        return console_edit_event_none;
+      }
+      e->escape = escape_none;
+      return escape(e, c);
+    default:
+      break;
+  }
+
+  switch (c) {
+    case '\r':
+    case '\n':
+      return console_edit_event_submit;
+    case key_escape:
+      e->escape = escape_start;
+      return console_edit_event_none;
+    case key_ctrl_a:
+      return escape(e, 'H');
+    case key_ctrl_e:
+      return escape(e, 'F');
+    case key_ctrl_b:
+      return escape(e, 'D');
+    case key_ctrl_f:
+      return escape(e, 'C');
+    case key_ctrl_p:
+      return browse(e, 1);
+    case key_ctrl_n:
+      return browse(e, -1);
+    case key_backspace:
+    case key_delete:
+      return e->cursor ? erase(e, e->cursor - 1, e->cursor) : console_edit_event_none;
+    case key_ctrl_k:
+      return erase(e, e->cursor, e->len);
+    case key_ctrl_u:
+      return erase(e, 0, e->cursor);
+    case key_ctrl_w: {
+      size_t from = e->cursor;
+      while (from && e->line[from - 1] == ' ') {
+        --from;
+      }
+      while (from && e->line[from - 1] != ' ') {
+        --from;
+      }
+      return erase(e, from, e->cursor);
+    }
+    case key_ctrl_l:
+      return console_edit_event_clear;
+    default:
+      break;
+  }
+
+  if (c < 0x20 || e->len == CONSOLE_LINE_MAX - 1) {
+    return console_edit_event_none;
+  }
+
+  memmove(e->line + e->cursor + 1, e->line + e->cursor, e->len - e->cursor);
+  e->line[e->cursor++] = (char) c;
+  ++e->len;
+  return console_edit_event_changed;
+}
+
+void console_edit_take(struct console_edit* e, char* out) {
+  memcpy(out, e->line, e->len);
+  out[e->len] = '\0';
+
+  // Blank lines and repeats stay out of history
+  const char* last = e->history[(e->history_next + CONSOLE_HISTORY_LEN - 1) % CONSOLE_HISTORY_LEN];
+  if (e->len && (!e->history_len || strcmp(last, out) != 0)) {
+    memcpy(e->history[e->history_next], out, e->len + 1);
+    e->history_next = (e->history_next + 1) % CONSOLE_HISTORY_LEN;
+    if (e->history_len < CONSOLE_HISTORY_LEN) {
+      ++e->history_len;
+    }
+  }
+
+  e->len = 0;
+  e->cursor = 0;
+  e->history_pos = 0;
+}
+
+size_t console_edit_render(const struct console_edit* e, const char* prompt, char* out, size_t cap) {
+  int n;
+  if (e->cursor < e->len) {
+    n = snprintf(out, cap, "\r\x1b[K%s%.*s\x1b[%zuD", prompt, (int) e->len, e->line, e->len - e->cursor);
+  } else {
+    n = snprintf(out, cap, "\r\x1b[K%s%.*s", prompt, (int) e->len, e->line);
+  }
+
+  return n < 0 ? 0 : (size_t) n < cap ? (size_t) n : cap - 1;
+}
@@ -0,0 +1,100 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_CONSOLE_EDIT_H
+#define SERVICE_CONSOLE_EDIT_H
+
+#include <stddef.h>
+
+/** The longest line, including the terminator. */
+#define CONSOLE_LINE_MAX 256
+
+/** The number of lines kept in history. */
+#define CONSOLE_HISTORY_LEN 32
+
+/** What a key did to the line being edited. */
+enum console_edit_event {
+  /** Nothing visible. */
+  console_edit_event_none,
+
+  /** The line or cursor changed. */
+  console_edit_event_changed,
+
+  /** The line was submitted. */
+  console_edit_event_submit,
+
+  /** The screen should be cleared. */
+  console_edit_event_clear,
+};
+
+/** A line editor with history. */
+struct console_edit {
+  /** The line. */
+  char line[CONSOLE_LINE_MAX];
+
+  /** The length of the line. */
+  size_t len;
+
+  /** The cursor position. */
+  size_t cursor;
+
+  /** The history, a ring ending before history_next. */
+  char history[CONSOLE_HISTORY_LEN][CONSOLE_LINE_MAX];
+
+  /** The number of lines in history. */
+  size_t history_len;
+
+  /** The ring index of the next line to add to history. */
+  size_t history_next;
+
+  /** How far back in history the line is, or zero for a new line. */
+  size_t history_pos;
+
+  /** The new line, kept while browsing history. */
+  char draft[CONSOLE_LINE_MAX];
+
+  /** The escape sequence state. */
+  int escape;
+
+  /** The numeric parameter of the escape sequence. */
+  int escape_param;
+};
+
+/**
+ * Initialize a line editor.
+ *
+ * @param e The line editor
+ */
+void console_edit_init(struct console_edit* e);
+
+/**
+ * Feed a key byte to a line editor. Escape sequences may span calls.
+ *
+ * @param e The line editor
+ * @param c The byte
+ * @return What it did
+ */
+enum console_edit_event console_edit_feed(struct console_edit* e, unsigned char c);
+
+/**
+ * Take the submitted line, add it to history and start a new one.
+ *
+ * @param e The line editor
+ * @param out The line, CONSOLE_LINE_MAX bytes
+ */
+void console_edit_take(struct console_edit* e, char* out);
+
+/**
+ * Render the prompt and line, leaving the terminal cursor in place.
+ *
+ * @param e The line editor
+ * @param prompt The prompt
+ * @param out The terminal output
+ * @param cap The capacity of the output
+ * @return The length of the output
+ */
+size_t console_edit_render(const struct console_edit* e, const char* prompt, char* out, size_t cap);
+
+#endif // #ifndef SERVICE_CONSOLE_EDIT_H
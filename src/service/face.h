@@ -6,9 +6,310 @@
 #ifndef SERVICE_FACE_H
 #define SERVICE_FACE_H
 
+#include <stddef.h>
+
+/** The number of elements in a face embedding. */
+#define FACE_EMBEDDING_DIM 128
+
+/** The maximum number of faces tracked at once. */
+#define FACE_MAX_FACES 16
+
+/** The side length of the preprocessed face given to the embedder. */
+#define FACE_INPUT_SIZE 64
+
 /** A face service procedure. */
 enum service_face_proc {
   service_face_proc_hello,
+
+  /** Configure the pipeline. Takes const struct face_config* as arg1. */
+  service_face_proc_configure,
+
+  /** Install a backend. Takes const struct face_backend* as arg1. */
+  service_face_proc_set_backend,
+
+  /** Add a known identity. Takes const struct face_identity* as arg1. */
+  service_face_proc_enroll,
+
+  /**
+   * Process a frame synchronously. Takes const struct face_frame* as arg1 and
+   * struct face_result* as arg2.
+   */
+  service_face_proc_process,
+
+  /**
+   * Hand a frame to the background pipeline without waiting. Takes const
+   * struct face_frame* as arg1. The frame is copied, and replaces any frame
+   * the pipeline has not started on yet.
+   */
+  service_face_proc_submit,
+
+  /** Get the latest background result. Takes struct face_result* as arg2. */
+  service_face_proc_get_result,
+
+  /** Get pipeline statistics. Takes struct face_stats* as arg2. */
+  service_face_proc_get_stats,
+
+  /**
+   * Pin the grayscale frame behind the latest background result so it can be
+   * read in place. Takes struct face_pin* as arg2. Fails if no frame was
+   * processed yet. Each pin holds a mailbox slot, so frames are dropped if
+   * too many are held at once.
+   */
+  service_face_proc_pin_frame,
+
+  /**
+   * Give back a pinned frame. Takes const struct face_pin* as arg1. Frames
+   * pinned when the service unloads stay valid, so this may be called
+   * through a procedure looked up beforehand, and the last one given back
+   * frees them.
+   */
+  service_face_proc_unpin_frame,
+};
+
+/** A frame pixel format. */
+enum face_pixel_format {
+  /** 8-bit grayscale. */
+  face_pixel_format_gray8,
+
+  /** Packed 24-bit RGB. */
+  face_pixel_format_rgb24,
+};
+
+/** A face preprocessing mode. */
+enum face_preprocess {
+  /** Normalize to zero mean and unit variance. */
+  face_preprocess_normalize,
+
+  /** Equalize the histogram into [-1, 1]. */
+  face_preprocess_equalize,
+};
+
+/** A stage of the face pipeline. */
+enum face_stage {
+  /** Grayscale conversion. */
+  face_stage_convert,
+
+  /** Full detection. */
+  face_stage_detect,
+
+  /** Track propagation between detections. */
+  face_stage_track,
+
+  /** Cropping and preprocessing faces, summed over faces. */
+  face_stage_preprocess,
+
+  /** Computing embeddings, summed over faces. */
+  face_stage_embed,
+
+  /** Matching embeddings against the gallery, summed over faces. */
+  face_stage_match,
+
+  /** The number of stages. */
+  face_stage_count,
+};
+
+/** A camera frame. */
+struct face_frame {
+  /** A monotonically increasing frame number. */
+  unsigned long id;
+
+  /** The capture time in nanoseconds on the monotonic clock. */
+  unsigned long long timestamp;
+
+  /** The width in pixels. */
+  int width;
+
+  /** The height in pixels. */
+  int height;
+
+  /** The distance in bytes between the starts of consecutive rows. */
+  int stride;
+
+  /** The pixel format. */
+  enum face_pixel_format format;
+
+  /** The pixel data. */
+  const unsigned char* data;
+};
+
+/** An axis-aligned bounding box in frame pixel coordinates. */
+struct face_box {
+  /** The left edge. */
+  int x;
+
+  /** The top edge. */
+  int y;
+
+  /** The width. */
+  int width;
+
+  /** The height. */
+  int height;
+};
+
+/** A pluggable face detection and embedding backend. */
+struct face_backend {
+  /** An opaque context passed to all functions. */
+  void* ctx;
+
+  /**
+   * Detect faces in a frame.
+   *
+   * The frame is always grayscale by the time it gets here.
+   *
+   * @param ctx The backend context
+   * @param frame The frame
+   * @param boxes The output boxes
+   * @param boxes_cap The capacity of the output boxes array
+   * @param boxes_len The number of boxes written
+   * @return Zero on success, otherwise nonzero
+   */
+  int (* detect)(void* ctx, const struct face_frame* frame, struct face_box* boxes, size_t boxes_cap,
+      size_t* boxes_len);
+
+  /**
+   * Compute the embedding of one face. If NULL, a built-in embedder is used.
+   *
+   * Called concurrently from worker threads when several faces need embedding
+   * in the same frame, so it must be thread-safe.
+   *
+   * @param ctx The backend context
+   * @param input The preprocessed face of FACE_INPUT_SIZE squared elements
+   * @param embedding The output embedding of FACE_EMBEDDING_DIM elements
+   * @return Zero on success, otherwise nonzero
+   */
+  int (* embed)(void* ctx, const float* input, float* embedding);
+
+  /**
+   * Compute the embeddings of several faces in one call. Optional.
+   *
+   * When present, this is preferred over embed(...) so that models which run
+   * faster on batches see all faces of a frame at once.
+   *
+   * @param ctx The backend context
+   * @param inputs The preprocessed faces, one after the other
+   * @param len The number of faces
+   * @param embeddings The output embeddings, one after the other
+   * @return Zero on success, otherwise nonzero
+   */
+  int (* embed_batch)(void* ctx, const float* inputs, size_t len, float* embeddings);
+};
+
+/** Face pipeline configuration. */
+struct face_config {
+  /** Run full detection every this many frames and track in between. */
+  unsigned int detect_interval;
+
+  /** Run detection early if any track falls below this confidence. */
+  float track_min_confidence;
+
+  /** Re-embed a track every this many frames, or zero to embed only once. */
+  unsigned int identity_refresh_interval;
+
+  /** The minimum cosine similarity for a gallery match. */
+  float match_threshold;
+
+  /** How faces are preprocessed before embedding. */
+  enum face_preprocess preprocess;
+
+  /** The most threads to spread one frame's faces over, or zero for all. */
+  int max_workers;
+
+  /** Nonzero to lower the processing resolution while frames are dropped. */
+  int adaptive;
+
+  /** The drop rate above which the resolution is halved. */
+  float adaptive_drop_rate;
+
+  /** The largest factor the resolution may be divided by. A power of two. */
+  int adaptive_max_scale;
+};
+
+/** A known identity. */
+struct face_identity {
+  /** The identity number. */
+  int id;
+
+  /** The reference embedding. */
+  float embedding[FACE_EMBEDDING_DIM];
+};
+
+/** A face observed in a frame. */
+struct face_observation {
+  /** The track number. Stable while the face stays in view. */
+  unsigned long track_id;
+
+  /** The bounding box. */
+  struct face_box box;
+
+  /** The tracking confidence from zero to one. */
+  float confidence;
+
+  /** The identity number or -1 if unknown. */
+  int identity;
+
+  /** The cosine similarity of the identity match. */
+  float similarity;
+};
+
+/** The result of processing a frame. */
+struct face_result {
+  /** The frame number. */
+  unsigned long frame_id;
+
+  /** Nonzero if full detection ran on this frame. */
+  int detected;
+
+  /** The number of faces. */
+  size_t faces_len;
+
+  /** The faces. */
+  struct face_observation faces[FACE_MAX_FACES];
+
+  /** The time spent in each stage in ns. */
+  unsigned long long stage_time[face_stage_count];
+};
+
+/** Face pipeline statistics. */
+struct face_stats {
+  /** The number of frames submitted. */
+  unsigned long frames_submitted;
+
+  /** The number of frames dropped in favor of newer ones. */
+  unsigned long frames_dropped;
+
+  /** The number of frames processed. */
+  unsigned long frames_processed;
+
+  /** The fraction of frames dropped over the last adaptation window. */
+  float drop_rate;
+
+  /** The current factor the processing resolution is divided by. */
+  int scale;
+
+  /** The age of the last processed frame when processing began, in ns. */
+  unsigned long long age_last;
+
+  /** The moving average of the age when processing began, in ns. */
+  unsigned long long age_mean;
+
+  /** The largest age when processing began, in ns. */
+  unsigned long long age_max;
+
+  /** The number of frames pinned. */
+  unsigned long frames_pinned;
+
+  /** The number of pins not yet given back. */
+  unsigned long pins_held;
+};
+
+/** A frame pinned in place. */
+struct face_pin {
+  /** The frame. Its data stays valid until the pin is given back. */
+  struct face_frame frame;
+
+  /** The pinned storage. Opaque. */
+  void* handle;
 };
 
 /** The face service. */
@@ -3,24 +3,753 @@
  * Copyright 2019 The Cozmonaut Contributors
  */
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "../face.h"
 
 #include "../../log.h"
+#include "../../metric.h"
+#include "../../pool.h"
+#include "../../record.h"
 #include "../../service.h"
+#include "../../trace.h"
+
+#include "gallery.h"
+#include "kernel.h"
+#include "mailbox.h"
+#include "track.h"
 
 #define LOG_TAG "face"
 
+/** The columns of the built-in embedder pooling grid. */
+#define EMBED_GRID_COLS 8
+
+/** The rows of the built-in embedder pooling grid. */
+#define EMBED_GRID_ROWS (FACE_EMBEDDING_DIM / EMBED_GRID_COLS)
+
+/** The number of processed frames between adaptation decisions. */
+#define ADAPT_WINDOW 30
+
+/** The number of quiet windows required before restoring resolution. */
+#define ADAPT_RESTORE_WINDOWS 4
+
+/** How long after capture a frame should be processed in nanoseconds, two frames at 30 Hz. */
+#define DEADLINE_NS 66000000ull
+
+/** The pipeline configuration. */
+static struct face_config config;
+
+/** The number of frames processed. */
+static struct metric* metric_frames;
+
+/** The time to process a frame in nanoseconds. */
+static struct metric* metric_frame_ns;
+
+/** The age of a frame when processing began in nanoseconds. */
+static struct metric* metric_age_ns;
+
+/** The time from capture to result in nanoseconds. */
+static struct metric* metric_latency_ns;
+
+/** The detection and embedding backend. */
+static struct face_backend backend;
+
+/** The known identities. */
+static struct face_gallery gallery;
+
+/** The face tracks. */
+static struct face_tracker tracker;
+
+/** The worker threads for per-face work. */
+static struct pool* workers;
+
+/** The number of frames left until detection runs again. */
+static unsigned int frames_until_detect;
+
+/** Scratch space for grayscale conversion. */
+static unsigned char* gray;
+
+/** The size of the grayscale scratch space in bytes. */
+static size_t gray_size;
+
+/** Scratch space for reduced-resolution frames. */
+static unsigned char* scaled;
+
+/** The size of the reduced-resolution scratch space in bytes. */
+static size_t scaled_size;
+
+/** The factor the tracker's coordinates are currently divided by. */
+static int tracker_scale;
+
+/** Serializes the pipeline between the worker and procedures. */
+static pthread_mutex_t pipeline_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The frame mailbox feeding the worker. */
+static struct face_mailbox mailbox;
+
+/** The background pipeline thread. */
+static pthread_t worker;
+
+/** Nonzero to ask the worker to exit. */
+static atomic_int worker_stop;
+
+/** Guards the latest result and the statistics. */
+static pthread_mutex_t result_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The latest background result. */
+static struct face_result latest;
+
+/** The slot holding the frame behind the latest result, or NULL. */
+static struct face_mailbox_slot* latest_slot;
+
+/** Nonzero once unloaded with frames still pinned, so the last unpin frees the mailbox. */
+static int unload_deferred;
+
+/** The pipeline statistics. */
+static struct face_stats stats;
+
+/** The submitted count at the start of the adaptation window. */
+static unsigned long window_submitted;
+
+/** The dropped count at the start of the adaptation window. */
+static unsigned long window_dropped;
+
+/** The number of frames processed in the adaptation window. */
+static unsigned int window_frames;
+
+/** The number of consecutive windows with almost no drops. */
+static unsigned int quiet_windows;
+
+/**
+ * Read the monotonic clock.
+ *
+ * @return The time in nanoseconds
+ */
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Compute an embedding by average pooling a face onto a coarse grid.
+ *
+ * This is a placeholder for a learned model. It is only good enough to tell
+ * apart very different faces under steady lighting.
+ */
+static int embed_builtin(void* ctx, const float* input, float* embedding) {
+  const int cell_w = FACE_INPUT_SIZE / EMBED_GRID_COLS;
+  const int cell_h = FACE_INPUT_SIZE / EMBED_GRID_ROWS;
+
+  memset(embedding, 0, FACE_EMBEDDING_DIM * sizeof *embedding);
+
+  for (int y = 0; y < FACE_INPUT_SIZE; ++y) {
+    float* cells = embedding + y / cell_h * EMBED_GRID_COLS;
+    const float* row = input + y * FACE_INPUT_SIZE;
+
+    for (int x = 0; x < FACE_INPUT_SIZE; ++x) {
+      cells[x / cell_w] += row[x];
+    }
+  }
+
+  return 0;
+}
+
+/** A batch of faces to embed and identify together. */
+struct embed_batch {
+  /** The frame the faces are in. */
+  const struct face_frame* frame;
+
+  /** The tracks of the faces, in track order. */
+  struct face_track* tracks[FACE_MAX_FACES];
+
+  /** The number of faces. */
+  size_t len;
+
+  /** The preprocessed faces. */
+  float inputs[FACE_MAX_FACES][FACE_INPUT_SIZE * FACE_INPUT_SIZE];
+
+  /** The embeddings. */
+  float embeddings[FACE_MAX_FACES][FACE_EMBEDDING_DIM];
+
+  /** Nonzero where embedding failed. */
+  int failed[FACE_MAX_FACES];
+
+  /** The matched identities. */
+  int identities[FACE_MAX_FACES];
+
+  /** The match similarities. */
+  float similarities[FACE_MAX_FACES];
+
+  /** The time spent in each stage per face in ns. */
+  unsigned long long stage_time[FACE_MAX_FACES][face_stage_count];
+};
+
+/** The embedding batch. Too big for the stack. */
+static struct embed_batch batch;
+
+/** Fan-out stage: preprocess one face. */
+static void batch_preprocess(void* ctx, size_t i) {
+  struct embed_batch* b = ctx;
+  unsigned long long t0 = now_ns();
+
+  if (config.preprocess == face_preprocess_equalize) {
+    face_kernel_crop_resize_equalize(b->frame, &b->tracks[i]->box, b->inputs[i], FACE_INPUT_SIZE, FACE_INPUT_SIZE);
+  } else {
+    face_kernel_crop_resize_normalize(b->frame, &b->tracks[i]->box, b->inputs[i], FACE_INPUT_SIZE, FACE_INPUT_SIZE);
+  }
+
+  b->stage_time[i][face_stage_preprocess] = now_ns() - t0;
+}
+
+/** Fan-out stage: match one embedded face against the gallery. */
+static void batch_match(void* ctx, size_t i) {
+  struct embed_batch* b = ctx;
+
+  if (b->failed[i]) {
+    return;
+  }
+
+  unsigned long long t0 = now_ns();
+  face_embedding_normalize(b->embeddings[i]);
+  b->identities[i] = face_gallery_match(&gallery, b->embeddings[i], &b->similarities[i]);
+  b->stage_time[i][face_stage_match] = now_ns() - t0;
+}
+
+/** Fan-out stage: preprocess, embed, and match one face. */
+static void batch_all(void* ctx, size_t i) {
+  struct embed_batch* b = ctx;
+
+  batch_preprocess(b, i);
+
+  unsigned long long t0 = now_ns();
+  b->failed[i] = backend.embed
+      ? backend.embed(backend.ctx, b->inputs[i], b->embeddings[i])
+      : embed_builtin(NULL, b->inputs[i], b->embeddings[i]);
+  b->stage_time[i][face_stage_embed] = now_ns() - t0;
+
+  batch_match(b, i);
+}
+
+/**
+ * Embed and identify tracks that are new or due for a refresh.
+ *
+ * All such faces in the frame go out as one batch. Per-face work fans out
+ * across the worker pool, and results are gathered back in track order.
+ *
+ * @param frame The frame
+ * @param result The result to add stage times to
+ */
+static void identify_tracks(const struct face_frame* frame, struct face_result* result) {
+  batch.frame = frame;
+  batch.len = 0;
+
+  for (size_t i = 0; i < tracker.tracks_len; ++i) {
+    struct face_track* track = &tracker.tracks[i];
+
+    // Identities are cached per track, so known faces are nearly free
+    if (track->embedded) {
+      if (!config.identity_refresh_interval || track->frames_since_embed < config.identity_refresh_interval) {
+        continue;
+      }
+    }
+
+    batch.tracks[batch.len++] = track;
+  }
+
+  if (!batch.len) {
+    return;
+  }
+
+  memset(batch.stage_time, 0, sizeof batch.stage_time);
+
+  if (backend.embed_batch) {
+    // Preprocess in parallel, then hand the model the whole batch at once
+    pool_for(workers, batch.len, config.max_workers, &batch_preprocess, &batch);
+
+    unsigned long long t0 = now_ns();
+    int fail = backend.embed_batch(backend.ctx, batch.inputs[0], batch.len, batch.embeddings[0]);
+    batch.stage_time[0][face_stage_embed] = now_ns() - t0;
+
+    for (size_t i = 0; i < batch.len; ++i) {
+      batch.failed[i] = fail;
+    }
+
+    pool_for(workers, batch.len, config.max_workers, &batch_match, &batch);
+  } else {
+    pool_for(workers, batch.len, config.max_workers, &batch_all, &batch);
+  }
+
+  // Gather in order
+  for (size_t i = 0; i < batch.len; ++i) {
+    struct face_track* track = batch.tracks[i];
+
+    for (int stage = face_stage_preprocess; stage <= face_stage_match; ++stage) {
+      result->stage_time[stage] += batch.stage_time[i][stage];
+    }
+
+    if (batch.failed[i]) {
+      LOGW("Embedding failed for track {}", _ul(track->id));
+      continue;
+    }
+
+    int id = batch.identities[i];
+    float similarity = batch.similarities[i];
+
+    track->identity = id >= 0 && similarity >= config.match_threshold ? id : -1;
+    track->similarity = similarity;
+    track->embedded = 1;
+    track->frames_since_embed = 0;
+
+    LOGD("Track {} identified as {} ({})", _ul(track->id), _i(track->identity), _f(similarity));
+  }
+}
+
+/**
+ * Run the pipeline on one frame.
+ *
+ * @param frame The frame
+ * @param result The result
+ * @return Zero on success, otherwise nonzero
+ */
+static int process_frame(const struct face_frame* frame, struct face_result* result) {
+  TRACE_SCOPE("frame");
+
+  struct face_frame gray_frame;
+
+  memset(result->stage_time, 0, sizeof result->stage_time);
+  unsigned long long t0 = now_ns();
+
+  // Everything downstream works in grayscale
+  if (frame->format == face_pixel_format_rgb24) {
+    size_t size = (size_t) frame->width * frame->height;
+
+    if (size > gray_size) {
+      unsigned char* next = realloc(gray, size);
+      if (!next) {
+        LOGE("Grayscale buffer alloc failed");
+        return 1;
+      }
+
+      gray = next;
+      gray_size = size;
+    }
+
+    face_kernel_rgb_to_gray(frame->data, frame->stride, gray, frame->width, frame->width, frame->height);
+
+    gray_frame = *frame;
+    gray_frame.stride = frame->width;
+    gray_frame.format = face_pixel_format_gray8;
+    gray_frame.data = gray;
+    frame = &gray_frame;
+  }
+
+  unsigned long long t1 = now_ns();
+  result->stage_time[face_stage_convert] = t1 - t0;
+
+  // Detect on schedule, or early when tracking gets shaky
+  int detect = backend.detect
+      && (!frames_until_detect || face_tracker_min_confidence(&tracker) < config.track_min_confidence);
+
+  if (detect) {
+    struct face_box boxes[FACE_MAX_FACES];
+    size_t boxes_len = 0;
+
+    if (backend.detect(backend.ctx, frame, boxes, FACE_MAX_FACES, &boxes_len)) {
+      LOGE("Detection failed on frame {}", _ul(frame->id));
+      return 1;
+    }
+
+    face_tracker_associate(&tracker, frame, boxes, boxes_len);
+    frames_until_detect = config.detect_interval - 1;
+
+    result->stage_time[face_stage_detect] = now_ns() - t1;
+  } else {
+    face_tracker_propagate(&tracker, frame);
+    if (frames_until_detect) {
+      --frames_until_detect;
+    }
+
+    result->stage_time[face_stage_track] = now_ns() - t1;
+  }
+
+  identify_tracks(frame, result);
+
+  // Report all tracks
+  result->frame_id = frame->id;
+  result->detected = detect;
+  result->faces_len = tracker.tracks_len;
+
+  for (size_t i = 0; i < tracker.tracks_len; ++i) {
+    const struct face_track* track = &tracker.tracks[i];
+    struct face_observation* face = &result->faces[i];
+
+    face->track_id = track->id;
+    face->box = track->box;
+    face->confidence = track->confidence;
+    face->identity = track->identity;
+    face->similarity = track->similarity;
+  }
+
+  metric_add(metric_frames, 1);
+  metric_record(metric_frame_ns, now_ns() - t0);
+  return 0;
+}
+
+/**
+ * Grow a scratch buffer to at least the given size.
+ *
+ * @param buf The buffer
+ * @param buf_size The buffer size
+ * @param size The required size
+ * @return Zero on success, otherwise nonzero
+ */
+static int reserve(unsigned char** buf, size_t* buf_size, size_t size) {
+  if (size > *buf_size) {
+    unsigned char* next = realloc(*buf, size);
+    if (!next) {
+      return 1;
+    }
+
+    *buf = next;
+    *buf_size = size;
+  }
+
+  return 0;
+}
+
+/**
+ * Run the pipeline on one grayscale frame at reduced resolution.
+ *
+ * Result boxes are mapped back to full-resolution coordinates.
+ *
+ * @param frame The frame
+ * @param scale The factor to divide the resolution by, a power of two
+ * @param result The result
+ * @return Zero on success, otherwise nonzero
+ */
+static int process_scaled(const struct face_frame* frame, int scale, struct face_result* result) {
+  // Keep track coordinates in step with the processing resolution
+  if (scale != tracker_scale) {
+    face_tracker_rescale(&tracker, tracker_scale, scale);
+    tracker_scale = scale;
+  }
+
+  if (scale == 1) {
+    return process_frame(frame, result);
+  }
+
+  if (reserve(&scaled, &scaled_size, (size_t) (frame->width / 2) * (frame->height / 2))) {
+    LOGE("Reduced-resolution buffer alloc failed");
+    return 1;
+  }
+
+  struct face_frame small = *frame;
+  small.data = scaled;
+
+  // Halve once out of the slot, then in place as many times as needed
+  unsigned long long t0 = now_ns();
+  const unsigned char* src = frame->data;
+  int src_stride = frame->stride;
+
+  for (int s = scale; s > 1; s /= 2) {
+    face_kernel_downscale2(src, src_stride, scaled, small.width / 2, small.width, small.height);
+
+    small.width /= 2;
+    small.height /= 2;
+    small.stride = small.width;
+
+    src = scaled;
+    src_stride = small.stride;
+  }
+
+  unsigned long long downscale_time = now_ns() - t0;
+
+  if (process_frame(&small, result)) {
+    return 1;
+  }
+
+  result->stage_time[face_stage_convert] += downscale_time;
+
+  for (size_t i = 0; i < result->faces_len; ++i) {
+    struct face_box* box = &result->faces[i].box;
+    box->x *= scale;
+    box->y *= scale;
+    box->width *= scale;
+    box->height *= scale;
+  }
+
+  return 0;
+}
+
+/**
+ * Update statistics after a frame and adapt the processing resolution.
+ *
+ * Must be called with the result lock held.
+ *
+ * @param age The age of the frame when processing began in ns
+ */
+static void update_stats(unsigned long long age) {
+  ++stats.frames_processed;
+  metric_record(metric_age_ns, age);
+
+  stats.age_last = age;
+  stats.age_mean = stats.frames_processed == 1 ? age : stats.age_mean + ((long long) (age - stats.age_mean)) / 16;
+  stats.age_max = age > stats.age_max ? age : stats.age_max;
+
+  if (++window_frames < ADAPT_WINDOW) {
+    return;
+  }
+
+  unsigned long submitted = atomic_load_explicit(&mailbox.posted, memory_order_relaxed);
+  unsigned long dropped = atomic_load_explicit(&mailbox.dropped, memory_order_relaxed);
+
+  stats.drop_rate = submitted > window_submitted
+      ? (float) (dropped - window_dropped) / (submitted - window_submitted)
+      : 0;
+
+  // Halve the resolution under pressure, and restore it once clear for a while
+  quiet_windows = stats.drop_rate < config.adaptive_drop_rate / 4 ? quiet_windows + 1 : 0;
+
+  if (config.adaptive) {
+    if (stats.drop_rate > config.adaptive_drop_rate && stats.scale < config.adaptive_max_scale) {
+      stats.scale *= 2;
+      LOGI("Dropping {} of frames, reducing resolution to 1/{}", _f(stats.drop_rate), _i(stats.scale));
+    } else if (quiet_windows >= ADAPT_RESTORE_WINDOWS && stats.scale > 1) {
+      stats.scale /= 2;
+      quiet_windows = 0;
+      LOGI("Dropping {} of frames, restoring resolution to 1/{}", _f(stats.drop_rate), _i(stats.scale));
+    }
+  } else {
+    stats.scale = 1;
+  }
+
+  window_submitted = submitted;
+  window_dropped = dropped;
+  window_frames = 0;
+}
+
+static void* worker_main(void* arg) {
+  service_sched_thread(SERVICE_FACE);
+
+  while (!atomic_load(&worker_stop)) {
+    // Submits and the stop both post, so an idle worker sleeps until one comes
+    face_mailbox_wait(&mailbox);
+
+    struct face_mailbox_slot* slot = face_mailbox_take(&mailbox);
+    if (!slot) {
+      continue;
+    }
+
+    unsigned long long now = now_ns();
+    unsigned long long captured = slot->frame.timestamp;
+    unsigned long long age = now > captured ? now - captured : 0;
+
+    pthread_mutex_lock(&result_lock);
+    int scale = stats.scale;
+    pthread_mutex_unlock(&result_lock);
+
+    struct face_result result;
+
+    pthread_mutex_lock(&pipeline_lock);
+    int fail = process_scaled(&slot->frame, scale, &result);
+    pthread_mutex_unlock(&pipeline_lock);
+
+    pthread_mutex_lock(&result_lock);
+    if (!fail) {
+      latest = result;
+
+      // Keep the frame around for anyone who wants to look at it in place
+      struct face_mailbox_slot* prev = latest_slot;
+      latest_slot = slot;
+      slot = prev;
+    }
+    if (slot) {
+      face_mailbox_release(slot);
+    }
+    update_stats(age);
+    pthread_mutex_unlock(&result_lock);
+
+    // Frames without a capture time have no deadline to meet
+    if (captured) {
+      unsigned long long done = now_ns();
+      metric_record(metric_latency_ns, done - captured);
+      service_sched_done(SERVICE_FACE, captured, done);
+    }
+  }
+
+  return NULL;
+}
+
 static int proc_hello(struct service* svc, const void* arg1, void* arg2) {
   LOGI("Hello, world!");
   return 0;
 }
 
+static int proc_configure(struct service* svc, const void* arg1, void* arg2) {
+  const struct face_config* next = arg1;
+
+  if (!next->detect_interval) {
+    LOGE("Detection interval must be at least one frame");
+    return 1;
+  }
+
+  if (next->adaptive && (next->adaptive_max_scale < 1 || next->adaptive_max_scale & (next->adaptive_max_scale - 1))) {
+    LOGE("Adaptive maximum scale must be a power of two");
+    return 1;
+  }
+
+  pthread_mutex_lock(&pipeline_lock);
+  config = *next;
+
+  // Pull the next detection in if the new interval is shorter
+  if (frames_until_detect >= config.detect_interval) {
+    frames_until_detect = config.detect_interval - 1;
+  }
+
+  pthread_mutex_unlock(&pipeline_lock);
+  return 0;
+}
+
+static int proc_set_backend(struct service* svc, const void* arg1, void* arg2) {
+  pthread_mutex_lock(&pipeline_lock);
+  backend = *(const struct face_backend*) arg1;
+
+  // Forget tracks made by the previous backend
+  face_tracker_init(&tracker);
+  frames_until_detect = 0;
+
+  pthread_mutex_unlock(&pipeline_lock);
+  return 0;
+}
+
+static int proc_enroll(struct service* svc, const void* arg1, void* arg2) {
+  const struct face_identity* identity = arg1;
+
+  pthread_mutex_lock(&pipeline_lock);
+
+  if (face_gallery_add(&gallery, identity->id, identity->embedding)) {
+    pthread_mutex_unlock(&pipeline_lock);
+    LOGE("Failed to enroll identity {}", _i(identity->id));
+    return 1;
+  }
+
+  // Give already-tracked faces a chance to match the newcomer
+  for (size_t i = 0; i < tracker.tracks_len; ++i) {
+    if (tracker.tracks[i].identity < 0) {
+      tracker.tracks[i].embedded = 0;
+    }
+  }
+
+  pthread_mutex_unlock(&pipeline_lock);
+  return 0;
+}
+
+static int proc_process(struct service* svc, const void* arg1, void* arg2) {
+  pthread_mutex_lock(&pipeline_lock);
+
+  // Synchronous callers always get full resolution
+  if (tracker_scale != 1) {
+    face_tracker_rescale(&tracker, tracker_scale, 1);
+    tracker_scale = 1;
+  }
+
+  int fail = process_frame(arg1, arg2);
+  pthread_mutex_unlock(&pipeline_lock);
+
+  return fail;
+}
+
+static int proc_submit(struct service* svc, const void* arg1, void* arg2) {
+  record_frame(arg1);
+  return face_mailbox_post(&mailbox, arg1);
+}
+
+static int proc_get_result(struct service* svc, const void* arg1, void* arg2) {
+  pthread_mutex_lock(&result_lock);
+  *(struct face_result*) arg2 = latest;
+  pthread_mutex_unlock(&result_lock);
+  return 0;
+}
+
+static int proc_get_stats(struct service* svc, const void* arg1, void* arg2) {
+  struct face_stats* out = arg2;
+
+  pthread_mutex_lock(&result_lock);
+  *out = stats;
+  pthread_mutex_unlock(&result_lock);
+
+  out->frames_submitted = atomic_load_explicit(&mailbox.posted, memory_order_relaxed);
+  out->frames_dropped = atomic_load_explicit(&mailbox.dropped, memory_order_relaxed);
+  return 0;
+}
+
+static int proc_pin_frame(struct service* svc, const void* arg1, void* arg2) {
+  struct face_pin* out = arg2;
+
+  pthread_mutex_lock(&result_lock);
+
+  if (!latest_slot) {
+    pthread_mutex_unlock(&result_lock);
+    return 1;
+  }
+
+  face_mailbox_retain(latest_slot);
+  out->frame = latest_slot->frame;
+  out->handle = latest_slot;
+
+  ++stats.frames_pinned;
+  ++stats.pins_held;
+
+  pthread_mutex_unlock(&result_lock);
+  return 0;
+}
+
+static int proc_unpin_frame(struct service* svc, const void* arg1, void* arg2) {
+  const struct face_pin* pin = arg1;
+
+  face_mailbox_release(pin->handle);
+
+  pthread_mutex_lock(&result_lock);
+  --stats.pins_held;
+
+  if (unload_deferred && !stats.pins_held) {
+    face_mailbox_free(&mailbox);
+    unload_deferred = 0;
+  }
+
+  pthread_mutex_unlock(&result_lock);
+
+  return 0;
+}
+
 static service_proc get_proc(const struct service* svc, int proc) {
   switch (proc) {
     case service_face_proc_hello:
       return &proc_hello;
+    case service_face_proc_configure:
+      return &proc_configure;
+    case service_face_proc_set_backend:
+      return &proc_set_backend;
+    case service_face_proc_enroll:
+      return &proc_enroll;
+    case service_face_proc_process:
+      return &proc_process;
+    case service_face_proc_submit:
+      return &proc_submit;
+    case service_face_proc_get_result:
+      return &proc_get_result;
+    case service_face_proc_get_stats:
+      return &proc_get_stats;
+    case service_face_proc_pin_frame:
+      return &proc_pin_frame;
+    case service_face_proc_unpin_frame:
+      return &proc_unpin_frame;
     default:
       return NULL;
   }
@@ -28,21 +757,110 @@ static service_proc get_proc(const struct service* svc, int proc) {
 
 static int on_load(struct service* svc) {
   LOGI("Face service load");
+
+  if (unload_deferred) {
+    LOGE("Frames pinned before the last unload are still held");
+    return 1;
+  }
+
+  config = (struct face_config) {
+    .detect_interval = 10,
+    .track_min_confidence = 0.6f,
+    .identity_refresh_interval = 150,
+    .match_threshold = 0.5f,
+    .preprocess = face_preprocess_normalize,
+    .max_workers = 0,
+    .adaptive = 0,
+    .adaptive_drop_rate = 0.25f,
+    .adaptive_max_scale = 4,
+  };
+
+  memset(&latest, 0, sizeof latest);
+  latest_slot = NULL;
+  memset(&stats, 0, sizeof stats);
+  stats.scale = 1;
+
+  metric_frames = metric_get("face.frames", metric_kind_counter);
+  metric_frame_ns = metric_get("face.frame_ns", metric_kind_histogram);
+  metric_age_ns = metric_get("face.age_ns", metric_kind_histogram);
+  metric_latency_ns = metric_get("face.latency_ns", metric_kind_histogram);
+  tracker_scale = 1;
+  window_submitted = 0;
+  window_dropped = 0;
+  window_frames = 0;
+  quiet_windows = 0;
+
+  if (face_mailbox_init(&mailbox)) {
+    LOGE("Failed to create frame mailbox");
+    return 1;
+  }
+
+  workers = pool_create(0);
+  if (!workers) {
+    LOGE("Failed to create face workers");
+    face_mailbox_free(&mailbox);
+    return 1;
+  }
+
+  memset(&backend, 0, sizeof backend);
+  face_gallery_init(&gallery);
+  face_tracker_init(&tracker);
+  frames_until_detect = 0;
+
   return 0;
 }
 
 static int on_unload(struct service* svc) {
   LOGI("Face service unload");
+  face_gallery_free(&gallery);
+
+  pool_destroy(workers);
+  workers = NULL;
+
+  pthread_mutex_lock(&result_lock);
+
+  latest_slot = NULL;
+
+  // Pinned frames must stay readable, so the last unpin frees them instead
+  if (stats.pins_held) {
+    LOGW("Keeping {} pinned frames until they are given back", _ul(stats.pins_held));
+    unload_deferred = 1;
+  } else {
+    face_mailbox_free(&mailbox);
+  }
+
+  pthread_mutex_unlock(&result_lock);
+
+  free(gray);
+  gray = NULL;
+  gray_size = 0;
+
+  free(scaled);
+  scaled = NULL;
+  scaled_size = 0;
+
   return 0;
 }
 
 static int on_start(struct service* svc) {
   LOGI("Face service start");
+
+  atomic_store(&worker_stop, 0);
+  if (pthread_create(&worker, NULL, &worker_main, NULL)) {
+    LOGE("Failed to start face worker");
+    return 1;
+  }
+
   return 0;
 }
 
 static int on_stop(struct service* svc) {
   LOGI("Face service stop");
+
+  atomic_store(&worker_stop, 1);
+  face_mailbox_wake(&mailbox);
+  pthread_join(worker, NULL);
+
   return 0;
 }
 
@@ -56,4 +874,6 @@ struct service* const SERVICE_FACE = &(struct service) {
     .on_start = &on_start,
     .on_stop = &on_stop,
   },
+  .sched_class = service_class_realtime,
+  .deadline = DEADLINE_NS,
 };
@@ -0,0 +1,122 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "gallery.h"
+
+void face_gallery_init(struct face_gallery* gallery) {
+  gallery->ids = NULL;
+  gallery->embeddings = NULL;
+  gallery->len = 0;
+  gallery->cap = 0;
+}
+
+void face_gallery_free(struct face_gallery* gallery) {
+  free(gallery->ids);
+  free(gallery->embeddings);
+  face_gallery_init(gallery);
+}
+
+int face_gallery_add(struct face_gallery* gallery, int id, const float* embedding) {
+  // Grow geometrically
+  if (gallery->len == gallery->cap) {
+    size_t cap = gallery->cap ? gallery->cap * 2 : 16;
+
+    int* ids = realloc(gallery->ids, cap * sizeof *ids);
+    if (!ids) {
+      return 1;
+    }
+    gallery->ids = ids;
+
+    float* embeddings = realloc(gallery->embeddings, cap * FACE_EMBEDDING_DIM * sizeof *embeddings);
+    if (!embeddings) {
+      return 1;
+    }
+    gallery->embeddings = embeddings;
+
+    gallery->cap = cap;
+  }
+
+  float* dst = gallery->embeddings + gallery->len * FACE_EMBEDDING_DIM;
+  memcpy(dst, embedding, FACE_EMBEDDING_DIM * sizeof *dst);
+  face_embedding_normalize(dst);
+
+  gallery->ids[gallery->len++] = id;
+  return 0;
+}
+
+/**
+ * Compute the dot product of two embeddings.
+ *
+ * @param a The first embedding
+ * @param b The second embedding
+ * @return The dot product
+ */
+static float dot(const float* a, const float* b) {
+#ifdef __SSE__
+  // Four independent accumulators hide the add latency
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  __m128 acc2 = _mm_setzero_ps();
+  __m128 acc3 = _mm_setzero_ps();
+
+  for (int k = 0; k < FACE_EMBEDDING_DIM; k += 16) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(b + k)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + k + 4), _mm_loadu_ps(b + k + 4)));
+    acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_loadu_ps(a + k + 8), _mm_loadu_ps(b + k + 8)));
+    acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_loadu_ps(a + k + 12), _mm_loadu_ps(b + k + 12)));
+  }
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, _mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3)));
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#else
+  float sum = 0;
+  for (int k = 0; k < FACE_EMBEDDING_DIM; ++k) {
+    sum += a[k] * b[k];
+  }
+  return sum;
+#endif
+}
+
+int face_gallery_match(const struct face_gallery* gallery, const float* embedding, float* similarity) {
+  int best_id = -1;
+  float best = -2;
+
+  for (size_t i = 0; i < gallery->len; ++i) {
+    // Both sides are unit length, so the dot product is the cosine
+    float score = dot(gallery->embeddings + i * FACE_EMBEDDING_DIM, embedding);
+
+    if (score > best) {
+      best = score;
+      best_id = gallery->ids[i];
+    }
+  }
+
+  *similarity = best_id >= 0 ? best : 0;
+  return best_id;
+}
+
+void face_embedding_normalize(float* embedding) {
+  float sum = 0;
+  for (int k = 0; k < FACE_EMBEDDING_DIM; ++k) {
+    sum += embedding[k] * embedding[k];
+  }
+
+  if (sum > 0) {
+    float scale = 1 / sqrtf(sum);
+    for (int k = 0; k < FACE_EMBEDDING_DIM; ++k) {
+      embedding[k] *= scale;
+    }
+  }
+}
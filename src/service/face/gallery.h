@@ -0,0 +1,73 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_FACE_GALLERY_H
+#define SERVICE_FACE_GALLERY_H
+
+#include <stddef.h>
+
+#include "../face.h"
+
+#if FACE_EMBEDDING_DIM % 16
+#error "FACE_EMBEDDING_DIM must be a multiple of 16"
+#endif
+
+/** A gallery of known face embeddings. */
+struct face_gallery {
+  /** The identity numbers. */
+  int* ids;
+
+  /** The unit-length embeddings, one after the other. */
+  float* embeddings;
+
+  /** The number of entries. */
+  size_t len;
+
+  /** The allocated capacity in entries. */
+  size_t cap;
+};
+
+/**
+ * Initialize an empty gallery.
+ *
+ * @param gallery The gallery
+ */
+void face_gallery_init(struct face_gallery* gallery);
+
+/**
+ * Free all memory held by a gallery.
+ *
+ * @param gallery The gallery
+ */
+void face_gallery_free(struct face_gallery* gallery);
+
+/**
+ * Add an entry to a gallery. The embedding is normalized on the way in.
+ *
+ * @param gallery The gallery
+ * @param id The identity number
+ * @param embedding The embedding
+ * @return Zero on success, otherwise nonzero
+ */
+int face_gallery_add(struct face_gallery* gallery, int id, const float* embedding);
+
+/**
+ * Find the entry most similar to an embedding.
+ *
+ * @param gallery The gallery
+ * @param embedding The unit-length query embedding
+ * @param similarity The output cosine similarity of the best entry
+ * @return The identity number of the best entry or -1 if empty
+ */
+int face_gallery_match(const struct face_gallery* gallery, const float* embedding, float* similarity);
+
+/**
+ * Scale an embedding to unit length.
+ *
+ * @param embedding The embedding
+ */
+void face_embedding_normalize(float* embedding);
+
+#endif // #ifndef SERVICE_FACE_GALLERY_H
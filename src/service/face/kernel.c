@@ -0,0 +1,334 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "kernel.h"
+
+/** The fixed-point red weight. */
+#define GRAY_WEIGHT_R 77
+
+/** The fixed-point green weight. */
+#define GRAY_WEIGHT_G 150
+
+/** The fixed-point blue weight. */
+#define GRAY_WEIGHT_B 29
+
+/**
+ * Convert one row of RGB to grayscale.
+ *
+ * @param src The source row
+ * @param dst The destination row
+ * @param width The width in pixels
+ */
+static void rgb_to_gray_row(const unsigned char* src, unsigned char* dst, int width) {
+  int x = 0;
+
+#ifdef __SSSE3__
+  // Shuffle masks to gather each channel of sixteen pixels from three loads
+  const __m128i r0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+  const __m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+  const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+  const __m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+  const __m128i b0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+  const __m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+
+  const __m128i wr = _mm_set1_epi16(GRAY_WEIGHT_R);
+  const __m128i wg = _mm_set1_epi16(GRAY_WEIGHT_G);
+  const __m128i wb = _mm_set1_epi16(GRAY_WEIGHT_B);
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; x + 16 <= width; x += 16) {
+    const unsigned char* p = src + 3 * x;
+
+    __m128i a = _mm_loadu_si128((const __m128i*) p);
+    __m128i b = _mm_loadu_si128((const __m128i*) (p + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*) (p + 32));
+
+    __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, r0), _mm_shuffle_epi8(b, r1)), _mm_shuffle_epi8(c, r2));
+    __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, g0), _mm_shuffle_epi8(b, g1)), _mm_shuffle_epi8(c, g2));
+    __m128i bl = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, b0), _mm_shuffle_epi8(b, b1)), _mm_shuffle_epi8(c, b2));
+
+    // Weighted sum in 16-bit lanes (the weights sum to 256, so no overflow)
+    __m128i lo = _mm_add_epi16(_mm_add_epi16(
+        _mm_mullo_epi16(_mm_unpacklo_epi8(r, zero), wr),
+        _mm_mullo_epi16(_mm_unpacklo_epi8(g, zero), wg)),
+        _mm_mullo_epi16(_mm_unpacklo_epi8(bl, zero), wb));
+    __m128i hi = _mm_add_epi16(_mm_add_epi16(
+        _mm_mullo_epi16(_mm_unpackhi_epi8(r, zero), wr),
+        _mm_mullo_epi16(_mm_unpackhi_epi8(g, zero), wg)),
+        _mm_mullo_epi16(_mm_unpackhi_epi8(bl, zero), wb));
+
+    __m128i y = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+    _mm_storeu_si128((__m128i*) (dst + x), y);
+  }
+#endif
+
+  for (; x < width; ++x) {
+    const unsigned char* p = src + 3 * x;
+    dst[x] = (unsigned char) ((GRAY_WEIGHT_R * p[0] + GRAY_WEIGHT_G * p[1] + GRAY_WEIGHT_B * p[2]) >> 8);
+  }
+}
+
+void face_kernel_rgb_to_gray(const unsigned char* src, int src_stride, unsigned char* dst, int dst_stride,
+    int width, int height) {
+  for (int y = 0; y < height; ++y) {
+    rgb_to_gray_row(src + (size_t) y * src_stride, dst + (size_t) y * dst_stride, width);
+  }
+}
+
+void face_kernel_downscale2(const unsigned char* src, int src_stride, unsigned char* dst, int dst_stride,
+    int width, int height) {
+  int out_w = width / 2;
+  int out_h = height / 2;
+
+  for (int y = 0; y < out_h; ++y) {
+    const unsigned char* r0 = src + (size_t) (2 * y) * src_stride;
+    const unsigned char* r1 = r0 + src_stride;
+    unsigned char* out = dst + (size_t) y * dst_stride;
+
+    int x = 0;
+
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi16(0xff);
+
+    for (; x + 16 <= out_w; x += 16) {
+      // Average vertically, then average even and odd columns
+      __m128i lo = _mm_avg_epu8(_mm_loadu_si128((const __m128i*) (r0 + 2 * x)),
+          _mm_loadu_si128((const __m128i*) (r1 + 2 * x)));
+      __m128i hi = _mm_avg_epu8(_mm_loadu_si128((const __m128i*) (r0 + 2 * x + 16)),
+          _mm_loadu_si128((const __m128i*) (r1 + 2 * x + 16)));
+
+      __m128i even = _mm_packus_epi16(_mm_and_si128(lo, mask), _mm_and_si128(hi, mask));
+      __m128i odd = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+
+      _mm_storeu_si128((__m128i*) (out + x), _mm_avg_epu8(even, odd));
+    }
+#endif
+
+    for (; x < out_w; ++x) {
+      int a = (r0[2 * x] + r1[2 * x] + 1) >> 1;
+      int b = (r0[2 * x + 1] + r1[2 * x + 1] + 1) >> 1;
+      out[x] = (unsigned char) ((a + b + 1) >> 1);
+    }
+  }
+}
+
+/**
+ * Blend two source rows into a float scratch row.
+ *
+ * @param r0 The upper source row
+ * @param r1 The lower source row
+ * @param fy The weight of the lower row
+ * @param out The scratch row
+ * @param len The number of pixels
+ */
+static void blend_rows(const unsigned char* r0, const unsigned char* r1, float fy, float* out, int len) {
+  int i = 0;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 w = _mm_set1_ps(fy);
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (r0 + i));
+    __m128i b = _mm_loadu_si128((const __m128i*) (r1 + i));
+
+    __m128i a_lo = _mm_unpacklo_epi8(a, zero);
+    __m128i a_hi = _mm_unpackhi_epi8(a, zero);
+    __m128i b_lo = _mm_unpacklo_epi8(b, zero);
+    __m128i b_hi = _mm_unpackhi_epi8(b, zero);
+
+    __m128 fa[4] = {
+      _mm_cvtepi32_ps(_mm_unpacklo_epi16(a_lo, zero)),
+      _mm_cvtepi32_ps(_mm_unpackhi_epi16(a_lo, zero)),
+      _mm_cvtepi32_ps(_mm_unpacklo_epi16(a_hi, zero)),
+      _mm_cvtepi32_ps(_mm_unpackhi_epi16(a_hi, zero)),
+    };
+    __m128 fb[4] = {
+      _mm_cvtepi32_ps(_mm_unpacklo_epi16(b_lo, zero)),
+      _mm_cvtepi32_ps(_mm_unpackhi_epi16(b_lo, zero)),
+      _mm_cvtepi32_ps(_mm_unpacklo_epi16(b_hi, zero)),
+      _mm_cvtepi32_ps(_mm_unpackhi_epi16(b_hi, zero)),
+    };
+
+    for (int k = 0; k < 4; ++k) {
+      _mm_storeu_ps(out + i + 4 * k, _mm_add_ps(fa[k], _mm_mul_ps(w, _mm_sub_ps(fb[k], fa[k]))));
+    }
+  }
+#endif
+
+  for (; i < len; ++i) {
+    out[i] = r0[i] + fy * (r1[i] - r0[i]);
+  }
+}
+
+/**
+ * Bilinearly resample a box into a float destination.
+ *
+ * @param frame The grayscale frame
+ * @param box The box
+ * @param dst The destination
+ * @param dst_width The destination width
+ * @param dst_height The destination height
+ * @param sum The output sum of destination values
+ * @param sum_sq The output sum of squared destination values
+ * @param hist An optional output histogram of rounded destination values
+ */
+static void crop_resize(const struct face_frame* frame, const struct face_box* box, float* dst,
+    int dst_width, int dst_height, double* sum, double* sum_sq, unsigned int* hist) {
+  int col0[dst_width];
+  int col1[dst_width];
+  float colw[dst_width];
+
+  // Precompute horizontal taps once for all rows
+  int span_lo = frame->width;
+  int span_hi = 0;
+  for (int x = 0; x < dst_width; ++x) {
+    float sx = box->x + (x + 0.5f) * box->width / dst_width - 0.5f;
+    int x0 = (int) floorf(sx);
+    colw[x] = sx - x0;
+
+    int x1 = x0 + 1;
+    x0 = x0 < 0 ? 0 : x0 >= frame->width ? frame->width - 1 : x0;
+    x1 = x1 < 0 ? 0 : x1 >= frame->width ? frame->width - 1 : x1;
+
+    col0[x] = x0;
+    col1[x] = x1;
+    span_lo = x0 < span_lo ? x0 : span_lo;
+    span_hi = x1 > span_hi ? x1 : span_hi;
+  }
+
+  // Make taps relative to the scratch row
+  int span = span_hi - span_lo + 1;
+  for (int x = 0; x < dst_width; ++x) {
+    col0[x] -= span_lo;
+    col1[x] -= span_lo;
+  }
+
+  float scratch[span];
+
+  double s = 0;
+  double ss = 0;
+
+  for (int y = 0; y < dst_height; ++y) {
+    float sy = box->y + (y + 0.5f) * box->height / dst_height - 0.5f;
+    int y0 = (int) floorf(sy);
+    float fy = sy - y0;
+
+    int y1 = y0 + 1;
+    y0 = y0 < 0 ? 0 : y0 >= frame->height ? frame->height - 1 : y0;
+    y1 = y1 < 0 ? 0 : y1 >= frame->height ? frame->height - 1 : y1;
+
+    const unsigned char* r0 = frame->data + (size_t) y0 * frame->stride + span_lo;
+    const unsigned char* r1 = frame->data + (size_t) y1 * frame->stride + span_lo;
+    blend_rows(r0, r1, fy, scratch, span);
+
+    float* out = dst + (size_t) y * dst_width;
+    float row_s = 0;
+    float row_ss = 0;
+
+    for (int x = 0; x < dst_width; ++x) {
+      float a = scratch[col0[x]];
+      float v = a + colw[x] * (scratch[col1[x]] - a);
+      out[x] = v;
+
+      row_s += v;
+      row_ss += v * v;
+
+      if (hist) {
+        ++hist[(int) (v + 0.5f)];
+      }
+    }
+
+    s += row_s;
+    ss += row_ss;
+  }
+
+  *sum = s;
+  *sum_sq = ss;
+}
+
+/**
+ * Apply an affine map to every element.
+ *
+ * @param data The elements
+ * @param len The number of elements
+ * @param offset The value subtracted first
+ * @param scale The factor applied second
+ */
+static void affine(float* data, int len, float offset, float scale) {
+  int i = 0;
+
+#ifdef __SSE2__
+  const __m128 o = _mm_set1_ps(offset);
+  const __m128 k = _mm_set1_ps(scale);
+
+  for (; i + 4 <= len; i += 4) {
+    _mm_storeu_ps(data + i, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(data + i), o), k));
+  }
+#endif
+
+  for (; i < len; ++i) {
+    data[i] = (data[i] - offset) * scale;
+  }
+}
+
+void face_kernel_crop_resize_normalize(const struct face_frame* frame, const struct face_box* box, float* dst,
+    int dst_width, int dst_height) {
+  double sum;
+  double sum_sq;
+  crop_resize(frame, box, dst, dst_width, dst_height, &sum, &sum_sq, NULL);
+
+  int len = dst_width * dst_height;
+  double mean = sum / len;
+  double var = sum_sq / len - mean * mean;
+
+  // Leave flat crops flat rather than amplifying rounding noise
+  float scale = var > 1e-3 ? (float) (1 / sqrt(var)) : 0;
+  affine(dst, len, (float) mean, scale);
+}
+
+void face_kernel_crop_resize_equalize(const struct face_frame* frame, const struct face_box* box, float* dst,
+    int dst_width, int dst_height) {
+  unsigned int hist[256];
+  memset(hist, 0, sizeof hist);
+
+  double sum;
+  double sum_sq;
+  crop_resize(frame, box, dst, dst_width, dst_height, &sum, &sum_sq, hist);
+
+  // Map each level through the cumulative distribution
+  int len = dst_width * dst_height;
+  float lut[256];
+
+  unsigned int cdf = 0;
+  unsigned int cdf_min = 0;
+  for (int v = 0; v < 256; ++v) {
+    if (!cdf_min && hist[v]) {
+      cdf_min = hist[v];
+    }
+
+    cdf += hist[v];
+    lut[v] = len > (int) cdf_min ? 2.0f * (cdf - cdf_min) / (len - cdf_min) - 1 : 0;
+  }
+
+  for (int i = 0; i < len; ++i) {
+    dst[i] = lut[(int) (dst[i] + 0.5f)];
+  }
+}
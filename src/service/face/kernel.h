@@ -0,0 +1,84 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_FACE_KERNEL_H
+#define SERVICE_FACE_KERNEL_H
+
+#include "../face.h"
+
+//
+// Image Preprocessing Kernels
+//
+// These run per frame and per face, so each one is written to touch its input
+// exactly once. Where SSE is available they process up to sixteen pixels at a
+// time; otherwise they fall back to plain C with equivalent results.
+//
+
+/**
+ * Convert packed 24-bit RGB to 8-bit grayscale.
+ *
+ * Uses the fixed-point BT.601 luma weights. Rows are streamed front to back,
+ * so the working set is two rows regardless of the frame size.
+ *
+ * @param src The source pixels
+ * @param src_stride The source row stride in bytes
+ * @param dst The destination pixels
+ * @param dst_stride The destination row stride in bytes
+ * @param width The width in pixels
+ * @param height The height in pixels
+ */
+void face_kernel_rgb_to_gray(const unsigned char* src, int src_stride, unsigned char* dst, int dst_stride,
+    int width, int height);
+
+/**
+ * Halve a grayscale image in both dimensions by averaging 2x2 blocks.
+ *
+ * An odd last row or column is dropped.
+ *
+ * @param src The source pixels
+ * @param src_stride The source row stride in bytes
+ * @param dst The destination pixels
+ * @param dst_stride The destination row stride in bytes
+ * @param width The source width in pixels
+ * @param height The source height in pixels
+ */
+void face_kernel_downscale2(const unsigned char* src, int src_stride, unsigned char* dst, int dst_stride,
+    int width, int height);
+
+/**
+ * Crop, resize, and normalize a face to zero mean and unit variance.
+ *
+ * The box is resampled one destination row at a time: the two source rows it
+ * straddles are blended vertically into a scratch row, which is then sampled
+ * horizontally. The working set is therefore two source rows, one scratch row,
+ * and the destination, which stays within L2 for any sane model input. Pixel
+ * statistics are gathered during the same sweep so only the destination is
+ * visited a second time. Parts of the box outside the frame are edge-clamped.
+ *
+ * @param frame The grayscale frame
+ * @param box The face box
+ * @param dst The destination of dst_width * dst_height floats
+ * @param dst_width The destination width
+ * @param dst_height The destination height
+ */
+void face_kernel_crop_resize_normalize(const struct face_frame* frame, const struct face_box* box, float* dst,
+    int dst_width, int dst_height);
+
+/**
+ * Crop, resize, and histogram-equalize a face into the range [-1, 1].
+ *
+ * Like face_kernel_crop_resize_normalize(...), but builds a histogram during
+ * the resampling sweep and maps through its cumulative distribution instead.
+ *
+ * @param frame The grayscale frame
+ * @param box The face box
+ * @param dst The destination of dst_width * dst_height floats
+ * @param dst_width The destination width
+ * @param dst_height The destination height
+ */
+void face_kernel_crop_resize_equalize(const struct face_frame* frame, const struct face_box* box, float* dst,
+    int dst_width, int dst_height);
+
+#endif // #ifndef SERVICE_FACE_KERNEL_H
@@ -0,0 +1,124 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernel.h"
+#include "mailbox.h"
+
+int face_mailbox_init(struct face_mailbox* mailbox) {
+  for (int i = 0; i < FACE_MAILBOX_SLOTS; ++i) {
+    struct face_mailbox_slot* slot = &mailbox->slots[i];
+    atomic_init(&slot->refs, 0);
+    memset(&slot->frame, 0, sizeof slot->frame);
+    slot->buf = NULL;
+    slot->buf_size = 0;
+  }
+
+  atomic_init(&mailbox->pending, NULL);
+  atomic_init(&mailbox->posted, 0);
+  atomic_init(&mailbox->dropped, 0);
+
+  return sem_init(&mailbox->ready, 0, 0);
+}
+
+void face_mailbox_free(struct face_mailbox* mailbox) {
+  sem_destroy(&mailbox->ready);
+
+  for (int i = 0; i < FACE_MAILBOX_SLOTS; ++i) {
+    free(mailbox->slots[i].buf);
+    mailbox->slots[i].buf = NULL;
+    mailbox->slots[i].buf_size = 0;
+  }
+}
+
+int face_mailbox_post(struct face_mailbox* mailbox, const struct face_frame* frame) {
+  atomic_fetch_add_explicit(&mailbox->posted, 1, memory_order_relaxed);
+
+  // Claim a free slot
+  struct face_mailbox_slot* slot = NULL;
+  for (int i = 0; i < FACE_MAILBOX_SLOTS; ++i) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&mailbox->slots[i].refs, &expected, 1)) {
+      slot = &mailbox->slots[i];
+      break;
+    }
+  }
+
+  // Every slot is in use, so this frame is as good as replaced
+  if (!slot) {
+    atomic_fetch_add_explicit(&mailbox->dropped, 1, memory_order_relaxed);
+    return 0;
+  }
+
+  size_t size = (size_t) frame->width * frame->height;
+  if (size > slot->buf_size) {
+    unsigned char* buf = realloc(slot->buf, size);
+    if (!buf) {
+      face_mailbox_release(slot);
+      return 1;
+    }
+
+    slot->buf = buf;
+    slot->buf_size = size;
+  }
+
+  // Copy in, converting to grayscale along the way
+  if (frame->format == face_pixel_format_rgb24) {
+    face_kernel_rgb_to_gray(frame->data, frame->stride, slot->buf, frame->width, frame->width, frame->height);
+  } else {
+    for (int y = 0; y < frame->height; ++y) {
+      memcpy(slot->buf + (size_t) y * frame->width, frame->data + (size_t) y * frame->stride, frame->width);
+    }
+  }
+
+  slot->frame = *frame;
+  slot->frame.stride = frame->width;
+  slot->frame.format = face_pixel_format_gray8;
+  slot->frame.data = slot->buf;
+
+  if (!slot->frame.timestamp) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    slot->frame.timestamp = (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  }
+
+  // Publish, and drop whatever the consumer did not get to in time
+  struct face_mailbox_slot* old = atomic_exchange(&mailbox->pending, slot);
+  if (old) {
+    atomic_fetch_add_explicit(&mailbox->dropped, 1, memory_order_relaxed);
+    face_mailbox_release(old);
+  }
+
+  sem_post(&mailbox->ready);
+  return 0;
+}
+
+struct face_mailbox_slot* face_mailbox_take(struct face_mailbox* mailbox) {
+  return atomic_exchange(&mailbox->pending, NULL);
+}
+
+void face_mailbox_wait(struct face_mailbox* mailbox) {
+  while (sem_wait(&mailbox->ready) && errno == EINTR) {
+  }
+}
+
+void face_mailbox_wake(struct face_mailbox* mailbox) {
+  sem_post(&mailbox->ready);
+}
+
+void face_mailbox_retain(struct face_mailbox_slot* slot) {
+  atomic_fetch_add_explicit(&slot->refs, 1, memory_order_relaxed);
+}
+
+void face_mailbox_release(struct face_mailbox_slot* slot) {
+  atomic_fetch_sub_explicit(&slot->refs, 1, memory_order_release);
+}
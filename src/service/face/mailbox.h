@@ -0,0 +1,127 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_FACE_MAILBOX_H
+#define SERVICE_FACE_MAILBOX_H
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "../face.h"
+
+/** The number of frame slots in a mailbox. */
+#define FACE_MAILBOX_SLOTS 6
+
+/** A reference-counted frame slot. */
+struct face_mailbox_slot {
+  /** The number of holders. Zero means free. */
+  atomic_int refs;
+
+  /** The grayscale frame. Its data points into buf. */
+  struct face_frame frame;
+
+  /** The pixel storage. */
+  unsigned char* buf;
+
+  /** The size of the pixel storage in bytes. */
+  size_t buf_size;
+};
+
+/**
+ * A latest-value-wins frame mailbox.
+ *
+ * Posting a frame atomically replaces any frame the consumer has not taken
+ * yet, so a slow consumer always sees the freshest frame and never a backlog.
+ * Frames are converted to grayscale on the way in, which makes the one copy
+ * we need to decouple from the producer as small as possible.
+ */
+struct face_mailbox {
+  /** The frame slots. */
+  struct face_mailbox_slot slots[FACE_MAILBOX_SLOTS];
+
+  /** The frame waiting to be taken, if any. */
+  _Atomic(struct face_mailbox_slot*) pending;
+
+  /** Posted when a frame arrives. May run ahead of the actual frame count. */
+  sem_t ready;
+
+  /** The number of frames posted. */
+  atomic_ulong posted;
+
+  /** The number of frames dropped, either replaced or refused. */
+  atomic_ulong dropped;
+};
+
+/**
+ * Initialize a mailbox.
+ *
+ * @param mailbox The mailbox
+ * @return Zero on success, otherwise nonzero
+ */
+int face_mailbox_init(struct face_mailbox* mailbox);
+
+/**
+ * Free all memory held by a mailbox.
+ *
+ * @param mailbox The mailbox
+ */
+void face_mailbox_free(struct face_mailbox* mailbox);
+
+/**
+ * Post a frame, replacing any frame not yet taken. Never blocks.
+ *
+ * The frame is copied (and converted to grayscale if needed), so the caller
+ * may reuse its buffer immediately. If the frame has no timestamp, the current
+ * time is used.
+ *
+ * @param mailbox The mailbox
+ * @param frame The frame
+ * @return Zero on success, otherwise nonzero
+ */
+int face_mailbox_post(struct face_mailbox* mailbox, const struct face_frame* frame);
+
+/**
+ * Take the pending frame, if any. Never blocks.
+ *
+ * The caller owns one reference to the returned slot and must give it back
+ * with face_mailbox_release(...).
+ *
+ * @param mailbox The mailbox
+ * @return The slot or NULL if nothing is pending
+ */
+struct face_mailbox_slot* face_mailbox_take(struct face_mailbox* mailbox);
+
+/**
+ * Wait for a frame to be posted or a wake, without a timeout.
+ *
+ * May return spuriously; follow up with face_mailbox_take(...).
+ *
+ * @param mailbox The mailbox
+ */
+void face_mailbox_wait(struct face_mailbox* mailbox);
+
+/**
+ * Wake one waiter without posting a frame.
+ *
+ * @param mailbox The mailbox
+ */
+void face_mailbox_wake(struct face_mailbox* mailbox);
+
+/**
+ * Add a reference to a slot.
+ *
+ * @param slot The slot
+ */
+void face_mailbox_retain(struct face_mailbox_slot* slot);
+
+/**
+ * Drop a reference to a slot.
+ *
+ * @param slot The slot
+ */
+void face_mailbox_release(struct face_mailbox_slot* slot);
+
+#endif // #ifndef SERVICE_FACE_MAILBOX_H
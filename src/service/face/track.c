@@ -0,0 +1,241 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "track.h"
+
+#define T FACE_TRACK_TEMPLATE_SIZE
+
+/**
+ * Sample a box into a template with nearest-neighbor lookup.
+ *
+ * Samples falling outside the frame are clamped to the nearest edge pixel.
+ *
+ * @param frame The frame
+ * @param box The box
+ * @param templ The output template
+ */
+static void sample_template(const struct face_frame* frame, const struct face_box* box, unsigned char* templ) {
+  for (int ty = 0; ty < T; ++ty) {
+    // Map template row to frame row through the cell center
+    int y = box->y + (2 * ty + 1) * box->height / (2 * T);
+    y = y < 0 ? 0 : y >= frame->height ? frame->height - 1 : y;
+
+    const unsigned char* row = frame->data + (size_t) y * frame->stride;
+
+    for (int tx = 0; tx < T; ++tx) {
+      int x = box->x + (2 * tx + 1) * box->width / (2 * T);
+      x = x < 0 ? 0 : x >= frame->width ? frame->width - 1 : x;
+
+      templ[ty * T + tx] = row[x];
+    }
+  }
+}
+
+/**
+ * Compute the normalized cross-correlation of two templates.
+ *
+ * @param a The first template
+ * @param b The second template
+ * @return The correlation from -1 to 1
+ */
+static float correlate(const unsigned char* a, const unsigned char* b) {
+  long sum_a = 0;
+  long sum_b = 0;
+  long sum_aa = 0;
+  long sum_bb = 0;
+  long sum_ab = 0;
+
+  for (int i = 0; i < T * T; ++i) {
+    sum_a += a[i];
+    sum_b += b[i];
+    sum_aa += a[i] * a[i];
+    sum_bb += b[i] * b[i];
+    sum_ab += a[i] * b[i];
+  }
+
+  double n = T * T;
+  double cov = sum_ab - sum_a * (double) sum_b / n;
+  double var_a = sum_aa - sum_a * (double) sum_a / n;
+  double var_b = sum_bb - sum_b * (double) sum_b / n;
+
+  // Flat patches carry no usable signal
+  if (var_a < 1 || var_b < 1) {
+    return 0;
+  }
+
+  return (float) (cov / sqrt(var_a * var_b));
+}
+
+/**
+ * Compute the intersection over union of two boxes.
+ *
+ * @param a The first box
+ * @param b The second box
+ * @return The intersection over union from 0 to 1
+ */
+static float iou(const struct face_box* a, const struct face_box* b) {
+  int x0 = a->x > b->x ? a->x : b->x;
+  int y0 = a->y > b->y ? a->y : b->y;
+  int x1 = a->x + a->width < b->x + b->width ? a->x + a->width : b->x + b->width;
+  int y1 = a->y + a->height < b->y + b->height ? a->y + a->height : b->y + b->height;
+
+  if (x1 <= x0 || y1 <= y0) {
+    return 0;
+  }
+
+  float inter = (float) (x1 - x0) * (float) (y1 - y0);
+  float uni = (float) a->width * a->height + (float) b->width * b->height - inter;
+  return inter / uni;
+}
+
+/**
+ * Check whether a box has its center inside the frame.
+ *
+ * @param frame The frame
+ * @param box The box
+ * @return Nonzero if inside, otherwise zero
+ */
+static int in_frame(const struct face_frame* frame, const struct face_box* box) {
+  int cx = box->x + box->width / 2;
+  int cy = box->y + box->height / 2;
+  return cx >= 0 && cx < frame->width && cy >= 0 && cy < frame->height;
+}
+
+void face_tracker_init(struct face_tracker* tracker) {
+  tracker->tracks_len = 0;
+  tracker->next_id = 1;
+}
+
+void face_tracker_propagate(struct face_tracker* tracker, const struct face_frame* frame) {
+  unsigned char candidate[T * T];
+
+  size_t kept = 0;
+  for (size_t i = 0; i < tracker->tracks_len; ++i) {
+    struct face_track* track = &tracker->tracks[i];
+
+    // Search step is one template cell so cost is independent of face size
+    int step_x = track->box.width / T > 0 ? track->box.width / T : 1;
+    int step_y = track->box.height / T > 0 ? track->box.height / T : 1;
+
+    // Start from the current position so a still face wins all ties
+    struct face_box best_box = track->box;
+    sample_template(frame, &best_box, candidate);
+    float best_score = correlate(track->templ, candidate);
+
+    for (int dy = -FACE_TRACK_SEARCH_RADIUS; dy <= FACE_TRACK_SEARCH_RADIUS; ++dy) {
+      for (int dx = -FACE_TRACK_SEARCH_RADIUS; dx <= FACE_TRACK_SEARCH_RADIUS; ++dx) {
+        if (!dx && !dy) {
+          continue;
+        }
+
+        struct face_box box = track->box;
+        box.x += dx * step_x;
+        box.y += dy * step_y;
+
+        sample_template(frame, &box, candidate);
+        float score = correlate(track->templ, candidate);
+
+        if (score > best_score) {
+          best_score = score;
+          best_box = box;
+        }
+      }
+    }
+
+    // Drop tracks that left the frame
+    if (!in_frame(frame, &best_box)) {
+      continue;
+    }
+
+    track->box = best_box;
+    track->confidence = best_score > 0 ? best_score : 0;
+    ++track->frames_since_embed;
+
+    // Refresh the template so slow appearance changes do not accumulate
+    sample_template(frame, &track->box, track->templ);
+
+    // Compact surviving tracks toward the front
+    if (kept != i) {
+      tracker->tracks[kept] = *track;
+    }
+    ++kept;
+  }
+
+  tracker->tracks_len = kept;
+}
+
+void face_tracker_associate(struct face_tracker* tracker, const struct face_frame* frame,
+    const struct face_box* boxes, size_t boxes_len) {
+  struct face_track next[FACE_MAX_FACES];
+  size_t next_len = 0;
+
+  int claimed[FACE_MAX_FACES];
+  memset(claimed, 0, sizeof claimed);
+
+  for (size_t d = 0; d < boxes_len && next_len < FACE_MAX_FACES; ++d) {
+    // Find the best unclaimed track for this detection
+    int best = -1;
+    float best_iou = FACE_TRACK_MIN_IOU;
+
+    for (size_t i = 0; i < tracker->tracks_len; ++i) {
+      if (claimed[i]) {
+        continue;
+      }
+
+      float overlap = iou(&tracker->tracks[i].box, &boxes[d]);
+      if (overlap >= best_iou) {
+        best = (int) i;
+        best_iou = overlap;
+      }
+    }
+
+    struct face_track* track = &next[next_len++];
+
+    if (best >= 0) {
+      // Continue the existing track and keep its cached identity
+      claimed[best] = 1;
+      *track = tracker->tracks[best];
+      ++track->frames_since_embed;
+    } else {
+      // Start a new unidentified track
+      track->id = tracker->next_id++;
+      track->identity = -1;
+      track->similarity = 0;
+      track->embedded = 0;
+      track->frames_since_embed = 0;
+    }
+
+    track->box = boxes[d];
+    track->confidence = 1;
+    sample_template(frame, &track->box, track->templ);
+  }
+
+  memcpy(tracker->tracks, next, next_len * sizeof *next);
+  tracker->tracks_len = next_len;
+}
+
+void face_tracker_rescale(struct face_tracker* tracker, int num, int den) {
+  for (size_t i = 0; i < tracker->tracks_len; ++i) {
+    struct face_box* box = &tracker->tracks[i].box;
+    box->x = box->x * num / den;
+    box->y = box->y * num / den;
+    box->width = box->width * num / den;
+    box->height = box->height * num / den;
+  }
+}
+
+float face_tracker_min_confidence(const struct face_tracker* tracker) {
+  float min = 1;
+  for (size_t i = 0; i < tracker->tracks_len; ++i) {
+    if (tracker->tracks[i].confidence < min) {
+      min = tracker->tracks[i].confidence;
+    }
+  }
+  return min;
+}
@@ -0,0 +1,111 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_FACE_TRACK_H
+#define SERVICE_FACE_TRACK_H
+
+#include <stddef.h>
+
+#include "../face.h"
+
+/** The side length of a track appearance template in samples. */
+#define FACE_TRACK_TEMPLATE_SIZE 16
+
+/** The search radius in template cells when propagating a track. */
+#define FACE_TRACK_SEARCH_RADIUS 4
+
+/** The minimum overlap for a detection to continue a track. */
+#define FACE_TRACK_MIN_IOU 0.3f
+
+/** A tracked face. */
+struct face_track {
+  /** The track number. */
+  unsigned long id;
+
+  /** The current bounding box. */
+  struct face_box box;
+
+  /** The confidence of the last propagation from zero to one. */
+  float confidence;
+
+  /** The cached identity number or -1 if unknown. */
+  int identity;
+
+  /** The cosine similarity of the cached identity match. */
+  float similarity;
+
+  /** Nonzero if the track has been embedded at least once. */
+  int embedded;
+
+  /** The number of frames since the track was last embedded. */
+  unsigned int frames_since_embed;
+
+  /** The appearance template sampled from the box. */
+  unsigned char templ[FACE_TRACK_TEMPLATE_SIZE * FACE_TRACK_TEMPLATE_SIZE];
+};
+
+/** A set of face tracks. */
+struct face_tracker {
+  /** The tracks. */
+  struct face_track tracks[FACE_MAX_FACES];
+
+  /** The number of tracks. */
+  size_t tracks_len;
+
+  /** The next track number to assign. */
+  unsigned long next_id;
+};
+
+/**
+ * Initialize a tracker with no tracks.
+ *
+ * @param tracker The tracker
+ */
+void face_tracker_init(struct face_tracker* tracker);
+
+/**
+ * Propagate all tracks into a new frame by template correlation.
+ *
+ * Tracks that leave the frame are dropped. Each surviving track has its box
+ * moved to the best match and its confidence set to the match score.
+ *
+ * @param tracker The tracker
+ * @param frame The new frame
+ */
+void face_tracker_propagate(struct face_tracker* tracker, const struct face_frame* frame);
+
+/**
+ * Reconcile tracks with fresh detections.
+ *
+ * Detections that overlap a track continue it and keep its cached identity.
+ * Tracks without a detection are dropped, and detections without a track
+ * start new, unidentified tracks.
+ *
+ * @param tracker The tracker
+ * @param frame The frame the detections came from
+ * @param boxes The detected boxes
+ * @param boxes_len The number of detected boxes
+ */
+void face_tracker_associate(struct face_tracker* tracker, const struct face_frame* frame,
+    const struct face_box* boxes, size_t boxes_len);
+
+/**
+ * Scale all track boxes, as when the processing resolution changes.
+ *
+ * @param tracker The tracker
+ * @param num The scale numerator
+ * @param den The scale denominator
+ */
+void face_tracker_rescale(struct face_tracker* tracker, int num, int den);
+
+/**
+ * Get the lowest confidence among all tracks.
+ *
+ * @param tracker The tracker
+ * @return The lowest confidence or one if there are no tracks
+ */
+float face_tracker_min_confidence(const struct face_tracker* tracker);
+
+#endif // #ifndef SERVICE_FACE_TRACK_H
@@ -6,9 +6,176 @@
 #ifndef SERVICE_MONITOR_H
 #define SERVICE_MONITOR_H
 
-/** A monitor service procedure. */
+#include <stddef.h>
+
+#include "face.h"
+
+/** The monitor width in pixels. */
+#define MONITOR_WIDTH 800
+
+/** The monitor height in pixels. */
+#define MONITOR_HEIGHT 480
+
+/** The width of the camera view at the left of the monitor in pixels. */
+#define MONITOR_CAMERA_WIDTH 640
+
+/** The number of status lines in the panel at the right of the monitor. */
+#define MONITOR_STATUS_LINES 24
+
+/** The longest status line, including the terminator. */
+#define MONITOR_STATUS_LEN 21
+
+/** The number of metric graphs below the status lines. */
+#define MONITOR_GRAPHS 4
+
+/**
+ * A monitor service procedure.
+ *
+ * The show procedures hand snapshots to the renderer through triple buffers,
+ * so they never wait on it. Each may have only one calling thread at a time.
+ */
 enum service_monitor_proc {
   service_monitor_proc_hello,
+
+  /**
+   * Configure rendering. Takes const struct monitor_config* as arg1. Only
+   * allowed while the service is stopped.
+   */
+  service_monitor_proc_configure,
+
+  /** Install a display. Takes const struct monitor_display* as arg1. */
+  service_monitor_proc_set_display,
+
+  /**
+   * Show a camera frame. Takes const struct face_frame* as arg1 and
+   * optionally const struct face_result* as arg2 for the boxes to overlay.
+   *
+   * The frame is only copied if its number differs from the last one shown,
+   * so a newer result for the same frame just moves the boxes.
+   */
+  service_monitor_proc_show_frame,
+
+  /** Show status text. Takes const struct monitor_status* as arg1. */
+  service_monitor_proc_show_status,
+
+  /**
+   * Redraw whatever changed and present it. Takes struct monitor_render* as
+   * arg2, optionally, for what was redrawn.
+   *
+   * While the service is started this happens on its render thread at the
+   * configured rate, woken by a timer on the event loop, so this is only
+   * needed while stopped.
+   */
+  service_monitor_proc_render,
+
+  /** Get rendering statistics. Takes struct monitor_stats* as arg2. */
+  service_monitor_proc_get_stats,
+};
+
+/** A monitor configuration. */
+struct monitor_config {
+  /** The most frames to render per second. */
+  int fps;
+
+  /**
+   * A directory to write every rendered frame to as a PPM image in place of
+   * the display, or NULL. Only read during configuration.
+   */
+  const char* headless_dir;
+
+  /**
+   * The names of the metrics to graph, or NULL for no graph. A metric need
+   * not be registered yet; its graph appears once it is. Only read during
+   * configuration.
+   */
+  const char* graphs[MONITOR_GRAPHS];
+};
+
+/** A rectangle in monitor pixels. */
+struct monitor_rect {
+  /** The left edge. */
+  int x;
+
+  /** The top edge. */
+  int y;
+
+  /** The width. */
+  int width;
+
+  /** The height. */
+  int height;
+};
+
+/** A snapshot of status text. */
+struct monitor_status {
+  /** Bumped by the producer whenever any line changes. */
+  unsigned long version;
+
+  /** The lines, top to bottom. */
+  char lines[MONITOR_STATUS_LINES][MONITOR_STATUS_LEN];
+};
+
+/** A pluggable display. */
+struct monitor_display {
+  /** An opaque pointer passed to every callback. */
+  void* ctx;
+
+  /**
+   * Present a rendered frame. Only the dirty rectangles have changed since
+   * the last present.
+   *
+   * @param ctx The display context
+   * @param pixels The MONITOR_WIDTH by MONITOR_HEIGHT XRGB8888 pixels
+   * @param dirty The dirty rectangles
+   * @param dirty_len The number of dirty rectangles
+   * @return Zero on success, otherwise nonzero
+   */
+  int (* present)(void* ctx, const unsigned int* pixels, const struct monitor_rect* dirty, size_t dirty_len);
+};
+
+/** What one render redrew. */
+struct monitor_render {
+  /** The number of pixels redrawn. */
+  size_t area;
+
+  /** The number of rectangles redrawn. */
+  size_t regions;
+
+  /** The time spent rendering in nanoseconds. */
+  unsigned long long time;
+};
+
+/** Monitor rendering statistics. */
+struct monitor_stats {
+  /** The number of renders. */
+  unsigned long renders;
+
+  /** The number of renders that found nothing to redraw. */
+  unsigned long renders_clean;
+
+  /** The number of camera frames copied. */
+  unsigned long frames_copied;
+
+  /** The number of camera frames replaced before they were rendered. */
+  unsigned long frames_dropped;
+
+  /** The number of box and status snapshots replaced before they were rendered. */
+  unsigned long snapshots_dropped;
+
+  /** The number of render ticks missed because a render ran long. */
+  unsigned long ticks_missed;
+
+  /** The number of pixels redrawn by the last render. */
+  unsigned long area_last;
+
+  /** The total number of pixels redrawn. */
+  unsigned long long area_total;
+
+  /** The time spent in the last render in nanoseconds. */
+  unsigned long long time_last;
+
+  /** The total time spent rendering in nanoseconds. */
+  unsigned long long time_total;
 };
 
 /** The monitor service. */
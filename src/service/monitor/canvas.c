@@ -0,0 +1,195 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "canvas.h"
+
+/** The first character with a glyph. */
+#define FONT_FIRST ' '
+
+/** The last character with a glyph. */
+#define FONT_LAST '_'
+
+/**
+ * A 3x5 font from space to underscore, one row per byte with the leftmost
+ * pixel in bit 2.
+ */
+static const unsigned char font[FONT_LAST - FONT_FIRST + 1][5] = {
+  { 0, 0, 0, 0, 0 }, { 2, 2, 2, 0, 2 }, { 5, 5, 0, 0, 0 }, { 5, 7, 5, 7, 5 }, // Space ! " #
+  { 3, 6, 2, 3, 6 }, { 5, 1, 2, 4, 5 }, { 2, 5, 2, 5, 3 }, { 2, 2, 0, 0, 0 }, // $ % & '
+  { 1, 2, 2, 2, 1 }, { 4, 2, 2, 2, 4 }, { 0, 5, 2, 5, 0 }, { 0, 2, 7, 2, 0 }, // ( ) * +
+  { 0, 0, 0, 2, 4 }, { 0, 0, 7, 0, 0 }, { 0, 0, 0, 0, 2 }, { 1, 1, 2, 4, 4 }, // , - . /
+  { 7, 5, 5, 5, 7 }, { 2, 6, 2, 2, 7 }, { 7, 1, 7, 4, 7 }, { 7, 1, 7, 1, 7 }, // 0 1 2 3
+  { 5, 5, 7, 1, 1 }, { 7, 4, 7, 1, 7 }, { 7, 4, 7, 5, 7 }, { 7, 1, 1, 1, 1 }, // 4 5 6 7
+  { 7, 5, 7, 5, 7 }, { 7, 5, 7, 1, 7 }, { 0, 2, 0, 2, 0 }, { 0, 2, 0, 2, 4 }, // 8 9 : ;
+  { 1, 2, 4, 2, 1 }, { 0, 7, 0, 7, 0 }, { 4, 2, 1, 2, 4 }, { 7, 1, 2, 0, 2 }, // < = > ?
+  { 7, 5, 7, 4, 7 }, { 2, 5, 7, 5, 5 }, { 6, 5, 6, 5, 6 }, { 3, 4, 4, 4, 3 }, // @ A B C
+  { 6, 5, 5, 5, 6 }, { 7, 4, 6, 4, 7 }, { 7, 4, 6, 4, 4 }, { 3, 4, 5, 5, 3 }, // D E F G
+  { 5, 5, 7, 5, 5 }, { 7, 2, 2, 2, 7 }, { 1, 1, 1, 5, 2 }, { 5, 5, 6, 5, 5 }, // H I J K
+  { 4, 4, 4, 4, 7 }, { 5, 7, 7, 5, 5 }, { 6, 5, 5, 5, 5 }, { 2, 5, 5, 5, 2 }, // L M N O
+  { 6, 5, 6, 4, 4 }, { 2, 5, 5, 6, 3 }, { 6, 5, 6, 5, 5 }, { 3, 4, 2, 1, 6 }, // P Q R S
+  { 7, 2, 2, 2, 2 }, { 5, 5, 5, 5, 7 }, { 5, 5, 5, 5, 2 }, { 5, 5, 7, 7, 5 }, // T U V W
+  { 5, 5, 2, 5, 5 }, { 5, 5, 2, 2, 2 }, { 7, 1, 2, 4, 7 }, { 6, 4, 4, 4, 6 }, // X Y Z [
+  { 4, 4, 2, 1, 1 }, { 3, 1, 1, 1, 3 }, { 2, 5, 0, 0, 0 }, { 0, 0, 0, 0, 7 }, // \ ] ^ _
+};
+
+size_t monitor_rect_area(const struct monitor_rect* r) {
+  return r->width > 0 && r->height > 0 ? (size_t) r->width * r->height : 0;
+}
+
+int monitor_rect_intersect(const struct monitor_rect* a, const struct monitor_rect* b, struct monitor_rect* out) {
+  int x0 = a->x > b->x ? a->x : b->x;
+  int y0 = a->y > b->y ? a->y : b->y;
+  int x1 = a->x + a->width < b->x + b->width ? a->x + a->width : b->x + b->width;
+  int y1 = a->y + a->height < b->y + b->height ? a->y + a->height : b->y + b->height;
+
+  *out = (struct monitor_rect) { x0, y0, x1 - x0, y1 - y0 };
+  return x1 > x0 && y1 > y0;
+}
+
+/**
+ * Get the bounding box of two rectangles.
+ */
+static struct monitor_rect rect_union(const struct monitor_rect* a, const struct monitor_rect* b) {
+  int x0 = a->x < b->x ? a->x : b->x;
+  int y0 = a->y < b->y ? a->y : b->y;
+  int x1 = a->x + a->width > b->x + b->width ? a->x + a->width : b->x + b->width;
+  int y1 = a->y + a->height > b->y + b->height ? a->y + a->height : b->y + b->height;
+
+  return (struct monitor_rect) { x0, y0, x1 - x0, y1 - y0 };
+}
+
+/**
+ * Get the area two rectangles cover together, counting overlap once.
+ */
+static size_t covered_area(const struct monitor_rect* a, const struct monitor_rect* b) {
+  struct monitor_rect overlap;
+  size_t shared = monitor_rect_intersect(a, b, &overlap) ? monitor_rect_area(&overlap) : 0;
+  return monitor_rect_area(a) + monitor_rect_area(b) - shared;
+}
+
+void monitor_dirty_clear(struct monitor_dirty* dirty) {
+  dirty->len = 0;
+}
+
+void monitor_dirty_add(struct monitor_dirty* dirty, const struct monitor_rect* r) {
+  if (!monitor_rect_area(r)) {
+    return;
+  }
+
+  struct monitor_rect next = *r;
+
+  // Absorb every rectangle whose union with this one costs nothing extra,
+  // starting over each time as the grown rectangle may now reach others
+  for (size_t i = 0; i < dirty->len;) {
+    struct monitor_rect u = rect_union(&next, &dirty->rects[i]);
+    if (monitor_rect_area(&u) <= covered_area(&next, &dirty->rects[i])) {
+      next = u;
+      dirty->rects[i] = dirty->rects[--dirty->len];
+      i = 0;
+    } else {
+      ++i;
+    }
+  }
+
+  if (dirty->len < MONITOR_DIRTY_MAX) {
+    dirty->rects[dirty->len++] = next;
+    return;
+  }
+
+  // Out of room, so fold the new rectangle into whichever grows least
+  size_t best = 0;
+  size_t best_growth = (size_t) -1;
+
+  for (size_t i = 0; i < dirty->len; ++i) {
+    struct monitor_rect u = rect_union(&next, &dirty->rects[i]);
+    size_t growth = monitor_rect_area(&u) - monitor_rect_area(&dirty->rects[i]);
+    if (growth < best_growth) {
+      best = i;
+      best_growth = growth;
+    }
+  }
+
+  next = rect_union(&next, &dirty->rects[best]);
+  dirty->rects[best] = dirty->rects[--dirty->len];
+  monitor_dirty_add(dirty, &next);
+}
+
+size_t monitor_dirty_area(const struct monitor_dirty* dirty) {
+  size_t area = 0;
+  for (size_t i = 0; i < dirty->len; ++i) {
+    area += monitor_rect_area(&dirty->rects[i]);
+  }
+  return area;
+}
+
+int monitor_canvas_init(struct monitor_canvas* canvas, int width, int height) {
+  canvas->width = width;
+  canvas->height = height;
+  canvas->pixels = calloc((size_t) width * height, sizeof *canvas->pixels);
+  return canvas->pixels ? 0 : 1;
+}
+
+void monitor_canvas_free(struct monitor_canvas* canvas) {
+  free(canvas->pixels);
+  canvas->pixels = NULL;
+}
+
+void monitor_canvas_fill(struct monitor_canvas* canvas, const struct monitor_rect* r, const struct monitor_rect* clip,
+    unsigned int color) {
+  struct monitor_rect area;
+  if (!monitor_rect_intersect(r, clip, &area)) {
+    return;
+  }
+
+  for (int y = area.y; y < area.y + area.height; ++y) {
+    unsigned int* row = canvas->pixels + (size_t) y * canvas->width + area.x;
+    for (int x = 0; x < area.width; ++x) {
+      row[x] = color;
+    }
+  }
+}
+
+void monitor_canvas_copy(struct monitor_canvas* canvas, const struct monitor_canvas* src,
+    const struct monitor_rect* r) {
+  for (int y = r->y; y < r->y + r->height; ++y) {
+    memcpy(canvas->pixels + (size_t) y * canvas->width + r->x, src->pixels + (size_t) y * src->width + r->x,
+        (size_t) r->width * sizeof *canvas->pixels);
+  }
+}
+
+void monitor_canvas_text(struct monitor_canvas* canvas, int x, int y, int scale, const char* text,
+    const struct monitor_rect* clip, unsigned int color) {
+  struct monitor_rect line = { x, y, (int) strlen(text) * MONITOR_GLYPH_WIDTH * scale, MONITOR_GLYPH_HEIGHT * scale };
+  struct monitor_rect visible;
+  if (!monitor_rect_intersect(&line, clip, &visible)) {
+    return;
+  }
+
+  for (const char* c = text; *c; ++c, x += MONITOR_GLYPH_WIDTH * scale) {
+    // Skip glyphs entirely outside the clip
+    if (x + MONITOR_GLYPH_WIDTH * scale <= visible.x || x >= visible.x + visible.width) {
+      continue;
+    }
+
+    int ch = *c >= 'a' && *c <= 'z' ? *c - 'a' + 'A' : *c;
+    if (ch < FONT_FIRST || ch > FONT_LAST) {
+      ch = '?';
+    }
+
+    const unsigned char* glyph = font[ch - FONT_FIRST];
+    for (int row = 0; row < 5; ++row) {
+      for (int col = 0; col < 3; ++col) {
+        if (glyph[row] & (4 >> col)) {
+          struct monitor_rect dot = { x + col * scale, y + row * scale, scale, scale };
+          monitor_canvas_fill(canvas, &dot, &visible, color);
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,141 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_MONITOR_CANVAS_H
+#define SERVICE_MONITOR_CANVAS_H
+
+#include <stddef.h>
+
+#include "../monitor.h"
+
+/** The largest number of separate dirty rectangles tracked per frame. */
+#define MONITOR_DIRTY_MAX 32
+
+/** The glyph cell width in font pixels, including spacing. */
+#define MONITOR_GLYPH_WIDTH 4
+
+/** The glyph cell height in font pixels, including spacing. */
+#define MONITOR_GLYPH_HEIGHT 6
+
+/** A set of dirty rectangles, kept disjoint enough to be cheap to redraw. */
+struct monitor_dirty {
+  /** The rectangles. */
+  struct monitor_rect rects[MONITOR_DIRTY_MAX];
+
+  /** The number of rectangles. */
+  size_t len;
+};
+
+/** An XRGB8888 drawing surface. */
+struct monitor_canvas {
+  /** The width in pixels. */
+  int width;
+
+  /** The height in pixels. */
+  int height;
+
+  /** The pixels, row by row with no padding. */
+  unsigned int* pixels;
+};
+
+/**
+ * Get the area of a rectangle.
+ *
+ * @param r The rectangle
+ * @return The area in pixels
+ */
+size_t monitor_rect_area(const struct monitor_rect* r);
+
+/**
+ * Intersect two rectangles.
+ *
+ * @param a The first rectangle
+ * @param b The second rectangle
+ * @param out The intersection
+ * @return Nonzero if the intersection is not empty, otherwise zero
+ */
+int monitor_rect_intersect(const struct monitor_rect* a, const struct monitor_rect* b, struct monitor_rect* out);
+
+/**
+ * Forget all dirty rectangles.
+ *
+ * @param dirty The dirty set
+ */
+void monitor_dirty_clear(struct monitor_dirty* dirty);
+
+/**
+ * Mark a rectangle dirty.
+ *
+ * Rectangles are merged with one another whenever their union would not
+ * redraw more than they do apart. Past MONITOR_DIRTY_MAX the pair that grows
+ * least is merged anyway.
+ *
+ * @param dirty The dirty set
+ * @param r The rectangle, already clipped to the canvas
+ */
+void monitor_dirty_add(struct monitor_dirty* dirty, const struct monitor_rect* r);
+
+/**
+ * Get the total dirty area.
+ *
+ * @param dirty The dirty set
+ * @return The area in pixels
+ */
+size_t monitor_dirty_area(const struct monitor_dirty* dirty);
+
+/**
+ * Allocate a canvas.
+ *
+ * @param canvas The canvas
+ * @param width The width in pixels
+ * @param height The height in pixels
+ * @return Zero on success, otherwise nonzero
+ */
+int monitor_canvas_init(struct monitor_canvas* canvas, int width, int height);
+
+/**
+ * Free a canvas.
+ *
+ * @param canvas The canvas
+ */
+void monitor_canvas_free(struct monitor_canvas* canvas);
+
+/**
+ * Fill a rectangle, clipped to a second rectangle.
+ *
+ * @param canvas The canvas
+ * @param r The rectangle
+ * @param clip The clip rectangle
+ * @param color The XRGB color
+ */
+void monitor_canvas_fill(struct monitor_canvas* canvas, const struct monitor_rect* r, const struct monitor_rect* clip,
+    unsigned int color);
+
+/**
+ * Copy a rectangle from another canvas with the same origin.
+ *
+ * @param canvas The destination canvas
+ * @param src The source canvas
+ * @param r The rectangle, within both canvases
+ */
+void monitor_canvas_copy(struct monitor_canvas* canvas, const struct monitor_canvas* src,
+    const struct monitor_rect* r);
+
+/**
+ * Draw text, clipped to a rectangle. Lowercase is drawn as uppercase and
+ * characters without a glyph as a question mark.
+ *
+ * @param canvas The canvas
+ * @param x The left edge
+ * @param y The top edge
+ * @param scale The size of a font pixel in canvas pixels
+ * @param text The text
+ * @param clip The clip rectangle
+ * @param color The XRGB color
+ */
+void monitor_canvas_text(struct monitor_canvas* canvas, int x, int y, int scale, const char* text,
+    const struct monitor_rect* clip, unsigned int color);
+
+#endif // #ifndef SERVICE_MONITOR_CANVAS_H
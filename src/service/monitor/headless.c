@@ -0,0 +1,60 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "headless.h"
+
+int monitor_headless_init(struct monitor_headless* headless, const char* dir) {
+  headless->dir = strdup(dir);
+  headless->frames = 0;
+  headless->rgb = malloc((size_t) MONITOR_WIDTH * MONITOR_HEIGHT * 3);
+
+  if (!headless->dir || !headless->rgb) {
+    monitor_headless_free(headless);
+    return 1;
+  }
+
+  return 0;
+}
+
+void monitor_headless_free(struct monitor_headless* headless) {
+  free(headless->dir);
+  free(headless->rgb);
+  headless->dir = NULL;
+  headless->rgb = NULL;
+}
+
+int monitor_headless_present(void* ctx, const unsigned int* pixels, const struct monitor_rect* dirty,
+    size_t dirty_len) {
+  struct monitor_headless* headless = ctx;
+
+  char path[4096];
+  snprintf(path, sizeof path, "%s/frame-%06lu.ppm", headless->dir, headless->frames);
+
+  FILE* file = fopen(path, "wb");
+  if (!file) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < (size_t) MONITOR_WIDTH * MONITOR_HEIGHT; ++i) {
+    headless->rgb[3 * i] = (unsigned char) (pixels[i] >> 16);
+    headless->rgb[3 * i + 1] = (unsigned char) (pixels[i] >> 8);
+    headless->rgb[3 * i + 2] = (unsigned char) pixels[i];
+  }
+
+  fprintf(file, "P6\n%d %d\n255\n", MONITOR_WIDTH, MONITOR_HEIGHT);
+  size_t written = fwrite(headless->rgb, 3, (size_t) MONITOR_WIDTH * MONITOR_HEIGHT, file);
+
+  if (fclose(file) || written != (size_t) MONITOR_WIDTH * MONITOR_HEIGHT) {
+    return 1;
+  }
+
+  ++headless->frames;
+  return 0;
+}
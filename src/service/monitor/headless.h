@@ -0,0 +1,53 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_MONITOR_HEADLESS_H
+#define SERVICE_MONITOR_HEADLESS_H
+
+#include <stddef.h>
+
+#include "../monitor.h"
+
+/** A display that writes every presented frame to an image file. */
+struct monitor_headless {
+  /** The output directory, owned. */
+  char* dir;
+
+  /** The number of frames written. */
+  unsigned long frames;
+
+  /** Scratch for one packed RGB frame. */
+  unsigned char* rgb;
+};
+
+/**
+ * Start writing frames to a directory.
+ *
+ * @param headless The headless display
+ * @param dir The output directory, which must exist
+ * @return Zero on success, otherwise nonzero
+ */
+int monitor_headless_init(struct monitor_headless* headless, const char* dir);
+
+/**
+ * Stop writing frames.
+ *
+ * @param headless The headless display
+ */
+void monitor_headless_free(struct monitor_headless* headless);
+
+/**
+ * Write a frame as frame-NNNNNN.ppm. Matches monitor_display.present.
+ *
+ * @param ctx The headless display
+ * @param pixels The MONITOR_WIDTH by MONITOR_HEIGHT XRGB8888 pixels
+ * @param dirty The dirty rectangles, unused as whole frames are written
+ * @param dirty_len The number of dirty rectangles
+ * @return Zero on success, otherwise nonzero
+ */
+int monitor_headless_present(void* ctx, const unsigned int* pixels, const struct monitor_rect* dirty,
+    size_t dirty_len);
+
+#endif // #ifndef SERVICE_MONITOR_HEADLESS_H
@@ -3,46 +3,914 @@
  * Copyright 2019 The Cozmonaut Contributors
  */
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include "../monitor.h"
 
 #include "../../log.h"
+#include "../../loop.h"
+#include "../../metric.h"
 #include "../../service.h"
+#include "../../tribuf.h"
+#include "../../trace.h"
+
+#include "canvas.h"
+#include "headless.h"
 
 #define LOG_TAG "monitor"
 
+/** The thickness of overlay box outlines in pixels. */
+#define BOX_THICKNESS 2
+
+/** The size of a font pixel in monitor pixels. */
+#define TEXT_SCALE 2
+
+/** The space around the status text in pixels. */
+#define TEXT_MARGIN 4
+
+/** The panel background color. */
+#define COLOR_PANEL 0x202020u
+
+/** The status text color. */
+#define COLOR_TEXT 0xe0e0e0u
+
+/** The graph bar color. */
+#define COLOR_GRAPH 0x4090e0u
+
+/** The outline color for identified faces. */
+#define COLOR_KNOWN 0x40e040u
+
+/** The outline color for unidentified faces. */
+#define COLOR_UNKNOWN 0xe0a020u
+
+/** The number of pixels in the camera view. */
+#define CAMERA_PIXELS (MONITOR_CAMERA_WIDTH * MONITOR_HEIGHT)
+
+/** The top edge of the first graph, just below the status lines. */
+#define GRAPHS_TOP (2 * TEXT_MARGIN + MONITOR_STATUS_LINES * MONITOR_GLYPH_HEIGHT * TEXT_SCALE)
+
+/** The height of each graph in pixels. */
+#define GRAPH_HEIGHT ((MONITOR_HEIGHT - GRAPHS_TOP) / MONITOR_GRAPHS)
+
+/** The width of each graph bar in pixels. */
+#define GRAPH_BAR_WIDTH 2
+
+/** The height of the tallest graph bar in pixels. */
+#define GRAPH_BAR_HEIGHT (GRAPH_HEIGHT - MONITOR_GLYPH_HEIGHT * TEXT_SCALE - 2 * TEXT_MARGIN)
+
+/** An overlay box in monitor pixels. */
+struct overlay {
+  /** The box. */
+  struct monitor_rect rect;
+
+  /** The outline color. */
+  unsigned int color;
+};
+
+/** A camera frame scaled to the camera view. */
+struct camera_snapshot {
+  /** The frame number. */
+  unsigned long id;
+
+  /** The pixels, MONITOR_CAMERA_WIDTH to a row. */
+  unsigned int pixels[CAMERA_PIXELS];
+};
+
+/** A metric graph. Render lock only. */
+struct graph {
+  /** The metric name, or empty for no graph. */
+  char name[METRIC_NAME_LEN];
+
+  /** The metric, or NULL until it is registered. */
+  struct metric* metric;
+
+  /** The graphed quantity over the last minute, oldest first. */
+  double points[METRIC_HISTORY];
+
+  /** The number of points. */
+  size_t len;
+
+  /** The largest point. */
+  double peak;
+
+  /** The latest point as text. */
+  char value[10];
+};
+
+/** The boxes to overlay on the camera view. */
+struct overlay_snapshot {
+  /** The number of boxes. */
+  size_t len;
+
+  /** The boxes. */
+  struct overlay boxes[FACE_MAX_FACES];
+};
+
+/** The camera view. */
+static const struct monitor_rect camera_rect = { 0, 0, MONITOR_CAMERA_WIDTH, MONITOR_HEIGHT };
+
+/** The status panel. */
+static const struct monitor_rect panel_rect = {
+  MONITOR_CAMERA_WIDTH, 0, MONITOR_WIDTH - MONITOR_CAMERA_WIDTH, MONITOR_HEIGHT,
+};
+
+/** The whole monitor. */
+static const struct monitor_rect screen_rect = { 0, 0, MONITOR_WIDTH, MONITOR_HEIGHT };
+
+/** The metrics graphed until configured otherwise. */
+static const char* const default_graphs[MONITOR_GRAPHS] = {
+  "face.frame_ns",
+  "face.age_ns",
+  "speech.hop_ns",
+  "speech.buffered",
+};
+
+/** An empty overlay for before the first snapshot. */
+static const struct overlay_snapshot no_overlay;
+
+/** An empty status for before the first snapshot. */
+static const struct monitor_status no_status;
+
+/** The rendering configuration. */
+static struct monitor_config config;
+
+/** Camera frames from the face producer. */
+static struct tribuf cameras;
+
+/** Overlay boxes from the face producer. */
+static struct tribuf overlays;
+
+/** Status text from the stats producer. */
+static struct tribuf statuses;
+
+/** The number of the last frame shown. Producer only. */
+static unsigned long shown_id;
+
+/** Nonzero once a frame was shown. Producer only. */
+static int shown_any;
+
+/** The number of camera frames copied. */
+static atomic_ulong frames_copied;
+
+/** Serializes rendering between the render thread and procedures. */
+static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The installed display. */
+static struct monitor_display display;
+
+/** The headless display. */
+static struct monitor_headless headless;
+
+/** Nonzero to render to image files instead of the display. */
+static int headless_on;
+
+/** The composited picture. */
+static struct monitor_canvas canvas;
+
+/** The camera snapshot being rendered, or NULL. */
+static const struct camera_snapshot* camera;
+
+/** The overlay snapshot being rendered. */
+static const struct overlay_snapshot* overlay;
+
+/** The status snapshot being rendered. */
+static const struct monitor_status* status;
+
+/** The sequence number of the camera snapshot on the canvas. */
+static unsigned long camera_drawn;
+
+/** The overlay on the canvas. */
+static struct overlay_snapshot overlay_drawn;
+
+/** The status on the canvas. */
+static struct monitor_status status_drawn;
+
+/** Nonzero until the next render has drawn everything. */
+static int first_render;
+
+/** The regions to redraw. */
+static struct monitor_dirty dirty;
+
+/** The metric graphs. */
+static struct graph graphs[MONITOR_GRAPHS];
+
+/** The metric history version the graphs were last updated at. */
+static unsigned long graphs_version;
+
+/** The rendering statistics. */
+static struct monitor_stats stats;
+
+/** The timer on the loop that wakes the render thread. */
+static int render_timer = -1;
+
+/** The render thread. */
+static pthread_t render_thread;
+
+/** Guards the pending ticks and stop flag. */
+static pthread_mutex_t tick_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signaled when ticks arrive or the render thread is asked to exit. */
+static pthread_cond_t tick_cond = PTHREAD_COND_INITIALIZER;
+
+/** The ticks since the render thread last woke. Tick lock only. */
+static unsigned long long ticks_pending;
+
+/** Set to ask the render thread to exit. Tick lock only. */
+static int render_stop;
+
+/** Nonzero while the render thread runs. */
+static atomic_int running;
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Scale a frame into a camera snapshot with nearest-neighbor sampling.
+ *
+ * @param frame The frame
+ * @param snapshot The snapshot
+ */
+static void copy_frame(const struct face_frame* frame, struct camera_snapshot* snapshot) {
+  static int columns[MONITOR_CAMERA_WIDTH];
+
+  int bpp = frame->format == face_pixel_format_rgb24 ? 3 : 1;
+  for (int x = 0; x < MONITOR_CAMERA_WIDTH; ++x) {
+    columns[x] = (int) ((long) x * frame->width / MONITOR_CAMERA_WIDTH) * bpp;
+  }
+
+  for (int y = 0; y < MONITOR_HEIGHT; ++y) {
+    const unsigned char* src = frame->data + (size_t) ((long) y * frame->height / MONITOR_HEIGHT) * frame->stride;
+    unsigned int* dst = snapshot->pixels + (size_t) y * MONITOR_CAMERA_WIDTH;
+
+    if (bpp == 3) {
+      for (int x = 0; x < MONITOR_CAMERA_WIDTH; ++x) {
+        const unsigned char* p = src + columns[x];
+        dst[x] = (unsigned int) p[0] << 16 | (unsigned int) p[1] << 8 | p[2];
+      }
+    } else {
+      for (int x = 0; x < MONITOR_CAMERA_WIDTH; ++x) {
+        unsigned int v = src[columns[x]];
+        dst[x] = v << 16 | v << 8 | v;
+      }
+    }
+  }
+
+  snapshot->id = frame->id;
+}
+
+/**
+ * Get the four edges of a box outline.
+ *
+ * @param box The box
+ * @param edges The top, bottom, left and right edges
+ */
+static void box_edges(const struct monitor_rect* box, struct monitor_rect edges[4]) {
+  edges[0] = (struct monitor_rect) { box->x, box->y, box->width, BOX_THICKNESS };
+  edges[1] = (struct monitor_rect) { box->x, box->y + box->height - BOX_THICKNESS, box->width, BOX_THICKNESS };
+  edges[2] = (struct monitor_rect) { box->x, box->y, BOX_THICKNESS, box->height };
+  edges[3] = (struct monitor_rect) { box->x + box->width - BOX_THICKNESS, box->y, BOX_THICKNESS, box->height };
+}
+
+/**
+ * Mark the outlines of boxes dirty.
+ *
+ * @param list The boxes
+ * @param len The number of boxes
+ */
+static void invalidate_boxes(const struct overlay* list, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    struct monitor_rect edges[4];
+    box_edges(&list[i].rect, edges);
+
+    for (int e = 0; e < 4; ++e) {
+      struct monitor_rect r;
+      if (monitor_rect_intersect(&edges[e], &camera_rect, &r)) {
+        monitor_dirty_add(&dirty, &r);
+      }
+    }
+  }
+}
+
+/**
+ * Get the area a status line occupies.
+ *
+ * @param line The line number
+ * @param first The first character
+ * @param len The number of characters
+ * @return The rectangle
+ */
+static struct monitor_rect status_span(size_t line, size_t first, size_t len) {
+  return (struct monitor_rect) {
+    panel_rect.x + TEXT_MARGIN + (int) first * MONITOR_GLYPH_WIDTH * TEXT_SCALE,
+    panel_rect.y + TEXT_MARGIN + (int) line * MONITOR_GLYPH_HEIGHT * TEXT_SCALE,
+    (int) len * MONITOR_GLYPH_WIDTH * TEXT_SCALE,
+    MONITOR_GLYPH_HEIGHT * TEXT_SCALE,
+  };
+}
+
+/**
+ * Mark the characters that differ between the drawn and latest status dirty.
+ */
+static void invalidate_status(void) {
+  for (size_t i = 0; i < MONITOR_STATUS_LINES; ++i) {
+    const char* old = status_drawn.lines[i];
+    const char* now = status->lines[i];
+
+    size_t first = 0;
+    while (old[first] && old[first] == now[first]) {
+      ++first;
+    }
+
+    size_t old_len = strlen(old);
+    size_t new_len = strlen(now);
+    size_t end = old_len > new_len ? old_len : new_len;
+
+    // Only trailing characters that differ need clearing
+    while (end > first && end <= old_len && end <= new_len && old[end - 1] == now[end - 1]) {
+      --end;
+    }
+
+    if (end > first) {
+      struct monitor_rect span = status_span(i, first, end - first);
+      struct monitor_rect r;
+      if (monitor_rect_intersect(&span, &panel_rect, &r)) {
+        monitor_dirty_add(&dirty, &r);
+      }
+    }
+  }
+}
+
+/**
+ * Get the area a graph occupies.
+ *
+ * @param i The graph number
+ * @return The rectangle
+ */
+static struct monitor_rect graph_rect(size_t i) {
+  return (struct monitor_rect) {
+    panel_rect.x, GRAPHS_TOP + (int) i * GRAPH_HEIGHT, panel_rect.width, GRAPH_HEIGHT,
+  };
+}
+
+/**
+ * Format a value in at most six characters.
+ *
+ * @param v The value
+ * @param out The text
+ * @param len The size of out
+ */
+static void format_value(double v, char* out, size_t len) {
+  if (v >= 1e9) {
+    snprintf(out, len, "%.1fG", v / 1e9);
+  } else if (v >= 1e6) {
+    snprintf(out, len, "%.1fM", v / 1e6);
+  } else if (v >= 1e3) {
+    snprintf(out, len, "%.1fK", v / 1e3);
+  } else {
+    snprintf(out, len, "%.0f", v);
+  }
+}
+
+/**
+ * Pull the latest history into the graphs, looking up any metrics that were
+ * not yet registered.
+ */
+static void update_graphs(void) {
+  struct metric* all[METRIC_MAX];
+  size_t all_len = 0;
+  int listed = 0;
+
+  for (size_t i = 0; i < MONITOR_GRAPHS; ++i) {
+    struct graph* g = &graphs[i];
+    if (!g->name[0]) {
+      continue;
+    }
+
+    if (!g->metric) {
+      if (!listed) {
+        all_len = metric_list(all, METRIC_MAX);
+        listed = 1;
+      }
+
+      for (size_t k = 0; k < all_len; ++k) {
+        if (!strcmp(metric_name(all[k]), g->name)) {
+          g->metric = all[k];
+          break;
+        }
+      }
+
+      if (!g->metric) {
+        continue;
+      }
+    }
+
+    struct metric_point history[METRIC_HISTORY];
+    g->len = metric_history(g->metric, metric_resolution_1s, history, METRIC_HISTORY);
+    g->peak = 0;
+
+    // Distributions are graphed by their tail, everything else by value
+    int tail = metric_kind(g->metric) == metric_kind_histogram;
+    for (size_t k = 0; k < g->len; ++k) {
+      g->points[k] = tail ? history[k].p99 : history[k].value;
+      if (g->points[k] > g->peak) {
+        g->peak = g->points[k];
+      }
+    }
+
+    g->value[0] = '\0';
+    if (g->len) {
+      format_value(g->points[g->len - 1], g->value, sizeof g->value);
+    }
+  }
+}
+
+/**
+ * Draw the part of a graph within a rectangle.
+ *
+ * @param i The graph number
+ * @param clip The rectangle
+ */
+static void draw_graph(size_t i, const struct monitor_rect* clip) {
+  const struct graph* g = &graphs[i];
+  struct monitor_rect area = graph_rect(i);
+
+  if (!g->name[0]) {
+    return;
+  }
+
+  int x = area.x + TEXT_MARGIN;
+  int top = area.y + TEXT_MARGIN + MONITOR_GLYPH_HEIGHT * TEXT_SCALE;
+  int bottom = top + GRAPH_BAR_HEIGHT;
+
+  monitor_canvas_text(&canvas, x, area.y + TEXT_MARGIN, TEXT_SCALE, g->name, clip, COLOR_TEXT);
+
+  // Newest points sit at the right edge so the graph scrolls leftward
+  int left = x + (METRIC_HISTORY - (int) g->len) * GRAPH_BAR_WIDTH;
+  for (size_t k = 0; k < g->len && g->peak > 0; ++k) {
+    int h = (int) (g->points[k] / g->peak * GRAPH_BAR_HEIGHT + 0.5);
+    struct monitor_rect bar = { left + (int) k * GRAPH_BAR_WIDTH, bottom - h, GRAPH_BAR_WIDTH, h };
+    monitor_canvas_fill(&canvas, &bar, clip, COLOR_GRAPH);
+  }
+
+  monitor_canvas_text(&canvas, x + METRIC_HISTORY * GRAPH_BAR_WIDTH + TEXT_MARGIN,
+      bottom - MONITOR_GLYPH_HEIGHT, 1, g->value, clip, COLOR_TEXT);
+}
+
+/**
+ * Redraw one dirty rectangle from the snapshots.
+ *
+ * @param r The rectangle
+ */
+static void composite(const struct monitor_rect* r) {
+  struct monitor_rect part;
+
+  if (monitor_rect_intersect(r, &camera_rect, &part)) {
+    if (camera) {
+      struct monitor_canvas layer = { MONITOR_CAMERA_WIDTH, MONITOR_HEIGHT, (unsigned int*) camera->pixels };
+      monitor_canvas_copy(&canvas, &layer, &part);
+    } else {
+      monitor_canvas_fill(&canvas, &part, &part, 0);
+    }
+
+    for (size_t i = 0; i < overlay->len; ++i) {
+      struct monitor_rect edges[4];
+      box_edges(&overlay->boxes[i].rect, edges);
+
+      for (int e = 0; e < 4; ++e) {
+        monitor_canvas_fill(&canvas, &edges[e], &part, overlay->boxes[i].color);
+      }
+    }
+  }
+
+  if (monitor_rect_intersect(r, &panel_rect, &part)) {
+    monitor_canvas_fill(&canvas, &part, &part, COLOR_PANEL);
+
+    for (size_t i = 0; i < MONITOR_STATUS_LINES; ++i) {
+      struct monitor_rect line = status_span(i, 0, MONITOR_STATUS_LEN - 1);
+      struct monitor_rect visible;
+      if (status->lines[i][0] && monitor_rect_intersect(&line, &part, &visible)) {
+        monitor_canvas_text(&canvas, line.x, line.y, TEXT_SCALE, status->lines[i], &visible, COLOR_TEXT);
+      }
+    }
+
+    for (size_t i = 0; i < MONITOR_GRAPHS; ++i) {
+      struct monitor_rect area = graph_rect(i);
+      struct monitor_rect visible;
+      if (monitor_rect_intersect(&area, &part, &visible)) {
+        draw_graph(i, &visible);
+      }
+    }
+  }
+}
+
+/**
+ * Redraw whatever changed since the last render and present it. Call with the
+ * render lock held.
+ *
+ * @param out What was redrawn, or NULL
+ */
+static void render(struct monitor_render* out) {
+  unsigned long long t0 = now_ns();
+
+  // Take the newest snapshots, dropping any that were never rendered
+  camera = tribuf_take(&cameras, &stats.frames_dropped);
+  overlay = tribuf_take(&overlays, &stats.snapshots_dropped);
+  status = tribuf_take(&statuses, &stats.snapshots_dropped);
+
+  if (!overlay) {
+    overlay = &no_overlay;
+  }
+  if (!status) {
+    status = &no_status;
+  }
+
+  // History gains a point at most once a second, so graphs rarely change
+  metric_sample(t0);
+
+  unsigned long version = metric_version();
+  int graphs_changed = version != graphs_version;
+  if (graphs_changed) {
+    update_graphs();
+    graphs_version = version;
+  }
+
+  monitor_dirty_clear(&dirty);
+
+  if (first_render) {
+    monitor_dirty_add(&dirty, &screen_rect);
+    first_render = 0;
+  } else {
+    // A new camera frame covers the whole view, boxes included
+    if (cameras.taken != camera_drawn) {
+      monitor_dirty_add(&dirty, &camera_rect);
+    } else if (overlay->len != overlay_drawn.len
+        || memcmp(overlay->boxes, overlay_drawn.boxes, overlay->len * sizeof *overlay->boxes)) {
+      invalidate_boxes(overlay_drawn.boxes, overlay_drawn.len);
+      invalidate_boxes(overlay->boxes, overlay->len);
+    }
+
+    if (status->version != status_drawn.version) {
+      invalidate_status();
+    }
+
+    for (size_t i = 0; i < MONITOR_GRAPHS && graphs_changed; ++i) {
+      if (graphs[i].metric) {
+        struct monitor_rect area = graph_rect(i);
+        monitor_dirty_add(&dirty, &area);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < dirty.len; ++i) {
+    composite(&dirty.rects[i]);
+  }
+
+  camera_drawn = cameras.taken;
+  overlay_drawn = *overlay;
+  status_drawn = *status;
+
+  if (dirty.len) {
+    if (headless_on) {
+      monitor_headless_present(&headless, canvas.pixels, dirty.rects, dirty.len);
+    } else if (display.present) {
+      display.present(display.ctx, canvas.pixels, dirty.rects, dirty.len);
+    }
+  }
+
+  size_t area = monitor_dirty_area(&dirty);
+  unsigned long long elapsed = now_ns() - t0;
+
+  ++stats.renders;
+  stats.renders_clean += !dirty.len;
+  stats.area_last = area;
+  stats.area_total += area;
+  stats.time_last = elapsed;
+  stats.time_total += elapsed;
+
+  if (out) {
+    out->area = area;
+    out->regions = dirty.len;
+    out->time = elapsed;
+  }
+}
+
+/**
+ * Render for the ticks that woke the render thread.
+ *
+ * @param ticks The number of ticks
+ */
+static void render_ticks(unsigned long long ticks) {
+  TRACE_SCOPE("render");
+
+  pthread_mutex_lock(&render_lock);
+
+  // Ticks a slow render overran are skipped rather than rendered back to back
+  stats.ticks_missed += ticks - 1;
+  render(NULL);
+
+  pthread_mutex_unlock(&render_lock);
+}
+
+static void* render_main(void* arg) {
+  service_sched_thread(SERVICE_MONITOR);
+
+  pthread_mutex_lock(&tick_lock);
+
+  for (;;) {
+    while (!ticks_pending && !render_stop) {
+      pthread_cond_wait(&tick_cond, &tick_lock);
+    }
+
+    if (render_stop) {
+      break;
+    }
+
+    unsigned long long ticks = ticks_pending;
+    ticks_pending = 0;
+
+    pthread_mutex_unlock(&tick_lock);
+    render_ticks(ticks);
+    pthread_mutex_lock(&tick_lock);
+  }
+
+  pthread_mutex_unlock(&tick_lock);
+  return NULL;
+}
+
+static void on_tick(int timer, unsigned long long expirations, void* ctx) {
+  // Only wake the render thread, as the loop must not wait on a render
+  pthread_mutex_lock(&tick_lock);
+  ticks_pending += expirations;
+  pthread_cond_signal(&tick_cond);
+  pthread_mutex_unlock(&tick_lock);
+}
+
+/**
+ * Ask the render thread to exit and join it.
+ */
+static void join_render(void) {
+  pthread_mutex_lock(&tick_lock);
+  render_stop = 1;
+  pthread_cond_signal(&tick_cond);
+  pthread_mutex_unlock(&tick_lock);
+
+  pthread_join(render_thread, NULL);
+}
+
 static int proc_hello(struct service* svc, const void* arg1, void* arg2) {
   LOGI("Hello, world!");
   return 0;
 }
 
+static int proc_configure(struct service* svc, const void* arg1, void* arg2) {
+  const struct monitor_config* next = arg1;
+
+  if (atomic_load(&running)) {
+    LOGE("Cannot configure the monitor while it is running");
+    return 1;
+  }
+
+  if (next->fps <= 0) {
+    LOGE("Invalid monitor frame rate");
+    return 1;
+  }
+
+  pthread_mutex_lock(&render_lock);
+
+  if (headless_on) {
+    monitor_headless_free(&headless);
+    headless_on = 0;
+  }
+
+  int failed = 0;
+  if (next->headless_dir) {
+    if (monitor_headless_init(&headless, next->headless_dir)) {
+      LOGE("Failed to set up headless rendering to {}", _str(next->headless_dir));
+      failed = 1;
+    } else {
+      headless_on = 1;
+    }
+  }
+
+  config = *next;
+  config.headless_dir = headless_on ? headless.dir : NULL;
+
+  for (size_t i = 0; i < MONITOR_GRAPHS; ++i) {
+    memset(&graphs[i], 0, sizeof graphs[i]);
+    if (next->graphs[i]) {
+      snprintf(graphs[i].name, sizeof graphs[i].name, "%s", next->graphs[i]);
+    }
+    config.graphs[i] = next->graphs[i] ? graphs[i].name : NULL;
+  }
+
+  update_graphs();
+
+  // A new output has seen nothing yet
+  first_render = 1;
+
+  pthread_mutex_unlock(&render_lock);
+  return failed;
+}
+
+static int proc_set_display(struct service* svc, const void* arg1, void* arg2) {
+  pthread_mutex_lock(&render_lock);
+
+  display = *(const struct monitor_display*) arg1;
+  first_render = 1;
+
+  pthread_mutex_unlock(&render_lock);
+  return 0;
+}
+
+static int proc_show_frame(struct service* svc, const void* arg1, void* arg2) {
+  const struct face_frame* frame = arg1;
+  const struct face_result* result = arg2;
+
+  if (frame->width <= 0 || frame->height <= 0) {
+    return 1;
+  }
+
+  if (!shown_any || frame->id != shown_id) {
+    copy_frame(frame, tribuf_back(&cameras));
+    tribuf_publish(&cameras);
+
+    shown_id = frame->id;
+    shown_any = 1;
+    atomic_fetch_add_explicit(&frames_copied, 1, memory_order_relaxed);
+  }
+
+  if (result) {
+    struct overlay_snapshot* next = tribuf_back(&overlays);
+    next->len = result->faces_len < FACE_MAX_FACES ? result->faces_len : FACE_MAX_FACES;
+
+    for (size_t i = 0; i < next->len; ++i) {
+      const struct face_box* box = &result->faces[i].box;
+
+      next->boxes[i].rect = (struct monitor_rect) {
+        (int) ((long) box->x * MONITOR_CAMERA_WIDTH / frame->width),
+        (int) ((long) box->y * MONITOR_HEIGHT / frame->height),
+        (int) ((long) box->width * MONITOR_CAMERA_WIDTH / frame->width),
+        (int) ((long) box->height * MONITOR_HEIGHT / frame->height),
+      };
+      next->boxes[i].color = result->faces[i].identity >= 0 ? COLOR_KNOWN : COLOR_UNKNOWN;
+    }
+
+    tribuf_publish(&overlays);
+  }
+
+  return 0;
+}
+
+static int proc_show_status(struct service* svc, const void* arg1, void* arg2) {
+  struct monitor_status* next = tribuf_back(&statuses);
+  *next = *(const struct monitor_status*) arg1;
+
+  // Never trust the producer to terminate lines
+  for (size_t i = 0; i < MONITOR_STATUS_LINES; ++i) {
+    next->lines[i][MONITOR_STATUS_LEN - 1] = '\0';
+  }
+
+  tribuf_publish(&statuses);
+  return 0;
+}
+
+static int proc_render(struct service* svc, const void* arg1, void* arg2) {
+  pthread_mutex_lock(&render_lock);
+  render(arg2);
+  pthread_mutex_unlock(&render_lock);
+  return 0;
+}
+
+static int proc_get_stats(struct service* svc, const void* arg1, void* arg2) {
+  struct monitor_stats* out = arg2;
+
+  pthread_mutex_lock(&render_lock);
+  *out = stats;
+  pthread_mutex_unlock(&render_lock);
+
+  out->frames_copied = atomic_load_explicit(&frames_copied, memory_order_relaxed);
+  return 0;
+}
+
 static service_proc get_proc(const struct service* svc, int proc) {
   switch (proc) {
     case service_monitor_proc_hello:
       return &proc_hello;
+    case service_monitor_proc_configure:
+      return &proc_configure;
+    case service_monitor_proc_set_display:
+      return &proc_set_display;
+    case service_monitor_proc_show_frame:
+      return &proc_show_frame;
+    case service_monitor_proc_show_status:
+      return &proc_show_status;
+    case service_monitor_proc_render:
+      return &proc_render;
+    case service_monitor_proc_get_stats:
+      return &proc_get_stats;
     default:
       return NULL;
   }
 }
 
+/**
+ * Free everything allocated at load.
+ */
+static void teardown(void) {
+  monitor_canvas_free(&canvas);
+  tribuf_free(&cameras);
+  tribuf_free(&overlays);
+  tribuf_free(&statuses);
+
+  if (headless_on) {
+    monitor_headless_free(&headless);
+    headless_on = 0;
+  }
+}
+
 static int on_load(struct service* svc) {
   LOGI("Monitor service load");
+
+  // Allocate up front so producers never have to
+  if (monitor_canvas_init(&canvas, MONITOR_WIDTH, MONITOR_HEIGHT)
+      || tribuf_init(&cameras, sizeof(struct camera_snapshot))
+      || tribuf_init(&overlays, sizeof(struct overlay_snapshot))
+      || tribuf_init(&statuses, sizeof(struct monitor_status))) {
+    LOGE("Failed to allocate monitor canvas");
+    teardown();
+    return 1;
+  }
+
+  memset(&display, 0, sizeof display);
+  memset(&overlay_drawn, 0, sizeof overlay_drawn);
+  memset(&status_drawn, 0, sizeof status_drawn);
+  memset(&stats, 0, sizeof stats);
+
+  config = (struct monitor_config) {
+    .fps = 30,
+    .headless_dir = NULL,
+  };
+
+  memset(graphs, 0, sizeof graphs);
+  for (size_t i = 0; i < MONITOR_GRAPHS; ++i) {
+    snprintf(graphs[i].name, sizeof graphs[i].name, "%s", default_graphs[i]);
+    config.graphs[i] = graphs[i].name;
+  }
+  graphs_version = 0;
+
+  shown_id = 0;
+  shown_any = 0;
+  atomic_store(&frames_copied, 0);
+  camera_drawn = 0;
+  first_render = 1;
+
   return 0;
 }
 
 static int on_unload(struct service* svc) {
   LOGI("Monitor service unload");
+  teardown();
   return 0;
 }
 
 static int on_start(struct service* svc) {
   LOGI("Monitor service start");
+
+  ticks_pending = 0;
+  render_stop = 0;
+  if (pthread_create(&render_thread, NULL, &render_main, NULL)) {
+    LOGE("Failed to start monitor render thread");
+    return 1;
+  }
+
+  unsigned long long period = 1000000000ull / (unsigned long long) config.fps;
+  if (loop_add_timer(SERVICE_MONITOR, period, &on_tick, NULL, &render_timer)) {
+    LOGE("Failed to start monitor render ticks");
+    join_render();
+    return 1;
+  }
+
+  atomic_store(&running, 1);
   return 0;
 }
 
 static int on_stop(struct service* svc) {
   LOGI("Monitor service stop");
+
+  // Once removed, no tick can wake the thread again
+  loop_remove_timer(render_timer);
+  render_timer = -1;
+  join_render();
+  atomic_store(&running, 0);
+
   return 0;
 }
 
@@ -56,4 +924,5 @@ struct service* const SERVICE_MONITOR = &(struct service) {
     .on_start = &on_start,
     .on_stop = &on_stop,
   },
+  .sched_class = service_class_background,
 };
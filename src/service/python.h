@@ -6,9 +6,268 @@
 #ifndef SERVICE_PYTHON_H
 #define SERVICE_PYTHON_H
 
-/** A Python service procedure. */
+/** The most interpreter threads. */
+#define PYTHON_MAX_THREADS 8
+
+/** The most tasks that can wait for an interpreter thread. */
+#define PYTHON_QUEUE_LEN 256
+
+/** The most tasks run under one acquisition of the GIL. */
+#define PYTHON_BATCH_MAX 64
+
+/** The most sub-interpreters for behaviour scripts. */
+#define PYTHON_MAX_INTERPRETERS 8
+
+/** The most scripts that can wait for one sub-interpreter. */
+#define PYTHON_SCRIPT_QUEUE_LEN 32
+
+/**
+ * A Python service procedure.
+ *
+ * Python code only ever runs on the service's interpreter threads. Other
+ * threads hand it work through a queue and never touch the GIL themselves.
+ */
 enum service_python_proc {
   service_python_proc_hello,
+
+  /**
+   * Configure the interpreter threads. Takes const struct python_config* as
+   * arg1. Only allowed while the service is stopped.
+   */
+  service_python_proc_configure,
+
+  /**
+   * Queue a task for an interpreter thread. Takes const struct python_task*
+   * as arg1. Never waits on the GIL. Fails if the queue is full. Tasks queued
+   * while stopped run once started.
+   */
+  service_python_proc_submit,
+
+  /**
+   * Run Python source and wait for it to finish. Takes const char* as arg1.
+   * Fails if the source raised. Runs on an interpreter thread while started,
+   * otherwise on the caller. Never call from a task.
+   */
+  service_python_proc_exec,
+
+  /** Get interpreter statistics. Takes struct python_stats* as arg2. */
+  service_python_proc_get_stats,
+
+  /**
+   * Run a behaviour script on a sub-interpreter chosen by the placement
+   * policy. Takes const struct python_script* as arg1, which is copied, and
+   * optionally int* as arg2 for the interpreter chosen. Never waits for the
+   * script. Fails if stopped or the interpreter's queue is full. Before
+   * CPython 3.12, each sub-interpreter is a worker process instead, so
+   * scripts still run in parallel.
+   */
+  service_python_proc_spawn,
+
+  /**
+   * Get sub-interpreter statistics. Takes const int* as arg1 for the
+   * interpreter and struct python_interp_stats* as arg2. Fails if there is no
+   * such interpreter.
+   */
+  service_python_proc_get_interp_stats,
+
+  /**
+   * Precompile a directory of Python source into a code archive for
+   * python_config.archive. Takes const struct python_pack* as arg1. Runs on
+   * the caller. Fails if any source does not compile.
+   */
+  service_python_proc_pack,
+};
+
+/**
+ * A task function. Called on an interpreter thread with the GIL held, along
+ * with every other task queued at the time. Any exception it leaves set is
+ * printed and cleared.
+ *
+ * @param ctx The task context
+ */
+typedef void (* python_task_fn)(void* ctx);
+
+/** A task for an interpreter thread. */
+struct python_task {
+  /** The function. */
+  python_task_fn fn;
+
+  /** The function context. */
+  void* ctx;
+};
+
+/** A policy for placing scripts on sub-interpreters. */
+enum python_placement {
+  /** The interpreter with the fewest scripts waiting or running, then the least CPU time. */
+  python_placement_least_loaded,
+
+  /** Each interpreter in turn. */
+  python_placement_round_robin,
+
+  /** The same interpreter for the same script name, so its imports stay warm. */
+  python_placement_by_name,
+};
+
+/** A behaviour script. */
+struct python_script {
+  /** The name, used for placement and tracebacks, or NULL. */
+  const char* name;
+
+  /** The source. */
+  const char* source;
+};
+
+/** A code archive to pack. */
+struct python_pack {
+  /** The source directory. Subdirectories are packed as subpackages. */
+  const char* source;
+
+  /** The archive, replaced atomically. */
+  const char* archive;
+};
+
+/** A Python configuration. */
+struct python_config {
+  /** The number of interpreter threads. */
+  int threads;
+
+  /** The most tasks to run per GIL acquisition, up to PYTHON_BATCH_MAX. */
+  int batch_max;
+
+  /** The number of sub-interpreters for scripts, up to PYTHON_MAX_INTERPRETERS. */
+  int interpreters;
+
+  /** The script placement policy. */
+  enum python_placement placement;
+
+  /** The code archive to import from ahead of sys.path, or NULL. Must outlive the service. */
+  const char* archive;
+
+  /** Comma-separated modules to import before any script runs, or NULL. Must outlive the service. */
+  const char* preload;
+
+  /** Nonzero to run archive modules only once first used, rather than on import. */
+  int lazy_imports;
+
+  /** Nonzero to warm the interpreter on a background thread rather than during start. */
+  int prewarm;
+};
+
+/** Python statistics. */
+struct python_stats {
+  /** The number of tasks queued. */
+  unsigned long tasks_submitted;
+
+  /** The number of tasks refused because the queue was full. */
+  unsigned long tasks_rejected;
+
+  /** The number of tasks run. */
+  unsigned long tasks_run;
+
+  /** The number of tasks that left an exception set. */
+  unsigned long tasks_failed;
+
+  /** The number of batches run, each under one GIL acquisition. */
+  unsigned long batches;
+
+  /** The most tasks ever waiting in the queue. */
+  unsigned long queue_max;
+
+  /** The number of times the GIL was acquired. */
+  unsigned long gil_acquisitions;
+
+  /** The total time spent waiting for the GIL in nanoseconds. */
+  unsigned long long gil_wait_total;
+
+  /** The longest wait for the GIL in nanoseconds. */
+  unsigned long long gil_wait_max;
+
+  /** The total time the GIL was held in nanoseconds. */
+  unsigned long long gil_hold_total;
+
+  /** The longest the GIL was held in nanoseconds. */
+  unsigned long long gil_hold_max;
+
+  /** The number of service calls made from Python with the GIL released. */
+  unsigned long released_calls;
+
+  /** The total time spent in those calls in nanoseconds. */
+  unsigned long long released_time;
+
+  /** The number of camera frames viewed in place. */
+  unsigned long frames_viewed;
+
+  /** The number of captured audio spans viewed in place. */
+  unsigned long audio_viewed;
+
+  /** The number of bytes handed to Python without a copy. */
+  unsigned long long bytes_viewed;
+
+  /** The number of frame and audio pins held by Python. */
+  unsigned long pins_held;
+
+  /** The number of service calls made by scripts, batched or not. */
+  unsigned long script_calls;
+
+  /** The number of batches of service calls made by scripts. */
+  unsigned long script_batches;
+
+  /** The number of sub-interpreters running. */
+  int interpreters;
+
+  /** Nonzero if each sub-interpreter has its own GIL. */
+  int own_gil;
+
+  /** Nonzero if scripts run in worker processes, as CPython has no GIL per sub-interpreter. */
+  int script_processes;
+
+  /** The number of scripts spawned. */
+  unsigned long scripts_spawned;
+
+  /** The number of scripts refused because an interpreter queue was full. */
+  unsigned long scripts_rejected;
+
+  /** The time to initialize CPython in nanoseconds. */
+  unsigned long long init_time;
+
+  /** The time to warm the main interpreter in nanoseconds. */
+  unsigned long long warm_time;
+
+  /** The time from load to the first script in nanoseconds, or zero if none ran yet. */
+  unsigned long long first_script_time;
+
+  /** The number of modules in the mapped code archive. */
+  unsigned long archive_modules;
+
+  /** The number of modules imported from the code archive. */
+  unsigned long archive_loads;
+};
+
+/** Sub-interpreter statistics. */
+struct python_interp_stats {
+  /** The number of scripts waiting. */
+  unsigned long scripts_waiting;
+
+  /** Nonzero while a script runs. */
+  int busy;
+
+  /** The number of scripts run. */
+  unsigned long scripts_run;
+
+  /** The number of scripts that raised. */
+  unsigned long scripts_failed;
+
+  /** The total CPU time spent running scripts in nanoseconds. */
+  unsigned long long cpu_time;
+
+  /** The total wall time spent running scripts in nanoseconds. */
+  unsigned long long run_time;
+
+  /** The total time scripts waited to start in nanoseconds. */
+  unsigned long long latency_total;
+
+  /** The longest a script waited to start in nanoseconds. */
+  unsigned long long latency_max;
 };
 
 /** The Python service. */
@@ -0,0 +1,148 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "gil.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "../../metric.h"
+
+/** The number of times the GIL was acquired. */
+static atomic_ulong acquisitions;
+
+/** The total GIL wait in nanoseconds. */
+static atomic_ullong wait_total;
+
+/** The longest GIL wait in nanoseconds. */
+static atomic_ullong wait_max;
+
+/** The total GIL hold in nanoseconds. */
+static atomic_ullong hold_total;
+
+/** The longest GIL hold in nanoseconds. */
+static atomic_ullong hold_max;
+
+/** The number of service calls made with the GIL released. */
+static atomic_ulong released_calls;
+
+/** The total time in those calls in nanoseconds. */
+static atomic_ullong released_time;
+
+/** The distribution of GIL waits. */
+static struct metric* metric_wait_ns;
+
+/** The distribution of GIL holds. */
+static struct metric* metric_hold_ns;
+
+/** When the calling thread last acquired the GIL, or zero if not tracked. */
+static _Thread_local unsigned long long acquired_at;
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Raise a maximum to at least a value.
+ */
+static void raise_max(atomic_ullong* max, unsigned long long v) {
+  unsigned long long cur = atomic_load_explicit(max, memory_order_relaxed);
+  while (v > cur && !atomic_compare_exchange_weak_explicit(max, &cur, v, memory_order_relaxed,
+      memory_order_relaxed)) {
+  }
+}
+
+void python_gil_init(void) {
+  atomic_store(&acquisitions, 0);
+  atomic_store(&wait_total, 0);
+  atomic_store(&wait_max, 0);
+  atomic_store(&hold_total, 0);
+  atomic_store(&hold_max, 0);
+  atomic_store(&released_calls, 0);
+  atomic_store(&released_time, 0);
+
+  metric_wait_ns = metric_get("python.gil_wait_ns", metric_kind_histogram);
+  metric_hold_ns = metric_get("python.gil_hold_ns", metric_kind_histogram);
+}
+
+/**
+ * Account a wait for the GIL that began at a time and just ended.
+ */
+static void account_wait(unsigned long long t0) {
+  acquired_at = now_ns();
+
+  unsigned long long wait = acquired_at - t0;
+  atomic_fetch_add_explicit(&acquisitions, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&wait_total, wait, memory_order_relaxed);
+  raise_max(&wait_max, wait);
+  metric_record(metric_wait_ns, wait);
+}
+
+/**
+ * Account the hold of the GIL that is about to end.
+ */
+static void account_hold(void) {
+  if (!acquired_at) {
+    return;
+  }
+
+  unsigned long long hold = now_ns() - acquired_at;
+  atomic_fetch_add_explicit(&hold_total, hold, memory_order_relaxed);
+  raise_max(&hold_max, hold);
+  metric_record(metric_hold_ns, hold);
+
+  acquired_at = 0;
+}
+
+void python_gil_acquire(PyThreadState* ts) {
+  unsigned long long t0 = now_ns();
+  PyEval_RestoreThread(ts);
+  account_wait(t0);
+}
+
+PyThreadState* python_gil_release(void) {
+  account_hold();
+  return PyEval_SaveThread();
+}
+
+PyGILState_STATE python_gil_ensure(void) {
+  unsigned long long t0 = now_ns();
+  PyGILState_STATE state = PyGILState_Ensure();
+  account_wait(t0);
+  return state;
+}
+
+void python_gil_release_state(PyGILState_STATE state) {
+  account_hold();
+  PyGILState_Release(state);
+}
+
+void python_gil_call(const struct python_gil_call* calls, size_t len, int* results) {
+  PyThreadState* ts = python_gil_release();
+
+  unsigned long long t0 = now_ns();
+  for (size_t i = 0; i < len; ++i) {
+    results[i] = calls[i].sp(calls[i].svc, calls[i].arg1, calls[i].arg2);
+  }
+  unsigned long long elapsed = now_ns() - t0;
+
+  atomic_fetch_add_explicit(&released_calls, len, memory_order_relaxed);
+  atomic_fetch_add_explicit(&released_time, elapsed, memory_order_relaxed);
+
+  python_gil_acquire(ts);
+}
+
+void python_gil_read(struct python_gil_stats* out) {
+  out->acquisitions = atomic_load_explicit(&acquisitions, memory_order_relaxed);
+  out->wait_total = atomic_load_explicit(&wait_total, memory_order_relaxed);
+  out->wait_max = atomic_load_explicit(&wait_max, memory_order_relaxed);
+  out->hold_total = atomic_load_explicit(&hold_total, memory_order_relaxed);
+  out->hold_max = atomic_load_explicit(&hold_max, memory_order_relaxed);
+  out->released_calls = atomic_load_explicit(&released_calls, memory_order_relaxed);
+  out->released_time = atomic_load_explicit(&released_time, memory_order_relaxed);
+}
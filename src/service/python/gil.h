@@ -0,0 +1,107 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_PYTHON_GIL_H
+#define SERVICE_PYTHON_GIL_H
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stddef.h>
+
+#include "../../service.h"
+
+/** A service call to make with the GIL released. */
+struct python_gil_call {
+  /** The service. */
+  struct service* svc;
+
+  /** The procedure, already looked up. */
+  service_proc sp;
+
+  /** The first argument. */
+  const void* arg1;
+
+  /** The second argument. */
+  void* arg2;
+};
+
+/** GIL accounting totals. */
+struct python_gil_stats {
+  /** The number of times the GIL was acquired. */
+  unsigned long acquisitions;
+
+  /** The total time spent waiting for the GIL in nanoseconds. */
+  unsigned long long wait_total;
+
+  /** The longest wait for the GIL in nanoseconds. */
+  unsigned long long wait_max;
+
+  /** The total time the GIL was held in nanoseconds. */
+  unsigned long long hold_total;
+
+  /** The longest the GIL was held in nanoseconds. */
+  unsigned long long hold_max;
+
+  /** The number of service calls made with the GIL released. */
+  unsigned long released_calls;
+
+  /** The total time spent in those calls in nanoseconds. */
+  unsigned long long released_time;
+};
+
+/**
+ * Register the GIL metrics and reset the totals. Not thread-safe.
+ */
+void python_gil_init(void);
+
+/**
+ * Acquire the GIL for a thread state, accounting the wait.
+ *
+ * @param ts The thread state
+ */
+void python_gil_acquire(PyThreadState* ts);
+
+/**
+ * Release the GIL, accounting the hold since the matching acquire.
+ *
+ * @return The thread state to acquire with again
+ */
+PyThreadState* python_gil_release(void);
+
+/**
+ * Acquire the GIL from a thread that may have no thread state of its own,
+ * accounting the wait.
+ *
+ * @return The state to give back to python_gil_release_state(...)
+ */
+PyGILState_STATE python_gil_ensure(void);
+
+/**
+ * Release the GIL taken with python_gil_ensure(), accounting the hold.
+ *
+ * @param state The state
+ */
+void python_gil_release_state(PyGILState_STATE state);
+
+/**
+ * Make service calls with the GIL released around all of them, so that long
+ * native work such as face matching or speech decoding never stalls other
+ * Python threads. Call with the GIL held.
+ *
+ * @param calls The calls, made in order
+ * @param len The number of calls
+ * @param results The procedure results
+ */
+void python_gil_call(const struct python_gil_call* calls, size_t len, int* results);
+
+/**
+ * Read the GIL accounting totals.
+ *
+ * @param out The totals
+ */
+void python_gil_read(struct python_gil_stats* out);
+
+#endif // #ifndef SERVICE_PYTHON_GIL_H
@@ -0,0 +1,917 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "interp.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../log.h"
+#include "../../metric.h"
+#include "../../service.h"
+#include "../../trace.h"
+
+#include "gil.h"
+#include "module.h"
+#include "startup.h"
+
+#define LOG_TAG "python"
+
+/** Whether sub-interpreters can have their own GIL. */
+#define OWN_GIL (PY_VERSION_HEX >= 0x030C0000)
+
+/** The bytes a worker channel carries at once, a script or the arguments of a call. */
+#define CHANNEL_LEN (1u << 20)
+
+/** Round a length in a worker channel up so what follows it is aligned. */
+#define CHANNEL_ALIGN(len) (((len) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+
+/** How often to check that a worker process is alive while waiting on it in nanoseconds. */
+#define WORKER_POLL_NS 100000000l
+
+/** A queued script. */
+struct script {
+  /** When the script was spawned in nanoseconds. */
+  unsigned long long spawned_at;
+
+  /** The name. */
+  const char* name;
+
+  /** The source, followed by the name. */
+  char source[];
+};
+
+#if !OWN_GIL
+
+/** A message over a worker channel. */
+enum channel_op {
+  /** To the worker, run the script in the data, its source then its name. */
+  channel_op_run,
+
+  /** To the worker, exit. */
+  channel_op_exit,
+
+  /** To the worker, a call was made and its second argument is back in the data. */
+  channel_op_reply,
+
+  /** To the driver, make a call with the arguments in the data. */
+  channel_op_call,
+
+  /** To the driver, the script finished. */
+  channel_op_done,
+};
+
+/**
+ * Shared memory between a worker process and the thread that drives it. Each
+ * side writes a message, then posts to the other and waits, so only one side
+ * touches it at a time.
+ */
+struct channel {
+  /** Posted when a message is ready for the worker. */
+  sem_t to_worker;
+
+  /** Posted when a message is ready for the driver. */
+  sem_t to_driver;
+
+  /** Set once scripts are asked to finish. */
+  atomic_int stop;
+
+  /** The message. */
+  enum channel_op op;
+
+  /** The procedure to call, as the module numbers them. */
+  int spec;
+
+  /** The call result, or nonzero if the script raised. */
+  int result;
+
+  /** The length of the first argument in bytes, or zero for NULL. */
+  size_t len1;
+
+  /** The length of the second argument in bytes, or zero for NULL. It follows the first, aligned. */
+  size_t len2;
+
+  /** The CPU time the script took in nanoseconds. */
+  unsigned long long cpu_time;
+
+  /** The script or the arguments. */
+  _Alignas(max_align_t) char data[CHANNEL_LEN];
+};
+
+#endif
+
+/** A sub-interpreter, or the worker process standing in for one, and the thread that runs it. */
+struct interp {
+  /** The thread. */
+  pthread_t thread;
+
+  /** The thread's parked main interpreter thread state. */
+  PyThreadState* boot;
+
+#if OWN_GIL
+  /** The sub-interpreter thread state. */
+  PyThreadState* ts;
+#else
+  /** The worker process, or zero if it exited. */
+  pid_t pid;
+
+  /** The channel to the worker process. */
+  struct channel* channel;
+#endif
+
+  /** Signaled when scripts are queued or the pool is stopping. */
+  pthread_cond_t cond;
+
+  /** The queued scripts, a ring starting at head. */
+  struct script* queue[PYTHON_SCRIPT_QUEUE_LEN];
+
+  /** The index of the oldest queued script. */
+  size_t head;
+
+  /** The number of queued scripts. */
+  size_t len;
+
+  /** Zero while starting, positive once ready, or negative if it failed. */
+  int ready;
+
+  /** The statistics. */
+  struct python_interp_stats stats;
+
+  /** The CPU time spent running scripts. */
+  struct metric* metric_cpu_ns;
+};
+
+/** The main interpreter. */
+static PyInterpreterState* main_interp;
+
+/** The configuration. */
+static const struct python_config* pool_config;
+
+/** The interpreters. Pool lock only. */
+static struct interp interps[PYTHON_MAX_INTERPRETERS];
+
+/** The number of interpreters started. */
+static int interps_len;
+
+/** The next interpreter for round-robin placement. */
+static unsigned int next_index;
+
+/** The pool totals. Pool lock only. */
+static struct python_interp_totals totals;
+
+/** Guards the interpreters and totals. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signaled when an interpreter is ready or has failed. */
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+/** The distribution of script start latencies. */
+static struct metric* metric_latency_ns;
+
+/** Set to ask scripts to finish and the interpreters to exit once idle. */
+static atomic_int pool_stop;
+
+#if !OWN_GIL
+/** In a worker process, the channel to its driver, otherwise NULL. */
+static struct channel* worker_channel;
+#endif
+
+static unsigned long long now_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Hash a script name for placement.
+ *
+ * @param name The name
+ * @return The FNV-1a hash
+ */
+static unsigned int hash_name(const char* name) {
+  unsigned int h = 2166136261u;
+  for (; *name; ++name) {
+    h = (h ^ (unsigned char) *name) * 16777619u;
+  }
+  return h;
+}
+
+/**
+ * Drop the calling thread's parked main thread state.
+ *
+ * @param boot The main interpreter thread state
+ */
+static void drop_boot(PyThreadState* boot) {
+  PyEval_RestoreThread(boot);
+  PyThreadState_Clear(boot);
+  PyThreadState_DeleteCurrent();
+}
+
+/**
+ * Run a script in fresh globals. Call with the GIL held.
+ *
+ * @param source The source
+ * @param name The name
+ * @return Zero on success, otherwise nonzero
+ */
+static int run_script(const char* source, const char* name) {
+  TRACE_SCOPE("script");
+
+  PyObject* result = NULL;
+  PyObject* code = Py_CompileString(source, name, Py_file_input);
+
+  if (code) {
+    PyObject* globals = Py_BuildValue("{s:O,s:s}", "__builtins__", PyEval_GetBuiltins(), "__name__", "__main__");
+    if (globals) {
+      result = PyEval_EvalCode(code, globals, globals);
+      Py_DECREF(globals);
+    }
+    Py_DECREF(code);
+  }
+
+  if (!result) {
+    PyErr_Print();
+    return 1;
+  }
+
+  Py_DECREF(result);
+  return 0;
+}
+
+#if OWN_GIL
+
+/**
+ * Create the calling thread's sub-interpreter, with a GIL of its own, and warm
+ * it. Takes the main GIL through the parked thread state to do so.
+ *
+ * @param in The interpreter
+ * @return Zero on success, otherwise nonzero
+ */
+static int open_interp(struct interp* in) {
+  PyEval_RestoreThread(in->boot);
+
+  PyInterpreterConfig cfg = {
+    .use_main_obmalloc = 0,
+    .allow_fork = 0,
+    .allow_exec = 0,
+    .allow_threads = 1,
+    .allow_daemon_threads = 0,
+    .check_multi_interp_extensions = 1,
+    .gil = PyInterpreterConfig_OWN_GIL,
+  };
+
+  // The main GIL is given up as the new one is taken
+  PyStatus status = Py_NewInterpreterFromConfig(&in->ts, &cfg);
+  if (PyStatus_Exception(status)) {
+    LOGE("Failed to create Python sub-interpreter: {}", _str(status.err_msg ? status.err_msg : "unknown"));
+    PyEval_SaveThread();
+    return 1;
+  }
+
+  PyEval_SaveThread();
+
+  // Scripts queue up while the interpreter warms
+  python_gil_acquire(in->ts);
+  python_startup_warm(pool_config, 0);
+  python_gil_release();
+
+  return 0;
+}
+
+/**
+ * End the calling thread's sub-interpreter and drop its parked main thread
+ * state.
+ *
+ * @param in The interpreter
+ */
+static void close_interp(struct interp* in) {
+  PyEval_RestoreThread(in->ts);
+  Py_EndInterpreter(in->ts);
+
+  // The interpreter's own GIL went with it
+  drop_boot(in->boot);
+}
+
+/**
+ * Run a script on the calling thread's sub-interpreter.
+ *
+ * @param in The interpreter
+ * @param s The script
+ * @param cpu The CPU time it took in nanoseconds
+ * @return Zero on success, otherwise nonzero
+ */
+static int run_on(struct interp* in, const struct script* s, unsigned long long* cpu) {
+  unsigned long long c0 = now_ns(CLOCK_THREAD_CPUTIME_ID);
+
+  python_gil_acquire(in->ts);
+  int failed = run_script(s->source, s->name);
+  python_gil_release();
+
+  *cpu = now_ns(CLOCK_THREAD_CPUTIME_ID) - c0;
+  return failed;
+}
+
+#else
+
+//
+// Worker Processes
+//
+// Before 3.12 every sub-interpreter takes turns under the one GIL, so scripts
+// would never run on two cores at once. Instead each interpreter is a worker
+// process forked from the main interpreter, with the GIL and modules as they
+// were at the fork, and its thread here drives it over a channel in shared
+// memory. The worker has only copies of the services, so calls its scripts
+// make are forwarded to this process, arguments copied both ways, and the
+// driver makes them. Procedures that take pointers and the zero-copy views
+// have no meaning across processes and are refused there.
+//
+// A worker that dies fails the script it was running and is forked again for
+// the next one.
+//
+
+/**
+ * Flush a standard stream of the worker, as it exits without finalizing.
+ *
+ * @param name The name in sys
+ */
+static void flush_std(const char* name) {
+  PyObject* stream = PySys_GetObject(name);
+  PyObject* result = stream && stream != Py_None ? PyObject_CallMethod(stream, "flush", NULL) : NULL;
+  Py_XDECREF(result);
+  PyErr_Clear();
+}
+
+/**
+ * Wait for the driver to post to the worker. Call with the GIL released.
+ *
+ * @param ch The channel
+ */
+static void wait_driver(struct channel* ch) {
+  while (sem_wait(&ch->to_worker) && errno == EINTR) {
+  }
+}
+
+/**
+ * Run scripts as the driver asks, then exit. The worker starts out holding
+ * the GIL as the driver did when it forked.
+ *
+ * @param ch The channel
+ * @param parent The service process
+ */
+static void worker_main(struct channel* ch, pid_t parent) {
+  worker_channel = ch;
+
+  // Go down with the service process rather than linger
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  if (getppid() != parent) {
+    _exit(1);
+  }
+
+  // A sink like the console's draws in the service process, not here
+  log_set_sink(NULL);
+
+  python_startup_warm(pool_config, 0);
+
+  for (;;) {
+    PyThreadState* ts = PyEval_SaveThread();
+    wait_driver(ch);
+    PyEval_RestoreThread(ts);
+
+    if (ch->op != channel_op_run) {
+      break;
+    }
+
+    unsigned long long c0 = now_ns(CLOCK_THREAD_CPUTIME_ID);
+    ch->result = run_script(ch->data, ch->data + strlen(ch->data) + 1);
+    ch->cpu_time = now_ns(CLOCK_THREAD_CPUTIME_ID) - c0;
+
+    flush_std("stdout");
+    flush_std("stderr");
+
+    ch->op = channel_op_done;
+    sem_post(&ch->to_driver);
+  }
+
+  _exit(0);
+}
+
+/**
+ * Initialize the semaphores of a worker channel.
+ *
+ * @param ch The channel
+ * @return Zero on success, otherwise nonzero
+ */
+static int init_channel(struct channel* ch) {
+  if (sem_init(&ch->to_worker, 1, 0) || sem_init(&ch->to_driver, 1, 0)) {
+    LOGE("Failed to create Python worker semaphores: {}", _str(strerror(errno)));
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Destroy the semaphores of a worker channel.
+ *
+ * @param ch The channel
+ */
+static void destroy_channel(struct channel* ch) {
+  sem_destroy(&ch->to_worker);
+  sem_destroy(&ch->to_driver);
+}
+
+/**
+ * Fork a worker process for an interpreter. Takes the main GIL through the
+ * parked thread state, so the worker starts out holding it.
+ *
+ * @param in The interpreter
+ * @return Zero on success, otherwise nonzero
+ */
+static int fork_worker(struct interp* in) {
+  struct channel* ch = in->channel;
+  pid_t parent = getpid();
+
+  PyEval_RestoreThread(in->boot);
+  PyOS_BeforeFork();
+
+  pid_t pid = fork();
+  if (!pid) {
+    PyOS_AfterFork_Child();
+    worker_main(ch, parent);
+  }
+
+  int err = errno;
+  PyOS_AfterFork_Parent();
+  PyEval_SaveThread();
+
+  if (pid < 0) {
+    LOGE("Failed to fork a Python worker process: {}", _str(strerror(err)));
+    return 1;
+  }
+
+  in->pid = pid;
+  return 0;
+}
+
+/**
+ * Wait for the worker to post to the driver.
+ *
+ * @param in The interpreter
+ * @return Zero once posted, or nonzero if the worker exited
+ */
+static int wait_worker(struct interp* in) {
+  for (;;) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += WORKER_POLL_NS;
+    if (deadline.tv_nsec >= 1000000000l) {
+      deadline.tv_nsec -= 1000000000l;
+      ++deadline.tv_sec;
+    }
+
+    if (!sem_timedwait(&in->channel->to_driver, &deadline)) {
+      return 0;
+    }
+
+    if (errno == ETIMEDOUT && waitpid(in->pid, NULL, WNOHANG) == in->pid) {
+      in->pid = 0;
+      return 1;
+    }
+  }
+}
+
+/**
+ * Make a call a worker forwarded, and put the result in the channel.
+ *
+ * @param ch The channel
+ */
+static void serve_call(struct channel* ch) {
+  size_t off2 = CHANNEL_ALIGN(ch->len1);
+
+  if (ch->len1 > CHANNEL_LEN || off2 > CHANNEL_LEN || ch->len2 > CHANNEL_LEN - off2) {
+    ch->result = 1;
+  } else {
+    ch->result = python_module_serve(ch->spec, ch->len1 ? ch->data : NULL, ch->len1,
+        ch->len2 ? ch->data + off2 : NULL, ch->len2);
+  }
+
+  ch->op = channel_op_reply;
+}
+
+/**
+ * Map the channel and fork the worker process for an interpreter.
+ *
+ * @param in The interpreter
+ * @return Zero on success, otherwise nonzero
+ */
+static int open_interp(struct interp* in) {
+  // Anonymous shared mappings are inherited across fork and start zeroed
+  void* map = mmap(NULL, sizeof *in->channel, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    LOGE("Failed to map a Python worker channel: {}", _str(strerror(errno)));
+    return 1;
+  }
+
+  in->channel = map;
+  if (init_channel(in->channel)) {
+    munmap(in->channel, sizeof *in->channel);
+    in->channel = NULL;
+    return 1;
+  }
+
+  if (fork_worker(in)) {
+    destroy_channel(in->channel);
+    munmap(in->channel, sizeof *in->channel);
+    in->channel = NULL;
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Ask the worker process to exit, wait for it and unmap its channel.
+ *
+ * @param in The interpreter
+ */
+static void close_interp(struct interp* in) {
+  struct channel* ch = in->channel;
+
+  if (in->pid) {
+    ch->op = channel_op_exit;
+    sem_post(&ch->to_worker);
+
+    while (waitpid(in->pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+    in->pid = 0;
+  }
+
+  destroy_channel(ch);
+  munmap(ch, sizeof *ch);
+  in->channel = NULL;
+
+  drop_boot(in->boot);
+}
+
+/**
+ * Run a script on an interpreter's worker process, making the calls it
+ * forwards until it finishes.
+ *
+ * @param in The interpreter
+ * @param s The script
+ * @param cpu The CPU time it took in nanoseconds
+ * @return Zero on success, otherwise nonzero
+ */
+static int run_on(struct interp* in, const struct script* s, unsigned long long* cpu) {
+  struct channel* ch = in->channel;
+  *cpu = 0;
+
+  // A worker that died is replaced, and anything it left in the channel forgotten
+  if (!in->pid) {
+    destroy_channel(ch);
+    if (init_channel(ch) || fork_worker(in)) {
+      return 1;
+    }
+  }
+
+  size_t source_len = strlen(s->source) + 1;
+  memcpy(ch->data, s->source, source_len + strlen(s->name) + 1);
+  ch->op = channel_op_run;
+  sem_post(&ch->to_worker);
+
+  while (!wait_worker(in)) {
+    if (ch->op == channel_op_done) {
+      *cpu = ch->cpu_time;
+      return ch->result;
+    }
+
+    serve_call(ch);
+    sem_post(&ch->to_worker);
+  }
+
+  LOGW("Python worker process exited while running {}", _str(s->name));
+  return 1;
+}
+
+#endif
+
+static void* interp_main(void* arg) {
+  struct interp* in = arg;
+
+  service_sched_thread(SERVICE_PYTHON);
+
+  in->boot = PyThreadState_New(main_interp);
+  int fail = open_interp(in);
+
+  pthread_mutex_lock(&pool_lock);
+  in->ready = fail ? -1 : 1;
+  pthread_cond_broadcast(&ready_cond);
+
+  pthread_mutex_unlock(&pool_lock);
+
+  if (fail) {
+    drop_boot(in->boot);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+
+  for (;;) {
+    while (!in->len && !atomic_load(&pool_stop)) {
+      pthread_cond_wait(&in->cond, &pool_lock);
+    }
+
+    // Only exit once everything queued has run
+    if (!in->len) {
+      break;
+    }
+
+    struct script* s = in->queue[in->head];
+    in->head = (in->head + 1) % PYTHON_SCRIPT_QUEUE_LEN;
+    --in->len;
+    --in->stats.scripts_waiting;
+    in->stats.busy = 1;
+
+    pthread_mutex_unlock(&pool_lock);
+
+    unsigned long long t0 = now_ns(CLOCK_MONOTONIC);
+    unsigned long long latency = t0 - s->spawned_at;
+
+    python_startup_first_script();
+
+    unsigned long long cpu;
+    int failed = run_on(in, s, &cpu);
+
+    unsigned long long run = now_ns(CLOCK_MONOTONIC) - t0;
+    free(s);
+
+    metric_record(metric_latency_ns, latency);
+    metric_add(in->metric_cpu_ns, cpu);
+
+    pthread_mutex_lock(&pool_lock);
+    in->stats.busy = 0;
+    ++in->stats.scripts_run;
+    in->stats.scripts_failed += failed;
+    in->stats.cpu_time += cpu;
+    in->stats.run_time += run;
+    in->stats.latency_total += latency;
+    if (latency > in->stats.latency_max) {
+      in->stats.latency_max = latency;
+    }
+  }
+
+  pthread_mutex_unlock(&pool_lock);
+
+  close_interp(in);
+  return NULL;
+}
+
+/**
+ * Pick an interpreter for a script. Call with the pool lock held.
+ *
+ * @param name The script name
+ * @param placement The placement policy
+ * @return The interpreter index
+ */
+static int place(const char* name, enum python_placement placement) {
+  switch (placement) {
+    case python_placement_round_robin:
+      return (int) (next_index++ % (unsigned int) interps_len);
+    case python_placement_by_name:
+      return (int) (hash_name(name) % (unsigned int) interps_len);
+    default:
+      break;
+  }
+
+  int best = 0;
+  for (int i = 1; i < interps_len; ++i) {
+    const struct python_interp_stats* a = &interps[i].stats;
+    const struct python_interp_stats* b = &interps[best].stats;
+    unsigned long load_a = a->scripts_waiting + a->busy;
+    unsigned long load_b = b->scripts_waiting + b->busy;
+
+    if (load_a < load_b || (load_a == load_b && a->cpu_time < b->cpu_time)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+int python_interp_start(PyInterpreterState* main, const struct python_config* config) {
+  int len = config->interpreters;
+
+  main_interp = main;
+  pool_config = config;
+  metric_latency_ns = metric_get("python.script_latency_ns", metric_kind_histogram);
+
+  atomic_store(&pool_stop, 0);
+
+  pthread_mutex_lock(&pool_lock);
+
+  memset(&totals, 0, sizeof totals);
+  totals.own_gil = OWN_GIL;
+  totals.processes = !OWN_GIL;
+  next_index = 0;
+
+  int fail = 0;
+  for (interps_len = 0; interps_len < len; ++interps_len) {
+    struct interp* in = &interps[interps_len];
+    memset(in, 0, sizeof *in);
+    pthread_cond_init(&in->cond, NULL);
+
+    char name[32];
+    snprintf(name, sizeof name, "python.interp%d.cpu_ns", interps_len);
+    in->metric_cpu_ns = metric_get(name, metric_kind_counter);
+
+    if (pthread_create(&in->thread, NULL, &interp_main, in)) {
+      LOGE("Failed to start Python sub-interpreter thread");
+      pthread_cond_destroy(&in->cond);
+      fail = 1;
+      break;
+    }
+  }
+
+  // Interpreters are created one at a time under the main GIL
+  for (int i = 0; i < interps_len; ++i) {
+    while (!interps[i].ready) {
+      pthread_cond_wait(&ready_cond, &pool_lock);
+    }
+    fail |= interps[i].ready < 0;
+  }
+
+  totals.interpreters = fail ? 0 : interps_len;
+
+  pthread_mutex_unlock(&pool_lock);
+
+  if (fail) {
+    python_interp_stop();
+    return 1;
+  }
+
+  if (len) {
+    LOGI("Started {} Python {}", _i(len), _str(OWN_GIL ? "sub-interpreters" : "worker processes"));
+  }
+  return 0;
+}
+
+void python_interp_stop(void) {
+  pthread_mutex_lock(&pool_lock);
+  atomic_store(&pool_stop, 1);
+  totals.interpreters = 0;
+  for (int i = 0; i < interps_len; ++i) {
+#if !OWN_GIL
+    if (interps[i].channel) {
+      atomic_store(&interps[i].channel->stop, 1);
+    }
+#endif
+    pthread_cond_signal(&interps[i].cond);
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  for (int i = 0; i < interps_len; ++i) {
+    pthread_join(interps[i].thread, NULL);
+    pthread_cond_destroy(&interps[i].cond);
+  }
+  interps_len = 0;
+}
+
+int python_interp_spawn(const struct python_script* script, enum python_placement placement, int* index) {
+  const char* name = script->name ? script->name : "<script>";
+  size_t source_len = strlen(script->source) + 1;
+  size_t name_len = strlen(name) + 1;
+
+#if !OWN_GIL
+  if (source_len + name_len > CHANNEL_LEN) {
+    LOGE("Python script {} is too long for a worker process", _str(name));
+    return 1;
+  }
+#endif
+
+  struct script* s = malloc(sizeof *s + source_len + name_len);
+  if (!s) {
+    return 1;
+  }
+
+  memcpy(s->source, script->source, source_len);
+  memcpy(s->source + source_len, name, name_len);
+  s->name = s->source + source_len;
+  s->spawned_at = now_ns(CLOCK_MONOTONIC);
+
+  pthread_mutex_lock(&pool_lock);
+
+  if (!totals.interpreters || atomic_load(&pool_stop)) {
+    pthread_mutex_unlock(&pool_lock);
+    free(s);
+    LOGE("No Python sub-interpreters are running");
+    return 1;
+  }
+
+  int i = place(s->name, placement);
+  struct interp* in = &interps[i];
+
+  if (in->len == PYTHON_SCRIPT_QUEUE_LEN) {
+    ++totals.rejected;
+    pthread_mutex_unlock(&pool_lock);
+    free(s);
+    LOGE("Python sub-interpreter {} script queue is full", _i(i));
+    return 1;
+  }
+
+  in->queue[(in->head + in->len) % PYTHON_SCRIPT_QUEUE_LEN] = s;
+  ++in->len;
+  ++in->stats.scripts_waiting;
+  ++totals.spawned;
+  pthread_cond_signal(&in->cond);
+
+  pthread_mutex_unlock(&pool_lock);
+
+  if (index) {
+    *index = i;
+  }
+  return 0;
+}
+
+int python_interp_stopping(void) {
+#if !OWN_GIL
+  if (worker_channel) {
+    return atomic_load(&worker_channel->stop);
+  }
+#endif
+
+  return atomic_load(&pool_stop);
+}
+
+int python_interp_worker(void) {
+#if OWN_GIL
+  return 0;
+#else
+  return worker_channel != NULL;
+#endif
+}
+
+int python_interp_forward(int spec, const void* arg1, size_t len1, void* arg2, size_t len2, int* result) {
+#if OWN_GIL
+  return 1;
+#else
+  struct channel* ch = worker_channel;
+  size_t off2 = CHANNEL_ALIGN(len1);
+
+  if (!ch || len1 > CHANNEL_LEN || off2 > CHANNEL_LEN || len2 > CHANNEL_LEN - off2) {
+    return 1;
+  }
+
+  if (len1) {
+    memcpy(ch->data, arg1, len1);
+  }
+  if (len2) {
+    memcpy(ch->data + off2, arg2, len2);
+  }
+
+  ch->spec = spec;
+  ch->len1 = len1;
+  ch->len2 = len2;
+  ch->op = channel_op_call;
+
+  // The GIL stays held, so calls from other Python threads wait their turn for the channel
+  sem_post(&ch->to_driver);
+  wait_driver(ch);
+
+  if (len2) {
+    memcpy(arg2, ch->data + off2, len2);
+  }
+
+  *result = ch->result;
+  return 0;
+#endif
+}
+
+int python_interp_read(int index, struct python_interp_stats* out) {
+  pthread_mutex_lock(&pool_lock);
+
+  int fail = index < 0 || index >= totals.interpreters;
+  if (!fail) {
+    *out = interps[index].stats;
+  }
+
+  pthread_mutex_unlock(&pool_lock);
+  return fail;
+}
+
+void python_interp_totals(struct python_interp_totals* out) {
+  pthread_mutex_lock(&pool_lock);
+  *out = totals;
+  pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,120 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_PYTHON_INTERP_H
+#define SERVICE_PYTHON_INTERP_H
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "../python.h"
+
+//
+// Sub-Interpreter Pool
+//
+// Behaviour scripts run on a pool of isolated sub-interpreters, each on its
+// own thread with its own modules and globals. Where CPython has a GIL per
+// interpreter (3.12 and up) they run in parallel on separate cores. Older
+// versions would have them take turns under the one GIL, so there each is a
+// worker process forked from the main interpreter instead, driven by its
+// thread over shared memory. Service calls from a worker are forwarded to
+// the service process, which copies their arguments, so procedures taking
+// pointers and the zero-copy views are not available to it.
+//
+// Scripts are placed on an interpreter when spawned and run there in order,
+// each in fresh globals. A script that loops should poll
+// cozmonaut.stopping() so the service can stop.
+//
+
+/** Pool totals. */
+struct python_interp_totals {
+  /** The number of interpreters running. */
+  int interpreters;
+
+  /** Nonzero if each interpreter has its own GIL. */
+  int own_gil;
+
+  /** Nonzero if each interpreter is a worker process. */
+  int processes;
+
+  /** The number of scripts spawned. */
+  unsigned long spawned;
+
+  /** The number of scripts refused because an interpreter queue was full. */
+  unsigned long rejected;
+};
+
+/**
+ * Start the pool. Each interpreter warms itself in the background, and
+ * scripts spawned meanwhile wait for it. Call without the GIL held.
+ *
+ * @param main The main interpreter
+ * @param config The configuration, which must outlive the pool
+ * @return Zero on success, otherwise nonzero
+ */
+int python_interp_start(PyInterpreterState* main, const struct python_config* config);
+
+/**
+ * Stop the pool once every script spawned has run. Call without the GIL held.
+ */
+void python_interp_stop(void);
+
+/**
+ * Place a script on an interpreter and queue it there.
+ *
+ * @param script The script, copied
+ * @param placement The placement policy
+ * @param index The interpreter chosen, or NULL
+ * @return Zero on success, otherwise nonzero
+ */
+int python_interp_spawn(const struct python_script* script, enum python_placement placement, int* index);
+
+/**
+ * Check whether scripts are being asked to finish.
+ *
+ * @return Nonzero if the pool is stopping
+ */
+int python_interp_stopping(void);
+
+/**
+ * Check whether the caller is a worker process, where service calls must be
+ * forwarded with python_interp_forward(...).
+ *
+ * @return Nonzero if it is
+ */
+int python_interp_worker(void);
+
+/**
+ * Forward a service call from a worker process to the service process and
+ * wait for it. Both arguments are copied across and the second copied back.
+ * Call with the GIL held.
+ *
+ * @param spec The procedure, as python_module_serve(...) numbers them
+ * @param arg1 The first argument, or NULL
+ * @param len1 The length of the first argument in bytes
+ * @param arg2 The second argument, or NULL
+ * @param len2 The length of the second argument in bytes
+ * @param result The result code
+ * @return Zero on success, otherwise nonzero if not a worker or the arguments are too long
+ */
+int python_interp_forward(int spec, const void* arg1, size_t len1, void* arg2, size_t len2, int* result);
+
+/**
+ * Read the statistics of one interpreter.
+ *
+ * @param index The interpreter
+ * @param out The statistics
+ * @return Zero on success, otherwise nonzero
+ */
+int python_interp_read(int index, struct python_interp_stats* out);
+
+/**
+ * Read the pool totals.
+ *
+ * @param out The totals
+ */
+void python_interp_totals(struct python_interp_totals* out);
+
+#endif // #ifndef SERVICE_PYTHON_INTERP_H
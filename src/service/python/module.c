@@ -0,0 +1,932 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "module.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "../console.h"
+#include "../face.h"
+#include "../monitor.h"
+#include "../python.h"
+#include "../speech.h"
+
+#include "../../service.h"
+
+#include "gil.h"
+#include "interp.h"
+#include "startup.h"
+#include "view.h"
+
+/** The number of calls a batch can marshal without allocating. */
+#define BATCH_STACK_LEN 16
+
+/** An argument a procedure takes nothing for. */
+#define ARG_NONE { arg_kind_none, 0, NULL, 0 }
+
+/** An argument a procedure takes by pointer to a type. */
+#define ARG(kind, type) { arg_kind_##kind, sizeof(type), #type, 0 }
+
+/** An argument a procedure takes by pointer to a type that holds pointers. */
+#define ARG_POINTERS(kind, type) { arg_kind_##kind, sizeof(type), #type, 1 }
+
+/** An argument a procedure takes as a string. */
+#define ARG_TEXT(kind) { arg_kind_##kind, 0, "str", 0 }
+
+/** How a procedure argument is passed. */
+enum arg_kind {
+  /** Unused, so only None. */
+  arg_kind_none,
+
+  /** A str, passed as its UTF-8 text. */
+  arg_kind_text,
+
+  /** A str, or None for NULL. */
+  arg_kind_text_optional,
+
+  /** A buffer at least the size of the type, passed by pointer. */
+  arg_kind_struct,
+
+  /** A buffer at least the size of the type, or None for NULL. */
+  arg_kind_struct_optional,
+};
+
+/** A procedure argument. */
+struct arg_spec {
+  /** How it is passed. */
+  enum arg_kind kind;
+
+  /** The least size of a buffer in bytes. */
+  size_t size;
+
+  /** The type, for errors. */
+  const char* type;
+
+  /** Nonzero if the type holds pointers, so it cannot be copied to another process. */
+  int pointers;
+};
+
+/** The arguments of a procedure scripts can call. */
+struct proc_spec {
+  /** The service. */
+  struct service* const* svc;
+
+  /** The procedure number. */
+  int proc;
+
+  /** The first argument. */
+  struct arg_spec in;
+
+  /** The second argument. */
+  struct arg_spec out;
+};
+
+/** A resolved service procedure. */
+struct proc_object {
+  PyObject_HEAD
+
+  /** The service. */
+  struct service* svc;
+
+  /** The procedure. */
+  service_proc sp;
+
+  /** The procedure number. */
+  int proc;
+
+  /** The arguments it takes. */
+  const struct proc_spec* spec;
+
+  /** Nonzero to release the GIL around single calls. */
+  int release_gil;
+};
+
+/** The marshalled arguments of one call. */
+struct call_args {
+  /** The arguments the procedure takes. */
+  const struct proc_spec* spec;
+
+  /** The first argument's buffer, if it has one. */
+  Py_buffer in;
+
+  /** The second argument's buffer, if it has one. */
+  Py_buffer out;
+};
+
+/** The services scripts can call, by name. */
+static struct service* const* const services[] = {
+  &SERVICE_CONSOLE,
+  &SERVICE_FACE,
+  &SERVICE_MONITOR,
+  &SERVICE_PYTHON,
+  &SERVICE_SPEECH,
+};
+
+/**
+ * The procedures scripts can call. Procedures read their arguments as
+ * structs, so each is checked against these before the call. Procedures
+ * left out take code pointers or handles a script cannot vouch for, have a
+ * safer wrapper in this module, or must not be called from an interpreter
+ * thread.
+ */
+static const struct proc_spec proc_specs[] = {
+  { &SERVICE_CONSOLE, service_console_proc_hello, ARG_NONE, ARG_NONE },
+  { &SERVICE_CONSOLE, service_console_proc_metrics, ARG_TEXT(text_optional), ARG_NONE },
+  { &SERVICE_CONSOLE, service_console_proc_command, ARG_TEXT(text), ARG_NONE },
+  { &SERVICE_CONSOLE, service_console_proc_get_stats, ARG_NONE, ARG(struct, struct console_stats) },
+
+  { &SERVICE_FACE, service_face_proc_hello, ARG_NONE, ARG_NONE },
+  { &SERVICE_FACE, service_face_proc_configure, ARG(struct, struct face_config), ARG_NONE },
+  { &SERVICE_FACE, service_face_proc_enroll, ARG(struct, struct face_identity), ARG_NONE },
+  {
+    &SERVICE_FACE, service_face_proc_process, ARG_POINTERS(struct, struct face_frame),
+    ARG(struct, struct face_result),
+  },
+  { &SERVICE_FACE, service_face_proc_submit, ARG_POINTERS(struct, struct face_frame), ARG_NONE },
+  { &SERVICE_FACE, service_face_proc_get_result, ARG_NONE, ARG(struct, struct face_result) },
+  { &SERVICE_FACE, service_face_proc_get_stats, ARG_NONE, ARG(struct, struct face_stats) },
+
+  { &SERVICE_MONITOR, service_monitor_proc_hello, ARG_NONE, ARG_NONE },
+  { &SERVICE_MONITOR, service_monitor_proc_configure, ARG_POINTERS(struct, struct monitor_config), ARG_NONE },
+  {
+    &SERVICE_MONITOR, service_monitor_proc_show_frame, ARG_POINTERS(struct, struct face_frame),
+    ARG(struct_optional, struct face_result),
+  },
+  { &SERVICE_MONITOR, service_monitor_proc_show_status, ARG(struct, struct monitor_status), ARG_NONE },
+  { &SERVICE_MONITOR, service_monitor_proc_render, ARG_NONE, ARG(struct_optional, struct monitor_render) },
+  { &SERVICE_MONITOR, service_monitor_proc_get_stats, ARG_NONE, ARG(struct, struct monitor_stats) },
+
+  { &SERVICE_PYTHON, service_python_proc_hello, ARG_NONE, ARG_NONE },
+  { &SERVICE_PYTHON, service_python_proc_get_stats, ARG_NONE, ARG(struct, struct python_stats) },
+  {
+    &SERVICE_PYTHON, service_python_proc_spawn, ARG_POINTERS(struct, struct python_script),
+    ARG(struct_optional, int),
+  },
+  {
+    &SERVICE_PYTHON, service_python_proc_get_interp_stats, ARG(struct, int),
+    ARG(struct, struct python_interp_stats),
+  },
+
+  { &SERVICE_SPEECH, service_speech_proc_hello, ARG_NONE, ARG_NONE },
+  { &SERVICE_SPEECH, service_speech_proc_configure, ARG_POINTERS(struct, struct speech_config), ARG_NONE },
+  {
+    &SERVICE_SPEECH, service_speech_proc_push_audio, ARG_POINTERS(struct, struct speech_audio),
+    ARG(struct_optional, size_t),
+  },
+  { &SERVICE_SPEECH, service_speech_proc_get_stats, ARG_NONE, ARG(struct, struct speech_stats) },
+  {
+    &SERVICE_SPEECH, service_speech_proc_replay, ARG_POINTERS(struct, struct speech_replay_options),
+    ARG_NONE,
+  },
+};
+
+/** The number of service calls made by scripts. */
+static atomic_ulong calls_made;
+
+/** The number of batches made by scripts. */
+static atomic_ulong batches_made;
+
+/**
+ * Find the arguments of a procedure scripts can call.
+ *
+ * @param svc The service
+ * @param proc The procedure number
+ * @return The arguments, or NULL if scripts cannot call it
+ */
+static const struct proc_spec* find_spec(const struct service* svc, int proc) {
+  for (size_t i = 0; i < sizeof proc_specs / sizeof *proc_specs; ++i) {
+    if (*proc_specs[i].svc == svc && proc_specs[i].proc == proc) {
+      return &proc_specs[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Marshal an argument as its procedure expects it: None as NULL, str as its
+ * UTF-8 text, and structs by pointer to a buffer at least their size.
+ *
+ * @param obj The argument
+ * @param spec How it is passed
+ * @param flags The buffer flags, PyBUF_WRITABLE for the second argument
+ * @param n The argument number, for errors
+ * @param view The buffer, released with release_args(...)
+ * @param out The pointer
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+static int marshal(PyObject* obj, const struct arg_spec* spec, int flags, int n, Py_buffer* view, void** out) {
+  view->obj = NULL;
+  *out = NULL;
+
+  switch (spec->kind) {
+    case arg_kind_none:
+      if (obj != Py_None) {
+        PyErr_Format(PyExc_TypeError, "argument %d must be None", n);
+        return 1;
+      }
+      return 0;
+    case arg_kind_text_optional:
+    case arg_kind_text:
+      if (obj == Py_None && spec->kind == arg_kind_text_optional) {
+        return 0;
+      }
+      if (!PyUnicode_Check(obj)) {
+        PyErr_Format(PyExc_TypeError, "argument %d must be str", n);
+        return 1;
+      }
+
+      // Strings cache their UTF-8 form, so this is free after the first time
+      *out = (void*) PyUnicode_AsUTF8(obj);
+      return *out ? 0 : 1;
+    case arg_kind_struct_optional:
+    case arg_kind_struct:
+      if (obj == Py_None && spec->kind == arg_kind_struct_optional) {
+        return 0;
+      }
+      if (obj == Py_None) {
+        PyErr_Format(PyExc_TypeError, "argument %d must be a buffer holding %s", n, spec->type);
+        return 1;
+      }
+      if (PyObject_GetBuffer(obj, view, flags)) {
+        return 1;
+      }
+      if ((size_t) view->len < spec->size) {
+        PyErr_Format(PyExc_ValueError, "argument %d is %zd bytes, too small for %s of %zu", n, view->len,
+            spec->type, spec->size);
+        PyBuffer_Release(view);
+        view->obj = NULL;
+        return 1;
+      }
+
+      *out = view->buf;
+      return 0;
+  }
+
+  return 0;
+}
+
+/**
+ * Marshal both arguments of a call.
+ *
+ * @param spec The procedure arguments
+ * @param arg1 The first argument
+ * @param arg2 The second argument
+ * @param args The buffers, released with release_args(...) on success
+ * @param call The call to fill in
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+static int marshal_args(const struct proc_spec* spec, PyObject* arg1, PyObject* arg2, struct call_args* args,
+    struct python_gil_call* call) {
+  args->spec = spec;
+
+  void* in;
+  if (marshal(arg1, &spec->in, PyBUF_SIMPLE, 1, &args->in, &in)) {
+    return 1;
+  }
+
+  if (marshal(arg2, &spec->out, PyBUF_WRITABLE, 2, &args->out, &call->arg2)) {
+    if (args->in.obj) {
+      PyBuffer_Release(&args->in);
+    }
+    return 1;
+  }
+
+  call->arg1 = in;
+  return 0;
+}
+
+/**
+ * Release marshalled arguments.
+ *
+ * @param args The arguments
+ * @param len The number of calls
+ */
+static void release_args(struct call_args* args, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if (args[i].in.obj) {
+      PyBuffer_Release(&args[i].in);
+    }
+    if (args[i].out.obj) {
+      PyBuffer_Release(&args[i].out);
+    }
+  }
+}
+
+/**
+ * Get the length of a marshalled argument, to copy it to another process.
+ *
+ * @param spec How it is passed
+ * @param arg The argument
+ * @return The length in bytes, or zero for NULL
+ */
+static size_t arg_len(const struct arg_spec* spec, const void* arg) {
+  if (!arg) {
+    return 0;
+  }
+
+  return spec->kind == arg_kind_text || spec->kind == arg_kind_text_optional ? strlen(arg) + 1 : spec->size;
+}
+
+/**
+ * Check an argument copied from another process.
+ *
+ * @param spec How it is passed
+ * @param arg The argument
+ * @param len The length in bytes
+ * @return Nonzero if the procedure can take it
+ */
+static int arg_fits(const struct arg_spec* spec, const void* arg, size_t len) {
+  if (spec->pointers) {
+    return 0;
+  }
+
+  if (!arg) {
+    return spec->kind != arg_kind_text && spec->kind != arg_kind_struct;
+  }
+
+  switch (spec->kind) {
+    case arg_kind_text_optional:
+    case arg_kind_text:
+      return len && !((const char*) arg)[len - 1];
+    case arg_kind_struct_optional:
+    case arg_kind_struct:
+      return len == spec->size;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Make a call from a worker process through the service process.
+ *
+ * @param spec The procedure arguments
+ * @param call The marshalled call
+ * @param result The result code
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+static int forward(const struct proc_spec* spec, const struct python_gil_call* call, int* result) {
+  if (spec->in.pointers || spec->out.pointers) {
+    PyErr_Format(PyExc_RuntimeError, "procedure %d of service %s takes pointers, so cannot be called from a "
+        "worker process", spec->proc, (*spec->svc)->name);
+    return 1;
+  }
+
+  if (python_interp_forward((int) (spec - proc_specs), call->arg1, arg_len(&spec->in, call->arg1), call->arg2,
+      arg_len(&spec->out, call->arg2), result)) {
+    PyErr_SetString(PyExc_RuntimeError, "arguments too long to forward to the service process");
+    return 1;
+  }
+
+  return 0;
+}
+
+static PyObject* proc_call(PyObject* self, PyObject* args, PyObject* kwargs) {
+  struct proc_object* p = (struct proc_object*) self;
+
+  PyObject* arg1 = Py_None;
+  PyObject* arg2 = Py_None;
+  if ((kwargs && PyDict_GET_SIZE(kwargs)) || !PyArg_UnpackTuple(args, "Proc", 0, 2, &arg1, &arg2)) {
+    if (!PyErr_Occurred()) {
+      PyErr_SetString(PyExc_TypeError, "Proc takes only positional arguments");
+    }
+    return NULL;
+  }
+
+  struct call_args marshalled;
+  struct python_gil_call call = {
+    .svc = p->svc,
+    .sp = p->sp,
+  };
+
+  if (marshal_args(p->spec, arg1, arg2, &marshalled, &call)) {
+    return NULL;
+  }
+
+  int result;
+  if (python_interp_worker()) {
+    if (forward(p->spec, &call, &result)) {
+      release_args(&marshalled, 1);
+      return NULL;
+    }
+  } else if (p->release_gil) {
+    python_gil_call(&call, 1, &result);
+  } else {
+    result = call.sp(call.svc, call.arg1, call.arg2);
+  }
+
+  release_args(&marshalled, 1);
+  atomic_fetch_add_explicit(&calls_made, 1, memory_order_relaxed);
+
+  return PyLong_FromLong(result);
+}
+
+static void proc_dealloc(PyObject* self) {
+  PyTypeObject* type = Py_TYPE(self);
+  type->tp_free(self);
+  Py_DECREF(type);
+}
+
+static PyObject* proc_repr(PyObject* self) {
+  struct proc_object* p = (struct proc_object*) self;
+  return PyUnicode_FromFormat("<cozmonaut.Proc %s:%d>", p->svc->name, p->proc);
+}
+
+static PyType_Slot proc_slots[] = {
+  { Py_tp_dealloc, &proc_dealloc },
+  { Py_tp_repr, &proc_repr },
+  { Py_tp_call, &proc_call },
+  {
+    Py_tp_doc, "A service procedure, looked up once. Call it with up to two arguments as it takes them: None, a "
+    "str, or a buffer at least the size of the struct passed by pointer, such as a ctypes structure or "
+    "bytearray. Returns the result code. From a worker process, calls are copied to the service process, and "
+    "procedures taking structs that hold pointers are refused.",
+  },
+  { 0, NULL },
+};
+
+static PyType_Spec proc_spec = {
+  .name = "cozmonaut.Proc",
+  .basicsize = sizeof(struct proc_object),
+  .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+  .slots = proc_slots,
+};
+
+static PyObject* finder_find_spec(PyObject* self, PyObject* args) {
+  PyObject* name;
+  PyObject* path = Py_None;
+  PyObject* target = Py_None;
+  if (!PyArg_UnpackTuple(args, "find_spec", 1, 3, &name, &path, &target)) {
+    return NULL;
+  }
+
+  const char* utf8 = PyUnicode_AsUTF8(name);
+  if (!utf8) {
+    return NULL;
+  }
+
+  // Packages in the archive find their submodules by full name, not path
+  int package;
+  if (python_startup_find(utf8, &package)) {
+    Py_RETURN_NONE;
+  }
+
+  struct python_module_state* state = PyType_GetModuleState(Py_TYPE(self));
+  PyObject* loader = state->lazy_loader ? state->lazy_loader : self;
+
+  PyObject* spec_args = Py_BuildValue("(OO)", name, loader);
+  PyObject* spec_kwargs = Py_BuildValue("{s:s,s:O}", "origin", python_startup_origin(), "is_package",
+      package ? Py_True : Py_False);
+
+  PyObject* spec = NULL;
+  if (spec_args && spec_kwargs) {
+    spec = PyObject_Call(state->spec_type, spec_args, spec_kwargs);
+  }
+
+  Py_XDECREF(spec_args);
+  Py_XDECREF(spec_kwargs);
+  return spec;
+}
+
+static PyObject* finder_create_module(PyObject* self, PyObject* spec) {
+  Py_RETURN_NONE;
+}
+
+static PyObject* finder_exec_module(PyObject* self, PyObject* module) {
+  const char* name = PyModule_GetName(module);
+  if (!name) {
+    return NULL;
+  }
+
+  PyObject* code = python_startup_load(name);
+  if (!code) {
+    return NULL;
+  }
+
+  PyObject* dict = PyModule_GetDict(module);
+  PyObject* result = PyEval_EvalCode(code, dict, dict);
+  Py_DECREF(code);
+
+  if (!result) {
+    return NULL;
+  }
+
+  Py_DECREF(result);
+  Py_RETURN_NONE;
+}
+
+static void finder_dealloc(PyObject* self) {
+  PyTypeObject* type = Py_TYPE(self);
+  type->tp_free(self);
+  Py_DECREF(type);
+}
+
+static PyMethodDef finder_methods[] = {
+  { "find_spec", &finder_find_spec, METH_VARARGS, "Find a module in the code archive." },
+  { "create_module", &finder_create_module, METH_O, "Use the default module creation." },
+  { "exec_module", &finder_exec_module, METH_O, "Run a module's code from the code archive." },
+  { NULL },
+};
+
+static PyType_Slot finder_slots[] = {
+  { Py_tp_dealloc, &finder_dealloc },
+  { Py_tp_methods, finder_methods },
+  { Py_tp_doc, "Imports precompiled modules from the mapped code archive." },
+  { 0, NULL },
+};
+
+static PyType_Spec finder_spec = {
+  .name = "cozmonaut.Finder",
+  .basicsize = sizeof(PyObject),
+  .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+  .slots = finder_slots,
+};
+
+static PyObject* module_proc(PyObject* self, PyObject* args, PyObject* kwargs) {
+  static char* keywords[] = { "service", "proc", "release_gil", NULL };
+  struct python_module_state* state = PyModule_GetState(self);
+
+  const char* name;
+  int proc;
+  int release_gil = 1;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "si|p:proc", keywords, &name, &proc, &release_gil)) {
+    return NULL;
+  }
+
+  PyObject* key = Py_BuildValue("(sii)", name, proc, release_gil);
+  if (!key) {
+    return NULL;
+  }
+
+  PyObject* cached = PyDict_GetItemWithError(state->procs, key);
+  if (cached || PyErr_Occurred()) {
+    Py_DECREF(key);
+    Py_XINCREF(cached);
+    return cached;
+  }
+
+  struct service* svc = NULL;
+  for (size_t i = 0; i < sizeof services / sizeof *services; ++i) {
+    if (!strcmp((*services[i])->name, name)) {
+      svc = *services[i];
+      break;
+    }
+  }
+
+  // A worker process has only copies of the services, so its calls are looked up where they are made
+  int worker = python_interp_worker();
+  service_proc sp = svc && !worker ? service_get_proc(svc, proc) : NULL;
+  if (!svc || (!sp && !worker)) {
+    Py_DECREF(key);
+    PyErr_Format(PyExc_LookupError, "no procedure %d in service %s", proc, name);
+    return NULL;
+  }
+
+  const struct proc_spec* spec = find_spec(svc, proc);
+  if (!spec) {
+    Py_DECREF(key);
+    PyErr_Format(PyExc_LookupError, "procedure %d of service %s cannot be called from scripts", proc, name);
+    return NULL;
+  }
+
+  struct proc_object* p = PyObject_New(struct proc_object, (PyTypeObject*) state->proc_type);
+  if (!p) {
+    Py_DECREF(key);
+    return NULL;
+  }
+
+  p->svc = svc;
+  p->sp = sp;
+  p->proc = proc;
+  p->spec = spec;
+  p->release_gil = release_gil;
+
+  if (PyDict_SetItem(state->procs, key, (PyObject*) p)) {
+    Py_DECREF(key);
+    Py_DECREF(p);
+    return NULL;
+  }
+
+  Py_DECREF(key);
+  return (PyObject*) p;
+}
+
+static PyObject* module_batch(PyObject* self, PyObject* arg) {
+  struct python_module_state* state = PyModule_GetState(self);
+  PyObject* seq = PySequence_Fast(arg, "batch takes a sequence of (proc, arg1, arg2) tuples");
+  if (!seq) {
+    return NULL;
+  }
+
+  size_t len = (size_t) PySequence_Fast_GET_SIZE(seq);
+  PyObject** items = PySequence_Fast_ITEMS(seq);
+
+  struct python_gil_call stack_calls[BATCH_STACK_LEN];
+  struct call_args stack_args[BATCH_STACK_LEN];
+  int stack_results[BATCH_STACK_LEN];
+
+  struct python_gil_call* calls = stack_calls;
+  struct call_args* marshalled = stack_args;
+  int* results = stack_results;
+
+  if (len > BATCH_STACK_LEN) {
+    calls = PyMem_Malloc(len * sizeof *calls);
+    marshalled = PyMem_Malloc(len * sizeof *marshalled);
+    results = PyMem_Malloc(len * sizeof *results);
+
+    if (!calls || !marshalled || !results) {
+      PyMem_Free(calls);
+      PyMem_Free(marshalled);
+      PyMem_Free(results);
+      Py_DECREF(seq);
+      return PyErr_NoMemory();
+    }
+  }
+
+  // Marshal everything up front so the GIL is released only once
+  size_t ready = 0;
+  for (; ready < len; ++ready) {
+    PyObject* item = items[ready];
+    PyObject* arg1 = Py_None;
+    PyObject* arg2 = Py_None;
+    PyObject* p = NULL;
+
+    if (!PyTuple_Check(item) || !PyArg_UnpackTuple(item, "batch", 1, 3, &p, &arg1, &arg2)) {
+      if (!PyErr_Occurred()) {
+        PyErr_SetString(PyExc_TypeError, "batch takes a sequence of (proc, arg1, arg2) tuples");
+      }
+      break;
+    }
+
+    if (!PyObject_TypeCheck(p, (PyTypeObject*) state->proc_type)) {
+      PyErr_SetString(PyExc_TypeError, "batch calls must start with a Proc");
+      break;
+    }
+
+    calls[ready].svc = ((struct proc_object*) p)->svc;
+    calls[ready].sp = ((struct proc_object*) p)->sp;
+
+    if (marshal_args(((struct proc_object*) p)->spec, arg1, arg2, &marshalled[ready], &calls[ready])) {
+      break;
+    }
+  }
+
+  int fail = ready < len;
+  if (!fail && python_interp_worker()) {
+    for (size_t i = 0; !fail && i < len; ++i) {
+      fail = forward(marshalled[i].spec, &calls[i], &results[i]);
+    }
+  } else if (!fail) {
+    python_gil_call(calls, len, results);
+  }
+
+  PyObject* out = NULL;
+  if (!fail) {
+    out = PyTuple_New((Py_ssize_t) len);
+    for (size_t i = 0; out && i < len; ++i) {
+      PyObject* result = PyLong_FromLong(results[i]);
+      if (!result) {
+        Py_CLEAR(out);
+        break;
+      }
+      PyTuple_SET_ITEM(out, (Py_ssize_t) i, result);
+    }
+
+    atomic_fetch_add_explicit(&calls_made, len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&batches_made, 1, memory_order_relaxed);
+  }
+
+  release_args(marshalled, ready);
+
+  if (calls != stack_calls) {
+    PyMem_Free(calls);
+    PyMem_Free(marshalled);
+    PyMem_Free(results);
+  }
+
+  Py_DECREF(seq);
+  return out;
+}
+
+/**
+ * Refuse a view from a worker process, which has only copies of the services.
+ *
+ * @return Nonzero with an exception set if the caller is a worker
+ */
+static int refuse_worker_view(void) {
+  if (!python_interp_worker()) {
+    return 0;
+  }
+
+  PyErr_SetString(PyExc_RuntimeError, "views cannot be taken from a worker process");
+  return 1;
+}
+
+static PyObject* module_frame(PyObject* self, PyObject* args) {
+  if (refuse_worker_view()) {
+    return NULL;
+  }
+
+  return python_view_frame(PyModule_GetState(self));
+}
+
+static PyObject* module_audio(PyObject* self, PyObject* arg) {
+  Py_ssize_t frames = PyLong_AsSsize_t(arg);
+  if (frames < 0) {
+    if (!PyErr_Occurred()) {
+      PyErr_SetString(PyExc_ValueError, "frame count must not be negative");
+    }
+    return NULL;
+  }
+
+  if (refuse_worker_view()) {
+    return NULL;
+  }
+
+  return python_view_audio(PyModule_GetState(self), (size_t) frames);
+}
+
+static PyObject* module_stopping(PyObject* self, PyObject* args) {
+  return PyBool_FromLong(python_interp_stopping());
+}
+
+static PyMethodDef module_methods[] = {
+  {
+    "proc", (PyCFunction) (void (*)(void)) &module_proc, METH_VARARGS | METH_KEYWORDS,
+    "proc(service, proc, release_gil=True)\n--\n\nLook up a service procedure once. Lookups are cached, and the "
+    "GIL is released around each call unless release_gil is false.",
+  },
+  {
+    "batch", &module_batch, METH_O,
+    "batch(calls)\n--\n\nMake a sequence of (proc, arg1, arg2) calls in order with the GIL released once around "
+    "all of them. Returns a tuple of result codes.",
+  },
+  {
+    "frame", &module_frame, METH_NOARGS,
+    "frame()\n--\n\nView the grayscale frame behind the latest face result in place, or get None. Not "
+    "available in a worker process.",
+  },
+  {
+    "audio", &module_audio, METH_O,
+    "audio(frames)\n--\n\nView up to frames of the latest captured audio in place as a tuple of one or two "
+    "segments, or get None. Not available in a worker process.",
+  },
+  {
+    "stopping", &module_stopping, METH_NOARGS,
+    "stopping()\n--\n\nCheck whether the service is stopping. Scripts that loop should return once it is.",
+  },
+  { NULL },
+};
+
+static int module_exec(PyObject* module) {
+  struct python_module_state* state = PyModule_GetState(module);
+
+  if (python_view_init(module, state)) {
+    return -1;
+  }
+
+  state->proc_type = PyType_FromModuleAndSpec(module, &proc_spec, NULL);
+  state->finder_type = PyType_FromModuleAndSpec(module, &finder_spec, NULL);
+  state->procs = PyDict_New();
+  if (!state->proc_type || !state->finder_type || !state->procs) {
+    return -1;
+  }
+
+  Py_INCREF(state->proc_type);
+  return PyModule_AddObject(module, "Proc", state->proc_type);
+}
+
+static int module_traverse(PyObject* module, visitproc visit, void* arg) {
+  struct python_module_state* state = PyModule_GetState(module);
+  Py_VISIT(state->pin_type);
+  Py_VISIT(state->view_type);
+  Py_VISIT(state->proc_type);
+  Py_VISIT(state->procs);
+  Py_VISIT(state->finder_type);
+  Py_VISIT(state->finder);
+  Py_VISIT(state->lazy_loader);
+  Py_VISIT(state->spec_type);
+  return 0;
+}
+
+static int module_clear(PyObject* module) {
+  struct python_module_state* state = PyModule_GetState(module);
+  Py_CLEAR(state->pin_type);
+  Py_CLEAR(state->view_type);
+  Py_CLEAR(state->proc_type);
+  Py_CLEAR(state->procs);
+  Py_CLEAR(state->finder_type);
+  Py_CLEAR(state->finder);
+  Py_CLEAR(state->lazy_loader);
+  Py_CLEAR(state->spec_type);
+  return 0;
+}
+
+static void module_free(void* module) {
+  module_clear(module);
+}
+
+static PyModuleDef_Slot module_slots[] = {
+  { Py_mod_exec, &module_exec },
+#if PY_VERSION_HEX >= 0x030C0000
+  // Nothing here is shared between interpreters but the service counts
+  { Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+  { 0, NULL },
+};
+
+static struct PyModuleDef module_def = {
+  PyModuleDef_HEAD_INIT,
+  .m_name = PYTHON_MODULE_NAME,
+  .m_doc = "The Cozmonaut runtime.",
+  .m_size = sizeof(struct python_module_state),
+  .m_methods = module_methods,
+  .m_slots = module_slots,
+  .m_traverse = &module_traverse,
+  .m_clear = &module_clear,
+  .m_free = &module_free,
+};
+
+PyMODINIT_FUNC python_module_init(void) {
+  return PyModuleDef_Init(&module_def);
+}
+
+int python_module_install_finder(int lazy) {
+  PyObject* module = PyImport_ImportModule(PYTHON_MODULE_NAME);
+  if (!module) {
+    return 1;
+  }
+
+  struct python_module_state* state = PyModule_GetState(module);
+  Py_DECREF(module);
+
+  if (!state->finder) {
+    PyObject* machinery = PyImport_ImportModule("importlib.machinery");
+    if (!machinery) {
+      return 1;
+    }
+
+    state->spec_type = PyObject_GetAttrString(machinery, "ModuleSpec");
+    Py_DECREF(machinery);
+
+    state->finder = state->spec_type ? PyObject_New(PyObject, (PyTypeObject*) state->finder_type) : NULL;
+    if (!state->finder) {
+      return 1;
+    }
+  }
+
+  Py_CLEAR(state->lazy_loader);
+  if (lazy) {
+    PyObject* util = PyImport_ImportModule("importlib.util");
+    if (!util) {
+      return 1;
+    }
+
+    state->lazy_loader = PyObject_CallMethod(util, "LazyLoader", "O", state->finder);
+    Py_DECREF(util);
+
+    if (!state->lazy_loader) {
+      return 1;
+    }
+  }
+
+  PyObject* meta_path = PySys_GetObject("meta_path");
+  if (!meta_path || !PyList_Check(meta_path)) {
+    PyErr_SetString(PyExc_RuntimeError, "sys.meta_path is not a list");
+    return 1;
+  }
+
+  int found = PySequence_Contains(meta_path, state->finder);
+  if (found < 0) {
+    return 1;
+  }
+
+  return !found && PyList_Insert(meta_path, 0, state->finder) < 0;
+}
+
+int python_module_serve(int spec, const void* arg1, size_t len1, void* arg2, size_t len2) {
+  if (spec < 0 || (size_t) spec >= sizeof proc_specs / sizeof *proc_specs) {
+    return 1;
+  }
+
+  const struct proc_spec* s = &proc_specs[spec];
+  if (!arg_fits(&s->in, arg1, len1) || !arg_fits(&s->out, arg2, len2)) {
+    return 1;
+  }
+
+  service_proc sp = service_get_proc(*s->svc, s->proc);
+  if (!sp) {
+    return 1;
+  }
+
+  atomic_fetch_add_explicit(&calls_made, 1, memory_order_relaxed);
+  return sp(*s->svc, arg1, arg2);
+}
+
+void python_module_read(struct python_module_stats* out) {
+  out->calls = atomic_load_explicit(&calls_made, memory_order_relaxed);
+  out->batches = atomic_load_explicit(&batches_made, memory_order_relaxed);
+}
@@ -0,0 +1,94 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_PYTHON_MODULE_H
+#define SERVICE_PYTHON_MODULE_H
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stddef.h>
+
+/** The name scripts import the built-in module by. */
+#define PYTHON_MODULE_NAME "cozmonaut"
+
+/**
+ * The state of one instance of the built-in module. Each interpreter imports
+ * its own, so no Python object is ever shared between interpreters.
+ */
+struct python_module_state {
+  /** The pin type. */
+  PyObject* pin_type;
+
+  /** The view type. */
+  PyObject* view_type;
+
+  /** The procedure type. */
+  PyObject* proc_type;
+
+  /** Resolved procedures by (service, number, release_gil). */
+  PyObject* procs;
+
+  /** The code archive finder type. */
+  PyObject* finder_type;
+
+  /** The code archive finder once installed, or NULL. */
+  PyObject* finder;
+
+  /** The finder wrapped to run modules on first use, or NULL. */
+  PyObject* lazy_loader;
+
+  /** The module spec type. */
+  PyObject* spec_type;
+};
+
+/** Built-in module counts. */
+struct python_module_stats {
+  /** The number of service calls made by scripts, batched or not. */
+  unsigned long calls;
+
+  /** The number of batches made by scripts. */
+  unsigned long batches;
+};
+
+/**
+ * Get the built-in module definition. Registered with the interpreter before
+ * it is initialized, and safe to import into any number of interpreters.
+ *
+ * @return The module definition
+ */
+PyMODINIT_FUNC python_module_init(void);
+
+/**
+ * Put the code archive finder first on sys.meta_path, if it is not there
+ * already. Call with the GIL held.
+ *
+ * @param lazy Nonzero to run archive modules only once first used
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+int python_module_install_finder(int lazy);
+
+/**
+ * Make a service call a script in a worker process forwarded. The arguments
+ * arrive as bytes, so they are checked again against what the procedure
+ * takes. Call without the GIL held.
+ *
+ * @param spec The procedure, as the module numbers those scripts can call
+ * @param arg1 The first argument, or NULL
+ * @param len1 The length of the first argument in bytes
+ * @param arg2 The second argument, or NULL
+ * @param len2 The length of the second argument in bytes
+ * @return The result code, or nonzero if the call cannot be made
+ */
+int python_module_serve(int spec, const void* arg1, size_t len1, void* arg2, size_t len2);
+
+/**
+ * Read the built-in module counts.
+ *
+ * @param out The counts
+ */
+void python_module_read(struct python_module_stats* out);
+
+#endif // #ifndef SERVICE_PYTHON_MODULE_H
@@ -3,24 +3,393 @@
  * Copyright 2019 The Cozmonaut Contributors
  */
 
+#include "gil.h"
+#include "interp.h"
+#include "module.h"
+#include "startup.h"
+#include "view.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "../python.h"
 
 #include "../../log.h"
+#include "../../metric.h"
 #include "../../service.h"
+#include "../../trace.h"
 
 #define LOG_TAG "python"
 
+/** A source run waiting for its result. */
+struct exec_call {
+  /** The source. */
+  const char* source;
+
+  /** Nonzero if the source raised. */
+  int failed;
+
+  /** Nonzero once the source ran. */
+  int done;
+};
+
+/** The interpreter configuration. */
+static struct python_config config;
+
+/** The main interpreter. */
+static PyInterpreterState* interp;
+
+/** The loading thread's state, parked while the service is loaded. */
+static PyThreadState* main_state;
+
+/** The queued tasks, a ring starting at queue_head. */
+static struct python_task queue[PYTHON_QUEUE_LEN];
+
+/** The index of the oldest queued task. */
+static size_t queue_head;
+
+/** The number of queued tasks. */
+static size_t queue_len;
+
+/** Guards the queue, exec results and statistics. */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signaled when tasks are queued or the threads should stop. */
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/** Signaled when an exec finishes. */
+static pthread_cond_t exec_cond = PTHREAD_COND_INITIALIZER;
+
+/** The interpreter statistics. Queue lock only. */
+static struct python_stats stats;
+
+/** The number of tasks queued. */
+static struct metric* metric_tasks;
+
+/** The number of tasks run per batch. */
+static struct metric* metric_batch;
+
+/** The interpreter threads. */
+static pthread_t workers[PYTHON_MAX_THREADS];
+
+/** The number of interpreter threads started. */
+static int workers_len;
+
+/** The thread warming the main interpreter. */
+static pthread_t warm_thread;
+
+/** Nonzero while the warm thread runs and needs joining. */
+static int warm_started;
+
+/** Nonzero until the main interpreter is warm. Queue lock only. */
+static int warming;
+
+/** Set to ask the interpreter threads to exit once the queue is empty. */
+static atomic_int worker_stop;
+
+/** Nonzero while the interpreter threads run. */
+static atomic_int running;
+
+/**
+ * Run a batch of tasks. Call with the GIL held.
+ *
+ * @param batch The tasks
+ * @param len The number of tasks
+ * @return The number of tasks that left an exception set
+ */
+static unsigned long run_batch(const struct python_task* batch, size_t len) {
+  unsigned long failed = 0;
+
+  for (size_t i = 0; i < len; ++i) {
+    batch[i].fn(batch[i].ctx);
+
+    // Never let one task's exception leak into the next
+    if (PyErr_Occurred()) {
+      PyErr_Print();
+      ++failed;
+    }
+  }
+
+  return failed;
+}
+
+static void* warm_main(void* arg) {
+  service_sched_thread(SERVICE_PYTHON);
+
+  PyThreadState* ts = PyThreadState_New(interp);
+
+  python_gil_acquire(ts);
+  python_startup_warm(&config, 1);
+  python_gil_release();
+
+  PyEval_RestoreThread(ts);
+  PyThreadState_Clear(ts);
+  PyThreadState_DeleteCurrent();
+
+  pthread_mutex_lock(&queue_lock);
+  warming = 0;
+  pthread_cond_broadcast(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+
+  return NULL;
+}
+
+static void* worker_main(void* arg) {
+  service_sched_thread(SERVICE_PYTHON);
+
+  PyThreadState* ts = PyThreadState_New(interp);
+  struct python_task batch[PYTHON_BATCH_MAX];
+
+  for (;;) {
+    pthread_mutex_lock(&queue_lock);
+
+    // Tasks wait for warming so they see the archive and preloaded modules
+    while ((!queue_len || warming) && !atomic_load(&worker_stop)) {
+      pthread_cond_wait(&queue_cond, &queue_lock);
+    }
+
+    // Only exit once everything queued has run
+    if (!queue_len) {
+      pthread_mutex_unlock(&queue_lock);
+      break;
+    }
+
+    // Take everything queued so it all runs under one acquisition
+    size_t len = queue_len < (size_t) config.batch_max ? queue_len : (size_t) config.batch_max;
+    for (size_t i = 0; i < len; ++i) {
+      batch[i] = queue[(queue_head + i) % PYTHON_QUEUE_LEN];
+    }
+    queue_head = (queue_head + len) % PYTHON_QUEUE_LEN;
+    queue_len -= len;
+
+    pthread_mutex_unlock(&queue_lock);
+
+    python_startup_first_script();
+
+    python_gil_acquire(ts);
+    unsigned long failed = run_batch(batch, len);
+    python_gil_release();
+
+    metric_record(metric_batch, len);
+
+    pthread_mutex_lock(&queue_lock);
+    stats.tasks_run += len;
+    stats.tasks_failed += failed;
+    ++stats.batches;
+    pthread_mutex_unlock(&queue_lock);
+  }
+
+  PyEval_RestoreThread(ts);
+  PyThreadState_Clear(ts);
+  PyThreadState_DeleteCurrent();
+
+  return NULL;
+}
+
+/**
+ * Run an exec call and report its result. Call with the GIL held.
+ */
+static void run_exec(void* ctx) {
+  struct exec_call* call = ctx;
+  TRACE_SCOPE("exec");
+
+  int failed = PyRun_SimpleString(call->source) != 0;
+
+  pthread_mutex_lock(&queue_lock);
+  call->failed = failed;
+  call->done = 1;
+  pthread_cond_broadcast(&exec_cond);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Queue a task. Call with the queue lock held.
+ *
+ * @param task The task
+ * @return Zero on success, otherwise nonzero
+ */
+static int enqueue(const struct python_task* task) {
+  if (queue_len == PYTHON_QUEUE_LEN) {
+    ++stats.tasks_rejected;
+    return 1;
+  }
+
+  queue[(queue_head + queue_len) % PYTHON_QUEUE_LEN] = *task;
+  ++queue_len;
+
+  ++stats.tasks_submitted;
+  if (queue_len > stats.queue_max) {
+    stats.queue_max = queue_len;
+  }
+
+  pthread_cond_signal(&queue_cond);
+  return 0;
+}
+
 static int proc_hello(struct service* svc, const void* arg1, void* arg2) {
   LOGI("Hello, world!");
   return 0;
 }
 
+static int proc_configure(struct service* svc, const void* arg1, void* arg2) {
+  const struct python_config* next = arg1;
+
+  if (atomic_load(&running)) {
+    LOGE("Cannot configure the Python service while it is running");
+    return 1;
+  }
+
+  if (next->threads <= 0 || next->threads > PYTHON_MAX_THREADS || next->batch_max <= 0
+      || next->batch_max > PYTHON_BATCH_MAX || next->interpreters < 0
+      || next->interpreters > PYTHON_MAX_INTERPRETERS || next->placement < python_placement_least_loaded
+      || next->placement > python_placement_by_name) {
+    LOGE("Invalid Python configuration");
+    return 1;
+  }
+
+  config = *next;
+  return 0;
+}
+
+static int proc_submit(struct service* svc, const void* arg1, void* arg2) {
+  pthread_mutex_lock(&queue_lock);
+  int fail = enqueue(arg1);
+  pthread_mutex_unlock(&queue_lock);
+
+  if (!fail) {
+    metric_add(metric_tasks, 1);
+  }
+
+  return fail;
+}
+
+static int proc_exec(struct service* svc, const void* arg1, void* arg2) {
+  struct exec_call call = {
+    .source = arg1,
+  };
+
+  // With no interpreter threads there is nothing to wait for
+  if (!atomic_load(&running)) {
+    python_startup_first_script();
+
+    PyGILState_STATE gil = python_gil_ensure();
+    call.failed = PyRun_SimpleString(call.source) != 0;
+    python_gil_release_state(gil);
+    return call.failed;
+  }
+
+  struct python_task task = {
+    .fn = &run_exec,
+    .ctx = &call,
+  };
+
+  pthread_mutex_lock(&queue_lock);
+
+  if (enqueue(&task)) {
+    pthread_mutex_unlock(&queue_lock);
+    LOGE("Python task queue is full");
+    return 1;
+  }
+
+  while (!call.done) {
+    pthread_cond_wait(&exec_cond, &queue_lock);
+  }
+
+  pthread_mutex_unlock(&queue_lock);
+
+  metric_add(metric_tasks, 1);
+  return call.failed;
+}
+
+static int proc_get_stats(struct service* svc, const void* arg1, void* arg2) {
+  struct python_stats* out = arg2;
+
+  pthread_mutex_lock(&queue_lock);
+  *out = stats;
+  pthread_mutex_unlock(&queue_lock);
+
+  struct python_gil_stats gil;
+  python_gil_read(&gil);
+
+  out->gil_acquisitions = gil.acquisitions;
+  out->gil_wait_total = gil.wait_total;
+  out->gil_wait_max = gil.wait_max;
+  out->gil_hold_total = gil.hold_total;
+  out->gil_hold_max = gil.hold_max;
+  out->released_calls = gil.released_calls;
+  out->released_time = gil.released_time;
+
+  struct python_view_stats views;
+  python_view_read(&views);
+
+  out->frames_viewed = views.frames_viewed;
+  out->audio_viewed = views.audio_viewed;
+  out->bytes_viewed = views.bytes_viewed;
+  out->pins_held = views.pins_held;
+
+  struct python_module_stats module;
+  python_module_read(&module);
+
+  out->script_calls = module.calls;
+  out->script_batches = module.batches;
+
+  struct python_interp_totals totals;
+  python_interp_totals(&totals);
+
+  out->interpreters = totals.interpreters;
+  out->own_gil = totals.own_gil;
+  out->script_processes = totals.processes;
+  out->scripts_spawned = totals.spawned;
+  out->scripts_rejected = totals.rejected;
+
+  struct python_startup_stats startup;
+  python_startup_read(&startup);
+
+  out->init_time = startup.init_time;
+  out->warm_time = startup.warm_time;
+  out->first_script_time = startup.first_script_time;
+  out->archive_modules = startup.archive_modules;
+  out->archive_loads = startup.archive_loads;
+
+  return 0;
+}
+
+static int proc_spawn(struct service* svc, const void* arg1, void* arg2) {
+  return python_interp_spawn(arg1, config.placement, arg2);
+}
+
+static int proc_get_interp_stats(struct service* svc, const void* arg1, void* arg2) {
+  return python_interp_read(*(const int*) arg1, arg2);
+}
+
+static int proc_pack(struct service* svc, const void* arg1, void* arg2) {
+  PyGILState_STATE gil = python_gil_ensure();
+  int fail = python_startup_pack(arg1);
+  python_gil_release_state(gil);
+
+  return fail;
+}
+
 static service_proc get_proc(const struct service* svc, int proc) {
   switch (proc) {
     case service_python_proc_hello:
       return &proc_hello;
+    case service_python_proc_configure:
+      return &proc_configure;
+    case service_python_proc_submit:
+      return &proc_submit;
+    case service_python_proc_exec:
+      return &proc_exec;
+    case service_python_proc_get_stats:
+      return &proc_get_stats;
+    case service_python_proc_spawn:
+      return &proc_spawn;
+    case service_python_proc_get_interp_stats:
+      return &proc_get_interp_stats;
+    case service_python_proc_pack:
+      return &proc_pack;
     default:
       return NULL;
   }
@@ -28,21 +397,138 @@ static service_proc get_proc(const struct service* svc, int proc) {
 
 static int on_load(struct service* svc) {
   LOGI("Python service load");
+
+  python_startup_begin();
+
+  // The table is only read at initialization, and must not grow on each load
+  static int module_added;
+  if (!module_added && PyImport_AppendInittab(PYTHON_MODULE_NAME, &python_module_init) == 0) {
+    module_added = 1;
+  }
+
+  Py_InitializeEx(0);
+  python_startup_initialized();
+
+  // Park the loading thread so interpreter threads can take the GIL
+  interp = PyThreadState_Get()->interp;
+  main_state = PyEval_SaveThread();
+
+  config = (struct python_config) {
+    .threads = 2,
+    .batch_max = 32,
+    .interpreters = 2,
+    .placement = python_placement_least_loaded,
+    .archive = NULL,
+    .preload = NULL,
+    .lazy_imports = 0,
+    .prewarm = 0,
+  };
+
+  queue_head = 0;
+  queue_len = 0;
+  memset(&stats, 0, sizeof stats);
+
+  python_gil_init();
+  metric_tasks = metric_get("python.tasks", metric_kind_counter);
+  metric_batch = metric_get("python.batch", metric_kind_histogram);
+
   return 0;
 }
 
 static int on_unload(struct service* svc) {
   LOGI("Python service unload");
+
+  if (queue_len) {
+    LOGI("Dropping {} Python tasks that never ran", _ul(queue_len));
+    queue_len = 0;
+  }
+
+  PyEval_RestoreThread(main_state);
+
+  if (Py_FinalizeEx()) {
+    LOGE("Failed to finalize the Python interpreter cleanly");
+  }
+
+  main_state = NULL;
+  interp = NULL;
+
   return 0;
 }
 
+/**
+ * Ask the interpreter threads and warm thread to exit, and join them.
+ */
+static void join_workers(void) {
+  if (warm_started) {
+    pthread_join(warm_thread, NULL);
+    warm_started = 0;
+  }
+
+  pthread_mutex_lock(&queue_lock);
+  atomic_store(&worker_stop, 1);
+  pthread_cond_broadcast(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+
+  for (int i = 0; i < workers_len; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+}
+
 static int on_start(struct service* svc) {
   LOGI("Python service start");
+
+  atomic_store(&worker_stop, 0);
+
+  // Without the archive, imports fall back to sys.path
+  if (config.archive) {
+    python_startup_open(config.archive);
+  }
+
+  warming = 1;
+  workers_len = 0;
+
+  if (pthread_create(&warm_thread, NULL, &warm_main, NULL)) {
+    LOGE("Failed to start Python warm thread");
+    python_startup_close();
+    return 1;
+  }
+  warm_started = 1;
+
+  for (; workers_len < config.threads; ++workers_len) {
+    if (pthread_create(&workers[workers_len], NULL, &worker_main, NULL)) {
+      LOGE("Failed to start Python interpreter thread");
+      join_workers();
+      python_startup_close();
+      return 1;
+    }
+  }
+
+  if (python_interp_start(interp, &config)) {
+    join_workers();
+    python_startup_close();
+    return 1;
+  }
+
+  // Otherwise warming goes on while other services start
+  if (!config.prewarm) {
+    pthread_join(warm_thread, NULL);
+    warm_started = 0;
+  }
+
+  atomic_store(&running, 1);
   return 0;
 }
 
 static int on_stop(struct service* svc) {
   LOGI("Python service stop");
+
+  python_interp_stop();
+  join_workers();
+  atomic_store(&running, 0);
+
+  // Nothing can import from the archive now
+  python_startup_close();
+
   return 0;
 }
 
@@ -56,4 +542,5 @@ struct service* const SERVICE_PYTHON = &(struct service) {
     .on_start = &on_start,
     .on_stop = &on_stop,
   },
+  .sched_class = service_class_background,
 };
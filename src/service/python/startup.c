@@ -0,0 +1,652 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "startup.h"
+
+#include <marshal.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../log.h"
+#include "../../metric.h"
+
+#include "module.h"
+
+#define LOG_TAG "python"
+
+/** The archive magic number, "CZPK". */
+#define ARCHIVE_MAGIC 0x4b505a43u
+
+/** The archive layout version. */
+#define ARCHIVE_VERSION 1u
+
+/** The entry flag for packages. */
+#define ENTRY_PACKAGE 1u
+
+/** The longest module name preloaded. */
+#define PRELOAD_NAME_LEN 128
+
+/** The archive header. */
+struct archive_header {
+  /** The magic number, ARCHIVE_MAGIC. */
+  uint32_t magic;
+
+  /** The layout version, ARCHIVE_VERSION. */
+  uint32_t version;
+
+  /** The bytecode magic number of the Python that packed it. */
+  uint32_t python_magic;
+
+  /** The number of entries. */
+  uint32_t count;
+};
+
+/** An archive entry. */
+struct archive_entry {
+  /** The offset of the module name. */
+  uint32_t name;
+
+  /** The offset of the marshalled code. */
+  uint32_t code;
+
+  /** The size of the marshalled code. */
+  uint32_t code_len;
+
+  /** The entry flags. */
+  uint32_t flags;
+};
+
+/** A module being packed. */
+struct packed {
+  /** The module name. */
+  char* name;
+
+  /** The marshalled code. */
+  PyObject* code;
+
+  /** The entry flags. */
+  uint32_t flags;
+};
+
+/** A list of modules being packed. */
+struct packed_list {
+  /** The modules. */
+  struct packed* items;
+
+  /** The number of modules. */
+  size_t len;
+
+  /** The capacity. */
+  size_t cap;
+};
+
+/** The mapped archive, or NULL. */
+static const unsigned char* map;
+
+/** The size of the mapped archive. */
+static size_t map_len;
+
+/** The archive entries. */
+static const struct archive_entry* entries;
+
+/** The number of archive entries. */
+static size_t entries_len;
+
+/** The path of the mapped archive. */
+static char origin[PATH_MAX];
+
+/** The bytecode magic number of the running Python. */
+static uint32_t python_magic;
+
+/** When load began in nanoseconds. */
+static unsigned long long load_at;
+
+/** The time to initialize CPython in nanoseconds. */
+static unsigned long long init_time;
+
+/** The time to warm the main interpreter in nanoseconds. */
+static atomic_ullong warm_time;
+
+/** The time from load to the first script in nanoseconds. */
+static atomic_ullong first_script_time;
+
+/** The number of modules imported from the archive. */
+static atomic_ulong archive_loads;
+
+/** The distribution of load to first script times. */
+static struct metric* metric_first_script_ns;
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void python_startup_begin(void) {
+  load_at = now_ns();
+  init_time = 0;
+  atomic_store(&warm_time, 0);
+  atomic_store(&first_script_time, 0);
+  atomic_store(&archive_loads, 0);
+
+  metric_first_script_ns = metric_get("python.first_script_ns", metric_kind_histogram);
+}
+
+void python_startup_initialized(void) {
+  init_time = now_ns() - load_at;
+  python_magic = (uint32_t) PyImport_GetMagicNumber();
+}
+
+void python_startup_first_script(void) {
+  // Checked first so the common case is a plain load
+  if (atomic_load_explicit(&first_script_time, memory_order_relaxed)) {
+    return;
+  }
+
+  unsigned long long expected = 0;
+  unsigned long long elapsed = now_ns() - load_at;
+  if (atomic_compare_exchange_strong(&first_script_time, &expected, elapsed)) {
+    metric_record(metric_first_script_ns, elapsed);
+    LOGI("First Python script ran {} ms after load", _ull(elapsed / 1000000));
+  }
+}
+
+/**
+ * Check that a mapped archive is whole and was packed by this Python.
+ *
+ * @param m The mapping
+ * @param len The size of the mapping
+ * @return Zero if valid, otherwise nonzero
+ */
+static int validate(const unsigned char* m, size_t len) {
+  if (len < sizeof(struct archive_header)) {
+    return 1;
+  }
+
+  const struct archive_header* header = (const struct archive_header*) m;
+  if (header->magic != ARCHIVE_MAGIC || header->version != ARCHIVE_VERSION) {
+    return 1;
+  }
+
+  if (header->python_magic != python_magic) {
+    LOGE("Code archive was packed by another version of Python");
+    return 1;
+  }
+
+  if (header->count > (len - sizeof *header) / sizeof(struct archive_entry)) {
+    return 1;
+  }
+
+  const struct archive_entry* e = (const struct archive_entry*) (header + 1);
+  for (uint32_t i = 0; i < header->count; ++i) {
+    if (e[i].name >= len || !memchr(m + e[i].name, 0, len - e[i].name) || e[i].code > len
+        || e[i].code_len > len - e[i].code) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int python_startup_open(const char* path) {
+  python_startup_close();
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOGE("Failed to open code archive {}", _str(path));
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size <= 0) {
+    LOGE("Failed to stat code archive {}", _str(path));
+    close(fd);
+    return 1;
+  }
+
+  void* m = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (m == MAP_FAILED) {
+    LOGE("Failed to map code archive {}", _str(path));
+    return 1;
+  }
+
+  if (validate(m, (size_t) st.st_size)) {
+    LOGE("Code archive {} is not valid", _str(path));
+    munmap(m, (size_t) st.st_size);
+    return 1;
+  }
+
+  // Everything in it is read on the first few imports
+  madvise(m, (size_t) st.st_size, MADV_WILLNEED);
+
+  map = m;
+  map_len = (size_t) st.st_size;
+  entries = (const struct archive_entry*) (map + sizeof(struct archive_header));
+  entries_len = ((const struct archive_header*) map)->count;
+  snprintf(origin, sizeof origin, "%s", path);
+
+  LOGI("Mapped {} modules from code archive {}", _ul(entries_len), _str(path));
+  return 0;
+}
+
+void python_startup_close(void) {
+  if (map) {
+    munmap((void*) map, map_len);
+  }
+
+  map = NULL;
+  map_len = 0;
+  entries = NULL;
+  entries_len = 0;
+}
+
+/**
+ * Import the preloaded modules. Call with the GIL held.
+ *
+ * @param list The comma-separated module names
+ * @return Zero on success, otherwise nonzero
+ */
+static int preload(const char* list) {
+  int fail = 0;
+
+  while (*list) {
+    size_t len = strcspn(list, ",");
+    char name[PRELOAD_NAME_LEN];
+
+    if (len && len < sizeof name) {
+      memcpy(name, list, len);
+      name[len] = '\0';
+
+      PyObject* module = PyImport_ImportModule(name);
+
+      // Touching the module runs it now even if it was imported lazily
+      PyObject* dict = module ? PyObject_GetAttrString(module, "__dict__") : NULL;
+      if (!dict) {
+        PyErr_Print();
+        fail = 1;
+      }
+
+      Py_XDECREF(dict);
+      Py_XDECREF(module);
+    }
+
+    list += len;
+    if (*list == ',') {
+      ++list;
+    }
+  }
+
+  return fail;
+}
+
+int python_startup_warm(const struct python_config* config, int main) {
+  unsigned long long t0 = now_ns();
+  int fail = 0;
+
+  if (entries && python_module_install_finder(config->lazy_imports)) {
+    PyErr_Print();
+    fail = 1;
+  }
+
+  if (config->preload) {
+    fail |= preload(config->preload);
+  }
+
+  if (main) {
+    atomic_store(&warm_time, now_ns() - t0);
+  }
+
+  return fail;
+}
+
+/**
+ * Look up an archive entry.
+ *
+ * @param name The module name
+ * @return The entry, or NULL
+ */
+static const struct archive_entry* find(const char* name) {
+  size_t lo = 0;
+  size_t hi = entries_len;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(name, (const char*) map + entries[mid].name);
+
+    if (!cmp) {
+      return &entries[mid];
+    }
+
+    if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  return NULL;
+}
+
+int python_startup_find(const char* name, int* package) {
+  const struct archive_entry* e = find(name);
+  if (!e) {
+    return 1;
+  }
+
+  *package = (e->flags & ENTRY_PACKAGE) != 0;
+  return 0;
+}
+
+const char* python_startup_origin(void) {
+  return origin;
+}
+
+PyObject* python_startup_load(const char* name) {
+  const struct archive_entry* e = find(name);
+  if (!e) {
+    PyErr_Format(PyExc_ImportError, "no module named %s in the code archive", name);
+    return NULL;
+  }
+
+  atomic_fetch_add_explicit(&archive_loads, 1, memory_order_relaxed);
+  return PyMarshal_ReadObjectFromString((const char*) map + e->code, (Py_ssize_t) e->code_len);
+}
+
+/**
+ * Compile and marshal one module.
+ *
+ * @param list The modules packed so far
+ * @param source The source
+ * @param rel The path relative to the source directory, for tracebacks
+ * @param name The module name, taken over
+ * @param flags The entry flags
+ * @return Zero on success, otherwise nonzero
+ */
+static int pack_source(struct packed_list* list, const char* source, const char* rel, char* name,
+    uint32_t flags) {
+  PyObject* code = Py_CompileString(source, rel, Py_file_input);
+  PyObject* marshalled = code ? PyMarshal_WriteObjectToString(code, Py_MARSHAL_VERSION) : NULL;
+  Py_XDECREF(code);
+
+  if (!marshalled) {
+    PyErr_Print();
+    free(name);
+    return 1;
+  }
+
+  if (list->len == list->cap) {
+    size_t cap = list->cap ? list->cap * 2 : 32;
+    struct packed* items = realloc(list->items, cap * sizeof *items);
+    if (!items) {
+      Py_DECREF(marshalled);
+      free(name);
+      return 1;
+    }
+
+    list->items = items;
+    list->cap = cap;
+  }
+
+  list->items[list->len++] = (struct packed) {
+    .name = name,
+    .code = marshalled,
+    .flags = flags,
+  };
+
+  return 0;
+}
+
+/**
+ * Compile and marshal one source file.
+ *
+ * @param list The modules packed so far
+ * @param path The source file
+ * @param rel The path relative to the source directory, for tracebacks
+ * @param name The module name, taken over
+ * @param flags The entry flags
+ * @return Zero on success, otherwise nonzero
+ */
+static int pack_file(struct packed_list* list, const char* path, const char* rel, char* name, uint32_t flags) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    LOGE("Failed to open {}", _str(path));
+    free(name);
+    return 1;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char* source = size >= 0 ? malloc((size_t) size + 1) : NULL;
+  if (!source || fread(source, 1, (size_t) size, file) != (size_t) size) {
+    LOGE("Failed to read {}", _str(path));
+    fclose(file);
+    free(source);
+    free(name);
+    return 1;
+  }
+
+  fclose(file);
+  source[size] = '\0';
+
+  int fail = pack_source(list, source, rel, name, flags);
+  free(source);
+
+  return fail;
+}
+
+/**
+ * Check whether a package was packed.
+ *
+ * @param list The modules packed so far
+ * @param from The first module to check
+ * @param prefix The package prefix, with its trailing dot
+ * @return Nonzero if the package was packed
+ */
+static int has_package(const struct packed_list* list, size_t from, const char* prefix) {
+  size_t len = strlen(prefix) - 1;
+
+  for (size_t i = from; i < list->len; ++i) {
+    if ((list->items[i].flags & ENTRY_PACKAGE) && !strncmp(list->items[i].name, prefix, len)
+        && !list->items[i].name[len]) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Pack a directory of source, recursing into subpackages.
+ *
+ * @param list The modules packed so far
+ * @param dir The directory
+ * @param rel The directory relative to the source directory, or ""
+ * @param prefix The package prefix, such as "behaviours.", or ""
+ * @return Zero on success, otherwise nonzero
+ */
+static int pack_dir(struct packed_list* list, const char* dir, const char* rel, const char* prefix) {
+  DIR* d = opendir(dir);
+  if (!d) {
+    LOGE("Failed to open {}", _str(dir));
+    return 1;
+  }
+
+  int fail = 0;
+  struct dirent* ent;
+
+  while (!fail && (ent = readdir(d))) {
+    if (ent->d_name[0] == '.' || !strcmp(ent->d_name, "__pycache__")) {
+      continue;
+    }
+
+    char path[PATH_MAX];
+    char rel_path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/%s", dir, ent->d_name);
+    snprintf(rel_path, sizeof rel_path, "%s%s%s", rel, *rel ? "/" : "", ent->d_name);
+
+    struct stat st;
+    if (stat(path, &st)) {
+      continue;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      char sub[PATH_MAX];
+      snprintf(sub, sizeof sub, "%s%s.", prefix, ent->d_name);
+
+      size_t before = list->len;
+      fail = pack_dir(list, path, rel_path, sub);
+
+      // Submodules are only found through their package, so give one to a
+      // directory without an __init__.py
+      if (!fail && list->len > before && !has_package(list, before, sub)) {
+        char* name = strndup(sub, strlen(sub) - 1);
+        fail = !name || pack_source(list, "", rel_path, name, ENTRY_PACKAGE);
+      }
+      continue;
+    }
+
+    size_t len = strlen(ent->d_name);
+    if (!S_ISREG(st.st_mode) || len < 4 || strcmp(ent->d_name + len - 3, ".py")) {
+      continue;
+    }
+
+    // A package is named by its directory, without the trailing dot
+    int package = !strcmp(ent->d_name, "__init__.py");
+    if (package && !*prefix) {
+      continue;
+    }
+
+    size_t prefix_len = strlen(prefix);
+    char* name = package ? strndup(prefix, prefix_len - 1) : malloc(prefix_len + len - 2);
+    if (!name) {
+      fail = 1;
+      break;
+    }
+
+    if (!package) {
+      snprintf(name, prefix_len + len - 2, "%s%.*s", prefix, (int) (len - 3), ent->d_name);
+    }
+
+    fail = pack_file(list, path, rel_path, name, package ? ENTRY_PACKAGE : 0);
+  }
+
+  closedir(d);
+  return fail;
+}
+
+static int compare_packed(const void* a, const void* b) {
+  return strcmp(((const struct packed*) a)->name, ((const struct packed*) b)->name);
+}
+
+/**
+ * Write packed modules out as an archive.
+ *
+ * @param list The modules, sorted by name
+ * @param path The archive
+ * @return Zero on success, otherwise nonzero
+ */
+static int write_archive(const struct packed_list* list, const char* path) {
+  // Write beside the archive and rename so a mapped archive is never torn
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof tmp, "%s.tmp", path);
+
+  FILE* file = fopen(tmp, "wb");
+  if (!file) {
+    LOGE("Failed to create {}", _str(tmp));
+    return 1;
+  }
+
+  struct archive_header header = {
+    .magic = ARCHIVE_MAGIC,
+    .version = ARCHIVE_VERSION,
+    .python_magic = python_magic,
+    .count = (uint32_t) list->len,
+  };
+
+  size_t offset = sizeof header + list->len * sizeof(struct archive_entry);
+  for (size_t i = 0; i < list->len; ++i) {
+    offset += strlen(list->items[i].name) + 1;
+  }
+
+  int fail = fwrite(&header, sizeof header, 1, file) != 1;
+
+  size_t name_at = sizeof header + list->len * sizeof(struct archive_entry);
+  size_t code_at = offset;
+  for (size_t i = 0; !fail && i < list->len; ++i) {
+    struct archive_entry e = {
+      .name = (uint32_t) name_at,
+      .code = (uint32_t) code_at,
+      .code_len = (uint32_t) PyBytes_GET_SIZE(list->items[i].code),
+      .flags = list->items[i].flags,
+    };
+
+    name_at += strlen(list->items[i].name) + 1;
+    code_at += e.code_len;
+    fail = fwrite(&e, sizeof e, 1, file) != 1;
+  }
+
+  for (size_t i = 0; !fail && i < list->len; ++i) {
+    fail = fputs(list->items[i].name, file) == EOF || fputc('\0', file) == EOF;
+  }
+
+  for (size_t i = 0; !fail && i < list->len; ++i) {
+    size_t len = (size_t) PyBytes_GET_SIZE(list->items[i].code);
+    fail = fwrite(PyBytes_AS_STRING(list->items[i].code), 1, len, file) != len;
+  }
+
+  if (fclose(file) || fail || code_at > UINT32_MAX || rename(tmp, path)) {
+    LOGE("Failed to write code archive {}", _str(path));
+    unlink(tmp);
+    return 1;
+  }
+
+  return 0;
+}
+
+int python_startup_pack(const struct python_pack* pack) {
+  struct packed_list list = { 0 };
+
+  int fail = pack_dir(&list, pack->source, "", "");
+  if (!fail) {
+    qsort(list.items, list.len, sizeof *list.items, &compare_packed);
+    fail = write_archive(&list, pack->archive);
+  }
+
+  if (!fail) {
+    LOGI("Packed {} modules into code archive {}", _ul(list.len), _str(pack->archive));
+  }
+
+  for (size_t i = 0; i < list.len; ++i) {
+    free(list.items[i].name);
+    Py_DECREF(list.items[i].code);
+  }
+  free(list.items);
+
+  return fail;
+}
+
+void python_startup_read(struct python_startup_stats* out) {
+  out->init_time = init_time;
+  out->warm_time = atomic_load(&warm_time);
+  out->first_script_time = atomic_load(&first_script_time);
+  out->archive_modules = entries_len;
+  out->archive_loads = atomic_load_explicit(&archive_loads, memory_order_relaxed);
+}
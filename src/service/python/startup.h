@@ -0,0 +1,130 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_PYTHON_STARTUP_H
+#define SERVICE_PYTHON_STARTUP_H
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "../python.h"
+
+//
+// Startup Cache
+//
+// Behaviour modules can be precompiled into one code archive, which is
+// mapped with a single mmap and imported from in place. No source is read or
+// compiled at startup, and no stat() calls are made down sys.path. Archive
+// modules can also be imported lazily, so their bodies only run once first
+// used.
+//
+// Archive layout, native byte order:
+//
+//   struct archive_header
+//   struct archive_entry[count], sorted by name
+//   Module names, each NUL-terminated
+//   Marshalled code objects
+//
+// Archives are only good for the Python they were packed with, and are
+// refused if its bytecode magic number differs.
+//
+
+/** Startup timings and archive counts. */
+struct python_startup_stats {
+  /** The time to initialize CPython in nanoseconds. */
+  unsigned long long init_time;
+
+  /** The time to warm the main interpreter in nanoseconds. */
+  unsigned long long warm_time;
+
+  /** The time from load to the first script in nanoseconds, or zero. */
+  unsigned long long first_script_time;
+
+  /** The number of modules in the archive, or zero if none is mapped. */
+  unsigned long archive_modules;
+
+  /** The number of modules imported from the archive. */
+  unsigned long archive_loads;
+};
+
+/**
+ * Start timing startup. Call at the beginning of load.
+ */
+void python_startup_begin(void);
+
+/**
+ * Note that CPython was initialized.
+ */
+void python_startup_initialized(void);
+
+/**
+ * Note that a script is about to run. Only the first call counts.
+ */
+void python_startup_first_script(void);
+
+/**
+ * Map a code archive.
+ *
+ * @param path The archive
+ * @return Zero on success, otherwise nonzero
+ */
+int python_startup_open(const char* path);
+
+/**
+ * Unmap the code archive, if any. Call once no interpreter can import.
+ */
+void python_startup_close(void);
+
+/**
+ * Warm the calling thread's interpreter: install the archive finder and
+ * import the preloaded modules. Call with the GIL held.
+ *
+ * @param config The configuration
+ * @param main Nonzero if this is the main interpreter
+ * @return Zero on success, otherwise nonzero
+ */
+int python_startup_warm(const struct python_config* config, int main);
+
+/**
+ * Look up a module in the archive.
+ *
+ * @param name The module name
+ * @param package Nonzero if the module is a package
+ * @return Zero if found, otherwise nonzero
+ */
+int python_startup_find(const char* name, int* package);
+
+/**
+ * Get the path of the mapped archive.
+ *
+ * @return The path
+ */
+const char* python_startup_origin(void);
+
+/**
+ * Load a module's code from the archive. Call with the GIL held.
+ *
+ * @param name The module name
+ * @return The code, or NULL with an exception set
+ */
+PyObject* python_startup_load(const char* name);
+
+/**
+ * Pack a directory of Python source into a code archive. Call with the GIL
+ * held.
+ *
+ * @param pack The source directory and archive
+ * @return Zero on success, otherwise nonzero
+ */
+int python_startup_pack(const struct python_pack* pack);
+
+/**
+ * Read the startup timings and archive counts.
+ *
+ * @param out The statistics
+ */
+void python_startup_read(struct python_startup_stats* out);
+
+#endif // #ifndef SERVICE_PYTHON_STARTUP_H
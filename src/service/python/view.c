@@ -0,0 +1,375 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "view.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <structmember.h>
+
+#include "../face.h"
+#include "../speech.h"
+
+#include "../../service.h"
+
+#include "module.h"
+
+/** A kind of pin. */
+enum pin_kind {
+  /** Nothing is pinned. */
+  pin_kind_none,
+
+  /** A camera frame. */
+  pin_kind_frame,
+
+  /** A span of captured audio. */
+  pin_kind_audio,
+};
+
+/** A pin shared by the views of it. */
+struct pin_object {
+  PyObject_HEAD
+
+  /** The kind of pin. */
+  enum pin_kind kind;
+
+  /** Gives the pin back, looked up when pinned so it still can after an unload. */
+  service_proc unpin;
+
+  /** The pin. */
+  union {
+    /** A camera frame. */
+    struct face_pin frame;
+
+    /** A span of captured audio. */
+    struct speech_pin audio;
+  } pin;
+};
+
+/** A read-only two-dimensional view of pinned memory. */
+struct view_object {
+  PyObject_HEAD
+
+  /** The pin, or NULL once released. */
+  PyObject* pin;
+
+  /** The first byte. */
+  const void* data;
+
+  /** The struct format of an element. */
+  const char* format;
+
+  /** The size of an element in bytes. */
+  Py_ssize_t itemsize;
+
+  /** The rows and columns. */
+  Py_ssize_t shape[2];
+
+  /** The row and column strides in bytes. */
+  Py_ssize_t strides[2];
+
+  /** The number of buffers exported and not yet released. */
+  Py_ssize_t exports;
+
+  /** The frame number, or zero for audio. */
+  unsigned long long id;
+
+  /** The frame timestamp in nanoseconds, or zero for audio. */
+  unsigned long long timestamp;
+
+  /** The audio sample rate in hertz, or zero for frames. */
+  int sample_rate;
+};
+
+/** The number of frames viewed. */
+static atomic_ulong frames_viewed;
+
+/** The number of audio spans viewed. */
+static atomic_ulong audio_viewed;
+
+/** The number of bytes viewed in place. */
+static atomic_ullong bytes_viewed;
+
+/** The number of pins not yet given back. */
+static atomic_ulong pins_held;
+
+static void pin_dealloc(PyObject* self) {
+  struct pin_object* p = (struct pin_object*) self;
+
+  switch (p->kind) {
+    case pin_kind_frame:
+      p->unpin(SERVICE_FACE, &p->pin.frame, NULL);
+      atomic_fetch_sub_explicit(&pins_held, 1, memory_order_relaxed);
+      break;
+    case pin_kind_audio:
+      p->unpin(SERVICE_SPEECH, &p->pin.audio, NULL);
+      atomic_fetch_sub_explicit(&pins_held, 1, memory_order_relaxed);
+      break;
+    default:
+      break;
+  }
+
+  PyTypeObject* type = Py_TYPE(self);
+  type->tp_free(self);
+  Py_DECREF(type);
+}
+
+static PyType_Slot pin_slots[] = {
+  { Py_tp_dealloc, &pin_dealloc },
+  { Py_tp_doc, "Pinned memory, given back once the last view of it is gone." },
+  { 0, NULL },
+};
+
+static PyType_Spec pin_spec = {
+  .name = "cozmonaut.Pin",
+  .basicsize = sizeof(struct pin_object),
+  .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+  .slots = pin_slots,
+};
+
+static int view_getbuffer(PyObject* self, Py_buffer* buf, int flags) {
+  struct view_object* v = (struct view_object*) self;
+  buf->obj = NULL;
+
+  if (!v->pin) {
+    PyErr_SetString(PyExc_ValueError, "operation forbidden on released view");
+    return -1;
+  }
+
+  if (flags & PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "view is read-only");
+    return -1;
+  }
+
+  // Without strides the consumer assumes C order
+  int contiguous = v->strides[1] == v->itemsize && v->strides[0] == v->shape[1] * v->itemsize;
+  if ((flags & PyBUF_STRIDES) != PyBUF_STRIDES && !contiguous) {
+    PyErr_SetString(PyExc_BufferError, "view is not contiguous");
+    return -1;
+  }
+
+  buf->buf = (void*) v->data;
+  buf->obj = self;
+  buf->len = v->shape[0] * v->shape[1] * v->itemsize;
+  buf->readonly = 1;
+  buf->itemsize = v->itemsize;
+  buf->format = flags & PyBUF_FORMAT ? (char*) v->format : NULL;
+  buf->ndim = flags & PyBUF_ND ? 2 : 1;
+  buf->shape = flags & PyBUF_ND ? v->shape : NULL;
+  buf->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? v->strides : NULL;
+  buf->suboffsets = NULL;
+  buf->internal = NULL;
+
+  Py_INCREF(self);
+  ++v->exports;
+  return 0;
+}
+
+static void view_releasebuffer(PyObject* self, Py_buffer* buf) {
+  --((struct view_object*) self)->exports;
+}
+
+static PyObject* view_release(PyObject* self, PyObject* args) {
+  struct view_object* v = (struct view_object*) self;
+
+  if (v->exports) {
+    PyErr_SetString(PyExc_BufferError, "cannot release a view while it is exported");
+    return NULL;
+  }
+
+  Py_CLEAR(v->pin);
+  Py_RETURN_NONE;
+}
+
+static PyObject* view_enter(PyObject* self, PyObject* args) {
+  Py_INCREF(self);
+  return self;
+}
+
+static PyObject* view_exit(PyObject* self, PyObject* args) {
+  return view_release(self, NULL);
+}
+
+static PyObject* view_get_released(PyObject* self, void* closure) {
+  return PyBool_FromLong(!((struct view_object*) self)->pin);
+}
+
+static void view_dealloc(PyObject* self) {
+  Py_XDECREF(((struct view_object*) self)->pin);
+
+  PyTypeObject* type = Py_TYPE(self);
+  type->tp_free(self);
+  Py_DECREF(type);
+}
+
+static PyMethodDef view_methods[] = {
+  { "release", &view_release, METH_NOARGS, "Give back the pin now instead of when the view is dropped." },
+  { "__enter__", &view_enter, METH_NOARGS, NULL },
+  { "__exit__", &view_exit, METH_VARARGS, NULL },
+  { NULL },
+};
+
+static PyMemberDef view_members[] = {
+  { "id", T_ULONGLONG, offsetof(struct view_object, id), READONLY, "The frame number." },
+  { "timestamp", T_ULONGLONG, offsetof(struct view_object, timestamp), READONLY, "The frame timestamp in ns." },
+  { "sample_rate", T_INT, offsetof(struct view_object, sample_rate), READONLY, "The audio sample rate in Hz." },
+  { NULL },
+};
+
+static PyGetSetDef view_getset[] = {
+  { "released", &view_get_released, NULL, "Whether the pin was given back.", NULL },
+  { NULL },
+};
+
+static PyType_Slot view_slots[] = {
+  { Py_tp_dealloc, &view_dealloc },
+  { Py_bf_getbuffer, &view_getbuffer },
+  { Py_bf_releasebuffer, &view_releasebuffer },
+  { Py_tp_methods, view_methods },
+  { Py_tp_members, view_members },
+  { Py_tp_getset, view_getset },
+  { Py_tp_doc, "A read-only view of a pinned frame or audio span. Wrap it with memoryview or numpy.asarray." },
+  { 0, NULL },
+};
+
+static PyType_Spec view_spec = {
+  .name = "cozmonaut.View",
+  .basicsize = sizeof(struct view_object),
+  .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+  .slots = view_slots,
+};
+
+/**
+ * Make a view of pinned memory.
+ *
+ * @param state The module state
+ * @param pin The pin, which gains a reference
+ * @param data The first byte
+ * @param format The struct format of an element
+ * @param itemsize The size of an element in bytes
+ * @param rows The number of rows
+ * @param cols The number of columns
+ * @param stride The row stride in bytes
+ * @return The view, or NULL with an exception set
+ */
+static struct view_object* new_view(struct python_module_state* state, PyObject* pin, const void* data,
+    const char* format, Py_ssize_t itemsize, Py_ssize_t rows, Py_ssize_t cols, Py_ssize_t stride) {
+  struct view_object* v = PyObject_New(struct view_object, (PyTypeObject*) state->view_type);
+  if (!v) {
+    return NULL;
+  }
+
+  Py_INCREF(pin);
+  v->pin = pin;
+  v->data = data;
+  v->format = format;
+  v->itemsize = itemsize;
+  v->shape[0] = rows;
+  v->shape[1] = cols;
+  v->strides[0] = stride;
+  v->strides[1] = itemsize;
+  v->exports = 0;
+  v->id = 0;
+  v->timestamp = 0;
+  v->sample_rate = 0;
+
+  atomic_fetch_add_explicit(&bytes_viewed, (unsigned long long) (rows * cols * itemsize), memory_order_relaxed);
+  return v;
+}
+
+int python_view_init(PyObject* module, struct python_module_state* state) {
+  state->pin_type = PyType_FromModuleAndSpec(module, &pin_spec, NULL);
+  state->view_type = PyType_FromModuleAndSpec(module, &view_spec, NULL);
+  if (!state->pin_type || !state->view_type) {
+    return 1;
+  }
+
+  Py_INCREF(state->view_type);
+  return PyModule_AddObject(module, "View", state->view_type) < 0;
+}
+
+PyObject* python_view_frame(struct python_module_state* state) {
+  struct pin_object* pin = PyObject_New(struct pin_object, (PyTypeObject*) state->pin_type);
+  if (!pin) {
+    return NULL;
+  }
+
+  pin->kind = pin_kind_none;
+  pin->unpin = service_get_proc(SERVICE_FACE, service_face_proc_unpin_frame);
+  if (!pin->unpin || service_call(SERVICE_FACE, service_face_proc_pin_frame, NULL, &pin->pin.frame)) {
+    Py_DECREF(pin);
+    Py_RETURN_NONE;
+  }
+
+  pin->kind = pin_kind_frame;
+  atomic_fetch_add_explicit(&pins_held, 1, memory_order_relaxed);
+
+  const struct face_frame* frame = &pin->pin.frame.frame;
+  struct view_object* v = new_view(state, (PyObject*) pin, frame->data, "B", 1, frame->height, frame->width,
+      frame->stride);
+
+  // The view holds the only reference now
+  Py_DECREF(pin);
+  if (!v) {
+    return NULL;
+  }
+
+  v->id = frame->id;
+  v->timestamp = frame->timestamp;
+
+  atomic_fetch_add_explicit(&frames_viewed, 1, memory_order_relaxed);
+  return (PyObject*) v;
+}
+
+PyObject* python_view_audio(struct python_module_state* state, size_t frames) {
+  struct pin_object* pin = PyObject_New(struct pin_object, (PyTypeObject*) state->pin_type);
+  if (!pin) {
+    return NULL;
+  }
+
+  pin->kind = pin_kind_none;
+  pin->unpin = service_get_proc(SERVICE_SPEECH, service_speech_proc_unpin_audio);
+  if (!pin->unpin || service_call(SERVICE_SPEECH, service_speech_proc_pin_audio, &frames, &pin->pin.audio)) {
+    Py_DECREF(pin);
+    Py_RETURN_NONE;
+  }
+
+  pin->kind = pin_kind_audio;
+  atomic_fetch_add_explicit(&pins_held, 1, memory_order_relaxed);
+
+  const struct speech_pin* audio = &pin->pin.audio;
+  Py_ssize_t stride = (Py_ssize_t) (audio->channels * sizeof(short));
+  Py_ssize_t segments = audio->second_len ? 2 : 1;
+
+  PyObject* out = PyTuple_New(segments);
+  for (Py_ssize_t i = 0; out && i < segments; ++i) {
+    const short* data = i ? audio->second : audio->first;
+    size_t len = i ? audio->second_len : audio->first_len;
+
+    struct view_object* v = new_view(state, (PyObject*) pin, data, "h", sizeof(short), (Py_ssize_t) len,
+        audio->channels, stride);
+    if (!v) {
+      Py_CLEAR(out);
+      break;
+    }
+
+    v->sample_rate = audio->sample_rate;
+    PyTuple_SET_ITEM(out, i, (PyObject*) v);
+  }
+
+  Py_DECREF(pin);
+
+  if (out) {
+    atomic_fetch_add_explicit(&audio_viewed, 1, memory_order_relaxed);
+  }
+  return out;
+}
+
+void python_view_read(struct python_view_stats* out) {
+  out->frames_viewed = atomic_load_explicit(&frames_viewed, memory_order_relaxed);
+  out->audio_viewed = atomic_load_explicit(&audio_viewed, memory_order_relaxed);
+  out->bytes_viewed = atomic_load_explicit(&bytes_viewed, memory_order_relaxed);
+  out->pins_held = atomic_load_explicit(&pins_held, memory_order_relaxed);
+}
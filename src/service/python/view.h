@@ -0,0 +1,78 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_PYTHON_VIEW_H
+#define SERVICE_PYTHON_VIEW_H
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stddef.h>
+
+struct python_module_state;
+
+//
+// Zero-Copy Views
+//
+// A view exposes a pinned camera frame or span of captured audio to Python
+// through the buffer protocol, read-only and in place, so NumPy and friends
+// can wrap it without a copy. Each view holds a reference to its pin, which
+// is given back to its service as soon as the last view and the last export
+// of it are gone. Views can also be released early with release() or a with
+// block.
+//
+
+/** View counts. */
+struct python_view_stats {
+  /** The number of frames viewed. */
+  unsigned long frames_viewed;
+
+  /** The number of audio spans viewed. */
+  unsigned long audio_viewed;
+
+  /** The number of bytes viewed in place. */
+  unsigned long long bytes_viewed;
+
+  /** The number of pins not yet given back. */
+  unsigned long pins_held;
+};
+
+/**
+ * Create the view types for one instance of the built-in module and add them
+ * to it. Call with the GIL held.
+ *
+ * @param module The module
+ * @param state The module state
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+int python_view_init(PyObject* module, struct python_module_state* state);
+
+/**
+ * View the frame behind the latest face result. Call with the GIL held.
+ *
+ * @param state The module state
+ * @return A view, None if no frame was processed yet, or NULL with an
+ *   exception set
+ */
+PyObject* python_view_frame(struct python_module_state* state);
+
+/**
+ * View the most recently processed captured audio. Call with the GIL held.
+ *
+ * @param state The module state
+ * @param frames The number of frames wanted
+ * @return A tuple of one view, or two if the audio wraps around the capture
+ *   buffer, None if no audio is available, or NULL with an exception set
+ */
+PyObject* python_view_audio(struct python_module_state* state, size_t frames);
+
+/**
+ * Read the view counts.
+ *
+ * @param out The counts
+ */
+void python_view_read(struct python_view_stats* out);
+
+#endif // #ifndef SERVICE_PYTHON_VIEW_H
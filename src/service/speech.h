@@ -6,9 +6,279 @@
 #ifndef SERVICE_SPEECH_H
 #define SERVICE_SPEECH_H
 
+#include <stddef.h>
+
+/** The sample rate the pipeline runs at after resampling captured audio. */
+#define SPEECH_SAMPLE_RATE 16000
+
+/** The period at which the pipeline consumes captured audio in milliseconds. */
+#define SPEECH_HOP_MS 10
+
+/** The number of cepstral coefficients in a feature frame. */
+#define SPEECH_FEATURE_DIM 13
+
+/** The most captured audio pins that can be held at once. */
+#define SPEECH_MAX_PINS 8
+
 /** A speech service procedure. */
 enum service_speech_proc {
   service_speech_proc_hello,
+
+  /**
+   * Configure audio capture. Takes const struct speech_config* as arg1. Only
+   * allowed while the service is stopped.
+   */
+  service_speech_proc_configure,
+
+  /** Install a backend. Takes const struct speech_backend* as arg1. */
+  service_speech_proc_set_backend,
+
+  /**
+   * Push captured audio. Takes const struct speech_audio* as arg1 and
+   * optionally size_t* as arg2 for the number of frames accepted.
+   *
+   * This is meant to be called from the capture callback. It never allocates
+   * or waits on the disk; frames that do not fit are dropped and counted as
+   * overruns. While inputs are recorded, it also takes the recording lock just
+   * long enough to reserve room for them, then copies them without it.
+   */
+  service_speech_proc_push_audio,
+
+  /** Get capture statistics. Takes struct speech_stats* as arg2. */
+  service_speech_proc_get_stats,
+
+  /**
+   * Replay a recording through the pipeline in place of capture. Takes const
+   * struct speech_replay_options* as arg1. Only allowed while the service is
+   * stopped.
+   *
+   * The recording runs on the calling thread, which returns once the last
+   * utterance has been closed. The pipeline is rebuilt first, and the capture
+   * format is switched to that of the recording, so the same file always
+   * produces the same segments and features.
+   */
+  service_speech_proc_replay,
+
+  /**
+   * Pin the most recently processed captured audio in the buffer so it can
+   * be read in place. Takes const size_t* as arg1 for the number of frames
+   * wanted and struct speech_pin* as arg2. At most tap_ms of audio can be
+   * pinned. Fails if no audio was captured yet or every pin is taken.
+   *
+   * Pinned audio is held back from capture, so holding a pin for longer than
+   * buffer_ms overruns the buffer.
+   */
+  service_speech_proc_pin_audio,
+
+  /** Give back pinned audio. Takes const struct speech_pin* as arg1. */
+  service_speech_proc_unpin_audio,
+};
+
+/** A speech capture configuration. */
+struct speech_config {
+  /** The capture sample rate in hertz. It is resampled to SPEECH_SAMPLE_RATE. */
+  int sample_rate;
+
+  /** The number of interleaved channels per frame. They are mixed down to mono. */
+  int channels;
+
+  /** The amount of audio to buffer between capture and pipeline in milliseconds. */
+  int buffer_ms;
+
+  /** Nonzero to forward only detected speech to the recognizer. */
+  int vad;
+
+  /** The level above the noise floor that opens a speech segment in decibels. */
+  float vad_onset_db;
+
+  /** The level above the noise floor that keeps a speech segment open in decibels. */
+  float vad_offset_db;
+
+  /** How long a segment stays open through silence in milliseconds. */
+  int vad_hangover_ms;
+
+  /** How much audio from before the onset to forward in milliseconds. */
+  int vad_preroll_ms;
+
+  /**
+   * The keyword spotting model file, or NULL to pass every speech segment to
+   * the recognizer. Only read during configuration.
+   */
+  const char* kws_model;
+
+  /** The smoothed keyword posterior that counts as a detection. */
+  float kws_threshold;
+
+  /**
+   * How much processed audio to keep in the buffer for pinning in
+   * milliseconds, or zero to release audio as soon as it is processed.
+   */
+  int tap_ms;
+};
+
+/**
+ * Captured audio pinned in place.
+ *
+ * The audio may wrap around the end of the buffer, so it comes in up to two
+ * segments of interleaved frames in the capture format.
+ */
+struct speech_pin {
+  /** The first segment. */
+  const short* first;
+
+  /** The number of frames in the first segment. */
+  size_t first_len;
+
+  /** The second segment. */
+  const short* second;
+
+  /** The number of frames in the second segment. */
+  size_t second_len;
+
+  /** The capture sample rate in hertz. */
+  int sample_rate;
+
+  /** The number of interleaved channels per frame. */
+  int channels;
+
+  /** The pin. Opaque. */
+  int handle;
+};
+
+/** Options for replaying a recording. */
+struct speech_replay_options {
+  /** The WAV or raw 16-bit PCM file path. */
+  const char* path;
+
+  /** The sample rate of raw PCM in hertz. WAV files carry their own. */
+  int sample_rate;
+
+  /** The number of channels of raw PCM. WAV files carry their own. */
+  int channels;
+
+  /** Nonzero to pace the audio in real time, otherwise as fast as possible. */
+  int realtime;
+};
+
+/** A chunk of captured audio. */
+struct speech_audio {
+  /** The interleaved 16-bit PCM samples. */
+  const short* samples;
+
+  /** The number of frames. */
+  size_t frames;
+};
+
+/** A pluggable speech recognizer. */
+struct speech_backend {
+  /** An opaque pointer passed to every callback. */
+  void* ctx;
+
+  /**
+   * Begin a speech segment.
+   *
+   * @param ctx The backend context
+   * @return Zero on success, otherwise nonzero
+   */
+  int (* begin)(void* ctx);
+
+  /**
+   * Feed audio belonging to the current segment.
+   *
+   * @param ctx The backend context
+   * @param samples The mono samples from -1 to 1 at SPEECH_SAMPLE_RATE
+   * @param len The number of samples
+   * @return Zero on success, otherwise nonzero
+   */
+  int (* feed)(void* ctx, const float* samples, size_t len);
+
+  /**
+   * Receive a feature frame belonging to the current segment. Optional.
+   *
+   * One frame arrives per hop once the first analysis window has filled.
+   *
+   * @param ctx The backend context
+   * @param mfcc The SPEECH_FEATURE_DIM cepstral coefficients
+   * @return Zero on success, otherwise nonzero
+   */
+  int (* features)(void* ctx, const float* mfcc);
+
+  /**
+   * End the current speech segment.
+   *
+   * @param ctx The backend context
+   * @return Zero on success, otherwise nonzero
+   */
+  int (* end)(void* ctx);
+};
+
+/** Speech capture statistics. */
+struct speech_stats {
+  /** The number of frames accepted from capture. */
+  unsigned long frames_captured;
+
+  /** The number of frames dropped because the buffer was full. */
+  unsigned long frames_overrun;
+
+  /** The number of frames consumed by the pipeline. */
+  unsigned long frames_consumed;
+
+  /** The number of pipeline hops that found no audio waiting. */
+  unsigned long underruns;
+
+  /** The number of frames waiting in the buffer. */
+  unsigned long frames_buffered;
+
+  /** The number of hops analyzed. */
+  unsigned long hops;
+
+  /** The number of hops passed by the detector, including pre-roll. */
+  unsigned long hops_forwarded;
+
+  /** The number of hops fed to the recognizer. */
+  unsigned long hops_recognized;
+
+  /** The number of speech segments the detector opened. */
+  unsigned long segments;
+
+  /** The number of feature frames run through the keyword spotter. */
+  unsigned long kws_frames;
+
+  /** The number of keyword detections. */
+  unsigned long kws_detections;
+
+  /** The audio time from speech onset to the last keyword detection in milliseconds. */
+  unsigned long kws_latency_ms;
+
+  /** The number of feature frames computed. */
+  unsigned long feature_frames;
+
+  /** The total time spent detecting voice activity in nanoseconds. */
+  unsigned long long vad_time;
+
+  /** The total time spent computing features in nanoseconds. */
+  unsigned long long feature_time;
+
+  /** The total time spent spotting keywords in nanoseconds. */
+  unsigned long long kws_time;
+
+  /** The total time spent in the recognizer in nanoseconds. */
+  unsigned long long recognizer_time;
+
+  /** The number of utterances closed. */
+  unsigned long utterances_closed;
+
+  /**
+   * The total time from the last voiced hop of each utterance to the
+   * recognizer finishing it in nanoseconds, hangover included.
+   */
+  unsigned long long eou_time;
+
+  /** The number of audio pins taken. */
+  unsigned long audio_pinned;
+
+  /** The number of audio pins not yet given back. */
+  unsigned long pins_held;
 };
 
 /** The speech service. */
@@ -0,0 +1,238 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "feature.h"
+
+/** A small energy that keeps logarithms finite on digital silence. */
+#define FEATURE_EPSILON 1e-10f
+
+/**
+ * Convert a frequency to the mel scale.
+ */
+static double to_mel(double hz) {
+  return 1127 * log(1 + hz / 700);
+}
+
+/**
+ * Convert a mel scale value to a frequency.
+ */
+static double from_mel(double mel) {
+  return 700 * (exp(mel / 1127) - 1);
+}
+
+/**
+ * Compute the dot product of two vectors.
+ *
+ * @param a The first vector
+ * @param b The second vector
+ * @param len The number of elements
+ * @return The dot product
+ */
+static float dot(const float* a, const float* b, size_t len) {
+  float sum = 0;
+  size_t i = 0;
+
+#ifdef __SSE__
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  size_t blocks = len & ~(size_t) 7;
+
+  for (; i < blocks; i += 8) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+  }
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+  sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+  for (; i < len; ++i) {
+    sum += a[i] * b[i];
+  }
+
+  return sum;
+}
+
+/**
+ * Multiply two vectors element by element.
+ *
+ * @param a The first vector
+ * @param b The second vector
+ * @param out The product
+ * @param len The number of elements
+ */
+static void multiply(const float* a, const float* b, float* out, size_t len) {
+  size_t i = 0;
+
+#ifdef __SSE__
+  for (; i + 4 <= len; i += 4) {
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  }
+#endif
+
+  for (; i < len; ++i) {
+    out[i] = a[i] * b[i];
+  }
+}
+
+int speech_feature_init(struct speech_feature* feature, int rate, size_t hop_len) {
+  memset(feature, 0, sizeof *feature);
+
+  size_t window_len = (size_t) rate * SPEECH_FEATURE_WINDOW_MS / 1000;
+  if (window_len < hop_len) {
+    window_len = hop_len;
+  }
+
+  size_t n = 4;
+  while (n < window_len) {
+    n <<= 1;
+  }
+
+  if (speech_fft_init(&feature->fft, n)) {
+    return 1;
+  }
+
+  feature->window_len = window_len;
+  feature->hop_len = hop_len;
+  feature->window = malloc(window_len * sizeof *feature->window);
+  feature->history = malloc(window_len * sizeof *feature->history);
+  feature->frame = calloc(n, sizeof *feature->frame);
+  feature->power = malloc((n / 2 + 1) * sizeof *feature->power);
+  feature->dct = malloc(SPEECH_FEATURE_DIM * SPEECH_FEATURE_MEL_BANDS * sizeof *feature->dct);
+
+  if (!feature->window || !feature->history || !feature->frame || !feature->power || !feature->dct) {
+    speech_feature_free(feature);
+    return 1;
+  }
+
+  for (size_t i = 0; i < window_len; ++i) {
+    feature->window[i] = (float) (0.54 - 0.46 * cos(2 * M_PI * (double) i / (double) (window_len - 1)));
+  }
+
+  // Place band edges evenly on the mel scale
+  double mel_low = to_mel(SPEECH_FEATURE_MEL_LOW);
+  double mel_high = to_mel(rate / 2.0);
+  double edges[SPEECH_FEATURE_MEL_BANDS + 2];
+
+  for (int b = 0; b < SPEECH_FEATURE_MEL_BANDS + 2; ++b) {
+    edges[b] = from_mel(mel_low + (mel_high - mel_low) * b / (SPEECH_FEATURE_MEL_BANDS + 1)) * n / rate;
+  }
+
+  // Store each triangle over just the bins it covers, so the filterbank is a
+  // short dot product per band rather than a dense matrix
+  size_t weights_len = 0;
+  for (int b = 0; b < SPEECH_FEATURE_MEL_BANDS; ++b) {
+    size_t first = (size_t) ceil(edges[b]);
+    size_t last = (size_t) floor(edges[b + 2]);
+    if (last > n / 2) {
+      last = n / 2;
+    }
+
+    feature->band_first[b] = first;
+    feature->band_len[b] = last >= first ? last - first + 1 : 0;
+    feature->band_offset[b] = weights_len;
+    weights_len += feature->band_len[b];
+  }
+
+  feature->band_weights = malloc((weights_len ? weights_len : 1) * sizeof *feature->band_weights);
+  if (!feature->band_weights) {
+    speech_feature_free(feature);
+    return 1;
+  }
+
+  for (int b = 0; b < SPEECH_FEATURE_MEL_BANDS; ++b) {
+    float* weights = feature->band_weights + feature->band_offset[b];
+
+    for (size_t i = 0; i < feature->band_len[b]; ++i) {
+      double k = (double) (feature->band_first[b] + i);
+      double w = k <= edges[b + 1]
+          ? (k - edges[b]) / (edges[b + 1] - edges[b])
+          : (edges[b + 2] - k) / (edges[b + 2] - edges[b + 1]);
+      weights[i] = (float) (w > 0 ? w : 0);
+    }
+  }
+
+  for (int c = 0; c < SPEECH_FEATURE_DIM; ++c) {
+    double norm = sqrt((c ? 2.0 : 1.0) / SPEECH_FEATURE_MEL_BANDS);
+    for (int b = 0; b < SPEECH_FEATURE_MEL_BANDS; ++b) {
+      feature->dct[c * SPEECH_FEATURE_MEL_BANDS + b] = (float) (norm * cos(M_PI * c * (b + 0.5)
+          / SPEECH_FEATURE_MEL_BANDS));
+    }
+  }
+
+  speech_feature_reset(feature);
+  return 0;
+}
+
+void speech_feature_free(struct speech_feature* feature) {
+  speech_fft_free(&feature->fft);
+
+  free(feature->window);
+  free(feature->history);
+  free(feature->frame);
+  free(feature->power);
+  free(feature->band_weights);
+  free(feature->dct);
+
+  feature->window = NULL;
+  feature->history = NULL;
+  feature->frame = NULL;
+  feature->power = NULL;
+  feature->band_weights = NULL;
+  feature->dct = NULL;
+}
+
+void speech_feature_reset(struct speech_feature* feature) {
+  feature->history_len = 0;
+  feature->last = 0;
+}
+
+int speech_feature_push(struct speech_feature* feature, const float* hop, float* out) {
+  size_t window_len = feature->window_len;
+  size_t hop_len = feature->hop_len;
+
+  // Slide the window along, keeping the overlap from earlier hops
+  if (feature->history_len + hop_len > window_len) {
+    size_t keep = window_len - hop_len;
+    memmove(feature->history, feature->history + feature->history_len - keep, keep * sizeof *feature->history);
+    feature->history_len = keep;
+  }
+
+  float* dst = feature->history + feature->history_len;
+  for (size_t i = 0; i < hop_len; ++i) {
+    dst[i] = hop[i] - SPEECH_FEATURE_PREEMPHASIS * feature->last;
+    feature->last = hop[i];
+  }
+  feature->history_len += hop_len;
+
+  if (feature->history_len < window_len) {
+    return 0;
+  }
+
+  multiply(feature->history, feature->window, feature->frame, window_len);
+  speech_fft_power(&feature->fft, feature->frame, feature->power);
+
+  for (int b = 0; b < SPEECH_FEATURE_MEL_BANDS; ++b) {
+    float energy = dot(feature->power + feature->band_first[b], feature->band_weights + feature->band_offset[b],
+        feature->band_len[b]);
+    feature->mel[b] = logf(energy + FEATURE_EPSILON);
+  }
+
+  for (int c = 0; c < SPEECH_FEATURE_DIM; ++c) {
+    out[c] = dot(feature->dct + c * SPEECH_FEATURE_MEL_BANDS, feature->mel, SPEECH_FEATURE_MEL_BANDS);
+  }
+
+  return 1;
+}
@@ -0,0 +1,116 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_SPEECH_FEATURE_H
+#define SERVICE_SPEECH_FEATURE_H
+
+#include <stddef.h>
+
+#include "../speech.h"
+
+#include "fft.h"
+
+/** The analysis window length in milliseconds. */
+#define SPEECH_FEATURE_WINDOW_MS 25
+
+/** The number of mel filterbank bands. */
+#define SPEECH_FEATURE_MEL_BANDS 40
+
+/** The lowest filterbank frequency in hertz. */
+#define SPEECH_FEATURE_MEL_LOW 20
+
+/** The pre-emphasis coefficient. */
+#define SPEECH_FEATURE_PREEMPHASIS 0.97f
+
+/**
+ * A streaming MFCC front end.
+ *
+ * Audio arrives one hop at a time. The tail of the previous window is kept
+ * between hops, so each hop costs exactly one windowed transform and one
+ * feature frame comes out as soon as enough audio has arrived for the first
+ * window. All tables are built at init.
+ */
+struct speech_feature {
+  /** The number of samples per window. */
+  size_t window_len;
+
+  /** The number of samples per hop. */
+  size_t hop_len;
+
+  /** The transform. Its size is the window length rounded up to a power of two. */
+  struct speech_fft fft;
+
+  /** The Hamming window. */
+  float* window;
+
+  /** The most recent window of pre-emphasized samples. */
+  float* history;
+
+  /** The number of valid samples in the history. */
+  size_t history_len;
+
+  /** The last raw sample, for pre-emphasis across hops. */
+  float last;
+
+  /** Scratch for the windowed, zero-padded frame. */
+  float* frame;
+
+  /** Scratch for the power spectrum. */
+  float* power;
+
+  /** The first spectrum bin of each mel band. */
+  size_t band_first[SPEECH_FEATURE_MEL_BANDS];
+
+  /** The number of bins in each mel band. */
+  size_t band_len[SPEECH_FEATURE_MEL_BANDS];
+
+  /** The offset of each band's weights in the weight table. */
+  size_t band_offset[SPEECH_FEATURE_MEL_BANDS];
+
+  /** The triangular filter weights of all bands, back to back. */
+  float* band_weights;
+
+  /** The orthonormal DCT-II matrix, SPEECH_FEATURE_DIM rows by SPEECH_FEATURE_MEL_BANDS columns. */
+  float* dct;
+
+  /** Scratch for the log mel energies. */
+  float mel[SPEECH_FEATURE_MEL_BANDS];
+};
+
+/**
+ * Initialize a front end and build its tables.
+ *
+ * @param feature The front end
+ * @param rate The sample rate in hertz
+ * @param hop_len The number of samples per hop
+ * @return Zero on success, otherwise nonzero
+ */
+int speech_feature_init(struct speech_feature* feature, int rate, size_t hop_len);
+
+/**
+ * Free a front end.
+ *
+ * @param feature The front end
+ */
+void speech_feature_free(struct speech_feature* feature);
+
+/**
+ * Forget buffered audio, as at the start of a segment.
+ *
+ * @param feature The front end
+ */
+void speech_feature_reset(struct speech_feature* feature);
+
+/**
+ * Push one hop of audio and compute a feature frame if a window is full.
+ *
+ * @param feature The front end
+ * @param hop The hop samples
+ * @param out The output frame of SPEECH_FEATURE_DIM coefficients
+ * @return Nonzero if a frame was written, otherwise zero
+ */
+int speech_feature_push(struct speech_feature* feature, const float* hop, float* out);
+
+#endif // #ifndef SERVICE_SPEECH_FEATURE_H
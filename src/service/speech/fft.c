@@ -0,0 +1,182 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "fft.h"
+
+//
+// The real transform of size n runs as a complex transform of size m = n / 2
+// over the even samples packed as real parts and the odd samples packed as
+// imaginary parts, and is then unpacked into the n / 2 + 1 real bins. Stage
+// twiddles are stored contiguously per stage (stage with half-width h starts
+// at offset h - 1) so the butterfly inner loop reads them at unit stride.
+//
+
+int speech_fft_init(struct speech_fft* fft, size_t n) {
+  if (n < 4 || n & (n - 1)) {
+    return 1;
+  }
+
+  size_t m = n / 2;
+
+  fft->n = n;
+  fft->stage_cos = malloc(m * sizeof *fft->stage_cos);
+  fft->stage_sin = malloc(m * sizeof *fft->stage_sin);
+  fft->split_cos = malloc((m + 1) * sizeof *fft->split_cos);
+  fft->split_sin = malloc((m + 1) * sizeof *fft->split_sin);
+  fft->bitrev = malloc(m * sizeof *fft->bitrev);
+  fft->re = malloc(m * sizeof *fft->re);
+  fft->im = malloc(m * sizeof *fft->im);
+
+  if (!fft->stage_cos || !fft->stage_sin || !fft->split_cos || !fft->split_sin || !fft->bitrev || !fft->re
+      || !fft->im) {
+    speech_fft_free(fft);
+    return 1;
+  }
+
+  for (size_t h = 1; h < m; h *= 2) {
+    for (size_t j = 0; j < h; ++j) {
+      double angle = M_PI * (double) j / (double) h;
+      fft->stage_cos[h - 1 + j] = (float) cos(angle);
+      fft->stage_sin[h - 1 + j] = (float) -sin(angle);
+    }
+  }
+
+  for (size_t k = 0; k <= m; ++k) {
+    double angle = 2 * M_PI * (double) k / (double) n;
+    fft->split_cos[k] = (float) cos(angle);
+    fft->split_sin[k] = (float) -sin(angle);
+  }
+
+  unsigned int bits = 0;
+  while ((1u << bits) < m) {
+    ++bits;
+  }
+
+  for (size_t i = 0; i < m; ++i) {
+    unsigned int r = 0;
+    for (unsigned int b = 0; b < bits; ++b) {
+      r |= ((i >> b) & 1u) << (bits - 1 - b);
+    }
+    fft->bitrev[i] = r;
+  }
+
+  return 0;
+}
+
+void speech_fft_free(struct speech_fft* fft) {
+  free(fft->stage_cos);
+  free(fft->stage_sin);
+  free(fft->split_cos);
+  free(fft->split_sin);
+  free(fft->bitrev);
+  free(fft->re);
+  free(fft->im);
+
+  fft->stage_cos = NULL;
+  fft->stage_sin = NULL;
+  fft->split_cos = NULL;
+  fft->split_sin = NULL;
+  fft->bitrev = NULL;
+  fft->re = NULL;
+  fft->im = NULL;
+}
+
+/**
+ * Run one radix-2 butterfly stage.
+ *
+ * @param re The real parts
+ * @param im The imaginary parts
+ * @param m The transform size
+ * @param h The butterfly half-width
+ * @param wr The stage twiddle cosines
+ * @param wi The stage twiddle sines
+ */
+static void butterflies(float* re, float* im, size_t m, size_t h, const float* wr, const float* wi) {
+  for (size_t base = 0; base < m; base += 2 * h) {
+    float* ar = re + base;
+    float* ai = im + base;
+    float* br = ar + h;
+    float* bi = ai + h;
+
+    size_t j = 0;
+
+#ifdef __SSE__
+    for (; j + 4 <= h; j += 4) {
+      __m128 vwr = _mm_loadu_ps(wr + j);
+      __m128 vwi = _mm_loadu_ps(wi + j);
+      __m128 vbr = _mm_loadu_ps(br + j);
+      __m128 vbi = _mm_loadu_ps(bi + j);
+      __m128 var = _mm_loadu_ps(ar + j);
+      __m128 vai = _mm_loadu_ps(ai + j);
+
+      __m128 tr = _mm_sub_ps(_mm_mul_ps(vbr, vwr), _mm_mul_ps(vbi, vwi));
+      __m128 ti = _mm_add_ps(_mm_mul_ps(vbr, vwi), _mm_mul_ps(vbi, vwr));
+
+      _mm_storeu_ps(br + j, _mm_sub_ps(var, tr));
+      _mm_storeu_ps(bi + j, _mm_sub_ps(vai, ti));
+      _mm_storeu_ps(ar + j, _mm_add_ps(var, tr));
+      _mm_storeu_ps(ai + j, _mm_add_ps(vai, ti));
+    }
+#endif
+
+    for (; j < h; ++j) {
+      float tr = br[j] * wr[j] - bi[j] * wi[j];
+      float ti = br[j] * wi[j] + bi[j] * wr[j];
+      br[j] = ar[j] - tr;
+      bi[j] = ai[j] - ti;
+      ar[j] += tr;
+      ai[j] += ti;
+    }
+  }
+}
+
+void speech_fft_power(struct speech_fft* fft, const float* in, float* power) {
+  size_t m = fft->n / 2;
+  float* re = fft->re;
+  float* im = fft->im;
+
+  // Pack even samples as real and odd as imaginary in bit-reversed order
+  for (size_t i = 0; i < m; ++i) {
+    unsigned int r = fft->bitrev[i];
+    re[r] = in[2 * i];
+    im[r] = in[2 * i + 1];
+  }
+
+  for (size_t h = 1; h < m; h *= 2) {
+    butterflies(re, im, m, h, fft->stage_cos + h - 1, fft->stage_sin + h - 1);
+  }
+
+  // Unpack the even and odd half spectra into the real spectrum
+  for (size_t k = 0; k <= m; ++k) {
+    size_t a = k == m ? 0 : k;
+    size_t b = k == 0 ? 0 : m - k;
+
+    float zr = re[a];
+    float zi = im[a];
+    float cr = re[b];
+    float ci = -im[b];
+
+    float even_r = 0.5f * (zr + cr);
+    float even_i = 0.5f * (zi + ci);
+    float odd_r = 0.5f * (zi - ci);
+    float odd_i = -0.5f * (zr - cr);
+
+    float wr = fft->split_cos[k];
+    float wi = fft->split_sin[k];
+
+    float xr = even_r + wr * odd_r - wi * odd_i;
+    float xi = even_i + wr * odd_i + wi * odd_r;
+
+    power[k] = xr * xr + xi * xi;
+  }
+}
@@ -0,0 +1,68 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_SPEECH_FFT_H
+#define SERVICE_SPEECH_FFT_H
+
+#include <stddef.h>
+
+/**
+ * A real-input FFT of one fixed size.
+ *
+ * All twiddle factors and the bit-reversal permutation are computed once at
+ * init, so transforms do no trigonometry and no allocation.
+ */
+struct speech_fft {
+  /** The transform size. A power of two, at least four. */
+  size_t n;
+
+  /** The twiddle cosines of each butterfly stage, stored stage after stage. */
+  float* stage_cos;
+
+  /** The negated twiddle sines of each butterfly stage. */
+  float* stage_sin;
+
+  /** The twiddle cosines for unpacking the real spectrum, n / 2 + 1 of them. */
+  float* split_cos;
+
+  /** The negated twiddle sines for unpacking the real spectrum. */
+  float* split_sin;
+
+  /** The bit-reversal permutation of the half-size transform. */
+  unsigned int* bitrev;
+
+  /** Scratch real parts. */
+  float* re;
+
+  /** Scratch imaginary parts. */
+  float* im;
+};
+
+/**
+ * Initialize a transform.
+ *
+ * @param fft The transform
+ * @param n The transform size, a power of two of at least four
+ * @return Zero on success, otherwise nonzero
+ */
+int speech_fft_init(struct speech_fft* fft, size_t n);
+
+/**
+ * Free a transform.
+ *
+ * @param fft The transform
+ */
+void speech_fft_free(struct speech_fft* fft);
+
+/**
+ * Compute the power spectrum of a real signal.
+ *
+ * @param fft The transform
+ * @param in The n input samples, already windowed
+ * @param power The n / 2 + 1 output bin powers
+ */
+void speech_fft_power(struct speech_fft* fft, const float* in, float* power);
+
+#endif // #ifndef SERVICE_SPEECH_FFT_H
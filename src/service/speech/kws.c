@@ -0,0 +1,284 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "kws.h"
+
+/**
+ * Decode a little-endian 32-bit unsigned integer.
+ */
+static unsigned int read_u32(const unsigned char* p) {
+  return (unsigned int) p[0] | (unsigned int) p[1] << 8 | (unsigned int) p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+/**
+ * Decode little-endian 32-bit floats.
+ *
+ * @param p The encoded floats
+ * @param len The number of floats
+ * @param out The decoded floats
+ */
+static void read_floats(const unsigned char* p, size_t len, float* out) {
+  for (size_t i = 0; i < len; ++i) {
+    unsigned int bits = read_u32(p + 4 * i);
+    memcpy(&out[i], &bits, sizeof bits);
+  }
+}
+
+/**
+ * Compute the dot product of two vectors.
+ *
+ * @param a The first vector
+ * @param b The second vector
+ * @param len The number of elements
+ * @return The dot product
+ */
+static float dot(const float* a, const float* b, size_t len) {
+  float sum = 0;
+  size_t i = 0;
+
+#ifdef __SSE__
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  size_t blocks = len & ~(size_t) 7;
+
+  for (; i < blocks; i += 8) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+  }
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+  sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+  for (; i < len; ++i) {
+    sum += a[i] * b[i];
+  }
+
+  return sum;
+}
+
+int speech_kws_load(struct speech_kws* kws, const char* path, float threshold) {
+  memset(kws, 0, sizeof *kws);
+
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return 1;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  unsigned char* data = size > 0 ? malloc((size_t) size) : NULL;
+  if (!data || fread(data, 1, (size_t) size, file) != (size_t) size) {
+    free(data);
+    fclose(file);
+    return 1;
+  }
+
+  fclose(file);
+
+  // Walk the file once to validate it and size the block
+  const unsigned char* end = data + size;
+  const unsigned char* p = data;
+
+  if (size < 16 || memcmp(p, SPEECH_KWS_MAGIC, 4) || read_u32(p + 4) != SPEECH_KWS_VERSION) {
+    free(data);
+    return 1;
+  }
+
+  size_t context = read_u32(p + 8);
+  size_t layers_len = read_u32(p + 12);
+  p += 16;
+
+  if (!context || context > SPEECH_KWS_MAX_CONTEXT || !layers_len || layers_len > SPEECH_KWS_MAX_LAYERS) {
+    free(data);
+    return 1;
+  }
+
+  size_t params = 0;
+  size_t widest = 0;
+  size_t expect = context * SPEECH_FEATURE_DIM;
+
+  for (size_t l = 0; l < layers_len; ++l) {
+    if (end - p < 12) {
+      free(data);
+      return 1;
+    }
+
+    size_t in = read_u32(p);
+    size_t out = read_u32(p + 4);
+    unsigned int activation = read_u32(p + 8);
+    p += 12;
+
+    int last = l == layers_len - 1;
+    if (in != expect || !out || activation > speech_kws_activation_softmax || (size_t) (end - p) / 4 < out * (in + 1)
+        || (last && (activation != speech_kws_activation_softmax || out < 2))) {
+      free(data);
+      return 1;
+    }
+
+    kws->layers[l].in = in;
+    kws->layers[l].out = out;
+    kws->layers[l].activation = (enum speech_kws_activation) activation;
+
+    params += out * (in + 1);
+    widest = out > widest ? out : widest;
+    expect = out;
+    p += 4 * out * (in + 1);
+  }
+
+  // Weights, the doubled frame stack and two scratch buffers in one block
+  size_t stack = 2 * context * SPEECH_FEATURE_DIM;
+  kws->block = malloc((params + stack + 2 * widest) * sizeof *kws->block);
+  if (!kws->block) {
+    free(data);
+    return 1;
+  }
+
+  float* at = kws->block;
+  p = data + 16;
+
+  for (size_t l = 0; l < layers_len; ++l) {
+    struct speech_kws_layer* layer = &kws->layers[l];
+    p += 12;
+
+    read_floats(p, layer->out * layer->in, at);
+    layer->weights = at;
+    at += layer->out * layer->in;
+    p += 4 * layer->out * layer->in;
+
+    read_floats(p, layer->out, at);
+    layer->biases = at;
+    at += layer->out;
+    p += 4 * layer->out;
+  }
+
+  free(data);
+
+  kws->frames = at;
+  kws->scratch[0] = at + stack;
+  kws->scratch[1] = at + stack + widest;
+  kws->context = context;
+  kws->layers_len = layers_len;
+  kws->threshold = threshold;
+  kws->loaded = 1;
+
+  speech_kws_reset(kws);
+  return 0;
+}
+
+void speech_kws_free(struct speech_kws* kws) {
+  free(kws->block);
+  memset(kws, 0, sizeof *kws);
+}
+
+void speech_kws_reset(struct speech_kws* kws) {
+  kws->frames_next = 0;
+  kws->frames_len = 0;
+  kws->refractory = 0;
+  memset(kws->posteriors, 0, sizeof kws->posteriors);
+}
+
+/**
+ * Run the model over the stacked frames.
+ *
+ * @param kws The spotter
+ * @return The keyword posterior
+ */
+static float infer(struct speech_kws* kws) {
+  // The newest context frames sit contiguously just after the next slot
+  const float* x = kws->frames + kws->frames_next * SPEECH_FEATURE_DIM;
+
+  float* y = NULL;
+  for (size_t l = 0; l < kws->layers_len; ++l) {
+    const struct speech_kws_layer* layer = &kws->layers[l];
+    y = kws->scratch[l % 2];
+
+    for (size_t o = 0; o < layer->out; ++o) {
+      y[o] = dot(layer->weights + o * layer->in, x, layer->in) + layer->biases[o];
+    }
+
+    switch (layer->activation) {
+      case speech_kws_activation_linear:
+        break;
+      case speech_kws_activation_relu:
+        for (size_t o = 0; o < layer->out; ++o) {
+          y[o] = y[o] > 0 ? y[o] : 0;
+        }
+        break;
+      case speech_kws_activation_softmax: {
+        float max = y[0];
+        for (size_t o = 1; o < layer->out; ++o) {
+          max = y[o] > max ? y[o] : max;
+        }
+
+        float sum = 0;
+        for (size_t o = 0; o < layer->out; ++o) {
+          y[o] = expf(y[o] - max);
+          sum += y[o];
+        }
+
+        for (size_t o = 0; o < layer->out; ++o) {
+          y[o] /= sum;
+        }
+        break;
+      }
+    }
+
+    x = y;
+  }
+
+  return y[1];
+}
+
+int speech_kws_push(struct speech_kws* kws, const float* mfcc) {
+  size_t slot = kws->frames_next;
+
+  // Write each frame twice so a window never wraps
+  memcpy(kws->frames + slot * SPEECH_FEATURE_DIM, mfcc, SPEECH_FEATURE_DIM * sizeof *mfcc);
+  memcpy(kws->frames + (slot + kws->context) * SPEECH_FEATURE_DIM, mfcc, SPEECH_FEATURE_DIM * sizeof *mfcc);
+
+  kws->frames_next = (slot + 1) % kws->context;
+  if (kws->frames_len < kws->context) {
+    ++kws->frames_len;
+  }
+
+  if (kws->frames_len < kws->context) {
+    return 0;
+  }
+
+  float posterior = infer(kws);
+
+  float sum = posterior;
+  for (size_t i = SPEECH_KWS_SMOOTH - 1; i > 0; --i) {
+    kws->posteriors[i] = kws->posteriors[i - 1];
+    sum += kws->posteriors[i];
+  }
+  kws->posteriors[0] = posterior;
+
+  if (kws->refractory) {
+    --kws->refractory;
+    return 0;
+  }
+
+  if (sum / SPEECH_KWS_SMOOTH < kws->threshold) {
+    return 0;
+  }
+
+  kws->refractory = SPEECH_KWS_REFRACTORY;
+  return 1;
+}
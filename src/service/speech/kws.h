@@ -0,0 +1,143 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_SPEECH_KWS_H
+#define SERVICE_SPEECH_KWS_H
+
+#include <stddef.h>
+
+#include "../speech.h"
+
+/** The model file magic number. */
+#define SPEECH_KWS_MAGIC "CZKW"
+
+/** The model file format version. */
+#define SPEECH_KWS_VERSION 1
+
+/** The largest number of layers in a model. */
+#define SPEECH_KWS_MAX_LAYERS 8
+
+/** The largest number of stacked feature frames a model may look at. */
+#define SPEECH_KWS_MAX_CONTEXT 100
+
+/** The number of frames the keyword posterior is averaged over. */
+#define SPEECH_KWS_SMOOTH 5
+
+/** The number of frames to ignore after a detection. */
+#define SPEECH_KWS_REFRACTORY 100
+
+//
+// Model File Format
+//
+// All fields are little-endian. The header is the four magic bytes followed
+// by version, context and layer count as 32-bit unsigned integers. Each layer
+// follows as input size, output size and activation (0 linear, 1 ReLU, 2
+// softmax) as 32-bit unsigned integers, then the output-by-input weights in
+// row-major order and the output biases as 32-bit floats. The first layer
+// takes context stacked frames of SPEECH_FEATURE_DIM coefficients, oldest
+// first. The last layer must be a softmax whose output 1 is the keyword.
+//
+
+/** A layer activation. */
+enum speech_kws_activation {
+  speech_kws_activation_linear,
+  speech_kws_activation_relu,
+  speech_kws_activation_softmax,
+};
+
+/** A dense layer. */
+struct speech_kws_layer {
+  /** The input size. */
+  size_t in;
+
+  /** The output size. */
+  size_t out;
+
+  /** The activation. */
+  enum speech_kws_activation activation;
+
+  /** The weights, out rows of in columns. */
+  const float* weights;
+
+  /** The biases. */
+  const float* biases;
+};
+
+/** A keyword spotter. */
+struct speech_kws {
+  /** Nonzero if a model is loaded. */
+  int loaded;
+
+  /** The number of stacked frames per inference. */
+  size_t context;
+
+  /** The layers. */
+  struct speech_kws_layer layers[SPEECH_KWS_MAX_LAYERS];
+
+  /** The number of layers. */
+  size_t layers_len;
+
+  /** The single allocation holding weights and scratch. */
+  float* block;
+
+  /**
+   * The stacked frames, stored twice over so the most recent context frames
+   * are always contiguous.
+   */
+  float* frames;
+
+  /** The slot the next frame goes into. */
+  size_t frames_next;
+
+  /** The number of frames seen since reset, saturating at the context. */
+  size_t frames_len;
+
+  /** Scratch activations, two buffers of the widest layer. */
+  float* scratch[2];
+
+  /** The recent keyword posteriors. */
+  float posteriors[SPEECH_KWS_SMOOTH];
+
+  /** The number of frames left to ignore after a detection. */
+  unsigned int refractory;
+
+  /** The smoothed posterior above which the keyword is detected. */
+  float threshold;
+};
+
+/**
+ * Load a model. This is the only call that allocates.
+ *
+ * @param kws The spotter
+ * @param path The model file path
+ * @param threshold The detection threshold from zero to one
+ * @return Zero on success, otherwise nonzero
+ */
+int speech_kws_load(struct speech_kws* kws, const char* path, float threshold);
+
+/**
+ * Unload the model.
+ *
+ * @param kws The spotter
+ */
+void speech_kws_free(struct speech_kws* kws);
+
+/**
+ * Forget stacked frames, as at the start of an utterance.
+ *
+ * @param kws The spotter
+ */
+void speech_kws_reset(struct speech_kws* kws);
+
+/**
+ * Push a feature frame and run the model. Never allocates.
+ *
+ * @param kws The spotter
+ * @param mfcc The SPEECH_FEATURE_DIM coefficients
+ * @return Nonzero if the keyword was detected, otherwise zero
+ */
+int speech_kws_push(struct speech_kws* kws, const float* mfcc);
+
+#endif // #ifndef SERVICE_SPEECH_KWS_H
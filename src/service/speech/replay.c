@@ -0,0 +1,161 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "replay.h"
+
+/** The WAVE_FORMAT_PCM format tag. */
+#define WAV_FORMAT_PCM 1
+
+/** The WAVE_FORMAT_EXTENSIBLE format tag. */
+#define WAV_FORMAT_EXTENSIBLE 0xfffe
+
+/**
+ * Decode a little-endian 16-bit unsigned integer.
+ */
+static unsigned int read_u16(const unsigned char* p) {
+  return (unsigned int) p[0] | (unsigned int) p[1] << 8;
+}
+
+/**
+ * Decode a little-endian 32-bit unsigned integer.
+ */
+static unsigned long read_u32(const unsigned char* p) {
+  return (unsigned long) p[0] | (unsigned long) p[1] << 8 | (unsigned long) p[2] << 16 | (unsigned long) p[3] << 24;
+}
+
+/**
+ * Find the format and audio in a WAV file.
+ *
+ * @param replay The replay, with the file mapped
+ * @return Zero on success, otherwise nonzero
+ */
+static int parse_wav(struct speech_replay* replay) {
+  const unsigned char* data = replay->map;
+  size_t len = replay->map_len;
+
+  int have_format = 0;
+  size_t pos = 12;
+
+  // Chunks are padded to even lengths, so the audio stays 16-bit aligned
+  while (pos + 8 <= len) {
+    const unsigned char* chunk = data + pos;
+    size_t chunk_len = read_u32(chunk + 4);
+    size_t body = pos + 8;
+
+    if (!memcmp(chunk, "fmt ", 4)) {
+      if (chunk_len < 16 || len - body < 16) {
+        return 1;
+      }
+
+      unsigned int format = read_u16(chunk + 8);
+      unsigned int bits = read_u16(chunk + 22);
+      if ((format != WAV_FORMAT_PCM && format != WAV_FORMAT_EXTENSIBLE) || bits != 16) {
+        return 1;
+      }
+
+      replay->channels = (int) read_u16(chunk + 10);
+      replay->sample_rate = (int) read_u32(chunk + 12);
+      have_format = 1;
+    } else if (!memcmp(chunk, "data", 4)) {
+      if (!have_format || !replay->channels) {
+        return 1;
+      }
+
+      // Recorders that stop abruptly leave the length unpatched
+      if (chunk_len > len - body) {
+        chunk_len = len - body;
+      }
+
+      replay->samples = (const short*) (data + body);
+      replay->frames = chunk_len / (2 * (size_t) replay->channels);
+      return 0;
+    }
+
+    if (chunk_len > len - body) {
+      return 1;
+    }
+
+    pos = body + chunk_len + (chunk_len & 1);
+  }
+
+  return 1;
+}
+
+int speech_replay_open(struct speech_replay* replay, const char* path, int sample_rate, int channels) {
+  memset(replay, 0, sizeof *replay);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < 12) {
+    close(fd);
+    return 1;
+  }
+
+  replay->map_len = (size_t) st.st_size;
+  replay->map = mmap(NULL, replay->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (replay->map == MAP_FAILED) {
+    replay->map = NULL;
+    return 1;
+  }
+
+  // Audio is read front to back exactly once
+  madvise(replay->map, replay->map_len, MADV_SEQUENTIAL);
+
+  const unsigned char* data = replay->map;
+  if (!memcmp(data, "RIFF", 4) && !memcmp(data + 8, "WAVE", 4)) {
+    if (parse_wav(replay)) {
+      speech_replay_close(replay);
+      return 1;
+    }
+  } else {
+    if (sample_rate <= 0 || channels <= 0) {
+      speech_replay_close(replay);
+      return 1;
+    }
+
+    replay->samples = replay->map;
+    replay->frames = replay->map_len / (2 * (size_t) channels);
+    replay->sample_rate = sample_rate;
+    replay->channels = channels;
+  }
+
+  if (replay->sample_rate <= 0) {
+    speech_replay_close(replay);
+    return 1;
+  }
+
+  return 0;
+}
+
+void speech_replay_close(struct speech_replay* replay) {
+  if (replay->map) {
+    munmap(replay->map, replay->map_len);
+  }
+  memset(replay, 0, sizeof *replay);
+}
+
+size_t speech_replay_read(struct speech_replay* replay, size_t max, const short** frames) {
+  size_t len = replay->frames - replay->pos;
+  if (len > max) {
+    len = max;
+  }
+
+  *frames = replay->samples + replay->pos * replay->channels;
+  replay->pos += len;
+  return len;
+}
@@ -0,0 +1,69 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_SPEECH_REPLAY_H
+#define SERVICE_SPEECH_REPLAY_H
+
+#include <stddef.h>
+
+/**
+ * A recording mapped into memory for replay.
+ *
+ * WAV files must hold 16-bit PCM and carry their own format. Anything else is
+ * taken as raw interleaved 16-bit PCM in the format given at open. Samples
+ * are read in place, so the host must be little-endian like the files.
+ */
+struct speech_replay {
+  /** The mapping. */
+  void* map;
+
+  /** The length of the mapping in bytes. */
+  size_t map_len;
+
+  /** The first frame of audio within the mapping. */
+  const short* samples;
+
+  /** The number of frames. */
+  size_t frames;
+
+  /** The sample rate in hertz. */
+  int sample_rate;
+
+  /** The number of interleaved channels per frame. */
+  int channels;
+
+  /** The index of the next frame to read. */
+  size_t pos;
+};
+
+/**
+ * Map a recording.
+ *
+ * @param replay The replay
+ * @param path The WAV or raw PCM file path
+ * @param sample_rate The sample rate of raw PCM in hertz
+ * @param channels The number of channels of raw PCM
+ * @return Zero on success, otherwise nonzero
+ */
+int speech_replay_open(struct speech_replay* replay, const char* path, int sample_rate, int channels);
+
+/**
+ * Unmap a recording.
+ *
+ * @param replay The replay
+ */
+void speech_replay_close(struct speech_replay* replay);
+
+/**
+ * Read the next frames without copying them.
+ *
+ * @param replay The replay
+ * @param max The largest number of frames to read
+ * @param frames The frames, pointing into the mapping
+ * @return The number of frames read, zero at the end
+ */
+size_t speech_replay_read(struct speech_replay* replay, size_t max, const short** frames);
+
+#endif // #ifndef SERVICE_SPEECH_REPLAY_H
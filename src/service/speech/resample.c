@@ -0,0 +1,253 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "resample.h"
+
+/**
+ * Compute the greatest common divisor of two numbers.
+ */
+static unsigned int gcd(unsigned int a, unsigned int b) {
+  while (b) {
+    unsigned int t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/**
+ * Evaluate the zeroth-order modified Bessel function of the first kind.
+ */
+static double bessel_i0(double x) {
+  double sum = 1;
+  double term = 1;
+  for (int k = 1; k < 50; ++k) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+    if (term < sum * 1e-12) {
+      break;
+    }
+  }
+  return sum;
+}
+
+/**
+ * Downmix interleaved 16-bit frames to mono float samples.
+ *
+ * @param frames The interleaved frames
+ * @param len The number of frames
+ * @param channels The number of channels per frame
+ * @param out The output samples from -1 to 1
+ */
+static void downmix(const short* frames, size_t len, int channels, float* out) {
+  float scale = 1.0f / (32768.0f * (float) channels);
+  size_t i = 0;
+
+#ifdef __SSE2__
+  __m128 vscale = _mm_set1_ps(scale);
+
+  if (channels == 1) {
+    for (; i + 8 <= len; i += 8) {
+      __m128i v = _mm_loadu_si128((const __m128i*) (frames + i));
+
+      // Sign-extend by unpacking into the high halves and shifting down
+      __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+      __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+
+      _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+      _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+    }
+  } else if (channels == 2) {
+    __m128i ones = _mm_set1_epi16(1);
+
+    for (; i + 4 <= len; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i*) (frames + 2 * i));
+
+      // Multiply-add against ones sums each left and right pair into 32 bits
+      __m128i sum = _mm_madd_epi16(v, ones);
+
+      _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(sum), vscale));
+    }
+  }
+#endif
+
+  for (; i < len; ++i) {
+    int sum = 0;
+    for (int c = 0; c < channels; ++c) {
+      sum += frames[i * channels + c];
+    }
+    out[i] = (float) sum * scale;
+  }
+}
+
+/**
+ * Compute the dot product of a filter phase and the delay line.
+ *
+ * @param coefs The phase coefficients
+ * @param samples The delay line samples
+ * @param taps The number of taps, a multiple of four
+ * @return The dot product
+ */
+static float mac(const float* coefs, const float* samples, size_t taps) {
+#ifdef __SSE2__
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  size_t i = 0;
+
+  for (; i + 8 <= taps; i += 8) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(coefs + i), _mm_loadu_ps(samples + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(coefs + i + 4), _mm_loadu_ps(samples + i + 4)));
+  }
+
+  if (i < taps) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(coefs + i), _mm_loadu_ps(samples + i)));
+  }
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#else
+  float sum = 0;
+  for (size_t i = 0; i < taps; ++i) {
+    sum += coefs[i] * samples[i];
+  }
+  return sum;
+#endif
+}
+
+int speech_resample_init(struct speech_resample* rs, int in_rate, int out_rate, size_t chunk) {
+  memset(rs, 0, sizeof *rs);
+
+  if (in_rate <= 0 || out_rate <= 0 || !chunk) {
+    return 1;
+  }
+
+  unsigned int g = gcd((unsigned int) in_rate, (unsigned int) out_rate);
+  unsigned int up = (unsigned int) out_rate / g;
+  unsigned int down = (unsigned int) in_rate / g;
+
+  if (up > SPEECH_RESAMPLE_MAX_UP) {
+    return 1;
+  }
+
+  size_t taps;
+
+  if (up == down) {
+    // Equal rates only need the conversion, so use a single unit tap
+    taps = 4;
+    rs->bank = calloc(taps, sizeof *rs->bank);
+    if (!rs->bank) {
+      return 1;
+    }
+    rs->bank[taps - 1] = 1;
+  } else {
+    // Size the prototype with the Kaiser formula for the transition band
+    // between the passband edge and the lower Nyquist frequency
+    double rate = (double) in_rate * up;
+    double nyquist = 0.5 * (in_rate < out_rate ? in_rate : out_rate);
+    double pass = SPEECH_RESAMPLE_PASSBAND * nyquist;
+    double cutoff = 0.5 * (pass + nyquist) / rate;
+    double width = (nyquist - pass) / rate;
+    double atten = SPEECH_RESAMPLE_ATTENUATION;
+    double beta = 0.1102 * (atten - 8.7);
+
+    size_t len = (size_t) ceil((atten - 7.95) / (14.36 * width)) + 1;
+    taps = (len + up - 1) / up;
+    taps = (taps + 3) & ~(size_t) 3;
+    len = taps * up;
+
+    rs->bank = malloc(len * sizeof *rs->bank);
+    if (!rs->bank) {
+      return 1;
+    }
+
+    double center = 0.5 * (double) (len - 1);
+    double norm = bessel_i0(beta);
+
+    for (size_t n = 0; n < len; ++n) {
+      double x = (double) n - center;
+      double sinc = x == 0 ? 1 : sin(2 * M_PI * cutoff * x) / (2 * M_PI * cutoff * x);
+      double r = x / center;
+      double window = bessel_i0(beta * sqrt(1 - r * r)) / norm;
+      double h = up * 2 * cutoff * sinc * window;
+
+      // Tap n belongs to phase n % up, stored reversed within the phase
+      size_t phase = n % up;
+      size_t k = n / up;
+      rs->bank[phase * taps + (taps - 1 - k)] = (float) h;
+    }
+  }
+
+  rs->up = up;
+  rs->down = down;
+  rs->taps = taps;
+  rs->chunk = chunk;
+  rs->line = malloc((taps - 1 + chunk) * sizeof *rs->line);
+
+  if (!rs->line) {
+    speech_resample_free(rs);
+    return 1;
+  }
+
+  speech_resample_reset(rs);
+  return 0;
+}
+
+void speech_resample_free(struct speech_resample* rs) {
+  free(rs->bank);
+  free(rs->line);
+  rs->bank = NULL;
+  rs->line = NULL;
+}
+
+void speech_resample_reset(struct speech_resample* rs) {
+  // Start with a line of silence so the first output has full history
+  memset(rs->line, 0, (rs->taps - 1) * sizeof *rs->line);
+  rs->line_len = rs->taps - 1;
+  rs->base = rs->taps - 1;
+  rs->phase = 0;
+}
+
+size_t speech_resample_max_out(const struct speech_resample* rs, size_t len) {
+  return (len * rs->up + rs->down - 1) / rs->down + 1;
+}
+
+size_t speech_resample_push(struct speech_resample* rs, const short* frames, size_t len, int channels, float* out) {
+  // Convert straight into the delay line
+  downmix(frames, len, channels, rs->line + rs->line_len);
+  rs->line_len += len;
+
+  size_t taps = rs->taps;
+  size_t n = 0;
+
+  while (rs->base < rs->line_len) {
+    out[n++] = mac(rs->bank + rs->phase * taps, rs->line + rs->base - (taps - 1), taps);
+
+    rs->phase += rs->down;
+    rs->base += rs->phase / rs->up;
+    rs->phase %= rs->up;
+  }
+
+  // Keep only the history the next output needs
+  size_t drop = rs->base - (taps - 1);
+  if (drop > rs->line_len) {
+    drop = rs->line_len;
+  }
+
+  memmove(rs->line, rs->line + drop, (rs->line_len - drop) * sizeof *rs->line);
+  rs->line_len -= drop;
+  rs->base -= drop;
+
+  return n;
+}
@@ -0,0 +1,104 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_SPEECH_RESAMPLE_H
+#define SERVICE_SPEECH_RESAMPLE_H
+
+#include <stddef.h>
+
+/** The largest supported interpolation factor after reducing the rate ratio. */
+#define SPEECH_RESAMPLE_MAX_UP 1024
+
+/** The stopband attenuation of the anti-aliasing filter in decibels. */
+#define SPEECH_RESAMPLE_ATTENUATION 80
+
+/** The passband edge as a fraction of the lower Nyquist frequency. */
+#define SPEECH_RESAMPLE_PASSBAND 0.875
+
+/**
+ * A streaming polyphase resampler for a rational rate ratio.
+ *
+ * The ratio is reduced to up / down. A Kaiser-windowed sinc prototype is split
+ * into up phases of equal length at init, with each phase's taps reversed so
+ * an output sample is one contiguous dot product over the delay line.
+ * Interleaved 16-bit input is downmixed and converted to float on its way
+ * into the delay line, so there is no separate conversion pass.
+ */
+struct speech_resample {
+  /** The interpolation factor. */
+  unsigned int up;
+
+  /** The decimation factor. */
+  unsigned int down;
+
+  /** The number of taps per phase. A multiple of four. */
+  size_t taps;
+
+  /** The filter bank, up phases of taps coefficients each. */
+  float* bank;
+
+  /** The delay line of mono input samples. */
+  float* line;
+
+  /** The number of valid samples in the delay line. */
+  size_t line_len;
+
+  /** The largest number of frames accepted per push. */
+  size_t chunk;
+
+  /** The delay line index of the newest sample under the next output. */
+  size_t base;
+
+  /** The filter phase of the next output. */
+  unsigned int phase;
+};
+
+/**
+ * Initialize a resampler and build its filter bank.
+ *
+ * @param rs The resampler
+ * @param in_rate The input sample rate in hertz
+ * @param out_rate The output sample rate in hertz
+ * @param chunk The largest number of frames to accept per push
+ * @return Zero on success, otherwise nonzero
+ */
+int speech_resample_init(struct speech_resample* rs, int in_rate, int out_rate, size_t chunk);
+
+/**
+ * Free a resampler.
+ *
+ * @param rs The resampler
+ */
+void speech_resample_free(struct speech_resample* rs);
+
+/**
+ * Forget all buffered input.
+ *
+ * @param rs The resampler
+ */
+void speech_resample_reset(struct speech_resample* rs);
+
+/**
+ * Get the most output samples a push can produce.
+ *
+ * @param rs The resampler
+ * @param len The number of input frames
+ * @return The output capacity needed
+ */
+size_t speech_resample_max_out(const struct speech_resample* rs, size_t len);
+
+/**
+ * Push interleaved 16-bit frames and collect the mono float output.
+ *
+ * @param rs The resampler
+ * @param frames The interleaved frames
+ * @param len The number of frames, at most the chunk size
+ * @param channels The number of channels per frame
+ * @param out The output samples from -1 to 1
+ * @return The number of output samples
+ */
+size_t speech_resample_push(struct speech_resample* rs, const short* frames, size_t len, int channels, float* out);
+
+#endif // #ifndef SERVICE_SPEECH_RESAMPLE_H
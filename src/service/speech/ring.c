@@ -0,0 +1,108 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+int speech_ring_init(struct speech_ring* ring, size_t cap, int channels) {
+  size_t pow2 = 1;
+  while (pow2 < cap) {
+    pow2 <<= 1;
+  }
+
+  ring->buf = calloc(pow2 * channels, sizeof *ring->buf);
+  if (!ring->buf) {
+    return 1;
+  }
+
+  ring->cap = pow2;
+  ring->channels = channels;
+  ring->tail_cache = 0;
+  ring->head_cache = 0;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->overruns, 0);
+  atomic_init(&ring->underruns, 0);
+
+  return 0;
+}
+
+void speech_ring_free(struct speech_ring* ring) {
+  free(ring->buf);
+  ring->buf = NULL;
+  ring->cap = 0;
+  ring->tail_cache = 0;
+  ring->head_cache = 0;
+  atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, 0, memory_order_relaxed);
+}
+
+size_t speech_ring_write(struct speech_ring* ring, const short* frames, size_t len) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+  // Only look at the consumer's line when the cached view says we are full
+  size_t space = ring->cap - (head - ring->tail_cache);
+  if (space < len) {
+    ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    space = ring->cap - (head - ring->tail_cache);
+  }
+
+  size_t n = len < space ? len : space;
+  if (n < len) {
+    atomic_fetch_add_explicit(&ring->overruns, len - n, memory_order_relaxed);
+  }
+
+  // Copy in at most two pieces around the wrap
+  size_t at = head & (ring->cap - 1);
+  size_t first = n < ring->cap - at ? n : ring->cap - at;
+  size_t frame_size = ring->channels * sizeof *ring->buf;
+
+  memcpy(ring->buf + at * ring->channels, frames, first * frame_size);
+  memcpy(ring->buf, frames + first * ring->channels, (n - first) * frame_size);
+
+  atomic_store_explicit(&ring->head, head + n, memory_order_release);
+  return n;
+}
+
+size_t speech_ring_peek(struct speech_ring* ring, size_t max, struct speech_ring_span* span) {
+  return speech_ring_peek_at(ring, atomic_load_explicit(&ring->tail, memory_order_relaxed), max, span);
+}
+
+size_t speech_ring_peek_at(struct speech_ring* ring, size_t pos, size_t max, struct speech_ring_span* span) {
+  // Only look at the producer's line when the cached view is exhausted
+  size_t avail = ring->head_cache - pos;
+  if (avail < max) {
+    ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+    avail = ring->head_cache - pos;
+  }
+
+  if (!avail) {
+    atomic_fetch_add_explicit(&ring->underruns, 1, memory_order_relaxed);
+  }
+
+  size_t n = avail < max ? avail : max;
+  speech_ring_view(ring, pos, n, span);
+
+  return n;
+}
+
+void speech_ring_view(const struct speech_ring* ring, size_t pos, size_t len, struct speech_ring_span* span) {
+  size_t at = pos & (ring->cap - 1);
+  size_t first = len < ring->cap - at ? len : ring->cap - at;
+
+  span->first = ring->buf + at * ring->channels;
+  span->first_len = first;
+  span->second = ring->buf;
+  span->second_len = len - first;
+}
+
+void speech_ring_consume(struct speech_ring* ring, size_t len) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+}
@@ -0,0 +1,146 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_SPEECH_RING_H
+#define SERVICE_SPEECH_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/** The assumed size of a cache line in bytes. */
+#define SPEECH_RING_CACHE_LINE 64
+
+/**
+ * A view of contiguous frames in a ring.
+ *
+ * Readable frames may wrap around the end of the storage, so a view has up to
+ * two segments. The second is empty unless the first runs to the end.
+ */
+struct speech_ring_span {
+  /** The first segment. */
+  const short* first;
+
+  /** The number of frames in the first segment. */
+  size_t first_len;
+
+  /** The second segment. */
+  const short* second;
+
+  /** The number of frames in the second segment. */
+  size_t second_len;
+};
+
+/**
+ * A fixed-capacity, lock-free ring of interleaved 16-bit PCM frames.
+ *
+ * Exactly one producer and one consumer may use a ring at the same time. The
+ * producer never blocks or allocates: frames that do not fit are dropped and
+ * counted as an overrun. Fields written by each side live on their own cache
+ * line so the two sides do not invalidate each other's lines on every access.
+ */
+struct speech_ring {
+  /** The total number of frames written. Producer-owned. */
+  _Alignas(SPEECH_RING_CACHE_LINE) atomic_size_t head;
+
+  /** The producer's last look at tail. Producer-owned. */
+  size_t tail_cache;
+
+  /** The number of frames dropped because the ring was full. Producer-owned. */
+  atomic_ulong overruns;
+
+  /** The total number of frames consumed. Consumer-owned. */
+  _Alignas(SPEECH_RING_CACHE_LINE) atomic_size_t tail;
+
+  /** The consumer's last look at head. Consumer-owned. */
+  size_t head_cache;
+
+  /** The number of reads that found the ring empty. Consumer-owned. */
+  atomic_ulong underruns;
+
+  /** The frame storage. */
+  _Alignas(SPEECH_RING_CACHE_LINE) short* buf;
+
+  /** The capacity in frames. A power of two. */
+  size_t cap;
+
+  /** The number of channels per frame. */
+  int channels;
+};
+
+/**
+ * Initialize a ring. This is the only call that allocates.
+ *
+ * @param ring The ring
+ * @param cap The minimum capacity in frames, rounded up to a power of two
+ * @param channels The number of channels per frame
+ * @return Zero on success, otherwise nonzero
+ */
+int speech_ring_init(struct speech_ring* ring, size_t cap, int channels);
+
+/**
+ * Free the storage of a ring, leaving it empty with no room.
+ *
+ * @param ring The ring
+ */
+void speech_ring_free(struct speech_ring* ring);
+
+/**
+ * Write frames. Producer only. Never blocks or allocates.
+ *
+ * @param ring The ring
+ * @param frames The interleaved frames
+ * @param len The number of frames
+ * @return The number of frames written; the rest count as overruns
+ */
+size_t speech_ring_write(struct speech_ring* ring, const short* frames, size_t len);
+
+/**
+ * Get a zero-copy view of readable frames. Consumer only.
+ *
+ * The frames stay valid until they are consumed. Finding the ring empty
+ * counts as an underrun.
+ *
+ * @param ring The ring
+ * @param max The maximum number of frames to view
+ * @param span The output view
+ * @return The number of frames in the view
+ */
+size_t speech_ring_peek(struct speech_ring* ring, size_t max, struct speech_ring_span* span);
+
+/**
+ * Get a zero-copy view of readable frames from a position at or after the
+ * oldest unconsumed frame. Consumer only.
+ *
+ * This lets the consumer read ahead while holding earlier frames back from
+ * the producer. Finding nothing past the position counts as an underrun.
+ *
+ * @param ring The ring
+ * @param pos The position, counted in frames written since initialization
+ * @param max The maximum number of frames to view
+ * @param span The output view
+ * @return The number of frames in the view
+ */
+size_t speech_ring_peek_at(struct speech_ring* ring, size_t pos, size_t max, struct speech_ring_span* span);
+
+/**
+ * Get a view of frames known to be written and not yet consumed. Safe from
+ * any thread as long as the consumer holds those frames back.
+ *
+ * @param ring The ring
+ * @param pos The position of the first frame
+ * @param len The number of frames
+ * @param span The output view
+ */
+void speech_ring_view(const struct speech_ring* ring, size_t pos, size_t len, struct speech_ring_span* span);
+
+/**
+ * Release frames back to the producer. Consumer only.
+ *
+ * @param ring The ring
+ * @param len The number of frames, at most what was last peeked
+ */
+void speech_ring_consume(struct speech_ring* ring, size_t len);
+
+#endif // #ifndef SERVICE_SPEECH_RING_H
@@ -3,24 +3,838 @@
  * Copyright 2019 The Cozmonaut Contributors
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "../speech.h"
 
 #include "../../log.h"
+#include "../../metric.h"
+#include "../../record.h"
 #include "../../service.h"
+#include "../../trace.h"
+
+#include "feature.h"
+#include "kws.h"
+#include "replay.h"
+#include "resample.h"
+#include "ring.h"
+#include "vad.h"
 
 #define LOG_TAG "speech"
 
+/** The spectral flatness below which a hop counts as voiced. */
+#define VAD_FLATNESS_MAX 0.35f
+
+/** The zero-crossing rate above which a loud hop counts as unvoiced speech. */
+#define VAD_ZCR_MIN 0.25f
+
+/** The number of consecutive speech hops needed to open a segment. */
+#define VAD_ONSET_HOPS 2
+
+/** The largest number of captured frames resampled at once. */
+#define RESAMPLE_CHUNK 1024
+
+/** The capture configuration. */
+static struct speech_config config;
+
+/** The number of hops processed. */
+static struct metric* metric_hops;
+
+/** The time to process a hop in nanoseconds. */
+static struct metric* metric_hop_ns;
+
+/** The number of frames waiting in the capture ring. */
+static struct metric* metric_buffered;
+
+/** The time from the last voiced hop of an utterance to its end in nanoseconds. */
+static struct metric* metric_eou_ns;
+
+/** The installed backend. */
+static struct speech_backend backend;
+
+/** Serializes the backend between the worker and procedures. */
+static pthread_mutex_t backend_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Nonzero while the backend is inside a segment. */
+static int segment_open;
+
+/** Nonzero while the detector hears speech. */
+static int utterance_open;
+
+/** The number of hops since the utterance began, pre-roll included. */
+static unsigned long utterance_hops;
+
+/** The number of pre-roll hops the utterance began with. */
+static unsigned long utterance_preroll;
+
+/** When the last voiced hop of the utterance was processed. */
+static unsigned long long voiced_ns;
+
+/** The ring carrying audio from capture to the worker. */
+static struct speech_ring ring;
+
+/** The ring position the worker has processed up to. */
+static size_t ring_read;
+
+/** The number of processed frames to hold back in the ring for pinning. */
+static size_t tap_len;
+
+/** The first ring position held by each pin. */
+static size_t pin_pos[SPEECH_MAX_PINS];
+
+/** Nonzero for each pin in use. */
+static int pin_used[SPEECH_MAX_PINS];
+
+/** Guards the processed position and the pins. */
+static pthread_mutex_t pin_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The voice activity detector. */
+static struct speech_vad vad;
+
+/** The feature front end. */
+static struct speech_feature feature;
+
+/** The keyword spotter. */
+static struct speech_kws kws;
+
+/** The keyword model path, owned. */
+static char* kws_model;
+
+/** The latest feature frame. */
+static float mfcc[SPEECH_FEATURE_DIM];
+
+/** The resampler from capture format to the pipeline rate. */
+static struct speech_resample resampler;
+
+/** The number of samples per hop at the pipeline rate. */
+static size_t hop_len;
+
+/** Resampled audio not yet making up a whole hop. */
+static float* pending;
+
+/** The number of samples in the pending buffer. */
+static size_t pending_len;
+
+/** The most recent non-speech hops, forwarded ahead of an onset. */
+static float* preroll;
+
+/** The capacity of the pre-roll in hops. */
+static size_t preroll_cap;
+
+/** The number of hops in the pre-roll. */
+static size_t preroll_len;
+
+/** The index of the oldest hop in the pre-roll. */
+static size_t preroll_first;
+
+/** Guards the statistics. */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The pipeline statistics. Ring counters are filled in on demand. */
+static struct speech_stats stats;
+
+/** The worker thread. */
+static pthread_t worker;
+
+/** Nonzero to ask the worker to exit. */
+static atomic_int worker_stop;
+
+/** Nonzero while the worker is running. */
+static atomic_int running;
+
+/**
+ * Read the monotonic clock.
+ *
+ * @return The time in nanoseconds
+ */
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Advance a deadline by some milliseconds.
+ *
+ * @param ts The deadline
+ * @param ms The milliseconds
+ */
+static void advance_ms(struct timespec* ts, int ms) {
+  ts->tv_nsec += (long) ms * 1000000;
+  while (ts->tv_nsec >= 1000000000) {
+    ts->tv_nsec -= 1000000000;
+    ++ts->tv_sec;
+  }
+}
+
+/**
+ * Begin a recognizer segment. Call with the backend lock held.
+ */
+static void open_segment(void) {
+  if (backend.begin) {
+    backend.begin(backend.ctx);
+  }
+  segment_open = 1;
+}
+
+/**
+ * End the recognizer segment, if one is open. Call with the backend lock
+ * held.
+ */
+static void close_segment(void) {
+  if (segment_open && backend.end) {
+    backend.end(backend.ctx);
+  }
+  segment_open = 0;
+}
+
+/**
+ * Run hops of speech through the feature front end and on to the keyword
+ * spotter or recognizer. Call with the backend and statistics locks held.
+ *
+ * @param samples The samples
+ * @param hops The number of hops
+ */
+static void forward(const float* samples, size_t hops) {
+  for (size_t i = 0; i < hops; ++i) {
+    const float* h = samples + i * hop_len;
+
+    unsigned long long t0 = now_ns();
+    int emitted = speech_feature_push(&feature, h, mfcc);
+    unsigned long long t1 = now_ns();
+
+    stats.feature_frames += emitted;
+    stats.feature_time += t1 - t0;
+    ++utterance_hops;
+
+    // A backend swapped in mid-utterance starts a fresh segment
+    if (!segment_open && !kws.loaded) {
+      open_segment();
+    }
+
+    // Until the keyword is heard, only the spotter listens
+    if (!segment_open) {
+      if (emitted && speech_kws_push(&kws, mfcc)) {
+        ++stats.kws_detections;
+        // Measured from the onset hop, so a keyword already heard in the pre-roll took no time
+        unsigned long onset = utterance_hops > utterance_preroll ? utterance_hops - utterance_preroll : 0;
+        stats.kws_latency_ms = onset * SPEECH_HOP_MS;
+        open_segment();
+      }
+
+      stats.kws_frames += emitted;
+      stats.kws_time += now_ns() - t1;
+      continue;
+    }
+
+    if (backend.feed) {
+      backend.feed(backend.ctx, h, hop_len);
+    }
+    if (emitted && backend.features) {
+      backend.features(backend.ctx, mfcc);
+    }
+
+    ++stats.hops_recognized;
+    stats.recognizer_time += now_ns() - t1;
+  }
+
+  stats.hops_forwarded += hops;
+}
+
+/**
+ * Start an utterance and flush the pre-roll into it. Call with the backend
+ * and statistics locks held.
+ */
+static void open_utterance(void) {
+  utterance_open = 1;
+  utterance_hops = 0;
+  utterance_preroll = preroll_len;
+  ++stats.segments;
+
+  // Each utterance starts from a clean window
+  speech_feature_reset(&feature);
+  speech_kws_reset(&kws);
+
+  // Without a keyword model every utterance goes to the recognizer
+  if (!kws.loaded) {
+    open_segment();
+  }
+
+  // The pre-roll is circular, so it comes out in at most two runs
+  size_t first = preroll_cap - preroll_first < preroll_len ? preroll_cap - preroll_first : preroll_len;
+  forward(preroll + preroll_first * hop_len, first);
+  forward(preroll, preroll_len - first);
+
+  preroll_len = 0;
+  preroll_first = 0;
+}
+
+/**
+ * End the utterance, if one is open. Call with the backend and statistics
+ * locks held.
+ */
+static void close_utterance(void) {
+  if (!utterance_open) {
+    return;
+  }
+
+  close_segment();
+  utterance_open = 0;
+
+  unsigned long long eou = now_ns() - voiced_ns;
+  ++stats.utterances_closed;
+  stats.eou_time += eou;
+  metric_record(metric_eou_ns, eou);
+}
+
+/**
+ * Remember a non-speech hop in case speech starts soon.
+ *
+ * @param hop The hop samples
+ */
+static void remember(const float* hop) {
+  if (!preroll_cap) {
+    return;
+  }
+
+  // Overwrite the oldest hop once full
+  size_t at = (preroll_first + preroll_len) % preroll_cap;
+  memcpy(preroll + at * hop_len, hop, hop_len * sizeof *hop);
+
+  if (preroll_len < preroll_cap) {
+    ++preroll_len;
+  } else {
+    preroll_first = (preroll_first + 1) % preroll_cap;
+  }
+}
+
+/**
+ * Analyze one hop and forward it if it belongs to speech.
+ *
+ * @param hop The hop samples
+ */
+static void process_hop(const float* hop) {
+  TRACE_SCOPE("hop");
+
+  unsigned long long t0 = now_ns();
+
+  enum speech_vad_state state = config.vad ? speech_vad_update(&vad, hop) : speech_vad_speech;
+
+  unsigned long long t1 = now_ns();
+
+  // Hangover hops keep the utterance open but are not voiced
+  if ((state == speech_vad_onset || state == speech_vad_speech) && (!config.vad || !vad.quiet)) {
+    voiced_ns = t0;
+  }
+
+  pthread_mutex_lock(&backend_lock);
+  pthread_mutex_lock(&stats_lock);
+
+  switch (state) {
+    case speech_vad_silence:
+      remember(hop);
+      break;
+    case speech_vad_onset:
+      open_utterance();
+      forward(hop, 1);
+      break;
+    case speech_vad_speech:
+      // Ungated audio is one long utterance
+      if (!utterance_open) {
+        open_utterance();
+      }
+      forward(hop, 1);
+      break;
+    case speech_vad_offset:
+      close_utterance();
+      remember(hop);
+      break;
+  }
+
+  ++stats.hops;
+  stats.vad_time += t1 - t0;
+
+  pthread_mutex_unlock(&stats_lock);
+  pthread_mutex_unlock(&backend_lock);
+
+  metric_add(metric_hops, 1);
+  metric_record(metric_hop_ns, now_ns() - t0);
+}
+
+/**
+ * Resample captured frames and process every whole hop that results.
+ *
+ * @param frames The interleaved frames
+ * @param len The number of frames
+ */
+static void ingest(const short* frames, size_t len) {
+  while (len) {
+    size_t chunk = len < RESAMPLE_CHUNK ? len : RESAMPLE_CHUNK;
+    pending_len += speech_resample_push(&resampler, frames, chunk, ring.channels, pending + pending_len);
+    frames += chunk * ring.channels;
+    len -= chunk;
+
+    size_t done = 0;
+    for (; done + hop_len <= pending_len; done += hop_len) {
+      process_hop(pending + done);
+    }
+
+    // Carry the partial hop over to the next chunk
+    memmove(pending, pending + done, (pending_len - done) * sizeof *pending);
+    pending_len -= done;
+  }
+}
+
+/**
+ * Process everything buffered in the ring.
+ */
+static void drain(void) {
+  struct speech_ring_span span;
+
+  // The resampler reads straight out of the ring before it is released
+  size_t len = speech_ring_peek_at(&ring, ring_read, ring.cap, &span);
+  metric_set(metric_buffered, (long long) len);
+
+  ingest(span.first, span.first_len);
+  ingest(span.second, span.second_len);
+
+  // Hold back the tap and anything pinned, and hand the rest to capture
+  pthread_mutex_lock(&pin_lock);
+
+  size_t tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+  ring_read += len;
+  size_t release = ring_read - tail > tap_len ? ring_read - tap_len : tail;
+  for (int i = 0; i < SPEECH_MAX_PINS; ++i) {
+    if (pin_used[i] && pin_pos[i] < release) {
+      release = pin_pos[i];
+    }
+  }
+
+  // Release under the lock so a pin taken meanwhile cannot lose its frames
+  speech_ring_consume(&ring, release - tail);
+
+  pthread_mutex_unlock(&pin_lock);
+}
+
+static void* worker_main(void* arg) {
+  service_sched_thread(SERVICE_SPEECH);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+  while (!atomic_load(&worker_stop)) {
+    // Wake on a fixed hop grid so slow hops do not push later ones back
+    advance_ms(&deadline, SPEECH_HOP_MS);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+
+    drain();
+
+    // Each hop is ready on its grid point and due before the next
+    service_sched_done(SERVICE_SPEECH, (unsigned long long) deadline.tv_sec * 1000000000ull + deadline.tv_nsec,
+        now_ns());
+  }
+
+  // Do not leave the recognizer hanging mid-utterance
+  pthread_mutex_lock(&backend_lock);
+  pthread_mutex_lock(&stats_lock);
+  close_utterance();
+  pthread_mutex_unlock(&stats_lock);
+  pthread_mutex_unlock(&backend_lock);
+
+  return NULL;
+}
+
+/**
+ * Release the pipeline buffers.
+ */
+static void teardown(void) {
+  speech_ring_free(&ring);
+  speech_resample_free(&resampler);
+  speech_vad_free(&vad);
+  speech_feature_free(&feature);
+  speech_kws_free(&kws);
+
+  free(kws_model);
+  kws_model = NULL;
+
+  free(pending);
+  pending = NULL;
+
+  free(preroll);
+  preroll = NULL;
+  preroll_cap = 0;
+}
+
+/**
+ * Allocate the pipeline buffers for a configuration. Nothing on the audio
+ * path allocates after this.
+ *
+ * @param next The configuration
+ * @return Zero on success, otherwise nonzero
+ */
+static int setup(const struct speech_config* next) {
+  // Copy the model path before teardown frees the current one
+  char* model = next->kws_model ? strdup(next->kws_model) : NULL;
+  if (next->kws_model && !model) {
+    return 1;
+  }
+
+  teardown();
+  kws_model = model;
+
+  hop_len = (size_t) SPEECH_SAMPLE_RATE * SPEECH_HOP_MS / 1000;
+
+  struct speech_vad_config vad_config = {
+    .onset_db = next->vad_onset_db,
+    .offset_db = next->vad_offset_db,
+    .flatness_max = VAD_FLATNESS_MAX,
+    .zcr_min = VAD_ZCR_MIN,
+    .onset_hops = VAD_ONSET_HOPS,
+    .hangover_hops = (unsigned int) (next->vad_hangover_ms / SPEECH_HOP_MS),
+  };
+
+  // The tap sits on top of the buffer so it never eats into capture headroom
+  tap_len = (size_t) next->sample_rate * next->tap_ms / 1000;
+  ring_read = 0;
+
+  if (speech_ring_init(&ring, (size_t) next->sample_rate * next->buffer_ms / 1000 + tap_len, next->channels)) {
+    return 1;
+  }
+
+  // Everything past the resampler runs at the pipeline rate
+  if (speech_resample_init(&resampler, next->sample_rate, SPEECH_SAMPLE_RATE, RESAMPLE_CHUNK)) {
+    teardown();
+    return 1;
+  }
+
+  if (speech_vad_init(&vad, hop_len, SPEECH_SAMPLE_RATE, &vad_config)) {
+    teardown();
+    return 1;
+  }
+
+  // Build the window, filterbank and DCT tables once, here
+  if (speech_feature_init(&feature, SPEECH_SAMPLE_RATE, hop_len)) {
+    teardown();
+    return 1;
+  }
+
+  // The model is read and validated here so the worker never touches disk
+  if (kws_model && speech_kws_load(&kws, kws_model, next->kws_threshold)) {
+    LOGE("Failed to load keyword model {}", _str(kws_model));
+    teardown();
+    return 1;
+  }
+
+  preroll_cap = (size_t) (next->vad_preroll_ms / SPEECH_HOP_MS);
+  preroll_len = 0;
+  preroll_first = 0;
+
+  pending_len = 0;
+  pending = malloc((hop_len + speech_resample_max_out(&resampler, RESAMPLE_CHUNK)) * sizeof *pending);
+  preroll = malloc((preroll_cap ? preroll_cap : 1) * hop_len * sizeof *preroll);
+
+  if (!pending || !preroll) {
+    teardown();
+    return 1;
+  }
+
+  config = *next;
+  config.kws_model = kws_model;
+  return 0;
+}
+
+/**
+ * Rebuild the pipeline for the configuration in place before a failed setup.
+ * If that fails too, there is no pipeline and capture is refused until a
+ * configuration is set up.
+ *
+ * @param prev The configuration
+ */
+static void restore(const struct speech_config* prev) {
+  if (setup(prev)) {
+    LOGE("Failed to restore the speech pipeline, so capture is refused until it is configured again");
+  }
+}
+
+/**
+ * Check whether any audio is pinned. The buffer cannot be rebuilt until it
+ * is all given back.
+ *
+ * @return Nonzero if audio is pinned, otherwise zero
+ */
+static int audio_pinned(void) {
+  pthread_mutex_lock(&stats_lock);
+  int pinned = stats.pins_held != 0;
+  pthread_mutex_unlock(&stats_lock);
+  return pinned;
+}
+
 static int proc_hello(struct service* svc, const void* arg1, void* arg2) {
   LOGI("Hello, world!");
   return 0;
 }
 
+static int proc_configure(struct service* svc, const void* arg1, void* arg2) {
+  const struct speech_config* next = arg1;
+
+  if (atomic_load(&running)) {
+    LOGE("Cannot configure capture while the speech service is running");
+    return 1;
+  }
+
+  if (next->sample_rate < 1000 / SPEECH_HOP_MS || next->channels <= 0 || next->buffer_ms < SPEECH_HOP_MS
+      || next->tap_ms < 0) {
+    LOGE("Invalid capture configuration");
+    return 1;
+  }
+
+  if (audio_pinned()) {
+    LOGE("Cannot configure capture while audio is pinned");
+    return 1;
+  }
+
+  if (next->vad && next->vad_offset_db > next->vad_onset_db) {
+    LOGE("Voice activity offset must not exceed onset");
+    return 1;
+  }
+
+  if (next->vad_hangover_ms < 0 || next->vad_preroll_ms < 0) {
+    LOGE("Voice activity hangover and pre-roll must not be negative");
+    return 1;
+  }
+
+  struct speech_config prev = config;
+
+  // Hold on to the old model path in case the old pipeline must be rebuilt
+  char* prev_model = kws_model;
+  kws_model = NULL;
+
+  if (setup(next)) {
+    LOGE("Failed to set up speech pipeline for {} Hz capture", _i(next->sample_rate));
+    restore(&prev);
+    free(prev_model);
+    return 1;
+  }
+
+  free(prev_model);
+  return 0;
+}
+
+static int proc_set_backend(struct service* svc, const void* arg1, void* arg2) {
+  pthread_mutex_lock(&backend_lock);
+
+  // Let the previous backend finish its segment
+  close_segment();
+  backend = *(const struct speech_backend*) arg1;
+
+  pthread_mutex_unlock(&backend_lock);
+  return 0;
+}
+
+static int proc_push_audio(struct service* svc, const void* arg1, void* arg2) {
+  const struct speech_audio* audio = arg1;
+
+  // A failed configure can leave no buffer to write to
+  if (!ring.buf) {
+    if (arg2) {
+      *(size_t*) arg2 = 0;
+    }
+    return 1;
+  }
+
+  record_audio(audio, config.sample_rate, ring.channels);
+
+  size_t written = speech_ring_write(&ring, audio->samples, audio->frames);
+  if (arg2) {
+    *(size_t*) arg2 = written;
+  }
+
+  return 0;
+}
+
+static int proc_get_stats(struct service* svc, const void* arg1, void* arg2) {
+  struct speech_stats* out = arg2;
+
+  pthread_mutex_lock(&stats_lock);
+  *out = stats;
+  pthread_mutex_unlock(&stats_lock);
+
+  size_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+
+  pthread_mutex_lock(&pin_lock);
+  size_t read = ring_read;
+  pthread_mutex_unlock(&pin_lock);
+
+  out->frames_captured = head;
+  out->frames_overrun = atomic_load_explicit(&ring.overruns, memory_order_relaxed);
+  out->frames_consumed = read;
+  out->underruns = atomic_load_explicit(&ring.underruns, memory_order_relaxed);
+  out->frames_buffered = head - read;
+  return 0;
+}
+
+static int proc_pin_audio(struct service* svc, const void* arg1, void* arg2) {
+  size_t want = *(const size_t*) arg1;
+  struct speech_pin* out = arg2;
+
+  pthread_mutex_lock(&pin_lock);
+
+  // Only processed frames still held back in the ring can be pinned
+  size_t tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+  size_t held = ring_read - tail;
+  size_t len = want < held ? want : held;
+
+  int slot = -1;
+  for (int i = 0; i < SPEECH_MAX_PINS && slot < 0; ++i) {
+    if (!pin_used[i]) {
+      slot = i;
+    }
+  }
+
+  if (!len || slot < 0) {
+    pthread_mutex_unlock(&pin_lock);
+    return 1;
+  }
+
+  pin_used[slot] = 1;
+  pin_pos[slot] = ring_read - len;
+
+  struct speech_ring_span span;
+  speech_ring_view(&ring, pin_pos[slot], len, &span);
+
+  pthread_mutex_unlock(&pin_lock);
+
+  *out = (struct speech_pin) {
+    .first = span.first,
+    .first_len = span.first_len,
+    .second = span.second,
+    .second_len = span.second_len,
+    .sample_rate = config.sample_rate,
+    .channels = ring.channels,
+    .handle = slot,
+  };
+
+  pthread_mutex_lock(&stats_lock);
+  ++stats.audio_pinned;
+  ++stats.pins_held;
+  pthread_mutex_unlock(&stats_lock);
+
+  return 0;
+}
+
+static int proc_unpin_audio(struct service* svc, const void* arg1, void* arg2) {
+  const struct speech_pin* pin = arg1;
+
+  pthread_mutex_lock(&pin_lock);
+  pin_used[pin->handle] = 0;
+  pthread_mutex_unlock(&pin_lock);
+
+  pthread_mutex_lock(&stats_lock);
+  --stats.pins_held;
+  pthread_mutex_unlock(&stats_lock);
+
+  return 0;
+}
+
+static int proc_replay(struct service* svc, const void* arg1, void* arg2) {
+  const struct speech_replay_options* options = arg1;
+
+  if (atomic_load(&running)) {
+    LOGE("Cannot replay while the speech service is running");
+    return 1;
+  }
+
+  if (audio_pinned()) {
+    LOGE("Cannot replay while audio is pinned");
+    return 1;
+  }
+
+  struct speech_replay replay;
+  if (speech_replay_open(&replay, options->path, options->sample_rate, options->channels)) {
+    LOGE("Failed to open recording {}", _str(options->path));
+    return 1;
+  }
+
+  if (replay.sample_rate < 1000 / SPEECH_HOP_MS || replay.channels <= 0) {
+    LOGE("Invalid recording format {} Hz, {} channels", _i(replay.sample_rate), _i(replay.channels));
+    speech_replay_close(&replay);
+    return 1;
+  }
+
+  // Start from a fresh pipeline in the recording's format
+  struct speech_config prev = config;
+  struct speech_config next = config;
+  next.sample_rate = replay.sample_rate;
+  next.channels = replay.channels;
+
+  // Hold on to the old model path in case the old pipeline must be rebuilt
+  char* prev_model = kws_model;
+  kws_model = NULL;
+
+  if (setup(&next)) {
+    LOGE("Failed to set up speech pipeline for {} Hz capture", _i(replay.sample_rate));
+    restore(&prev);
+    free(prev_model);
+    speech_replay_close(&replay);
+    return 1;
+  }
+
+  free(prev_model);
+
+  // Pace like capture would, one hop of frames per tick
+  size_t chunk = options->realtime ? (size_t) replay.sample_rate * SPEECH_HOP_MS / 1000 : RESAMPLE_CHUNK;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+  const short* frames;
+  size_t len;
+  while ((len = speech_replay_read(&replay, chunk, &frames))) {
+    if (options->realtime) {
+      advance_ms(&deadline, SPEECH_HOP_MS);
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+      }
+    }
+
+    ingest(frames, len);
+  }
+
+  // The end of the recording ends the last utterance
+  pthread_mutex_lock(&backend_lock);
+  pthread_mutex_lock(&stats_lock);
+  close_utterance();
+  pthread_mutex_unlock(&stats_lock);
+  pthread_mutex_unlock(&backend_lock);
+
+  speech_replay_close(&replay);
+  return 0;
+}
+
 static service_proc get_proc(const struct service* svc, int proc) {
   switch (proc) {
     case service_speech_proc_hello:
       return &proc_hello;
+    case service_speech_proc_configure:
+      return &proc_configure;
+    case service_speech_proc_set_backend:
+      return &proc_set_backend;
+    case service_speech_proc_push_audio:
+      return &proc_push_audio;
+    case service_speech_proc_get_stats:
+      return &proc_get_stats;
+    case service_speech_proc_replay:
+      return &proc_replay;
+    case service_speech_proc_pin_audio:
+      return &proc_pin_audio;
+    case service_speech_proc_unpin_audio:
+      return &proc_unpin_audio;
     default:
       return NULL;
   }
@@ -28,21 +842,71 @@ static service_proc get_proc(const struct service* svc, int proc) {
 
 static int on_load(struct service* svc) {
   LOGI("Speech service load");
+
+  struct speech_config defaults = {
+    .sample_rate = 16000,
+    .channels = 1,
+    .buffer_ms = 500,
+    .vad = 1,
+    .vad_onset_db = 9,
+    .vad_offset_db = 6,
+    .vad_hangover_ms = 300,
+    .vad_preroll_ms = 200,
+    .kws_model = NULL,
+    .kws_threshold = 0.8f,
+    .tap_ms = 1000,
+  };
+
+  // Allocate up front so the capture path never has to
+  if (setup(&defaults)) {
+    LOGE("Failed to allocate speech pipeline");
+    return 1;
+  }
+
+  memset(&backend, 0, sizeof backend);
+  memset(&stats, 0, sizeof stats);
+  memset(pin_used, 0, sizeof pin_used);
+
+  metric_hops = metric_get("speech.hops", metric_kind_counter);
+  metric_hop_ns = metric_get("speech.hop_ns", metric_kind_histogram);
+  metric_buffered = metric_get("speech.buffered", metric_kind_gauge);
+  metric_eou_ns = metric_get("speech.eou_ns", metric_kind_histogram);
+  segment_open = 0;
+
   return 0;
 }
 
 static int on_unload(struct service* svc) {
   LOGI("Speech service unload");
+  teardown();
   return 0;
 }
 
 static int on_start(struct service* svc) {
   LOGI("Speech service start");
+
+  if (!ring.buf) {
+    LOGE("Cannot start the speech service with no pipeline set up");
+    return 1;
+  }
+
+  atomic_store(&worker_stop, 0);
+  if (pthread_create(&worker, NULL, &worker_main, NULL)) {
+    LOGE("Failed to start speech worker");
+    return 1;
+  }
+
+  atomic_store(&running, 1);
   return 0;
 }
 
 static int on_stop(struct service* svc) {
   LOGI("Speech service stop");
+
+  atomic_store(&worker_stop, 1);
+  pthread_join(worker, NULL);
+  atomic_store(&running, 0);
+
   return 0;
 }
 
@@ -56,4 +920,6 @@ struct service* const SERVICE_SPEECH = &(struct service) {
     .on_start = &on_start,
     .on_stop = &on_stop,
   },
+  .sched_class = service_class_realtime,
+  .deadline = SPEECH_HOP_MS * 1000000ull,
 };
@@ -0,0 +1,198 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "vad.h"
+
+/** A small energy that keeps logarithms finite on digital silence. */
+#define VAD_EPSILON 1e-10f
+
+/** The lower edge of the speech band in hertz. */
+#define VAD_BAND_LOW 250
+
+/** The upper edge of the speech band in hertz. */
+#define VAD_BAND_HIGH 4000
+
+/** The per-hop rate at which the noise floor falls. */
+#define VAD_FLOOR_FALL 0.2f
+
+/** The per-hop rate at which the noise floor rises while closed. */
+#define VAD_FLOOR_RISE 0.02f
+
+/** The per-hop rate at which the noise floor rises during a pause in a segment. */
+#define VAD_FLOOR_RISE_ACTIVE 0.002f
+
+/** The per-hop rate at which the noise floor rises during speech. */
+#define VAD_FLOOR_RISE_SPEECH 0.0005f
+
+int speech_vad_init(struct speech_vad* vad, size_t hop, int rate, const struct speech_vad_config* config) {
+  // Transform the hop zero-padded to the next power of two
+  size_t n = 4;
+  while (n < hop) {
+    n <<= 1;
+  }
+
+  memset(vad, 0, sizeof *vad);
+
+  if (speech_fft_init(&vad->fft, n)) {
+    return 1;
+  }
+
+  vad->window = malloc(hop * sizeof *vad->window);
+  vad->frame = calloc(n, sizeof *vad->frame);
+  vad->power = malloc((n / 2 + 1) * sizeof *vad->power);
+
+  if (!vad->window || !vad->frame || !vad->power) {
+    speech_vad_free(vad);
+    return 1;
+  }
+
+  for (size_t i = 0; i < hop; ++i) {
+    vad->window[i] = (float) (0.5 - 0.5 * cos(2 * M_PI * (double) i / (double) (hop - 1)));
+  }
+
+  // Clamp the band for low sample rates
+  vad->band_first = (size_t) (VAD_BAND_LOW * n / rate) + 1;
+  vad->band_last = (size_t) (VAD_BAND_HIGH * n / rate) + 1;
+  if (vad->band_last > n / 2 + 1) {
+    vad->band_last = n / 2 + 1;
+  }
+  if (vad->band_first + 1 >= vad->band_last) {
+    vad->band_first = 1;
+  }
+
+  vad->config = *config;
+  vad->hop = hop;
+  return 0;
+}
+
+void speech_vad_free(struct speech_vad* vad) {
+  speech_fft_free(&vad->fft);
+
+  free(vad->window);
+  free(vad->frame);
+  free(vad->power);
+
+  vad->window = NULL;
+  vad->frame = NULL;
+  vad->power = NULL;
+}
+
+/**
+ * Compute the zero-crossing rate of a hop.
+ *
+ * @param samples The hop samples
+ * @param len The number of samples
+ * @return The fraction of adjacent sample pairs that change sign
+ */
+static float zero_crossing_rate(const float* samples, size_t len) {
+  unsigned int crossings = 0;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  __m128 zero = _mm_setzero_ps();
+
+  for (; i + 5 <= len; i += 4) {
+    __m128 a = _mm_loadu_ps(samples + i);
+    __m128 b = _mm_loadu_ps(samples + i + 1);
+
+    // A pair crosses zero when its product is negative
+    int mask = _mm_movemask_ps(_mm_cmplt_ps(_mm_mul_ps(a, b), zero));
+    crossings += (unsigned int) __builtin_popcount(mask);
+  }
+#endif
+
+  for (; i + 1 < len; ++i) {
+    if (samples[i] * samples[i + 1] < 0) {
+      ++crossings;
+    }
+  }
+
+  return len > 1 ? (float) crossings / (float) (len - 1) : 0;
+}
+
+void speech_vad_features(struct speech_vad* vad, const float* samples, struct speech_vad_features* out) {
+  out->zcr = zero_crossing_rate(samples, vad->hop);
+
+  for (size_t i = 0; i < vad->hop; ++i) {
+    vad->frame[i] = samples[i] * vad->window[i];
+  }
+
+  speech_fft_power(&vad->fft, vad->frame, vad->power);
+
+  // Only look at the speech band, which leaves out hum and motor rumble
+  size_t bins = vad->band_last - vad->band_first;
+  float log_sum = 0;
+  float sum = 0;
+
+  for (size_t k = vad->band_first; k < vad->band_last; ++k) {
+    log_sum += logf(vad->power[k] + VAD_EPSILON);
+    sum += vad->power[k];
+  }
+
+  // Scale band power back to a mean square amplitude of the same order
+  out->energy = sum / (float) (vad->fft.n * vad->hop) * 2;
+  out->flatness = expf(log_sum / (float) bins) / (sum / (float) bins + VAD_EPSILON);
+}
+
+enum speech_vad_state speech_vad_update(struct speech_vad* vad, const float* samples) {
+  struct speech_vad_features features;
+  speech_vad_features(vad, samples, &features);
+
+  if (!vad->hops++) {
+    vad->floor = features.energy;
+  }
+
+  float margin = 10 * log10f((features.energy + VAD_EPSILON) / (vad->floor + VAD_EPSILON));
+
+  // Hysteresis: it takes more to open a segment than to keep one open
+  float threshold = vad->active ? vad->config.offset_db : vad->config.onset_db;
+
+  int voiced = features.flatness < vad->config.flatness_max;
+  int unvoiced = features.zcr > vad->config.zcr_min && margin > threshold + 3;
+  int speech = margin > threshold && (voiced || unvoiced);
+
+  // Follow the floor down quickly, and up slowly so speech does not raise it
+  if (features.energy < vad->floor) {
+    vad->floor += (features.energy - vad->floor) * VAD_FLOOR_FALL;
+  } else if (!speech) {
+    vad->floor += (features.energy - vad->floor) * (vad->active ? VAD_FLOOR_RISE_ACTIVE : VAD_FLOOR_RISE);
+  } else if (vad->active) {
+    // A segment that never ends is more likely a change in background noise
+    vad->floor += (features.energy - vad->floor) * VAD_FLOOR_RISE_SPEECH;
+  }
+
+  if (!vad->active) {
+    vad->run = speech ? vad->run + 1 : 0;
+    if (vad->run < vad->config.onset_hops) {
+      return speech_vad_silence;
+    }
+
+    vad->active = 1;
+    vad->quiet = 0;
+    return speech_vad_onset;
+  }
+
+  if (speech) {
+    vad->quiet = 0;
+    return speech_vad_speech;
+  }
+
+  if (++vad->quiet <= vad->config.hangover_hops) {
+    return speech_vad_speech;
+  }
+
+  vad->active = 0;
+  vad->run = 0;
+  return speech_vad_offset;
+}
@@ -0,0 +1,139 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SERVICE_SPEECH_VAD_H
+#define SERVICE_SPEECH_VAD_H
+
+#include <stddef.h>
+
+#include "fft.h"
+
+/** The outcome of one voice activity decision. */
+enum speech_vad_state {
+  /** Not speech, and no segment is open. */
+  speech_vad_silence,
+
+  /** A segment opens with this hop. */
+  speech_vad_onset,
+
+  /** A segment continues through this hop. */
+  speech_vad_speech,
+
+  /** A segment closed before this hop. The hop itself is not speech. */
+  speech_vad_offset,
+};
+
+/** Voice activity detector tuning. */
+struct speech_vad_config {
+  /** The level above the noise floor that opens a segment in decibels. */
+  float onset_db;
+
+  /** The level above the noise floor that keeps a segment open in decibels. */
+  float offset_db;
+
+  /** The spectral flatness below which a hop counts as voiced. */
+  float flatness_max;
+
+  /** The zero-crossing rate above which a loud hop counts as unvoiced speech. */
+  float zcr_min;
+
+  /** The number of consecutive speech hops needed to open a segment. */
+  unsigned int onset_hops;
+
+  /** The number of non-speech hops tolerated before a segment closes. */
+  unsigned int hangover_hops;
+};
+
+/** The features of one hop. */
+struct speech_vad_features {
+  /** The speech band energy, scaled like a mean square amplitude. */
+  float energy;
+
+  /** The fraction of adjacent sample pairs that change sign. */
+  float zcr;
+
+  /** The ratio of the geometric to arithmetic mean of the speech band power. */
+  float flatness;
+};
+
+/** A streaming voice activity detector. */
+struct speech_vad {
+  /** The tuning. */
+  struct speech_vad_config config;
+
+  /** The number of samples per hop. */
+  size_t hop;
+
+  /** The transform used for spectral flatness. */
+  struct speech_fft fft;
+
+  /** The first spectrum bin of the speech band. */
+  size_t band_first;
+
+  /** One past the last spectrum bin of the speech band. */
+  size_t band_last;
+
+  /** The analysis window, one weight per hop sample. */
+  float* window;
+
+  /** Scratch for the windowed, zero-padded hop. */
+  float* frame;
+
+  /** Scratch for the power spectrum. */
+  float* power;
+
+  /** The tracked noise floor energy. */
+  float floor;
+
+  /** The number of hops seen. */
+  unsigned long hops;
+
+  /** Nonzero while a segment is open. */
+  int active;
+
+  /** The number of consecutive speech hops while closed. */
+  unsigned int run;
+
+  /** The number of consecutive non-speech hops while open. */
+  unsigned int quiet;
+};
+
+/**
+ * Initialize a detector. This allocates all scratch up front.
+ *
+ * @param vad The detector
+ * @param hop The number of samples per hop
+ * @param rate The sample rate in hertz
+ * @param config The tuning
+ * @return Zero on success, otherwise nonzero
+ */
+int speech_vad_init(struct speech_vad* vad, size_t hop, int rate, const struct speech_vad_config* config);
+
+/**
+ * Free a detector.
+ *
+ * @param vad The detector
+ */
+void speech_vad_free(struct speech_vad* vad);
+
+/**
+ * Compute the features of one hop without updating any state.
+ *
+ * @param vad The detector
+ * @param samples The hop samples
+ * @param out The features
+ */
+void speech_vad_features(struct speech_vad* vad, const float* samples, struct speech_vad_features* out);
+
+/**
+ * Classify one hop and advance the segment state.
+ *
+ * @param vad The detector
+ * @param samples The hop samples
+ * @return The segment state for the hop
+ */
+enum speech_vad_state speech_vad_update(struct speech_vad* vad, const float* samples);
+
+#endif // #ifndef SERVICE_SPEECH_VAD_H
@@ -0,0 +1,475 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "log.h"
+#include "trace.h"
+
+#define LOG_TAG "trace"
+
+/** The longest thread name kept. */
+#define THREAD_NAME_LEN 16
+
+/** The most thread names kept, the oldest forgotten first. */
+#define THREAD_NAMES_LEN 256
+
+/** An event. */
+struct trace_event {
+  /** The time in ticks. */
+  unsigned long long ticks;
+
+  /** The name, or NULL for an end. */
+  const char* name;
+
+  /** The category, or NULL for an end. */
+  const char* cat;
+
+  /** The detail, or NULL. */
+  const char* detail;
+
+  /** The number shown alongside. */
+  long arg;
+
+  /** The kernel thread ID of the thread that recorded it. */
+  long tid;
+
+  /** The phase, as in the Chrome format. */
+  char phase;
+};
+
+/**
+ * The events of one thread at a time. When its thread exits, the buffer is
+ * handed to the next thread that needs one, which carries on after the
+ * events already there, so those are kept until the ring wraps over them.
+ */
+struct trace_buffer {
+  /** The events, a ring. */
+  struct trace_event events[TRACE_BUFFER_LEN];
+
+  /** The number of events ever written. Written by the owner only. */
+  _Alignas(64) atomic_ulong head;
+
+  /** The value of head when the current trace began. Written by the owner only. */
+  atomic_ulong start;
+
+  /** The trace start the owner last saw, published after start. */
+  atomic_uint epoch;
+
+  /** Nonzero while a thread owns the buffer. */
+  atomic_int owned;
+};
+
+/** A traced thread. */
+struct trace_thread {
+  /** The kernel thread ID. */
+  long tid;
+
+  /** The thread name. */
+  char name[THREAD_NAME_LEN];
+};
+
+atomic_int trace__enabled;
+
+/** The buffers, published one by one. */
+static struct trace_buffer* _Atomic buffers[TRACE_MAX_THREADS];
+
+/** The number of buffers created. */
+static atomic_int slots_taken;
+
+/** The names of threads given buffers, a ring. Slots lock only. */
+static struct trace_thread threads[THREAD_NAMES_LEN];
+
+/** The number of thread names ever kept. Slots lock only. */
+static unsigned long threads_len;
+
+/** Guards handing out buffers and the thread names. */
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Gives a thread's buffer back as it exits. */
+static pthread_key_t release_key;
+
+/** Sets up the release key and fork handlers once. */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/** Bumped each time tracing starts. */
+static atomic_uint epoch;
+
+/** The number of events dropped by threads without a buffer. */
+static atomic_ulong dropped;
+
+/** Serializes starting, stopping and dumping. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The ticks and monotonic time when tracing started. */
+static unsigned long long start_ticks;
+static unsigned long long start_ns;
+
+/** The ticks and monotonic time when tracing stopped, or zero while on. */
+static unsigned long long stop_ticks;
+static unsigned long long stop_ns;
+
+/** The calling thread's buffer, or NULL before its first event. */
+static _Thread_local struct trace_buffer* local;
+
+/** The calling thread's kernel thread ID, once it has a buffer. */
+static _Thread_local long local_tid;
+
+/** Nonzero once the calling thread has been refused a buffer. */
+static _Thread_local int refused;
+
+/**
+ * Read the tick counter. This is the time stamp counter where there is one,
+ * which is constant-rate on anything recent enough to run this, and the
+ * monotonic clock elsewhere.
+ */
+static unsigned long long ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + (unsigned long long) ts.tv_nsec;
+#endif
+}
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + (unsigned long long) ts.tv_nsec;
+}
+
+/**
+ * Give an exiting thread's buffer back, keeping its events for a dump.
+ *
+ * @param arg The buffer
+ */
+static void release_buffer(void* arg) {
+  struct trace_buffer* buf = arg;
+
+  // Anything the thread records from here on is dropped
+  local = NULL;
+  refused = 1;
+
+  atomic_store_explicit(&buf->owned, 0, memory_order_release);
+}
+
+static void lock_all(void) {
+  pthread_mutex_lock(&lock);
+  pthread_mutex_lock(&slots_lock);
+}
+
+static void unlock_all(void) {
+  pthread_mutex_unlock(&slots_lock);
+  pthread_mutex_unlock(&lock);
+}
+
+static void init(void) {
+  pthread_key_create(&release_key, &release_buffer);
+
+  // Hold the locks across fork, so a child never starts out with one held by a thread it lacks
+  pthread_atfork(&lock_all, &unlock_all, &unlock_all);
+}
+
+/**
+ * Get the calling thread's buffer on first use, taking one a thread gave
+ * back or else creating one.
+ *
+ * @return The buffer, or NULL if there is none to be had
+ */
+static struct trace_buffer* local_buffer(void) {
+  if (local || refused) {
+    return local;
+  }
+
+  pthread_once(&init_once, &init);
+
+  pthread_mutex_lock(&slots_lock);
+
+  struct trace_buffer* buf = NULL;
+  int slots = atomic_load_explicit(&slots_taken, memory_order_relaxed);
+  if (slots < TRACE_MAX_THREADS) {
+    buf = calloc(1, sizeof *buf);
+    if (buf) {
+      atomic_store_explicit(&buffers[slots], buf, memory_order_release);
+      atomic_store_explicit(&slots_taken, slots + 1, memory_order_release);
+    }
+  }
+
+  // Past that, take the buffer given back with the fewest events of this trace to wrap over
+  if (!buf) {
+    unsigned int e = atomic_load_explicit(&epoch, memory_order_acquire);
+    unsigned long fewest = ULONG_MAX;
+    for (int s = 0; s < slots; ++s) {
+      struct trace_buffer* given = atomic_load_explicit(&buffers[s], memory_order_relaxed);
+      if (atomic_load_explicit(&given->owned, memory_order_acquire)) {
+        continue;
+      }
+
+      unsigned long held = 0;
+      if (atomic_load_explicit(&given->epoch, memory_order_relaxed) == e) {
+        held = atomic_load_explicit(&given->head, memory_order_relaxed)
+            - atomic_load_explicit(&given->start, memory_order_relaxed);
+      }
+
+      if (held < fewest) {
+        fewest = held;
+        buf = given;
+      }
+    }
+  }
+
+  if (!buf) {
+    pthread_mutex_unlock(&slots_lock);
+    refused = 1;
+    return NULL;
+  }
+
+  atomic_store_explicit(&buf->owned, 1, memory_order_relaxed);
+
+  local_tid = (long) syscall(SYS_gettid);
+
+  struct trace_thread* t = &threads[threads_len++ % THREAD_NAMES_LEN];
+  t->tid = local_tid;
+  pthread_getname_np(pthread_self(), t->name, sizeof t->name);
+
+  pthread_mutex_unlock(&slots_lock);
+
+  pthread_setspecific(release_key, buf);
+  local = buf;
+  return buf;
+}
+
+void trace__record(char phase, const char* name, const char* cat, const char* detail, long arg) {
+  struct trace_buffer* buf = local_buffer();
+  if (!buf) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  unsigned long head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+
+  // Forget what came before the current trace the first time through it
+  unsigned int e = atomic_load_explicit(&epoch, memory_order_acquire);
+  if (atomic_load_explicit(&buf->epoch, memory_order_relaxed) != e) {
+    atomic_store_explicit(&buf->start, head, memory_order_relaxed);
+    atomic_store_explicit(&buf->epoch, e, memory_order_release);
+  }
+
+  struct trace_event* ev = &buf->events[head % TRACE_BUFFER_LEN];
+  ev->ticks = ticks();
+  ev->name = name;
+  ev->cat = cat;
+  ev->detail = detail;
+  ev->arg = arg;
+  ev->tid = local_tid;
+  ev->phase = phase;
+
+  atomic_store_explicit(&buf->head, head + 1, memory_order_release);
+}
+
+void trace_start(void) {
+  pthread_once(&init_once, &init);
+  pthread_mutex_lock(&lock);
+
+  start_ticks = ticks();
+  start_ns = now_ns();
+  stop_ticks = 0;
+  stop_ns = 0;
+  atomic_store_explicit(&dropped, 0, memory_order_relaxed);
+  atomic_fetch_add_explicit(&epoch, 1, memory_order_release);
+  atomic_store_explicit(&trace__enabled, 1, memory_order_relaxed);
+
+  pthread_mutex_unlock(&lock);
+
+  LOGI("Tracing on");
+}
+
+void trace_stop(void) {
+  pthread_once(&init_once, &init);
+  pthread_mutex_lock(&lock);
+
+  if (atomic_load_explicit(&trace__enabled, memory_order_relaxed)) {
+    atomic_store_explicit(&trace__enabled, 0, memory_order_relaxed);
+    stop_ticks = ticks();
+    stop_ns = now_ns();
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  LOGI("Tracing off");
+}
+
+/**
+ * Write a string as a JSON string.
+ */
+static void put_string(FILE* file, const char* str) {
+  fputc('"', file);
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\') {
+      fputc('\\', file);
+      fputc(*str, file);
+    } else if ((unsigned char) *str < 0x20) {
+      fprintf(file, "\\u%04x", (unsigned char) *str);
+    } else {
+      fputc(*str, file);
+    }
+  }
+  fputc('"', file);
+}
+
+/**
+ * Write one event.
+ *
+ * @param file The file
+ * @param ev The event
+ * @param us_per_tick Microseconds per tick
+ */
+static void put_event(FILE* file, const struct trace_event* ev, double us_per_tick) {
+  // A thread may stamp an event a hair before the start it raced with
+  double ts = ev->ticks > start_ticks ? (double) (ev->ticks - start_ticks) * us_per_tick : 0;
+
+  fprintf(file, "{\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%ld,\"tid\":%ld", ev->phase, ts, (long) getpid(), ev->tid);
+
+  if (ev->name) {
+    fputs(",\"name\":", file);
+    put_string(file, ev->name);
+  }
+
+  if (ev->cat) {
+    fputs(",\"cat\":", file);
+    put_string(file, ev->cat);
+  }
+
+  if (ev->phase == 'i') {
+    fputs(",\"s\":\"t\"", file);
+  }
+
+  if (ev->phase != 'E' && (ev->detail || ev->arg)) {
+    fputs(",\"args\":{", file);
+    if (ev->detail) {
+      fputs("\"detail\":", file);
+      put_string(file, ev->detail);
+    }
+    if (ev->arg) {
+      fprintf(file, "%s\"arg\":%ld", ev->detail ? "," : "", ev->arg);
+    }
+    fputc('}', file);
+  }
+
+  fputc('}', file);
+}
+
+int trace_dump(const char* path, size_t* events) {
+  pthread_once(&init_once, &init);
+
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    LOGE("Failed to open {}", _str(path));
+    return 1;
+  }
+
+  struct trace_event* copy = malloc(TRACE_BUFFER_LEN * sizeof *copy);
+  struct trace_thread* names = malloc(sizeof threads);
+  if (!copy || !names) {
+    free(copy);
+    free(names);
+    fclose(file);
+    return 1;
+  }
+
+  // Copy the names so writing them out cannot hold up threads taking buffers
+  pthread_mutex_lock(&slots_lock);
+  size_t names_len = threads_len < THREAD_NAMES_LEN ? threads_len : THREAD_NAMES_LEN;
+  memcpy(names, threads, sizeof threads);
+  pthread_mutex_unlock(&slots_lock);
+
+  pthread_mutex_lock(&lock);
+
+  // Calibrate ticks against the clock over the whole trace
+  unsigned long long end_ticks = stop_ticks ? stop_ticks : ticks();
+  unsigned long long end_ns = stop_ns ? stop_ns : now_ns();
+  double us_per_tick = end_ticks > start_ticks ? (double) (end_ns - start_ns) / 1000.0 / (double) (end_ticks - start_ticks) : 0;
+
+  unsigned int e = atomic_load_explicit(&epoch, memory_order_acquire);
+  size_t written = 0;
+
+  fputs("{\"traceEvents\":[", file);
+
+  // Names of threads with no events left are harmless
+  for (size_t i = 0; i < names_len; ++i) {
+    fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":",
+        i ? "," : "", (long) getpid(), names[i].tid);
+    put_string(file, names[i].name);
+    fputs("}}", file);
+  }
+
+  int slots = atomic_load_explicit(&slots_taken, memory_order_acquire);
+  for (int s = 0; s < slots && s < TRACE_MAX_THREADS; ++s) {
+    struct trace_buffer* buf = atomic_load_explicit(&buffers[s], memory_order_acquire);
+    if (!buf || atomic_load_explicit(&buf->epoch, memory_order_acquire) != e) {
+      continue;
+    }
+
+    unsigned long start = atomic_load_explicit(&buf->start, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&buf->head, memory_order_acquire);
+    unsigned long first = head - start > TRACE_BUFFER_LEN ? head - TRACE_BUFFER_LEN : start;
+
+    for (unsigned long i = first; i < head; ++i) {
+      copy[i - first] = buf->events[i % TRACE_BUFFER_LEN];
+    }
+
+    // Skip whatever the owner overwrote while it was copied
+    atomic_thread_fence(memory_order_acquire);
+    unsigned long after = atomic_load_explicit(&buf->head, memory_order_relaxed);
+    unsigned long valid = after - first > TRACE_BUFFER_LEN ? after - TRACE_BUFFER_LEN : first;
+
+    for (unsigned long i = valid < head ? valid : head; i < head; ++i) {
+      if (names_len || written) {
+        fputc(',', file);
+      }
+      put_event(file, &copy[i - first], us_per_tick);
+      ++written;
+    }
+  }
+
+  fputs("],\"displayTimeUnit\":\"ns\"}\n", file);
+
+  unsigned long lost = atomic_load_explicit(&dropped, memory_order_relaxed);
+
+  pthread_mutex_unlock(&lock);
+
+  free(copy);
+  free(names);
+
+  if (fclose(file)) {
+    LOGE("Failed to write {}", _str(path));
+    return 1;
+  }
+
+  if (lost) {
+    LOGW("Dropped {} events from threads past {} at once", _ul(lost), _i(TRACE_MAX_THREADS));
+  }
+
+  if (events) {
+    *events = written;
+  }
+
+  return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+//
+// Tracing
+//
+// Spans of time are recorded as begin and end events into a ring per thread,
+// timestamped with the CPU's cycle counter, and dumped in the Chrome trace
+// event format for chrome://tracing or Perfetto. Only the owning thread
+// writes a ring, so recording takes no locks, and a dump taken while tracing
+// skips whatever was overwritten as it read. While tracing is off, each
+// event costs one load and one branch.
+//
+// A thread takes a ring with its first event and gives it back as it exits.
+// The next thread to take it carries on after the events already there, so
+// a dump still shows threads that have exited until their events are
+// written over.
+//
+// Names, categories and details are kept by pointer until the dump, so they
+// must be string literals or otherwise outlive the trace.
+//
+
+/** The number of events kept per thread. */
+#define TRACE_BUFFER_LEN 8192
+
+/** The most threads traced at once. */
+#define TRACE_MAX_THREADS 64
+
+/** @private */
+extern atomic_int trace__enabled;
+
+/** @private */
+void trace__record(char phase, const char* name, const char* cat, const char* detail, long arg);
+
+/**
+ * Check whether tracing is on.
+ *
+ * @return Nonzero if it is
+ */
+static inline int trace_enabled(void) {
+  return atomic_load_explicit(&trace__enabled, memory_order_relaxed);
+}
+
+/**
+ * Begin a span on the calling thread.
+ *
+ * @param name The span name
+ * @param cat The category
+ * @param detail A detail shown with the span, or NULL
+ * @param arg A number shown with the span
+ * @return Nonzero if recorded, to pass to trace_end
+ */
+static inline int trace_begin(const char* name, const char* cat, const char* detail, long arg) {
+  if (!trace_enabled()) {
+    return 0;
+  }
+
+  trace__record('B', name, cat, detail, arg);
+  return 1;
+}
+
+/**
+ * End the innermost span on the calling thread.
+ *
+ * @param began What trace_begin returned
+ */
+static inline void trace_end(int began) {
+  if (began) {
+    trace__record('E', NULL, NULL, NULL, 0);
+  }
+}
+
+/** @private */
+static inline void trace__end_scope(int* began) {
+  trace_end(*began);
+}
+
+/**
+ * Start tracing, discarding anything recorded before.
+ */
+void trace_start(void);
+
+/**
+ * Stop tracing, keeping what was recorded for a dump.
+ */
+void trace_stop(void);
+
+/**
+ * Write what was recorded in the Chrome trace event format.
+ *
+ * @param path The file to write
+ * @param events The number of events written, or NULL
+ * @return Zero on success, otherwise nonzero
+ */
+int trace_dump(const char* path, size_t* events);
+
+//
+// Macros for Quick Tracing
+//
+// Like the LOG* macros, these take the category from the nearest LOG_TAG.
+//
+
+/** @private */
+#define TRACE__VAR2(line) trace__scope_ ## line
+
+/** @private */
+#define TRACE__VAR(line) TRACE__VAR2(line)
+
+/**
+ * Trace the rest of the enclosing block as a span.
+ *
+ * @param name The span name
+ */
+#define TRACE_SCOPE(name) TRACE_SCOPE_WITH((name), NULL, 0)
+
+/**
+ * Trace the rest of the enclosing block as a span with a detail and number.
+ *
+ * @param name The span name
+ * @param detail A detail shown with the span, or NULL
+ * @param arg A number shown with the span
+ */
+#define TRACE_SCOPE_WITH(name, detail, arg)                                                 \
+    __attribute__((cleanup(trace__end_scope))) int TRACE__VAR(__LINE__) =                 \
+        trace_begin((name), LOG_TAG, (detail), (arg))
+
+/**
+ * Begin a span. Pass the result to TRACE_END.
+ *
+ * @param name The span name
+ */
+#define TRACE_BEGIN(name) trace_begin((name), LOG_TAG, NULL, 0)
+
+/**
+ * End the span begun by TRACE_BEGIN.
+ *
+ * @param began What TRACE_BEGIN returned
+ */
+#define TRACE_END(began) trace_end(began)
+
+/**
+ * Mark an instant.
+ *
+ * @param name The instant name
+ */
+#define TRACE_INSTANT(name) do {                      \
+      if (trace_enabled()) {                          \
+        trace__record('i', (name), LOG_TAG, NULL, 0); \
+      }                                               \
+    } while (0)
+
+#endif // #ifndef TRACE_H
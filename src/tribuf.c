@@ -0,0 +1,76 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tribuf.h"
+
+/** Marks the middle slot as published but not yet taken. */
+#define TRIBUF_FRESH 4u
+
+/** Masks the slot index out of the middle word. */
+#define TRIBUF_INDEX 3u
+
+int tribuf_init(struct tribuf* tb, size_t size) {
+  for (int i = 0; i < 3; ++i) {
+    tb->slots[i] = malloc(size);
+    tb->seq[i] = 0;
+  }
+
+  if (!tb->slots[0] || !tb->slots[1] || !tb->slots[2]) {
+    tribuf_free(tb);
+    return 1;
+  }
+
+  // Touch every page now so the first publishes do not fault
+  for (int i = 0; i < 3; ++i) {
+    memset(tb->slots[i], 0, size);
+  }
+
+  tb->back = 0;
+  atomic_init(&tb->middle, 1);
+  tb->front = 2;
+  tb->published = 0;
+  tb->taken = 0;
+
+  return 0;
+}
+
+void tribuf_free(struct tribuf* tb) {
+  for (int i = 0; i < 3; ++i) {
+    free(tb->slots[i]);
+    tb->slots[i] = NULL;
+  }
+}
+
+void* tribuf_back(struct tribuf* tb) {
+  return tb->slots[tb->back];
+}
+
+void tribuf_publish(struct tribuf* tb) {
+  tb->seq[tb->back] = ++tb->published;
+
+  // Release the slot contents and sequence number along with the swap
+  unsigned int prev = atomic_exchange_explicit(&tb->middle, tb->back | TRIBUF_FRESH, memory_order_acq_rel);
+  tb->back = prev & TRIBUF_INDEX;
+}
+
+const void* tribuf_take(struct tribuf* tb, unsigned long* dropped) {
+  if (atomic_load_explicit(&tb->middle, memory_order_relaxed) & TRIBUF_FRESH) {
+    unsigned int prev = atomic_exchange_explicit(&tb->middle, tb->front, memory_order_acq_rel);
+    tb->front = prev & TRIBUF_INDEX;
+
+    unsigned long seq = tb->seq[tb->front];
+    if (dropped) {
+      *dropped += seq - tb->taken - 1;
+    }
+    tb->taken = seq;
+  }
+
+  return tb->taken ? tb->slots[tb->front] : NULL;
+}
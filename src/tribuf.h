@@ -0,0 +1,86 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef TRIBUF_H
+#define TRIBUF_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * A triple buffer handing the latest snapshot from one producer to one
+ * consumer.
+ *
+ * The producer fills the back slot and publishes it, swapping it with the
+ * middle slot. The consumer swaps the front slot with the middle slot only
+ * when something new was published. Neither side ever waits for the other.
+ * A snapshot published over one the consumer never took is dropped, never
+ * queued.
+ */
+struct tribuf {
+  /** The slots. */
+  void* slots[3];
+
+  /** The middle slot index, plus TRIBUF_FRESH if it was never read. */
+  atomic_uint middle;
+
+  /** The slot the producer fills. Producer only. */
+  unsigned int back;
+
+  /** The slot the consumer reads. Consumer only. */
+  unsigned int front;
+
+  /** The sequence number of the snapshot in each slot. */
+  unsigned long seq[3];
+
+  /** The number of snapshots published. Producer only. */
+  unsigned long published;
+
+  /** The sequence number of the snapshot last taken. Consumer only. */
+  unsigned long taken;
+};
+
+/**
+ * Allocate a triple buffer with zeroed slots.
+ *
+ * @param tb The triple buffer
+ * @param size The slot size in bytes
+ * @return Zero on success, otherwise nonzero
+ */
+int tribuf_init(struct tribuf* tb, size_t size);
+
+/**
+ * Free a triple buffer.
+ *
+ * @param tb The triple buffer
+ */
+void tribuf_free(struct tribuf* tb);
+
+/**
+ * Get the slot to fill. Producer only. Its contents are stale.
+ *
+ * @param tb The triple buffer
+ * @return The back slot
+ */
+void* tribuf_back(struct tribuf* tb);
+
+/**
+ * Publish the back slot. Producer only.
+ *
+ * @param tb The triple buffer
+ */
+void tribuf_publish(struct tribuf* tb);
+
+/**
+ * Take the latest published snapshot. Consumer only.
+ *
+ * @param tb The triple buffer
+ * @param dropped Incremented by the number of snapshots dropped since the
+ *     last take, or NULL
+ * @return The latest snapshot, or NULL if none was ever published
+ */
+const void* tribuf_take(struct tribuf* tb, unsigned long* dropped);
+
+#endif // #ifndef TRIBUF_H